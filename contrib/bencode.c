@@ -34,12 +34,23 @@ struct ben_decode_ctx {
 	char c;
 	int line;
 	struct bencode_type **types;
+	/* Lazy decoding, see ben_decode_arena() */
+	ben_expand_fn expand;
+	void *expand_arg;
+	const struct bencode *path[256];
+	int path_n;
+	/* Where objects are allocated, see ben_decode_arena(). NULL for the heap. */
+	struct ben_arena *arena;
+	/* Whether strings point into 'data' instead of being copied */
+	int borrow;
 };
 
 struct ben_encode_ctx {
 	char *data;
 	size_t size;
 	size_t pos;
+	/* Whether 'data' is malloc()ed and may be grown when it is full */
+	int grow;
 };
 
 /*
@@ -51,11 +62,17 @@ struct ben_encode_ctx {
 
 static struct bencode *decode_printed(struct ben_decode_ctx *ctx);
 static void inplace_ben_str(struct bencode_str *b, const char *s, size_t len);
-static int resize_dict(struct bencode_dict *d, size_t newalloc);
-static int resize_list(struct bencode_list *list, size_t newalloc);
+static int resize_dict(struct bencode_dict *d, size_t newalloc,
+		       struct ben_arena *arena);
+static void *ben_arena_alloc(struct ben_arena *arena, size_t size);
+static void ben_mark_dirty(struct bencode *b);
+static int resize_list(struct bencode_list *list, size_t newalloc,
+		       struct ben_arena *arena);
 static int unpack(const struct bencode *b, struct ben_decode_ctx *ctx,
 		  va_list *vl);
 static struct bencode *pack(struct ben_decode_ctx *ctx, va_list *vl);
+static struct bencode *decode_child(struct ben_decode_ctx *ctx,
+				    const struct bencode *key);
 
 static size_t type_size(int type)
 {
@@ -84,6 +101,21 @@ static void *alloc(int type)
 	return b;
 }
 
+/* Like alloc(), but from the decode arena if there is one */
+static void *ctx_alloc(struct ben_decode_ctx *ctx, int type)
+{
+	struct bencode *b;
+	if (ctx->arena == NULL)
+		return alloc(type);
+	b = ben_arena_alloc(ctx->arena, type_size(type));
+	if (b == NULL)
+		return NULL;
+	memset(b, 0, type_size(type));
+	b->type = type;
+	b->arena = BEN_ARENA_OBJECT;
+	return b;
+}
+
 void *ben_alloc_user(struct bencode_type *type)
 {
 	struct bencode_user *user = calloc(1, type->size);
@@ -234,9 +266,9 @@ int ben_allocate(struct bencode *b, size_t n)
 {
 	switch (b->type) {
 	case BENCODE_DICT:
-		return resize_dict(ben_dict_cast(b), n);
+		return resize_dict(ben_dict_cast(b), n, NULL);
 	case BENCODE_LIST:
-		return resize_list(ben_list_cast(b), n);
+		return resize_list(ben_list_cast(b), n, NULL);
 	default:
 		die("ben_allocate(): Unknown type %d\n", b->type);
 	}
@@ -312,6 +344,9 @@ static struct bencode *share_dict(const struct bencode_dict *d)
 		return NULL;
 	memcpy(newdict, d, sizeof(*d));
 	((struct bencode_dict *) newdict)->shared = 1;
+	newdict->arena = 0;
+	newdict->parent = NULL;
+	newdict->span_len = 0;
 	return newdict;
 }
 
@@ -322,6 +357,9 @@ static struct bencode *share_list(const struct bencode_list *list)
 		return NULL;
 	memcpy(newlist, list, sizeof(*list));
 	((struct bencode_list *) newlist)->shared = 1;
+	newlist->arena = 0;
+	newlist->parent = NULL;
+	newlist->span_len = 0;
 	return newlist;
 }
 
@@ -361,33 +399,28 @@ static int cmp_dict(const struct bencode *a, const struct bencode *b)
 {
 	size_t len = ben_dict_len(a);
 	size_t pos;
-	struct bencode *key;
-	struct bencode *va;
+	const struct bencode_dict *da = ben_dict_const_cast(a);
 	struct bencode *vb;
 	int ret = 0;
-	struct bencode_keyvalue *pairs;
 
 	if (len != ben_dict_len(b)) {
 		/* Returning any non-zero value is allowed */
 		return (len < ben_dict_len(b)) ? -1 : 1;
 	}
 
-	pairs = ben_dict_ordered_items(a);
+	/* The order of keys does not matter here */
 	for (pos = 0; pos < len; pos++) {
-		key = pairs[pos].key;
-		va = pairs[pos].value;
-		vb = ben_dict_get(b, key);
+		vb = ben_dict_get(b, da->nodes[pos].key);
 		if (vb == NULL) {
 			/* Returning any non-zero value is allowed */
 			ret = (a < b) ? -1 : 1;
 			break;
 		}
-		ret = ben_cmp(va, vb);
+		ret = ben_cmp(da->nodes[pos].value, vb);
 		if (ret)
 			break;
 	}
 
-	free(pairs);
 	return ret;
 }
 
@@ -493,7 +526,7 @@ static struct bencode *decode_bool(struct ben_decode_ctx *ctx)
 		return ben_invalid_ptr(ctx);
 
 	value = (c == '1');
-	b = alloc(BENCODE_BOOL);
+	b = ctx_alloc(ctx, BENCODE_BOOL);
 	if (b == NULL)
 		return ben_oom_ptr(ctx);
 
@@ -514,12 +547,51 @@ static size_t hash_bucket_head(long long hash, const struct bencode_dict *d)
 	return d->buckets[hash_bucket(hash, d)];
 }
 
-static int resize_dict(struct bencode_dict *d, size_t newalloc)
+/*
+ * Add a key that is known not to be in 'd' yet. There must be room for it.
+ * Does not mark 'd' dirty.
+ */
+static void dict_insert_new(struct bencode_dict *d, struct bencode *key,
+			    struct bencode *value, long long hash)
+{
+	size_t bucket = hash_bucket(hash, d);
+	d->nodes[d->n] = (struct bencode_dict_node) {.hash = hash,
+						     .key = key,
+						     .value = value,
+						     .next = d->buckets[bucket]};
+	d->buckets[bucket] = d->n;
+	d->n++;
+	key->parent = (struct bencode *) d;
+	value->parent = (struct bencode *) d;
+}
+
+/* Rebuild all bucket chains, for when nodes have moved */
+static void rehash_dict(struct bencode_dict *d)
 {
-	size_t *newbuckets;
-	struct bencode_dict_node *newnodes;;
 	size_t pos;
 
+	/* Clear all buckets */
+	memset(d->buckets, -1, d->alloc * sizeof(d->buckets[0]));
+
+	/* Reinsert nodes into buckets */
+	for (pos = 0; pos < d->n; pos++) {
+		struct bencode_dict_node *node = &d->nodes[pos];
+		size_t bucket = hash_bucket(node->hash, d);
+		node->next = d->buckets[bucket];
+		d->buckets[bucket] = pos;
+	}
+}
+
+/*
+ * Arrays that live in an arena are never realloc()ed: with 'arena', the
+ * new arrays come from it, otherwise they move to the heap.
+ */
+static int resize_dict(struct bencode_dict *d, size_t newalloc,
+		       struct ben_arena *arena)
+{
+	size_t *newbuckets;
+	struct bencode_dict_node *newnodes;
+
 	if (newalloc == -1) {
 		if (d->alloc >= DICT_MAX_ALLOC)
 			return -1;
@@ -545,29 +617,45 @@ static int resize_dict(struct bencode_dict *d, size_t newalloc)
 	/* size must be a power of two */
 	assert((newalloc & (newalloc - 1)) == 0);
 
-	newbuckets = realloc(d->buckets, sizeof(newbuckets[0]) * newalloc);
-	newnodes = realloc(d->nodes, sizeof(newnodes[0]) * newalloc);
-	if (newnodes == NULL || newbuckets == NULL) {
-		free(newnodes);
-		free(newbuckets);
-		return -1;
+	if (arena != NULL || (d->arena & BEN_ARENA_DATA)) {
+		if (arena != NULL) {
+			newbuckets = ben_arena_alloc(arena, sizeof(newbuckets[0]) * newalloc);
+			newnodes = ben_arena_alloc(arena, sizeof(newnodes[0]) * newalloc);
+		} else {
+			newbuckets = malloc(sizeof(newbuckets[0]) * newalloc);
+			newnodes = malloc(sizeof(newnodes[0]) * newalloc);
+		}
+		if (newnodes == NULL || newbuckets == NULL) {
+			if (arena == NULL) {
+				free(newnodes);
+				free(newbuckets);
+			}
+			return -1;
+		}
+		if (d->n > 0)
+			memcpy(newnodes, d->nodes, sizeof(newnodes[0]) * d->n);
+		if (!(d->arena & BEN_ARENA_DATA)) {
+			free(d->buckets);
+			free(d->nodes);
+		}
+		if (arena != NULL)
+			d->arena |= BEN_ARENA_DATA;
+		else
+			d->arena &= ~BEN_ARENA_DATA;
+	} else {
+		newbuckets = realloc(d->buckets, sizeof(newbuckets[0]) * newalloc);
+		newnodes = realloc(d->nodes, sizeof(newnodes[0]) * newalloc);
+		if (newnodes == NULL || newbuckets == NULL) {
+			free(newnodes);
+			free(newbuckets);
+			return -1;
+		}
 	}
 
 	d->alloc = newalloc;
 	d->buckets = newbuckets;
 	d->nodes = newnodes;
-
-	/* Clear all buckets */
-	memset(d->buckets, -1, d->alloc * sizeof(d->buckets[0]));
-
-	/* Reinsert nodes into buckets */
-	for (pos = 0; pos < d->n; pos++) {
-		struct bencode_dict_node *node = &d->nodes[pos];
-		size_t bucket = hash_bucket(node->hash, d);
-		node->next = d->buckets[bucket];
-		d->buckets[bucket] = pos;
-	}
-
+	rehash_dict(d);
 	return 0;
 }
 
@@ -594,6 +682,11 @@ long long ben_str_hash(const struct bencode *b)
 	return str_hash(s, bstr->len);
 }
 
+long long ben_str_hash_buf(const void *s, size_t len)
+{
+	return str_hash(s, len);
+}
+
 long long ben_int_hash(const struct bencode *b)
 {
 	long long x = ben_int_const_cast(b)->ll;
@@ -612,14 +705,97 @@ long long ben_hash(const struct bencode *b)
 	}		
 }
 
+/* Where a dict key was decoded from, for ordering keys by their source */
+struct key_span {
+	int type; /* 0 for none */
+	long long ll;
+	size_t off;
+	size_t len;
+};
+
+/* Same order as ben_cmp() */
+static int cmp_key_spans(const struct ben_decode_ctx *ctx,
+			 const struct key_span *a, const struct key_span *b)
+{
+	int cmp;
+	if (a->type != b->type)
+		return (a->type == BENCODE_INT) ? -1 : 1;
+	if (a->type == BENCODE_INT)
+		return (a->ll > b->ll) - (a->ll < b->ll);
+	cmp = memcmp(ctx->data + a->off, ctx->data + b->off,
+		     (a->len <= b->len) ? a->len : b->len);
+	if (cmp == 0)
+		cmp = (a->len > b->len) - (a->len < b->len);
+	return cmp;
+}
+
+#define DICT_COUNT_TOKENS 4096
+
+/*
+ * Count the entries of the dict whose first key is at the current offset,
+ * looking at no more than DICT_COUNT_TOKENS tokens, so that decode_dict()
+ * can size its arrays once. Nothing is validated, decoding does that.
+ * Returns a lower bound if the dict is too big to count, and 0 if the data
+ * makes no sense.
+ */
+static size_t count_dict_entries(const struct ben_decode_ctx *ctx)
+{
+	const char *p = ctx->data + ctx->off;
+	const char *end = ctx->data + ctx->len;
+	size_t items = 0;
+	size_t len;
+	int depth = 0;
+	int tokens;
+
+	for (tokens = 0; tokens < DICT_COUNT_TOKENS && p < end; tokens++) {
+		if (*p == 'e') {
+			if (depth == 0)
+				break;
+			depth--;
+			p++;
+			continue;
+		}
+		if (depth == 0)
+			items++;
+		switch (*p) {
+		case 'i':
+			p = memchr(p, 'e', end - p);
+			if (p == NULL)
+				return 0;
+			p++;
+			break;
+		case 'd':
+		case 'l':
+			depth++;
+			p++;
+			break;
+		default:
+			if (!isdigit((unsigned char) *p))
+				return 0;
+			len = 0;
+			for (; p < end && isdigit((unsigned char) *p); p++) {
+				len = len * 10 + (*p - '0');
+				if (len >= (size_t) (end - p))
+					return 0;
+			}
+			if (p == end || *p != ':')
+				return 0;
+			p += 1 + len;
+		}
+	}
+	return items / 2;
+}
+
 static struct bencode *decode_dict(struct ben_decode_ctx *ctx)
 {
 	struct bencode *key;
-	struct bencode *lastkey = NULL;
 	struct bencode *value;
 	struct bencode_dict *d;
+	struct key_span span;
+	struct key_span lastspan = {.type = 0};
+	size_t count;
 
-	d = alloc(BENCODE_DICT);
+	d = ctx_alloc(ctx, BENCODE_DICT);
 	if (d == NULL) {
 		warn("Not enough memory for dict\n");
 		return ben_oom_ptr(ctx);
@@ -627,11 +803,25 @@ static struct bencode *decode_dict(struct ben_decode_ctx *ctx)
 
 	ctx->off++;
 
+	/* Allocate the nodes and buckets once instead of growing them */
+	count = count_dict_entries(ctx);
+	if (count > 0 && resize_dict(d, count, ctx->arena)) {
+		ctx->error = BEN_NO_MEMORY;
+		goto error;
+	}
+
 	while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
 		key = ben_ctx_decode(ctx);
 		if (key == NULL)
 			goto error;
-		if (key->type != BENCODE_INT && key->type != BENCODE_STR) {
+		if (key->type == BENCODE_INT) {
+			span.type = BENCODE_INT;
+			span.ll = ben_int_val(key);
+		} else if (key->type == BENCODE_STR) {
+			span.type = BENCODE_STR;
+			span.len = ben_str_len(key);
+			span.off = key->span_off + key->span_len - span.len;
+		} else {
 			ben_free(key);
 			key = NULL;
 			ctx->error = BEN_INVALID;
@@ -639,21 +829,26 @@ static struct bencode *decode_dict(struct ben_decode_ctx *ctx)
 			goto error;
 		}
 
-		if (lastkey != NULL && ben_cmp(lastkey, key) >= 0) {
+		/*
+		 * Keys have to be in strictly increasing order, so they can
+		 * be added without looking for duplicates.
+		 */
+		if (lastspan.type && cmp_key_spans(ctx, &lastspan, &span) >= 0) {
 			ben_free(key);
 			key = NULL;
 			ctx->error = BEN_INVALID;
 			goto error;
 		}
 
-		value = ben_ctx_decode(ctx);
+		value = decode_child(ctx, key);
 		if (value == NULL) {
 			ben_free(key);
 			key = NULL;
 			goto error;
 		}
 
-		if (ben_dict_set((struct bencode *) d, key, value)) {
+		/* Grows in the arena, if there is one */
+		if (d->n == d->alloc && resize_dict(d, -1, ctx->arena)) {
 			ben_free(key);
 			ben_free(value);
 			key = NULL;
@@ -661,8 +856,9 @@ static struct bencode *decode_dict(struct ben_decode_ctx *ctx)
 			ctx->error = BEN_NO_MEMORY;
 			goto error;
 		}
+		dict_insert_new(d, key, value, ben_hash(key));
 
-		lastkey = key;
+		lastspan = span;
 	}
 	if (ctx->off >= ctx->len) {
 		ctx->error = BEN_INSUFFICIENT;
@@ -734,14 +930,16 @@ static struct bencode *decode_int(struct ben_decode_ctx *ctx)
 	ctx->off++;
 	if (read_long_long(&ll, ctx, 'e'))
 		return NULL;
-	b = alloc(BENCODE_INT);
+	b = ctx_alloc(ctx, BENCODE_INT);
 	if (b == NULL)
 		return ben_oom_ptr(ctx);
 	b->ll = ll;
 	return (struct bencode *) b;
 }
 
-static int resize_list(struct bencode_list *list, size_t newalloc)
+/* Arena arrays are handled like in resize_dict() */
+static int resize_list(struct bencode_list *list, size_t newalloc,
+		       struct ben_arena *arena)
 {
 	struct bencode **newvalues;
 	size_t newsize;
@@ -759,9 +957,26 @@ static int resize_list(struct bencode_list *list, size_t newalloc)
 	}
 
 	newsize = sizeof(list->values[0]) * newalloc;
-	newvalues = realloc(list->values, newsize);
-	if (newvalues == NULL)
-		return -1;
+	if (arena != NULL || (list->arena & BEN_ARENA_DATA)) {
+		if (arena != NULL)
+			newvalues = ben_arena_alloc(arena, newsize);
+		else
+			newvalues = malloc(newsize);
+		if (newvalues == NULL)
+			return -1;
+		if (list->n > 0)
+			memcpy(newvalues, list->values, sizeof(list->values[0]) * list->n);
+		if (!(list->arena & BEN_ARENA_DATA))
+			free(list->values);
+		if (arena != NULL)
+			list->arena |= BEN_ARENA_DATA;
+		else
+			list->arena &= ~BEN_ARENA_DATA;
+	} else {
+		newvalues = realloc(list->values, newsize);
+		if (newvalues == NULL)
+			return -1;
+	}
 	list->alloc = newalloc;
 	list->values = newvalues;
 	return 0;
@@ -769,17 +984,20 @@ static int resize_list(struct bencode_list *list, size_t newalloc)
 
 static struct bencode *decode_list(struct ben_decode_ctx *ctx)
 {
-	struct bencode_list *l = alloc(BENCODE_LIST);
+	struct bencode_list *l = ctx_alloc(ctx, BENCODE_LIST);
 	if (l == NULL)
 		return ben_oom_ptr(ctx);
 
 	ctx->off++;
 
 	while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
-		struct bencode *b = ben_ctx_decode(ctx);
+		struct bencode *b = decode_child(ctx, NULL);
 		if (b == NULL)
 			goto error;
-		if (ben_list_append((struct bencode *) l, b)) {
+		/* Grow it in the arena, or ben_list_append() would use the heap */
+		if ((ctx->arena != NULL && l->n == l->alloc &&
+		     resize_list(l, -1, ctx->arena)) ||
+		    ben_list_append((struct bencode *) l, b)) {
 			ben_free(b);
 			ctx->error = BEN_NO_MEMORY;
 			goto error;
@@ -827,17 +1045,244 @@ static struct bencode *decode_str(struct ben_decode_ctx *ctx)
 	if (ben_need_bytes(ctx, datalen))
 		return ben_insufficient_ptr(ctx);
 
-	/* Allocate string structure and copy data into it */
-	b = ben_blob(ctx->data + ctx->off, datalen);
+	if (ctx->borrow) {
+		struct bencode_str *s = ctx_alloc(ctx, BENCODE_STR);
+		if (s == NULL)
+			return ben_oom_ptr(ctx);
+		s->s = (char *) ctx->data + ctx->off;
+		s->len = datalen;
+		s->arena |= BEN_ARENA_BORROWED;
+		b = (struct bencode *) s;
+	} else if (ctx->arena != NULL) {
+		struct bencode_str *s = ctx_alloc(ctx, BENCODE_STR);
+		char *data = ben_arena_alloc(ctx->arena, datalen + 1);
+		if (s == NULL || data == NULL)
+			return ben_oom_ptr(ctx);
+		memcpy(data, ctx->data + ctx->off, datalen);
+		data[datalen] = 0;
+		s->s = data;
+		s->len = datalen;
+		s->arena |= BEN_ARENA_DATA;
+		b = (struct bencode *) s;
+	} else {
+		/* Allocate string structure and copy data into it */
+		b = ben_blob(ctx->data + ctx->off, datalen);
+	}
 	ctx->off += datalen;
 	return b;
 }
 
+/* Opaque node for a value that ben_decode_arena() did not expand */
+struct bencode_raw {
+	struct bencode_user user;
+	const char *data;
+	size_t len;
+};
+
+static int encode_raw(struct ben_encode_ctx *ctx, const struct bencode *b)
+{
+	const struct bencode_raw *raw = (const struct bencode_raw *) b;
+	return ben_put_buffer(ctx, raw->data, raw->len);
+}
+
+static size_t get_size_raw(const struct bencode *b)
+{
+	return ((const struct bencode_raw *) b)->len;
+}
+
+static int cmp_raw(const struct bencode *a, const struct bencode *b)
+{
+	const struct bencode_raw *ra = (const struct bencode_raw *) a;
+	const struct bencode_raw *rb = (const struct bencode_raw *) b;
+	size_t cmplen = (ra->len <= rb->len) ? ra->len : rb->len;
+	int ret = memcmp(ra->data, rb->data, cmplen);
+	if (ret)
+		return ret < 0 ? -1 : 1;
+	if (ra->len != rb->len)
+		return (ra->len < rb->len) ? -1 : 1;
+	return 0;
+}
+
+static struct bencode_type raw_type = {
+	.size = sizeof(struct bencode_raw),
+	.encode = encode_raw,
+	.get_size = get_size_raw,
+	.cmp = cmp_raw,
+};
+
+/*
+ * Check the value at the current offset and move past it, without
+ * allocating anything. Applies exactly the same rules as ben_ctx_decode(),
+ * so that a value is rejected with the same error whether it is expanded
+ * or not.
+ */
+static int skip_value(struct ben_decode_ctx *ctx)
+{
+	struct bencode_type *type;
+	struct bencode *b;
+	long long ll = 0;
+	size_t len;
+	size_t keyoff;
+	struct key_span key = {.type = 0};
+	struct key_span lastkey = {.type = 0};
+	char c;
+
+	ctx->level++;
+	if (ctx->level > 256)
+		return invalid(ctx);
+
+	if (ctx->off == ctx->len)
+		return insufficient(ctx);
+
+	c = ben_current_char(ctx);
+	switch (c) {
+	case '0':
+	case '1':
+	case '2':
+	case '3':
+	case '4':
+	case '5':
+	case '6':
+	case '7':
+	case '8':
+	case '9':
+		len = read_size_t(ctx, ':');
+		if (len == -1)
+			return -1;
+		if (ben_need_bytes(ctx, len))
+			return insufficient(ctx);
+		ctx->off += len;
+		break;
+	case 'b':
+		if (ben_need_bytes(ctx, 2))
+			return insufficient(ctx);
+		ctx->off++;
+		c = ben_current_char(ctx);
+		if (c != '0' && c != '1')
+			return invalid(ctx);
+		ctx->off++;
+		break;
+	case 'i':
+		ctx->off++;
+		if (read_long_long(&ll, ctx, 'e'))
+			return -1;
+		break;
+	case 'l':
+		ctx->off++;
+		while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
+			if (skip_value(ctx))
+				return -1;
+		}
+		if (ctx->off >= ctx->len)
+			return insufficient(ctx);
+		ctx->off++;
+		break;
+	case 'd':
+		ctx->off++;
+		while (ctx->off < ctx->len && ben_current_char(ctx) != 'e') {
+			keyoff = ctx->off;
+			key.type = ben_current_char(ctx) == 'i' ? BENCODE_INT : BENCODE_STR;
+			if (skip_value(ctx))
+				return -1;
+			if (key.type == BENCODE_INT) {
+				/* Parse it again for the value */
+				key.ll = strtoll(ctx->data + keyoff + 1, NULL, 10);
+			} else if (isdigit((unsigned char) ctx->data[keyoff])) {
+				/* Find where the string data starts */
+				while (ctx->data[keyoff++] != ':')
+					;
+				key.off = keyoff;
+				key.len = ctx->off - keyoff;
+			} else {
+				warn("Invalid dict key type\n");
+				return invalid(ctx);
+			}
+
+			if (lastkey.type && cmp_key_spans(ctx, &lastkey, &key) >= 0)
+				return invalid(ctx);
+			lastkey = key;
+
+			if (skip_value(ctx))
+				return -1;
+		}
+		if (ctx->off >= ctx->len)
+			return insufficient(ctx);
+		ctx->off++;
+		break;
+	default:
+		if (ctx->types && (unsigned char) c < 128 &&
+		    (type = ctx->types[(unsigned char) c]) != NULL) {
+			/* User types have to be decoded to know where they end */
+			ctx->off++;
+			b = type->decode(ctx);
+			if (b == NULL)
+				return -1;
+			ben_free(b);
+		} else {
+			return invalid(ctx);
+		}
+	}
+	ctx->level--;
+	return 0;
+}
+
+static struct bencode *decode_raw(struct ben_decode_ctx *ctx)
+{
+	struct bencode_raw *raw;
+	size_t start = ctx->off;
+
+	if (skip_value(ctx))
+		return NULL;
+
+	if (ctx->arena != NULL) {
+		raw = ben_arena_alloc(ctx->arena, sizeof(*raw));
+		if (raw != NULL) {
+			memset(raw, 0, sizeof(*raw));
+			raw->user.type = BENCODE_USER;
+			raw->user.arena = BEN_ARENA_OBJECT;
+			raw->user.info = &raw_type;
+		}
+	} else {
+		raw = ben_alloc_user(&raw_type);
+	}
+	if (raw == NULL)
+		return ben_oom_ptr(ctx);
+	raw->data = ctx->data + start;
+	raw->len = ctx->off - start;
+	raw->user.span_off = start;
+	raw->user.span_len = raw->len;
+	return (struct bencode *) raw;
+}
+
+/*
+ * Decode a value inside a dictionary (under 'key') or a list (key == NULL),
+ * unless lazy decoding is on and the caller does not want it expanded.
+ */
+static struct bencode *decode_child(struct ben_decode_ctx *ctx,
+				    const struct bencode *key)
+{
+	struct bencode *b;
+
+	if (ctx->expand == NULL)
+		return ben_ctx_decode(ctx);
+	if (ctx->path_n >= 256)
+		return ben_invalid_ptr(ctx);
+
+	ctx->path[ctx->path_n++] = key;
+	if (ctx->expand(ctx->expand_arg, ctx->path, ctx->path_n))
+		b = ben_ctx_decode(ctx);
+	else
+		b = decode_raw(ctx);
+	ctx->path_n--;
+	return b;
+}
+
 struct bencode *ben_ctx_decode(struct ben_decode_ctx *ctx)
 {
 	char c;
 	struct bencode_type *type;
 	struct bencode *b;
+	size_t start = ctx->off;
 	ctx->level++;
 	if (ctx->level > 256)
 		return ben_invalid_ptr(ctx);
@@ -884,6 +1329,10 @@ struct bencode *ben_ctx_decode(struct ben_decode_ctx *ctx)
 			return ben_invalid_ptr(ctx);
 	}
 	ctx->level--;
+	if (b != NULL) {
+		b->span_off = start;
+		b->span_len = ctx->off - start;
+	}
 	return b;
 }
 
@@ -910,6 +1359,21 @@ struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *erro
 	return b;
 }
 
+
+struct bencode *ben_decode_arena(const void *data, size_t len, size_t *off, int *error, ben_expand_fn expand, void *arg, struct ben_arena *arena, int borrow)
+{
+	struct ben_decode_ctx ctx = {.data = data, .len = len, .off = *off,
+				     .expand = expand, .expand_arg = arg,
+				     .arena = arena, .borrow = borrow};
+	struct bencode *b = ben_ctx_decode(&ctx);
+	*off = ctx.off;
+	if (error != NULL) {
+		assert((b != NULL) ^ (ctx.error != 0));
+		*error = ctx.error;
+	}
+	return b;
+}
+
 struct bencode *ben_decode3(const void *data, size_t len, size_t *off, int *error, struct bencode_type *types[128])
 {
 	struct ben_decode_ctx ctx = {.data = data, .len = len, .off = *off,
@@ -1310,6 +1774,8 @@ static void free_dict(struct bencode_dict *d)
 		d->nodes[pos].key = NULL;
 		d->nodes[pos].value = NULL;
 	}
+	if (d->arena & BEN_ARENA_DATA)
+		return;
 	free(d->buckets);
 	free(d->nodes);
 }
@@ -1323,13 +1789,37 @@ static void free_list(struct bencode_list *list)
 		ben_free(list->values[pos]);
 		list->values[pos] = NULL;
 	}
+	if (list->arena & BEN_ARENA_DATA)
+		return;
 	free(list->values);
 }
 
+/* Make room for 'len' more bytes in the output of 'ctx' by growing it */
+static int make_room(struct ben_encode_ctx *ctx, size_t len)
+{
+	char *newdata;
+	size_t newsize;
+
+	if (!ctx->grow)
+		return -1;
+	newsize = ctx->size ? ctx->size : 256;
+	while (newsize - ctx->pos < len) {
+		if (newsize > ((size_t) -1) / 2)
+			return -1;
+		newsize *= 2;
+	}
+	newdata = realloc(ctx->data, newsize);
+	if (newdata == NULL)
+		return -1;
+	ctx->data = newdata;
+	ctx->size = newsize;
+	return 0;
+}
+
 int ben_put_char(struct ben_encode_ctx *ctx, char c)
 {
 	if (ctx->pos >= ctx->size)
-		return -1;
+		return ben_put_buffer(ctx, &c, 1);
 	ctx->data[ctx->pos] = c;
 	ctx->pos++;
 	return 0;
@@ -1337,8 +1827,10 @@ int ben_put_char(struct ben_encode_ctx *ctx, char c)
 
 int ben_put_buffer(struct ben_encode_ctx *ctx, const void *buf, size_t len)
 {
-	if ((ctx->pos + len) > ctx->size)
-		return -1;
+	if (len > ctx->size - ctx->pos) {
+		if (make_room(ctx, len))
+			return -1;
+	}
 	memcpy(ctx->data + ctx->pos, buf, len);
 	ctx->pos += len;
 	return 0;
@@ -1352,20 +1844,45 @@ static int puthexchar(struct ben_encode_ctx *ctx, unsigned char hex)
 	return ben_put_buffer(ctx, buf, len);
 }
 
+/* Write the digits of 'llu' so that they end at 'end'. Returns the first. */
+static char *format_digits(char *end, unsigned long long llu)
+{
+	do {
+		*--end = '0' + llu % 10;
+		llu /= 10;
+	} while (llu != 0);
+	return end;
+}
+
+/* Same as strlen() of the digits of 'llu' */
+static size_t count_digits(unsigned long long llu)
+{
+	size_t n = 1;
+	for (; llu >= 10; llu /= 10)
+		n++;
+	return n;
+}
+
+/* Magnitude of 'll', which is fine for LLONG_MIN too */
+static unsigned long long magnitude(long long ll)
+{
+	return ll < 0 ? 0ULL - (unsigned long long) ll : (unsigned long long) ll;
+}
+
 static int putlonglong(struct ben_encode_ctx *ctx, long long ll)
 {
 	char buf[LONGLONGSIZE];
-	int len = snprintf(buf, sizeof buf, "%lld", ll);
-	assert(len > 0);
-	return ben_put_buffer(ctx, buf, len);
+	char *start = format_digits(buf + sizeof buf, magnitude(ll));
+	if (ll < 0)
+		*--start = '-';
+	return ben_put_buffer(ctx, start, buf + sizeof buf - start);
 }
 
 static int putunsignedlonglong(struct ben_encode_ctx *ctx, unsigned long long llu)
 {
 	char buf[LONGLONGSIZE];
-	int len = snprintf(buf, sizeof buf, "%llu", llu);
-	assert(len > 0);
-	return ben_put_buffer(ctx, buf, len);
+	char *start = format_digits(buf + sizeof buf, llu);
+	return ben_put_buffer(ctx, start, buf + sizeof buf - start);
 }
 
 static int putstr(struct ben_encode_ctx *ctx, char *s)
@@ -1373,6 +1890,41 @@ static int putstr(struct ben_encode_ctx *ctx, char *s)
 	return ben_put_buffer(ctx, s, strlen(s));
 }
 
+/*
+ * Sorted items of dict 'b' if it is unsorted, NULL if its nodes are in key
+ * order already or there is no memory. Use ordered_key() and
+ * ordered_value() to walk either.
+ */
+static struct bencode_keyvalue *sorted_items(const struct bencode *b)
+{
+	if (!ben_dict_const_cast(b)->unsorted)
+		return NULL;
+	return ben_dict_ordered_items(b);
+}
+
+static int sorted_items_failed(const struct bencode *b,
+			       const struct bencode_keyvalue *pairs)
+{
+	if (pairs != NULL || !ben_dict_const_cast(b)->unsorted)
+		return 0;
+	warn("No memory for dict serialization\n");
+	return 1;
+}
+
+static const struct bencode *ordered_key(const struct bencode *b,
+					 const struct bencode_keyvalue *pairs,
+					 size_t i)
+{
+	return pairs != NULL ? pairs[i].key : ben_dict_const_cast(b)->nodes[i].key;
+}
+
+static const struct bencode *ordered_value(const struct bencode *b,
+					   const struct bencode_keyvalue *pairs,
+					   size_t i)
+{
+	return pairs != NULL ? pairs[i].value : ben_dict_const_cast(b)->nodes[i].value;
+}
+
 static int print(struct ben_encode_ctx *ctx, const struct bencode *b)
 {
 	const struct bencode_bool *boolean;
@@ -1392,19 +1944,17 @@ static int print(struct ben_encode_ctx *ctx, const struct bencode *b)
 		if (ben_put_char(ctx, '{'))
 			return -1;
 
-		pairs = ben_dict_ordered_items(b);
-		if (pairs == NULL) {
-			warn("No memory for dict serialization\n");
+		pairs = sorted_items(b);
+		if (sorted_items_failed(b, pairs))
 			return -1;
-		}
 
 		len = ben_dict_len(b);
 		for (i = 0; i < len; i++) {
-			if (print(ctx, pairs[i].key))
+			if (print(ctx, ordered_key(b, pairs, i)))
 				break;
 			if (putstr(ctx, ": "))
 				break;
-			if (print(ctx, pairs[i].value))
+			if (print(ctx, ordered_value(b, pairs, i)))
 				break;
 			if (i < (len - 1)) {
 				if (putstr(ctx, ", "))
@@ -1552,17 +2102,15 @@ int ben_ctx_encode(struct ben_encode_ctx *ctx, const struct bencode *b)
 		if (ben_put_char(ctx, 'd'))
 			return -1;
 
-		pairs = ben_dict_ordered_items(b);
-		if (pairs == NULL) {
-			warn("No memory for dict serialization\n");
+		pairs = sorted_items(b);
+		if (sorted_items_failed(b, pairs))
 			return -1;
-		}
 
 		len = ben_dict_len(b);
 		for (i = 0; i < len; i++) {
-			if (ben_ctx_encode(ctx, pairs[i].key))
+			if (ben_ctx_encode(ctx, ordered_key(b, pairs, i)))
 				break;
-			if (ben_ctx_encode(ctx, pairs[i].value))
+			if (ben_ctx_encode(ctx, ordered_value(b, pairs, i)))
 				break;
 		}
 		free(pairs);
@@ -1618,7 +2166,6 @@ static size_t get_size(const struct bencode *b)
 	const struct bencode_str *s;
 	const struct bencode_user *u;
 	size_t size = 0;
-	char buf[1];
 
 	switch (b->type) {
 	case BENCODE_BOOL:
@@ -1632,7 +2179,7 @@ static size_t get_size(const struct bencode *b)
 		return size + 2;
 	case BENCODE_INT:
 		i = ben_int_const_cast(b);
-		return 2 + snprintf(buf, 0, "%lld", i->ll);
+		return 2 + (i->ll < 0) + count_digits(magnitude(i->ll));
 	case BENCODE_LIST:
 		l = ben_list_const_cast(b);
 		for (pos = 0; pos < l->n; pos++)
@@ -1640,7 +2187,7 @@ static size_t get_size(const struct bencode *b)
 		return size + 2;
 	case BENCODE_STR:
 		s = ben_str_const_cast(b);
-		return snprintf(buf, 0, "%zu", s->len) + 1 + s->len;
+		return count_digits(s->len) + 1 + s->len;
 	case BENCODE_USER:
 		u = ben_user_const_cast(b);
 		return u->info->get_size(b);
@@ -1656,20 +2203,18 @@ size_t ben_encoded_size(const struct bencode *b)
 
 void *ben_encode(size_t *len, const struct bencode *b)
 {
-	size_t size = get_size(b);
-	void *data = malloc(size);
-	struct ben_encode_ctx ctx = {.data = data, .size = size};
-	if (data == NULL) {
-		warn("No memory to encode\n");
-		return NULL;
-	}
+	/* Growing as needed takes one walk, instead of get_size() first */
+	struct ben_encode_ctx ctx = {.grow = 1};
+	char *data;
 	if (ben_ctx_encode(&ctx, b)) {
+		warn("No memory to encode\n");
 		free(ctx.data);
 		return NULL;
 	}
-	assert(ctx.pos == size);
+	/* Give back what the last doubling did not use */
+	data = ctx.pos > 0 ? realloc(ctx.data, ctx.pos) : NULL;
 	*len = ctx.pos;
-	return data;
+	return data != NULL ? data : ctx.data;
 }
 
 size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b)
@@ -1680,6 +2225,323 @@ size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b)
 	return ctx.pos;
 }
 
+void ben_str_replace(struct bencode *b, char *s, size_t len)
+{
+	struct bencode_str *str = ben_str_cast(b);
+	if (!(str->arena & (BEN_ARENA_DATA | BEN_ARENA_BORROWED)))
+		free(str->s);
+	str->s = s;
+	str->len = len;
+	str->arena &= ~(BEN_ARENA_DATA | BEN_ARENA_BORROWED);
+	ben_mark_dirty(b);
+}
+
+int ben_str_own(struct bencode *b)
+{
+	struct bencode_str *str = ben_str_cast(b);
+	char *s;
+	if (!(str->arena & BEN_ARENA_BORROWED))
+		return 0;
+	s = malloc(str->len + 1);
+	if (s == NULL)
+		return -1;
+	memcpy(s, str->s, str->len);
+	s[str->len] = 0;
+	str->s = s;
+	str->arena &= ~BEN_ARENA_BORROWED;
+	ben_mark_dirty(b);
+	return 0;
+}
+
+/*
+ * Mark 'b' and all of its ancestors as modified, so that ben_encode_spliced()
+ * re-encodes them instead of copying their source bytes
+ */
+static void ben_mark_dirty(struct bencode *b)
+{
+	/*
+	 * Ancestors of a dirty object are always dirty, so we can stop at
+	 * the first object that already is.
+	 */
+	for (; b != NULL && b->span_len != 0; b = b->parent)
+		b->span_len = 0;
+}
+
+struct splice_chunk {
+	int in_scratch;
+	size_t off; /* offset into either src or scratch */
+	size_t len;
+};
+
+struct ben_splice_ctx {
+	const char *src;
+	struct splice_chunk *chunks;
+	size_t n;
+	size_t alloc;
+	char *scratch;
+	size_t scratch_n;
+	size_t scratch_alloc;
+};
+
+static struct splice_chunk *splice_chunk(struct ben_splice_ctx *ctx, int in_scratch, size_t off)
+{
+	struct splice_chunk *last = ctx->n ? &ctx->chunks[ctx->n - 1] : NULL;
+	struct splice_chunk *newchunks;
+
+	/* Extend the last chunk if this one is contiguous with it */
+	if (last != NULL && last->in_scratch == in_scratch && last->off + last->len == off)
+		return last;
+
+	if (ctx->n == ctx->alloc) {
+		ctx->alloc = ctx->alloc ? ctx->alloc * 2 : 16;
+		newchunks = realloc(ctx->chunks, ctx->alloc * sizeof(ctx->chunks[0]));
+		if (newchunks == NULL)
+			return NULL;
+		ctx->chunks = newchunks;
+	}
+	last = &ctx->chunks[ctx->n++];
+	*last = (struct splice_chunk) {.in_scratch = in_scratch, .off = off};
+	return last;
+}
+
+/* Reserve 'len' bytes at the end of scratch. Returns NULL if there is no memory */
+static char *splice_reserve(struct ben_splice_ctx *ctx, size_t len)
+{
+	struct splice_chunk *chunk;
+	char *newscratch;
+	size_t newalloc;
+	char *reserved;
+
+	if (ctx->scratch_n + len > ctx->scratch_alloc) {
+		newalloc = ctx->scratch_alloc ? ctx->scratch_alloc : 256;
+		while (newalloc < ctx->scratch_n + len)
+			newalloc *= 2;
+		newscratch = realloc(ctx->scratch, newalloc);
+		if (newscratch == NULL)
+			return NULL;
+		ctx->scratch = newscratch;
+		ctx->scratch_alloc = newalloc;
+	}
+	chunk = splice_chunk(ctx, 1, ctx->scratch_n);
+	if (chunk == NULL)
+		return NULL;
+	chunk->len += len;
+	reserved = ctx->scratch + ctx->scratch_n;
+	ctx->scratch_n += len;
+	return reserved;
+}
+
+static int splice_put_char(struct ben_splice_ctx *ctx, char c)
+{
+	char *dst = splice_reserve(ctx, 1);
+	if (dst == NULL)
+		return -1;
+	*dst = c;
+	return 0;
+}
+
+static int splice_encode(struct ben_splice_ctx *ctx, const struct bencode *b)
+{
+	struct splice_chunk *chunk;
+	struct bencode_keyvalue *pairs;
+	struct ben_encode_ctx leaf;
+	const struct bencode_list *list;
+	size_t i;
+	size_t len;
+
+	if (b->span_len != 0) {
+		chunk = splice_chunk(ctx, 0, b->span_off);
+		if (chunk == NULL)
+			return -1;
+		chunk->len += b->span_len;
+		return 0;
+	}
+
+	switch (b->type) {
+	case BENCODE_DICT:
+		if (splice_put_char(ctx, 'd'))
+			return -1;
+		pairs = sorted_items(b);
+		if (sorted_items_failed(b, pairs))
+			return -1;
+		len = ben_dict_len(b);
+		for (i = 0; i < len; i++) {
+			if (splice_encode(ctx, ordered_key(b, pairs, i)))
+				break;
+			if (splice_encode(ctx, ordered_value(b, pairs, i)))
+				break;
+		}
+		free(pairs);
+		if (i < len)
+			return -1;
+		return splice_put_char(ctx, 'e');
+
+	case BENCODE_LIST:
+		if (splice_put_char(ctx, 'l'))
+			return -1;
+		list = ben_list_const_cast(b);
+		for (i = 0; i < list->n; i++) {
+			if (splice_encode(ctx, list->values[i]))
+				return -1;
+		}
+		return splice_put_char(ctx, 'e');
+
+	default:
+		/* Leaves are small enough to be encoded normally into scratch */
+		len = get_size(b);
+		leaf.data = splice_reserve(ctx, len);
+		if (leaf.data == NULL)
+			return -1;
+		leaf.size = len;
+		leaf.pos = 0;
+		if (ben_ctx_encode(&leaf, b))
+			return -1;
+		assert(leaf.pos == len);
+		return 0;
+	}
+}
+
+struct ben_iovec *ben_encode_spliced(size_t *iov_n, char **scratch, size_t *len,
+				     const struct bencode *b, const void *src)
+{
+	struct ben_splice_ctx ctx = {.src = src};
+	struct ben_iovec *iov;
+	size_t i;
+
+	if (splice_encode(&ctx, b))
+		goto error;
+
+	/* Scratch does not move anymore, so chunks can be turned into pointers */
+	iov = malloc((ctx.n ? ctx.n : 1) * sizeof(iov[0]));
+	if (iov == NULL)
+		goto error;
+	*len = 0;
+	for (i = 0; i < ctx.n; i++) {
+		iov[i].base = (ctx.chunks[i].in_scratch ? ctx.scratch : ctx.src) + ctx.chunks[i].off;
+		iov[i].len = ctx.chunks[i].len;
+		*len += iov[i].len;
+	}
+	free(ctx.chunks);
+	*iov_n = ctx.n;
+	*scratch = ctx.scratch;
+	return iov;
+
+error:
+	warn("No memory to encode\n");
+	free(ctx.chunks);
+	free(ctx.scratch);
+	return NULL;
+}
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_MIN (64 * 1024)
+
+struct ben_arena_chunk {
+	struct ben_arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+/* Chunk data starts after the header, rounded up to the alignment */
+#define ARENA_HEADER ((sizeof(struct ben_arena_chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct ben_arena {
+	struct ben_arena_chunk *chunks; /* the one being filled first */
+};
+
+struct ben_arena *ben_arena_new(void)
+{
+	return calloc(1, sizeof(struct ben_arena));
+}
+
+static struct ben_arena_chunk *arena_chunk(size_t size)
+{
+	struct ben_arena_chunk *chunk;
+	if (size > ((size_t) -1) - ARENA_HEADER)
+		return NULL;
+	chunk = malloc(ARENA_HEADER + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void *ben_arena_alloc(struct ben_arena *arena, size_t size)
+{
+	struct ben_arena_chunk *chunk = arena->chunks;
+	size_t chunksize;
+
+	if (size > ((size_t) -1) / 2)
+		return NULL;
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		if (size > ARENA_CHUNK_MIN / 4) {
+			/*
+			 * Big objects get a chunk of their own behind the
+			 * current one, which keeps being filled.
+			 */
+			struct ben_arena_chunk *big = arena_chunk(size);
+			if (big == NULL)
+				return NULL;
+			big->used = size;
+			if (chunk != NULL) {
+				big->next = chunk->next;
+				chunk->next = big;
+			} else {
+				arena->chunks = big;
+			}
+			return (char *) big + ARENA_HEADER;
+		}
+		chunksize = chunk != NULL ? chunk->size * 2 : ARENA_CHUNK_MIN;
+		if (chunksize < ARENA_CHUNK_MIN)
+			chunksize = ARENA_CHUNK_MIN;
+		chunk = arena_chunk(chunksize);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+	chunk->used += size;
+	return (char *) chunk + ARENA_HEADER + chunk->used - size;
+}
+
+void ben_arena_reset(struct ben_arena *arena)
+{
+	/*
+	 * Chunks double in size, so the first one is about as big as all the
+	 * others together. Keeping it means the next tree of about the same
+	 * size needs at most one more chunk.
+	 */
+	struct ben_arena_chunk *chunk = arena->chunks;
+	struct ben_arena_chunk *next;
+	if (chunk == NULL)
+		return;
+	for (next = chunk->next; next != NULL; ) {
+		struct ben_arena_chunk *after = next->next;
+		free(next);
+		next = after;
+	}
+	chunk->next = NULL;
+	chunk->used = 0;
+}
+
+void ben_arena_free(struct ben_arena *arena)
+{
+	struct ben_arena_chunk *chunk;
+	if (arena == NULL)
+		return;
+	chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct ben_arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(arena);
+}
+
 void ben_free(struct bencode *b)
 {
 	struct bencode_str *s;
@@ -1687,6 +2549,12 @@ void ben_free(struct bencode *b)
 	size_t size;
 	if (b == NULL)
 		return;
+	/*
+	 * Modifying an object dirties it, so an arena object that is still
+	 * clean has nothing on the heap below it.
+	 */
+	if ((b->arena & BEN_ARENA_OBJECT) && b->span_len != 0)
+		return;
 	switch (b->type) {
 	case BENCODE_BOOL:
 		break;
@@ -1700,7 +2568,8 @@ void ben_free(struct bencode *b)
 		break;
 	case BENCODE_STR:
 		s = ben_str_cast(b);
-		free(s->s);
+		if (!(s->arena & (BEN_ARENA_DATA | BEN_ARENA_BORROWED)))
+			free(s->s);
 		break;
 	case BENCODE_USER:
 		u = ben_user_cast(b);
@@ -1711,6 +2580,8 @@ void ben_free(struct bencode *b)
 		die("invalid type: %d\n", b->type);
 	}
 
+	if (b->arena & BEN_ARENA_OBJECT)
+		return;
 	if (b->type == BENCODE_USER)
 		size = ((struct bencode_user *) b)->info->size;
 	else
@@ -1789,6 +2660,24 @@ struct bencode *ben_dict_get_by_str(const struct bencode *dict, const char *key)
 	return ben_dict_get(dict, (struct bencode *) &s);
 }
 
+struct bencode *ben_dict_get_by_hashed_str(const struct bencode *dict,
+					   const char *key, size_t len,
+					   long long hash)
+{
+	const struct bencode_dict *d = ben_dict_const_cast(dict);
+	struct bencode_str s;
+	size_t pos = hash_bucket_head(hash, d);
+	inplace_ben_str(&s, key, len);
+	while (pos != -1) {
+		assert(pos < d->n);
+		if (d->nodes[pos].hash == hash &&
+		    ben_cmp(d->nodes[pos].key, (struct bencode *) &s) == 0)
+			return d->nodes[pos].value;
+		pos = d->nodes[pos].next;
+	}
+	return NULL;
+}
+
 struct bencode *ben_dict_get_by_int(const struct bencode *dict, long long key)
 {
 	struct bencode_int i;
@@ -1810,7 +2699,8 @@ struct bencode_keyvalue *ben_dict_ordered_items(const struct bencode *b)
 		pairs[i].key = dict->nodes[i].key;
 		pairs[i].value = dict->nodes[i].value;
 	}
-	qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
+	if (dict->unsorted)
+		qsort(pairs, dict->n, sizeof(pairs[0]), ben_cmp_qsort);
 	return pairs;
 }
 
@@ -1874,6 +2764,23 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 		return NULL;
 	key = NULL; /* avoid using the pointer again, it may not be valid */
 
+	if (!d->unsorted && removepos != tailpos) {
+		/*
+		 * Swapping the tail node in would lose the key order, so
+		 * close the gap instead and relink everything.
+		 */
+		value = d->nodes[removepos].value;
+		value->parent = NULL;
+		ben_free(d->nodes[removepos].key);
+		memmove(&d->nodes[removepos], &d->nodes[removepos + 1],
+			(tailpos - removepos) * sizeof(d->nodes[0]));
+		memset(&d->nodes[tailpos], 0, sizeof d->nodes[tailpos]); /* poison */
+		d->nodes[tailpos].next = ((size_t) -1) / 2;
+		d->n--;
+		rehash_dict(d);
+		goto popped;
+	}
+
 	/*
 	 * WARNING: complicated code follows.
 	 *
@@ -1891,6 +2798,7 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 
 	/* Then read the removed node and free its key */
 	value = d->nodes[removepos].value;
+	value->parent = NULL;
 	ben_free(d->nodes[removepos].key);
 
 	/* Then re-insert the unliked tail node in the place of removed node */
@@ -1909,9 +2817,11 @@ static struct bencode *dict_pop(struct bencode_dict *d,
 
 	d->n--;
 
+popped:
 	if (d->n <= (d->alloc / 4) && d->alloc >= 8)
-		resize_dict(d, d->alloc / 2);
+		resize_dict(d, d->alloc / 2, NULL);
 
+	ben_mark_dirty((struct bencode *) d);
 	return value;
 }
 
@@ -1948,7 +2858,6 @@ int ben_dict_set(struct bencode *dict, struct bencode *key, struct bencode *valu
 {
 	struct bencode_dict *d = ben_dict_cast(dict);
 	long long hash = ben_hash(key);
-	size_t bucket;
 	size_t pos;
 
 	assert(value != NULL);
@@ -1962,22 +2871,21 @@ int ben_dict_set(struct bencode *dict, struct bencode *key, struct bencode *valu
 		ben_free(d->nodes[pos].value);
 		d->nodes[pos].key = key;
 		d->nodes[pos].value = value;
+		key->parent = dict;
+		value->parent = dict;
+		ben_mark_dirty(dict);
 		/* 'hash' and 'next' members stay the same */
 		return 0;
 	}
 
 	assert(d->n <= d->alloc);
-	if (d->n == d->alloc && resize_dict(d, -1))
+	if (d->n == d->alloc && resize_dict(d, -1, NULL))
 		return -1;
 
-	bucket = hash_bucket(hash, d);
-	pos = d->n;
-	d->nodes[pos] = (struct bencode_dict_node) {.hash = hash,
-						    .key = key,
-						    .value = value,
-						    .next = d->buckets[bucket]};
-	d->n++;
-	d->buckets[bucket] = pos;
+	if (d->n > 0 && ben_cmp(d->nodes[d->n - 1].key, key) > 0)
+		d->unsorted = 1;
+	dict_insert_new(d, key, value, hash);
+	ben_mark_dirty(dict);
 	return 0;
 }
 
@@ -2029,11 +2937,13 @@ int ben_list_append(struct bencode *list, struct bencode *b)
 	struct bencode_list *l = ben_list_cast(list);
 	/* NULL pointer de-reference if the cast fails */
 	assert(l->n <= l->alloc);
-	if (l->n == l->alloc && resize_list(l, -1))
+	if (l->n == l->alloc && resize_list(l, -1, NULL))
 		return -1;
 	assert(b != NULL);
 	l->values[l->n] = b;
 	l->n++;
+	b->parent = list;
+	ben_mark_dirty(list);
 	return 0;
 }
 
@@ -2067,6 +2977,8 @@ struct bencode *ben_list_pop(struct bencode *list, size_t pos)
 
 	l->values[l->n - 1] = NULL;
 	l->n--;
+	value->parent = NULL;
+	ben_mark_dirty(list);
 	return value;
 }
 
@@ -2079,6 +2991,8 @@ void ben_list_set(struct bencode *list, size_t i, struct bencode *b)
 	ben_free(l->values[i]);
 	assert(b != NULL);
 	l->values[i] = b;
+	b->parent = list;
+	ben_mark_dirty(list);
 }
 
 char *ben_print(const struct bencode *b)
@@ -31,6 +31,13 @@ enum {
 	BENCODE_USER,
 };
 
+/* Bits of the 'arena' member of objects */
+enum {
+	BEN_ARENA_OBJECT = 1, /* the object itself */
+	BEN_ARENA_DATA = 2,   /* its string, list values, or dict nodes and buckets */
+	BEN_ARENA_BORROWED = 4, /* its string points into the decoded data */
+};
+
 enum {
 	BEN_OK = 0, /* No errors. Set to zero. Non-zero implies an error. */
 	BEN_INVALID,      /* Invalid data was given to decoder */
@@ -39,12 +46,35 @@ enum {
 	BEN_MISMATCH,     /* A given structure did not match unpack format */
 };
 
+/*
+ * Every bencode object begins with the members of struct bencode.
+ *
+ * 'parent' is the dictionary or list holding the object, if any.
+ *
+ * 'span_off' and 'span_len' locate the bytes the object was decoded from.
+ * 'span_len' is zero for objects that were not decoded, or that were
+ * modified after decoding (they are "dirty").
+ * Modifying an object also dirties all of its ancestors, so an object with
+ * a non-zero 'span_len' can be re-encoded by copying its source bytes.
+ *
+ * 'arena' says which parts of the object were allocated from a ben_arena
+ * by ben_decode_arena(), or are borrowed from the data it decoded.
+ * ben_free() leaves those to ben_arena_reset() or the owner of the data.
+ */
 struct bencode {
 	char type;
+	char arena; /* BEN_ARENA_* bits */
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 };
 
 struct bencode_bool {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	char b;
 };
 
@@ -57,8 +87,15 @@ struct bencode_dict_node {
 
 struct bencode_dict {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	char shared; /* non-zero means that the internal data is shared with
 			other instances and should not be freed */
+	char unsorted; /* non-zero once a key was added out of order. Until
+			  then, nodes are in key order and can be encoded
+			  without sorting. */
 	size_t n;
 	size_t alloc;
 	size_t *buckets;
@@ -67,11 +104,19 @@ struct bencode_dict {
 
 struct bencode_int {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	long long ll;
 };
 
 struct bencode_list {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	char shared; /* non-zero means that the internal data is shared with
 			other instances and should not be freed */
 	size_t n;
@@ -81,6 +126,10 @@ struct bencode_list {
 
 struct bencode_str {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	size_t len;
 	char *s;
 };
@@ -99,9 +148,19 @@ struct bencode_type {
 
 struct bencode_user {
 	char type;
+	char arena;
+	struct bencode *parent;
+	size_t span_off;
+	size_t span_len;
 	struct bencode_type *info;
 };
 
+/* One chunk of output from ben_encode_spliced() */
+struct ben_iovec {
+	const void *base;
+	size_t len;
+};
+
 struct bencode_error {
 	int error;  /* 0 if no errors */
 	int line;   /* Error line: 0 is the first line */
@@ -192,6 +251,56 @@ struct bencode *ben_decode(const void *data, size_t len);
  */
 struct bencode *ben_decode2(const void *data, size_t len, size_t *off, int *error);
 
+/*
+ * Called by ben_decode_arena() before decoding a value inside a dictionary or
+ * a list. 'path' holds the dictionary keys leading from the root to the
+ * value, with NULL for list elements, so 'path[path_n - 1]' is the key of
+ * the value itself. Return non-zero to decode the value normally, or zero
+ * to keep it as a raw node.
+ */
+typedef int (*ben_expand_fn)(void *arg, const struct bencode *const *path, int path_n);
+
+/*
+ * A bump-pointer allocator for decoded objects. Memory is taken from big
+ * chunks and is only given back all at once, by ben_arena_reset() or
+ * ben_arena_free(), which makes decoding a large tree and freeing it again
+ * a handful of malloc() calls instead of one or two per object.
+ */
+struct ben_arena;
+
+/* Returns NULL if there is no memory */
+struct ben_arena *ben_arena_new(void);
+
+/*
+ * Free everything allocated from 'arena' at once, keeping the biggest chunk
+ * for the next user. Every tree decoded into it must have been ben_free()d
+ * first, so that objects added to it later on the heap get freed too.
+ */
+void ben_arena_reset(struct ben_arena *arena);
+
+/* Free 'arena' and everything allocated from it. Does nothing if NULL. */
+void ben_arena_free(struct ben_arena *arena);
+
+/*
+ * Same as ben_decode2(), but values that 'expand' rejects are only checked
+ * for validity, with the same errors as usual, and kept as raw nodes instead
+ * of being decoded. 'expand' may be NULL to decode everything. A raw node is
+ * an opaque user type that points into 'data' and encodes back to the same
+ * bytes, so 'data' must stay valid for as long as the result is used.
+ *
+ * Objects are allocated from 'arena', which may be NULL for the heap. The
+ * result can be modified like any other tree: whatever is added or grown
+ * afterwards goes on the heap. ben_free() must still be called before
+ * resetting the arena, but it skips subtrees that were never modified, so it
+ * is cheap.
+ *
+ * If 'borrow' is non-zero, strings point into 'data' instead of being
+ * copied, so 'data' must outlive the tree. Borrowed strings are NOT zero
+ * terminated: use ben_str_len(), or ben_str_own() before ben_str_val().
+ * The encoders write them straight from 'data'.
+ */
+struct bencode *ben_decode_arena(const void *data, size_t len, size_t *off, int *error, ben_expand_fn expand, void *arg, struct ben_arena *arena, int borrow);
+
 /*
  * Same as ben_decode2(), but allows one to define user types.
  */
@@ -228,6 +337,34 @@ void *ben_encode(size_t *len, const struct bencode *b);
  */
 size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b);
 
+/*
+ * Encode 'b', which was decoded from 'src', by copying the source bytes of
+ * all objects that have not been modified since decoding. Only objects changed
+ * through this library's functions since then are re-encoded.
+ *
+ * Returns an array of '*iov_n' chunks which, concatenated, form the encoded
+ * data of '*len' bytes. Chunks point either into 'src' or into '*scratch',
+ * so both must stay valid while the chunks are used. Free the returned array
+ * and '*scratch' with free(). Returns NULL if there is no memory.
+ */
+struct ben_iovec *ben_encode_spliced(size_t *iov_n, char **scratch, size_t *len,
+				     const struct bencode *b, const void *src);
+
+/*
+ * Replace the contents of string 'b' with 's', which must be malloc()ed and
+ * zero terminated at 'len'. 'b' takes ownership of it and frees the old
+ * contents, unless they belong to an arena or are borrowed. Marks 'b' dirty.
+ */
+void ben_str_replace(struct bencode *b, char *s, size_t len);
+
+/*
+ * Give string 'b' a zero terminated copy of its contents if they are
+ * borrowed (see ben_decode_arena()). That marks 'b' dirty, because its
+ * contents are then on the heap. Returns 0 on success, -1 if there is no
+ * memory.
+ */
+int ben_str_own(struct bencode *b);
+
 /*
  * You must use ben_free() for all allocated bencode structures after use.
  * If b == NULL, ben_free does nothing.
@@ -238,6 +375,8 @@ size_t ben_encode2(char *data, size_t maxlen, const struct bencode *b);
 void ben_free(struct bencode *b);
 
 long long ben_str_hash(const struct bencode *b);
+/* Same hash as ben_str_hash(), for a key that isn't a bencode object */
+long long ben_str_hash_buf(const void *s, size_t len);
 long long ben_int_hash(const struct bencode *b);
 long long ben_hash(const struct bencode *b);
 
@@ -257,6 +396,15 @@ struct bencode *ben_dict(void);
 struct bencode *ben_dict_get(const struct bencode *d, const struct bencode *key);
 
 struct bencode *ben_dict_get_by_str(const struct bencode *d, const char *key);
+
+/*
+ * Like ben_dict_get_by_str(), but with the key's length and hash given by the
+ * caller. Use this to look up the same key in many dictionaries without
+ * hashing it each time. 'hash' must be ben_str_hash_buf(key, len).
+ */
+struct bencode *ben_dict_get_by_hashed_str(const struct bencode *d,
+					   const char *key, size_t len,
+					   long long hash);
 struct bencode *ben_dict_get_by_int(const struct bencode *d, long long key);
 
 struct bencode_keyvalue {
@@ -565,8 +713,8 @@ static inline long long ben_int_val(const struct bencode *b)
 }
 
 /*
- * Note: the string is always zero terminated. Also, the string may
- * contain more than one zero.
+ * Note: the string is always zero terminated, unless it was borrowed by
+ * ben_decode_arena(). Also, the string may contain more than one zero.
  * bencode strings are not compatible with C strings.
  */
 static inline const char *ben_str_val(const struct bencode *b)
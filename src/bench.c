@@ -0,0 +1,693 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "libannouncebulk.h"
+#include "vector.h"
+#include "err.h"
+#include "util.h"
+
+// what a generated corpus directory is marked with, so only directories the benchmark made are ever emptied
+#define BENCH_MARKER ".greeny-bench"
+#define BENCH_PASSKEY "abcdef0123456789abcdef0123456789"
+
+struct bench_ctx {
+	char *dir;
+	int torrents_n;
+	int runs_n;
+	uint64_t seed;
+	int jobs_n;
+	int pipeline_n;
+	int io_depth;
+
+	// the corpus being generated
+	uint64_t rng;
+	uint64_t bytes_n;
+	int files_n;
+
+	struct grn_source *source;
+	pthread_t search_thread;
+	bool searching;
+	int search_err;
+
+	struct grn_ctx *grn_ctx;
+	// nanoseconds from each file being opened to it being done
+	struct vector *latencies;
+};
+
+// what a run's child process sends back
+struct bench_result {
+	double seconds;
+	int files_n;
+	int errs_n;
+	int unchanged_n;
+	// p50, p90, p99, p99.9 and max
+	double latency_us[5];
+};
+
+static void die_silent( struct bench_ctx *bench_ctx );
+static void die_if( struct bench_ctx *bench_ctx, int err );
+
+static void handle_opts( struct bench_ctx *bench_ctx, int argc, char **argv );
+static long opt_long( struct bench_ctx *bench_ctx, long min, long max );
+
+// BEGIN corpus
+static uint64_t rng_next( struct bench_ctx *bench_ctx );
+static uint64_t rng_below( struct bench_ctx *bench_ctx, uint64_t n );
+static void rng_hex( struct bench_ctx *bench_ctx, char *out, int n );
+static char *bench_path( struct bench_ctx *bench_ctx, const char *sub );
+static void bench_mkdir( struct bench_ctx *bench_ctx, const char *sub );
+static FILE *bench_fopen( struct bench_ctx *bench_ctx, const char *sub );
+static void bench_fclose( struct bench_ctx *bench_ctx, FILE *f );
+static void clear_corpus( struct bench_ctx *bench_ctx );
+static void generate( struct bench_ctx *bench_ctx );
+static void gen_announce( struct bench_ctx *bench_ctx, char *out );
+static void gen_torrent( struct bench_ctx *bench_ctx, FILE *f, const char *announce, const char *name, uint64_t *out_pieces_n );
+static void gen_fastresume( struct bench_ctx *bench_ctx, FILE *f, const char *announce, uint64_t pieces_n );
+static void gen_deluge_state( struct bench_ctx *bench_ctx );
+static void gen_resume_dat( struct bench_ctx *bench_ctx );
+// END corpus
+
+static void run( struct bench_ctx *bench_ctx, int run_i );
+static void measure( struct bench_ctx *bench_ctx, struct bench_result *result );
+static void *search( void *arg );
+static void join_search( struct bench_ctx *bench_ctx );
+static void summarize_latencies( struct bench_ctx *bench_ctx, struct bench_result *result );
+static void report( struct bench_ctx *bench_ctx, int run_i, const struct bench_result *result, long peak_rss_kb );
+
+char help_text[] = "USAGE:\n"
+                   "\n"
+                   "greeny-bench [ OPTIONS ]\n"
+                   "\n"
+                   "Generates a corpus of torrents and client files, transforms it like greeny-cli --orpheus would, and prints one\n"
+                   "line of JSON per run to stdout. The same seed always generates the same corpus.\n"
+                   "\n"
+                   "OPTIONS:\n"
+                   "\n"
+                   "  -h               Show this help text.\n"
+                   "  --dir DIR        Where to generate the corpus. Default .tmp/greeny-bench.\n"
+                   "  --torrents N     How many torrents each kind of client gets. Default 1000.\n"
+                   "  --runs N         Regenerate and transform the corpus N times. Default 1.\n"
+                   "  --seed N         Default 1.\n"
+                   "  -j, --jobs N     Like greeny-cli.\n"
+                   "  --pipeline N     Like greeny-cli.\n"
+                   "  --io-depth N     Like greeny-cli.\n"
+                   "\n"
+                   "Latency is how long each file took from greeny opening it to it being reported done. Files are reported in\n"
+                   "order, so with more than one file in flight at once this includes waiting behind slower files opened before it.\n"
+                   "\n"
+                   "Each run is measured in a child process of its own, so peak_rss_kb doesn't include generating the corpus.\n";
+
+int main( int argc, char **argv ) {
+	struct bench_ctx bench_ctx;
+	int in_err;
+
+	memset( &bench_ctx, 0, sizeof( struct bench_ctx ) );
+	bench_ctx.torrents_n = 1000;
+	bench_ctx.runs_n = 1;
+	bench_ctx.seed = 1;
+	handle_opts( &bench_ctx, argc, argv );
+	if ( bench_ctx.dir == NULL ) {
+		bench_ctx.dir = grn_strcpy_malloc( ".tmp/greeny-bench", &in_err );
+		die_if( &bench_ctx, in_err );
+	}
+	bench_ctx.latencies = vector_alloc( sizeof( uint64_t ), &in_err );
+	die_if( &bench_ctx, in_err );
+
+	for ( int i = 0; i < bench_ctx.runs_n; i++ ) {
+		generate( &bench_ctx );
+		run( &bench_ctx, i );
+	}
+
+	vector_free( bench_ctx.latencies );
+	free( bench_ctx.dir );
+	return EXIT_SUCCESS;
+}
+
+static void die_silent( struct bench_ctx *bench_ctx ) {
+	int in_err;
+
+	if ( bench_ctx->grn_ctx != NULL ) {
+		grn_ctx_free( bench_ctx->grn_ctx, &in_err );
+	}
+	join_search( bench_ctx );
+	vector_free( bench_ctx->latencies );
+	grn_free( bench_ctx->dir );
+	exit( EXIT_FAILURE );
+}
+
+static void die_if( struct bench_ctx *bench_ctx, int err ) {
+	if ( err ) {
+		fprintf( stderr, "ERROR: %s\n", grn_err_to_string( err ) );
+		die_silent( bench_ctx );
+	}
+}
+
+static long opt_long( struct bench_ctx *bench_ctx, long min, long max ) {
+	char *end;
+	long n = strtol( optarg, &end, 10 );
+	if ( *optarg == '\0' || *end != '\0' || n < min || n > max ) {
+		die_if( bench_ctx, GRN_ERR_CLI_OPT_SYNTAX );
+	}
+	return n;
+}
+
+static void handle_opts( struct bench_ctx *bench_ctx, int argc, char **argv ) {
+	int in_err;
+	char shortopts[] = "hj:";
+	struct option longopts[] = {
+		{ .name = "help", .has_arg = 0, .flag = NULL, .val = 'h' },
+		{ .name = "jobs", .has_arg = 1, .flag = NULL, .val = 'j' },
+		{ .name = "dir", .has_arg = 1, .flag = NULL, .val = 1337 },
+		{ .name = "torrents", .has_arg = 1, .flag = NULL, .val = 1338 },
+		{ .name = "runs", .has_arg = 1, .flag = NULL, .val = 1339 },
+		{ .name = "seed", .has_arg = 1, .flag = NULL, .val = 1340 },
+		{ .name = "pipeline", .has_arg = 1, .flag = NULL, .val = 1341 },
+		{ .name = "io-depth", .has_arg = 1, .flag = NULL, .val = 1342 },
+		{ 0 },
+	};
+
+	int opt_c = 0;
+	while ( ( opt_c = getopt_long( argc, argv, shortopts, longopts, NULL ) ) != -1 ) {
+		switch ( opt_c ) {
+			case 1337:
+				;
+				grn_free( bench_ctx->dir );
+				bench_ctx->dir = grn_strcpy_malloc( optarg, &in_err );
+				die_if( bench_ctx, in_err );
+				break;
+			case 1338:
+				;
+				bench_ctx->torrents_n = opt_long( bench_ctx, 1, 10000000 );
+				break;
+			case 1339:
+				;
+				bench_ctx->runs_n = opt_long( bench_ctx, 1, 1000 );
+				break;
+			case 1340:
+				;
+				bench_ctx->seed = opt_long( bench_ctx, 0, LONG_MAX );
+				break;
+			case 1341:
+				;
+				bench_ctx->pipeline_n = opt_long( bench_ctx, 1, 1024 );
+				break;
+			case 1342:
+				;
+				bench_ctx->io_depth = opt_long( bench_ctx, 1, 4096 );
+				break;
+			case 'j':
+				;
+				bench_ctx->jobs_n = opt_long( bench_ctx, 1, 1024 );
+				break;
+			case 'h':
+				;
+				puts( help_text );
+				exit( EXIT_SUCCESS );
+				break;
+			case '?':
+				;
+				die_if( bench_ctx, GRN_ERR_UNKNOWN_CLI_OPT );
+				break;
+		}
+	}
+	if ( optind != argc ) {
+		die_if( bench_ctx, GRN_ERR_UNKNOWN_CLI_OPT );
+	}
+}
+
+// BEGIN corpus
+
+// xorshift64*, so the corpus only depends on the seed
+static uint64_t rng_next( struct bench_ctx *bench_ctx ) {
+	bench_ctx->rng ^= bench_ctx->rng >> 12;
+	bench_ctx->rng ^= bench_ctx->rng << 25;
+	bench_ctx->rng ^= bench_ctx->rng >> 27;
+	return bench_ctx->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t rng_below( struct bench_ctx *bench_ctx, uint64_t n ) {
+	return rng_next( bench_ctx ) % n;
+}
+
+// n random hex digits and a NUL
+static void rng_hex( struct bench_ctx *bench_ctx, char *out, int n ) {
+	for ( int i = 0; i < n; i++ ) {
+		out[i] = "0123456789abcdef"[rng_below( bench_ctx, 16 )];
+	}
+	out[n] = '\0';
+}
+
+// dir/sub, dynamically allocated
+static char *bench_path( struct bench_ctx *bench_ctx, const char *sub ) {
+	char *path = malloc( strlen( bench_ctx->dir ) + 1 + strlen( sub ) + 1 );
+	if ( path == NULL ) {
+		die_if( bench_ctx, GRN_ERR_OOM );
+	}
+	sprintf( path, "%s/%s", bench_ctx->dir, sub );
+	return path;
+}
+
+static void bench_mkdir( struct bench_ctx *bench_ctx, const char *sub ) {
+	char *path = bench_path( bench_ctx, sub );
+	int mkdir_err = mkdir( path, 0755 );
+	free( path );
+	if ( mkdir_err ) {
+		die_if( bench_ctx, GRN_ERR_FS_WRITE );
+	}
+}
+
+static FILE *bench_fopen( struct bench_ctx *bench_ctx, const char *sub ) {
+	char *path = bench_path( bench_ctx, sub );
+	FILE *f = fopen( path, "wb" );
+	free( path );
+	if ( f == NULL ) {
+		die_if( bench_ctx, GRN_ERR_FS_OPEN );
+	}
+	return f;
+}
+
+// counts the file towards the corpus
+static void bench_fclose( struct bench_ctx *bench_ctx, FILE *f ) {
+	long size = ftell( f );
+	bool write_err = ferror( f ) || size < 0;
+	if ( fclose( f ) || write_err ) {
+		die_if( bench_ctx, GRN_ERR_FS_WRITE );
+	}
+	bench_ctx->bytes_n += size;
+	bench_ctx->files_n++;
+}
+
+static int clear_corpus_cb( const char *path, const struct stat *st, int flag, struct FTW *ftw_info ) {
+	// the directory itself, and its marker, are kept
+	if ( ftw_info->level == 0 || ( ftw_info->level == 1 && strcmp( path + ftw_info->base, BENCH_MARKER ) == 0 ) ) {
+		return 0;
+	}
+	return remove( path ) ? -1 : 0;
+}
+
+static void clear_corpus( struct bench_ctx *bench_ctx ) {
+	struct stat st;
+	char *marker = bench_path( bench_ctx, BENCH_MARKER );
+	bool marked = stat( marker, &st ) == 0;
+	free( marker );
+
+	if ( stat( bench_ctx->dir, &st ) == 0 ) {
+		if ( !marked ) {
+			fprintf( stderr, "%s already exists, and wasn't made by greeny-bench. Not touching it.\n", bench_ctx->dir );
+			die_silent( bench_ctx );
+		}
+		if ( nftw( bench_ctx->dir, clear_corpus_cb, 16, FTW_DEPTH | FTW_PHYS ) ) {
+			die_if( bench_ctx, GRN_ERR_FS_NFTW );
+		}
+		return;
+	}
+	if ( mkdir( bench_ctx->dir, 0755 ) ) {
+		die_if( bench_ctx, GRN_ERR_FS_WRITE );
+	}
+	fclose( bench_fopen( bench_ctx, BENCH_MARKER ) );
+}
+
+static void gen_announce( struct bench_ctx *bench_ctx, char *out ) {
+	// some torrents are from somewhere else, and have nothing to change
+	if ( rng_below( bench_ctx, 4 ) == 0 ) {
+		strcpy( out, "udp://tracker.example.org:6969/announce" );
+		return;
+	}
+	char passkey[33];
+	rng_hex( bench_ctx, passkey, 32 );
+	sprintf( out, "https://mars.apollo.rip/%s/announce", passkey );
+}
+
+static void put_str( FILE *f, const char *str ) {
+	fprintf( f, "%zu:%s", strlen( str ), str );
+}
+
+static void put_random( struct bench_ctx *bench_ctx, FILE *f, uint64_t n ) {
+	fprintf( f, "%llu:", ( unsigned long long ) n );
+	for ( uint64_t i = 0; i < n; i++ ) {
+		fputc( ( int ) rng_below( bench_ctx, 256 ), f );
+	}
+}
+
+/**
+ * A torrent the way mktorrent makes them, between 1MiB and 16GiB of content, in one file or an album's worth.
+ * The piece hashes are most of the file, as they are in real torrents.
+ */
+static void gen_torrent( struct bench_ctx *bench_ctx, FILE *f, const char *announce, const char *name, uint64_t *out_pieces_n ) {
+	uint64_t length = ( 1ULL << ( 20 + rng_below( bench_ctx, 14 ) ) ) + rng_below( bench_ctx, 1ULL << 20 );
+	// mktorrent's choice: around a thousand pieces, at least 32KiB and at most 16MiB each
+	uint64_t piece_length = 1 << 15;
+	while ( length / piece_length > 1500 && piece_length < ( 1 << 24 ) ) {
+		piece_length *= 2;
+	}
+	uint64_t pieces_n = ( length + piece_length - 1 ) / piece_length;
+
+	fputs( "d8:announce", f );
+	put_str( f, announce );
+	fputs( "13:announce-listll", f );
+	put_str( f, announce );
+	fprintf( f, "ee10:created by13:mktorrent 1.113:creation datei%llue4:infod",
+	         1500000000ULL + ( unsigned long long ) rng_below( bench_ctx, 100000000 ) );
+	if ( rng_below( bench_ctx, 2 ) ) {
+		fprintf( f, "6:lengthi%llue", ( unsigned long long ) length );
+	} else {
+		int tracks_n = 2 + rng_below( bench_ctx, 20 );
+		fputs( "5:filesl", f );
+		for ( int i = 0; i < tracks_n; i++ ) {
+			uint64_t track_length = i + 1 < tracks_n ? length / tracks_n : length - length / tracks_n * ( tracks_n - 1 );
+			char track[64];
+			sprintf( track, "%02d - Track %d.flac", i + 1, i + 1 );
+			fprintf( f, "d6:lengthi%llue4:pathl", ( unsigned long long ) track_length );
+			put_str( f, track );
+			fputs( "ee", f );
+		}
+		fputs( "e", f );
+	}
+	fputs( "4:name", f );
+	put_str( f, name );
+	fprintf( f, "12:piece lengthi%llue6:pieces", ( unsigned long long ) piece_length );
+	put_random( bench_ctx, f, pieces_n * 20 );
+	fputs( "7:privatei1e6:source3:OPSee", f );
+	*out_pieces_n = pieces_n;
+}
+
+// the libtorrent resume data qBittorrent keeps next to each torrent in BT_backup
+static void gen_fastresume( struct bench_ctx *bench_ctx, FILE *f, const char *announce, uint64_t pieces_n ) {
+	fprintf( f, "d11:active_timei%llue10:added_timei%llue11:file-format22:libtorrent resume file12:file-versioni1e9:info-hash",
+	         ( unsigned long long ) rng_below( bench_ctx, 10000000 ), 1500000000ULL + ( unsigned long long ) rng_below( bench_ctx, 100000000 ) );
+	put_random( bench_ctx, f, 20 );
+	// one byte per piece, all of them had
+	fprintf( f, "6:pieces%llu:", ( unsigned long long ) pieces_n );
+	for ( uint64_t i = 0; i < pieces_n; i++ ) {
+		fputc( 1, f );
+	}
+	fputs( "12:qBt-category0:12:qBt-savePath16:/home/user/Music9:save_path16:/home/user/Music8:trackersll", f );
+	put_str( f, announce );
+	fputs( "eee", f );
+}
+
+// deluge pickles its state. greeny only ever looks for announce URLs in it, so this is the shape of one, not a real one.
+static void gen_deluge_state( struct bench_ctx *bench_ctx ) {
+	FILE *f = bench_fopen( bench_ctx, "deluge/state/torrents.state" );
+	fputs( "(ideluge.core.torrentmanager\nTorrentManagerState\np0\n(dp1\nS'torrents'\np2\n(lp3\n", f );
+	for ( int i = 0; i < bench_ctx->torrents_n; i++ ) {
+		char announce[128], hash[41];
+		gen_announce( bench_ctx, announce );
+		rng_hex( bench_ctx, hash, 40 );
+		fprintf( f, "(ideluge.core.torrentmanager\nTorrentState\n(dS'torrent_id'\nS'%s'\nS'trackers'\n"
+		         "(lp\n(dp\nS'url'\nS'%s'\nsS'tier'\nI0\nsasS'save_path'\nS'/home/user/Music'\nsS'paused'\nI00\nsba",
+		         hash, announce );
+	}
+	fputs( "sb.", f );
+	bench_fclose( bench_ctx, f );
+}
+
+// uTorrent's resume.dat: one dictionary for every torrent, and a hash of the whole thing
+static void gen_resume_dat( struct bench_ctx *bench_ctx ) {
+	FILE *f = bench_fopen( bench_ctx, "uTorrent/resume.dat" );
+	char fileguard[41];
+	rng_hex( bench_ctx, fileguard, 40 );
+	fputs( "d10:.fileguard40:", f );
+	fputs( fileguard, f );
+	// zero padded, so the keys are in order like bencode wants
+	for ( int i = 0; i < bench_ctx->torrents_n; i++ ) {
+		char announce[128], name[64];
+		gen_announce( bench_ctx, announce );
+		sprintf( name, "bench-%08d.torrent", i );
+		uint64_t have_n = 1 + rng_below( bench_ctx, 256 );
+		put_str( f, name );
+		fprintf( f, "d8:added_oni%llue4:have", 1500000000ULL + ( unsigned long long ) rng_below( bench_ctx, 100000000 ) );
+		put_random( bench_ctx, f, have_n );
+		fputs( "4:path", f );
+		put_str( f, "C:\\Users\\user\\Music" );
+		fputs( "8:trackersl", f );
+		put_str( f, announce );
+		fputs( "ee", f );
+	}
+	fputs( "e", f );
+	bench_fclose( bench_ctx, f );
+}
+
+static void generate( struct bench_ctx *bench_ctx ) {
+	bench_ctx->rng = bench_ctx->seed * 0x9E3779B97F4A7C15ULL + 1;
+	// the one state xorshift can't leave
+	if ( bench_ctx->rng == 0 ) {
+		bench_ctx->rng = 1;
+	}
+	bench_ctx->bytes_n = 0;
+	bench_ctx->files_n = 0;
+	clear_corpus( bench_ctx );
+
+	bench_mkdir( bench_ctx, "torrents" );
+	bench_mkdir( bench_ctx, "qBittorrent" );
+	bench_mkdir( bench_ctx, "qBittorrent/BT_backup" );
+	bench_mkdir( bench_ctx, "deluge" );
+	bench_mkdir( bench_ctx, "deluge/state" );
+	bench_mkdir( bench_ctx, "uTorrent" );
+
+	// spread over a few directories, like a download folder sorted by artist
+	for ( int i = 0; i < 16 && i < bench_ctx->torrents_n; i++ ) {
+		char sub[64];
+		sprintf( sub, "torrents/%02d", i );
+		bench_mkdir( bench_ctx, sub );
+	}
+	for ( int i = 0; i < bench_ctx->torrents_n; i++ ) {
+		char announce[128], name[64], sub[128];
+		uint64_t pieces_n;
+		gen_announce( bench_ctx, announce );
+		sprintf( name, "Artist %d - Album %d (FLAC)", i % 16, i );
+		sprintf( sub, "torrents/%02d/%s.torrent", i % 16, name );
+		FILE *f = bench_fopen( bench_ctx, sub );
+		gen_torrent( bench_ctx, f, announce, name, &pieces_n );
+		bench_fclose( bench_ctx, f );
+	}
+
+	for ( int i = 0; i < bench_ctx->torrents_n; i++ ) {
+		char announce[128], name[64], hash[41], sub[128];
+		uint64_t pieces_n;
+		gen_announce( bench_ctx, announce );
+		sprintf( name, "Album %d", i );
+		rng_hex( bench_ctx, hash, 40 );
+		sprintf( sub, "qBittorrent/BT_backup/%s.torrent", hash );
+		FILE *f = bench_fopen( bench_ctx, sub );
+		gen_torrent( bench_ctx, f, announce, name, &pieces_n );
+		bench_fclose( bench_ctx, f );
+		sprintf( sub, "qBittorrent/BT_backup/%s.fastresume", hash );
+		f = bench_fopen( bench_ctx, sub );
+		gen_fastresume( bench_ctx, f, announce, pieces_n );
+		bench_fclose( bench_ctx, f );
+	}
+
+	gen_deluge_state( bench_ctx );
+	gen_resume_dat( bench_ctx );
+}
+
+// END corpus
+
+static uint64_t now_ns( void ) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t ) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// measured in a child process, so the peak memory use is the run's alone
+static void run( struct bench_ctx *bench_ctx, int run_i ) {
+	int fds[2];
+	if ( pipe( fds ) ) {
+		die_if( bench_ctx, GRN_ERR_THREAD );
+	}
+	// or whatever's buffered would be printed twice
+	fflush( stdout );
+	pid_t pid = fork();
+	if ( pid == -1 ) {
+		close( fds[0] );
+		close( fds[1] );
+		die_if( bench_ctx, GRN_ERR_THREAD );
+	}
+	if ( pid == 0 ) {
+		close( fds[0] );
+		struct bench_result result;
+		measure( bench_ctx, &result );
+		bool sent = write( fds[1], &result, sizeof( result ) ) == sizeof( result );
+		close( fds[1] );
+		vector_free( bench_ctx->latencies );
+		free( bench_ctx->dir );
+		exit( sent ? EXIT_SUCCESS : EXIT_FAILURE );
+	}
+
+	close( fds[1] );
+	struct bench_result result;
+	// small enough to be written in one go
+	bool received = read( fds[0], &result, sizeof( result ) ) == sizeof( result );
+	close( fds[0] );
+	int status;
+	struct rusage usage;
+	if ( wait4( pid, &status, 0, &usage ) == -1 || !WIFEXITED( status ) || WEXITSTATUS( status ) != EXIT_SUCCESS || !received ) {
+		// the child has said what went wrong
+		die_silent( bench_ctx );
+	}
+	long peak_rss_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+	// bytes there
+	peak_rss_kb /= 1024;
+#endif
+	report( bench_ctx, run_i, &result, peak_rss_kb );
+}
+
+static void measure( struct bench_ctx *bench_ctx, struct bench_result *result ) {
+	int in_err;
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	die_if( bench_ctx, in_err );
+	grn_cat_transforms_orpheus( transforms, BENCH_PASSKEY, &in_err );
+	if ( in_err ) {
+		grn_free_transforms_v( transforms );
+		die_if( bench_ctx, in_err );
+	}
+
+	bench_ctx->grn_ctx = grn_ctx_alloc( &in_err );
+	if ( in_err ) {
+		grn_free_transforms_v( transforms );
+		die_if( bench_ctx, in_err );
+	}
+	grn_ctx_set_transforms_v( bench_ctx->grn_ctx, transforms );
+	bench_ctx->source = grn_source_alloc( 0, &in_err );
+	die_if( bench_ctx, in_err );
+	grn_ctx_set_source( bench_ctx->grn_ctx, bench_ctx->source );
+	grn_ctx_set_threads( bench_ctx->grn_ctx, bench_ctx->jobs_n );
+	grn_ctx_set_pipeline( bench_ctx->grn_ctx, bench_ctx->pipeline_n );
+	grn_ctx_set_io_depth( bench_ctx->grn_ctx, bench_ctx->io_depth );
+	vector_clear( bench_ctx->latencies );
+
+	// the search is part of what's measured, like it is for greeny-cli
+	uint64_t start = now_ns();
+	if ( pthread_create( &bench_ctx->search_thread, NULL, search, bench_ctx ) ) {
+		grn_source_close( bench_ctx->source );
+		die_if( bench_ctx, GRN_ERR_THREAD );
+	}
+	bench_ctx->searching = true;
+
+	while ( !grn_one_file( bench_ctx->grn_ctx, &in_err ) ) {
+		die_if( bench_ctx, in_err );
+		uint64_t now = now_ns();
+		uint64_t started = grn_ctx_get_c_started_ns( bench_ctx->grn_ctx );
+		int single_file_err = grn_ctx_get_c_error( bench_ctx->grn_ctx );
+		if ( single_file_err ) {
+			size_t path_n = grn_ctx_get_c_path( bench_ctx->grn_ctx, NULL, 0 );
+			char *path = malloc( path_n + 1 );
+			if ( path == NULL ) {
+				die_if( bench_ctx, GRN_ERR_OOM );
+			}
+			grn_ctx_get_c_path( bench_ctx->grn_ctx, path, path_n + 1 );
+			fprintf( stderr, "%s for %s\n", grn_err_to_string( single_file_err ), path );
+			free( path );
+		}
+		// both are CLOCK_MONOTONIC
+		uint64_t latency = now - started;
+		vector_push( bench_ctx->latencies, &latency, &in_err );
+		die_if( bench_ctx, in_err );
+	}
+	die_if( bench_ctx, in_err );
+	join_search( bench_ctx );
+	die_if( bench_ctx, bench_ctx->search_err );
+	uint64_t end = now_ns();
+
+	struct grn_ctx *ctx = bench_ctx->grn_ctx;
+	result->seconds = ( end - start ) / 1e9;
+	result->files_n = grn_ctx_get_files_n( ctx );
+	result->errs_n = grn_ctx_get_errs_n( ctx );
+	result->unchanged_n = grn_ctx_get_unchanged_n( ctx );
+	summarize_latencies( bench_ctx, result );
+	grn_ctx_free( bench_ctx->grn_ctx, &in_err );
+	bench_ctx->grn_ctx = NULL;
+	die_if( bench_ctx, in_err );
+}
+
+// runs on search_thread, and closes the source when it's done
+static void *search( void *arg ) {
+	struct bench_ctx *bench_ctx = arg;
+	int in_err = GRN_OK;
+	// the same extensions cat_client looks for
+	const char *subs[] = { "torrents", "qBittorrent/BT_backup", "qBittorrent/BT_backup", "deluge/state/torrents.state", "uTorrent/resume.dat" };
+	const char *extensions[] = { ".torrent", ".torrent", ".fastresume", ".state", ".dat" };
+
+	for ( int i = 0; in_err == GRN_OK && i < ( int ) ( sizeof( subs ) / sizeof( subs[0] ) ); i++ ) {
+		char *path = bench_path( bench_ctx, subs[i] );
+		grn_source_cat_torrent_files( bench_ctx->source, path, extensions[i], &in_err );
+		if ( grn_err_is_single_file( in_err ) ) {
+			fprintf( stderr, "Error adding %s -- %s.\n", path, grn_err_to_string( in_err ) );
+			in_err = GRN_OK;
+		}
+		free( path );
+	}
+
+	bench_ctx->search_err = in_err;
+	grn_source_close( bench_ctx->source );
+	return NULL;
+}
+
+static void join_search( struct bench_ctx *bench_ctx ) {
+	if ( bench_ctx->searching ) {
+		pthread_join( bench_ctx->search_thread, NULL );
+		bench_ctx->searching = false;
+	}
+}
+
+static int cmp_u64( const void *a, const void *b ) {
+	uint64_t x = *( const uint64_t * ) a, y = *( const uint64_t * ) b;
+	return x < y ? -1 : x > y;
+}
+
+// nearest rank, in microseconds
+static double percentile_us( uint64_t *sorted, int n, double p ) {
+	if ( n == 0 ) {
+		return 0;
+	}
+	int i = ( int ) ( p / 100 * n + 0.5 );
+	i = i < 1 ? 1 : i > n ? n : i;
+	return sorted[i - 1] / 1e3;
+}
+
+static void summarize_latencies( struct bench_ctx *bench_ctx, struct bench_result *result ) {
+	int latencies_n = vector_length( bench_ctx->latencies );
+	uint64_t *sorted = malloc( ( size_t ) ( latencies_n > 0 ? latencies_n : 1 ) * sizeof( uint64_t ) );
+	if ( sorted == NULL ) {
+		die_if( bench_ctx, GRN_ERR_OOM );
+	}
+	for ( int i = 0; i < latencies_n; i++ ) {
+		sorted[i] = VECTOR_AT( bench_ctx->latencies, uint64_t, i );
+	}
+	qsort( sorted, latencies_n, sizeof( uint64_t ), cmp_u64 );
+
+	const double ps[] = { 50, 90, 99, 99.9, 100 };
+	for ( int i = 0; i < 5; i++ ) {
+		result->latency_us[i] = percentile_us( sorted, latencies_n, ps[i] );
+	}
+	free( sorted );
+}
+
+static void report( struct bench_ctx *bench_ctx, int run_i, const struct bench_result *result, long peak_rss_kb ) {
+	double seconds = result->seconds;
+	printf( "{\"run\":%d,\"seed\":%llu,\"jobs\":%d,\"pipeline\":%d,\"io_depth\":%d,"
+	        "\"corpus_files\":%d,\"corpus_bytes\":%llu,\"files\":%d,\"errors\":%d,\"unchanged\":%d,"
+	        "\"seconds\":%.6f,\"files_per_s\":%.1f,\"mb_per_s\":%.2f,\"peak_rss_kb\":%ld,"
+	        "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+	        run_i, ( unsigned long long ) bench_ctx->seed, bench_ctx->jobs_n, bench_ctx->pipeline_n, bench_ctx->io_depth,
+	        bench_ctx->files_n, ( unsigned long long ) bench_ctx->bytes_n, result->files_n, result->errs_n, result->unchanged_n,
+	        seconds, result->files_n / seconds, bench_ctx->bytes_n / 1e6 / seconds, peak_rss_kb,
+	        result->latency_us[0], result->latency_us[1], result->latency_us[2], result->latency_us[3], result->latency_us[4] );
+	fflush( stdout );
+}
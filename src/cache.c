@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "err.h"
+#include "cache.h"
+
+// the file starts with this, followed by the entries as they're laid out in memory.
+// It's only meant to be read back on the machine that wrote it.
+#define CACHE_MAGIC "GRNCACH1"
+#define CACHE_MAGIC_N 8
+
+struct cache_entry {
+	struct grn_cache_key key;
+	uint64_t hash;
+};
+
+struct grn_cache {
+	char *path;
+	// open addressing on device and inode. Inode 0 marks an empty slot.
+	struct cache_entry *entries;
+	size_t entries_n;
+	size_t allocated;
+	bool dirty; // whether there's anything grn_cache_save needs to write
+};
+
+// the slot the file is recorded in, or the empty one it would go in
+size_t cache_slot( const struct grn_cache *cache, struct grn_cache_key key ) {
+	size_t mask = cache->allocated - 1;
+	size_t i = ( key.ino * 0x9E3779B97F4A7C15ULL ^ key.dev ) & mask;
+	while ( cache->entries[i].key.ino != 0 &&
+	        ( cache->entries[i].key.ino != key.ino || cache->entries[i].key.dev != key.dev ) ) {
+		i = ( i + 1 ) & mask;
+	}
+	return i;
+}
+
+void cache_insert( struct grn_cache *cache, struct cache_entry entry, int *out_err ) {
+	*out_err = GRN_OK;
+
+	// kept at most half full
+	if ( ( cache->entries_n + 1 ) * 2 > cache->allocated ) {
+		struct grn_cache grown = *cache;
+		grown.allocated = cache->allocated ? cache->allocated * 2 : 1024;
+		grown.entries = calloc( grown.allocated, sizeof( struct cache_entry ) );
+		ERR( grown.entries == NULL, GRN_ERR_OOM );
+		for ( size_t i = 0; i < cache->allocated; i++ ) {
+			if ( cache->entries[i].key.ino != 0 ) {
+				grown.entries[cache_slot( &grown, cache->entries[i].key )] = cache->entries[i];
+			}
+		}
+		free( cache->entries );
+		*cache = grown;
+	}
+
+	size_t i = cache_slot( cache, entry.key );
+	if ( cache->entries[i].key.ino == 0 ) {
+		cache->entries_n++;
+	}
+	cache->entries[i] = entry;
+}
+
+struct grn_cache *grn_cache_load( const char *path, int *out_err ) {
+	*out_err = GRN_OK;
+
+	FILE *fh = NULL;
+	struct grn_cache *cache = calloc( 1, sizeof( struct grn_cache ) );
+	ERR_NULL( cache == NULL, GRN_ERR_OOM );
+	cache->path = malloc( strlen( path ) + 1 );
+	if ( cache->path == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	strcpy( cache->path, path );
+
+	fh = fopen( path, "rb" );
+	if ( fh == NULL ) {
+		if ( errno != ENOENT ) {
+			*out_err = GRN_ERR_FS_OPEN;
+		}
+		goto cleanup;
+	}
+	// anything else gets replaced on the next save
+	char magic[CACHE_MAGIC_N];
+	if ( fread( magic, 1, CACHE_MAGIC_N, fh ) != CACHE_MAGIC_N || memcmp( magic, CACHE_MAGIC, CACHE_MAGIC_N ) ) {
+		goto cleanup;
+	}
+	struct cache_entry entry;
+	while ( fread( &entry, sizeof( entry ), 1, fh ) == 1 ) {
+		if ( entry.key.ino == 0 ) {
+			continue;
+		}
+		cache_insert( cache, entry, out_err );
+		ERR_FW_CLEANUP();
+	}
+	if ( ferror( fh ) ) {
+		*out_err = GRN_ERR_FS_READ;
+	}
+
+cleanup:
+	if ( fh != NULL ) {
+		fclose( fh );
+	}
+	if ( *out_err ) {
+		grn_cache_free( cache );
+		return NULL;
+	}
+	return cache;
+}
+
+void grn_cache_free( struct grn_cache *cache ) {
+	if ( cache == NULL ) {
+		return;
+	}
+	free( cache->path );
+	free( cache->entries );
+	free( cache );
+}
+
+bool grn_cache_fresh( const struct grn_cache *cache, struct grn_cache_key key, uint64_t hash ) {
+	if ( cache->entries_n == 0 ) {
+		return false;
+	}
+	const struct cache_entry *entry = &cache->entries[cache_slot( cache, key )];
+	return entry->key.ino != 0 &&
+	       entry->hash == hash &&
+	       entry->key.size == key.size &&
+	       entry->key.mtime_ns == key.mtime_ns &&
+	       entry->key.ctime_ns == key.ctime_ns;
+}
+
+void grn_cache_record( struct grn_cache *cache, struct grn_cache_key key, uint64_t hash, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct cache_entry entry = {
+		.key = key,
+		.hash = hash,
+	};
+	cache_insert( cache, entry, out_err );
+	ERR_FW();
+	cache->dirty = true;
+}
+
+void grn_cache_save( struct grn_cache *cache, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( !cache->dirty ) {
+		return;
+	}
+	// written next to the old cache, so it can be renamed over it
+	char *tmp_path = malloc( strlen( cache->path ) + sizeof( ".tmp" ) );
+	ERR( tmp_path == NULL, GRN_ERR_OOM );
+	strcpy( tmp_path, cache->path );
+	strcat( tmp_path, ".tmp" );
+
+	FILE *fh = fopen( tmp_path, "wb" );
+	if ( fh == NULL ) {
+		*out_err = GRN_ERR_FS_OPEN;
+		goto cleanup;
+	}
+	bool written = fwrite( CACHE_MAGIC, 1, CACHE_MAGIC_N, fh ) == CACHE_MAGIC_N;
+	for ( size_t i = 0; written && i < cache->allocated; i++ ) {
+		if ( cache->entries[i].key.ino != 0 ) {
+			written = fwrite( &cache->entries[i], sizeof( struct cache_entry ), 1, fh ) == 1;
+		}
+	}
+	if ( fclose( fh ) || !written ) {
+		*out_err = GRN_ERR_FS_WRITE;
+		remove( tmp_path );
+		goto cleanup;
+	}
+	if ( rename( tmp_path, cache->path ) ) {
+		*out_err = GRN_ERR_FS_RENAME;
+		remove( tmp_path );
+		goto cleanup;
+	}
+	cache->dirty = false;
+
+cleanup:
+	free( tmp_path );
+}
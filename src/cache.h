@@ -0,0 +1,42 @@
+#ifndef H_GRN_CACHE
+#define H_GRN_CACHE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Which files have been processed, and with which transforms, remembered between runs in a file,
+ * so files that haven't changed since can be skipped without even being opened.
+ */
+struct grn_cache;
+
+// identifies a file, and tells whether it changed since it was recorded
+struct grn_cache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	// changes along with the contents, even when the modification time is set back afterwards
+	int64_t ctime_ns;
+};
+
+/**
+ * Load the cache kept at path. Doesn't touch the file again until grn_cache_save.
+ * @return an empty cache if the file doesn't exist yet, or isn't a cache
+ */
+struct grn_cache *grn_cache_load( const char *path, int *out_err );
+// noop if null
+void grn_cache_free( struct grn_cache *cache );
+
+/**
+ * @param hash identifies the transforms the file has to have been processed with
+ * @return whether the file was recorded with the same hash, and hasn't changed since
+ */
+bool grn_cache_fresh( const struct grn_cache *cache, struct grn_cache_key key, uint64_t hash );
+// replaces whatever was recorded for the same file before
+void grn_cache_record( struct grn_cache *cache, struct grn_cache_key key, uint64_t hash, int *out_err );
+
+// write the cache back to the file it was loaded from, if anything was recorded. The old file is replaced all at once.
+void grn_cache_save( struct grn_cache *cache, int *out_err );
+
+#endif
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "libannouncebulk.h"
 #include "vector.h"
@@ -14,9 +15,20 @@
 
 struct cli_ctx {
 	struct vector *transforms;
-	struct vector *files;
+	// the paths from the command line, searched on search_thread while the files found so far are processed
+	char **search_paths;
+	int search_paths_n;
+	struct grn_source *source;
+	pthread_t search_thread;
+	bool searching; // whether search_thread still needs to be joined
+	int search_err;
 
 	char *orpheus_user_announce;
+	int jobs_n;
+	int pipeline_n;
+	int io_depth;
+	enum grn_sync_mode sync;
+	char *cache_path;
 
 #define X_CLIENT(x_machine, x_enum, x_human) int x_machine;
 #include "x_clients.h"
@@ -37,11 +49,13 @@ static void cli_ctx_free( struct cli_ctx *cli_ctx );
 // uses getopt_long to parse CLI options. Will add transforms.
 static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **argv );
 static void cat_transforms( struct cli_ctx *cli_ctx );
-// uses the mutilated argv from getopt_long which only has files in it now
-// argind is optind
-static void cat_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv );
 
 static void seal( struct cli_ctx *cli_ctx );
+// uses the mutilated argv from getopt_long which only has files in it now
+// argind is optind
+static void start_search( struct cli_ctx *cli_ctx, int argind, int argc, char **argv );
+static void *search( void *arg );
+static void join_search( struct cli_ctx *cli_ctx );
 
 static void main_loop( struct cli_ctx *cli_ctx );
 
@@ -54,6 +68,11 @@ char help_text[] = "USAGE:\n"
                    "  -h               Show this help text.\n"
                    "  -v               Show the version.\n"
                    "  -t               Specify a custom transform.\n"
+                   "  -j, --jobs N     Process N files at a time on separate threads.\n"
+                   "  --pipeline N     Read and write files on their own threads, overlapping with N threads transforming them. Ignored with --jobs.\n"
+                   "  --io-depth N     Keep the I/O of N files in flight at once on one thread, with io_uring on Linux. Ignored with --jobs.\n"
+                   "  --sync MODE      When to flush written files to disk: none (default), batch (once at the end) or file (each file).\n"
+                   "  --cache FILE     Remember which files are done in FILE, and skip them next time if they haven't changed.\n"
                    "\n"
                    "  --orpheus        Use the preset to transform for Orpheus. This is the default.\n"
                    "\n"
@@ -72,9 +91,9 @@ int main( int argc, char **argv ) {
 	int argind;
 	handle_opts( &cli_ctx, &argind, argc, argv );
 	cat_transforms( &cli_ctx );
-	cat_files( &cli_ctx, argind, argc, argv );
 
 	seal( &cli_ctx );
+	start_search( &cli_ctx, argind, argc, argv );
 	main_loop( &cli_ctx );
 
 	exit_kindly( &cli_ctx );
@@ -102,8 +121,6 @@ static void cli_ctx_alloc( struct cli_ctx *cli_ctx ) {
 	int in_err;
 
 	memset( cli_ctx, 0, sizeof( struct cli_ctx ) );
-	cli_ctx->files = vector_alloc( sizeof( char * ), &in_err );
-	die_if( cli_ctx, in_err );
 	cli_ctx->transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
 	die_if( cli_ctx, in_err );
 	cli_ctx->grn_ctx = grn_ctx_alloc( &in_err );
@@ -111,11 +128,9 @@ static void cli_ctx_alloc( struct cli_ctx *cli_ctx ) {
 }
 
 static void cli_ctx_free_cats( struct cli_ctx *cli_ctx ) {
-	vector_free( cli_ctx->files );
 	if ( cli_ctx->transforms != NULL ) {
 		grn_free_transforms_v( cli_ctx->transforms );
 	}
-	cli_ctx->files = NULL;
 	cli_ctx->transforms = NULL;
 }
 
@@ -124,16 +139,19 @@ static void cli_ctx_free( struct cli_ctx *cli_ctx ) {
 
 	cli_ctx_free_cats( cli_ctx );
 	grn_free( cli_ctx->orpheus_user_announce );
+	grn_free( cli_ctx->cache_path );
 	if ( cli_ctx->grn_ctx != NULL ) {
 		grn_ctx_free( cli_ctx->grn_ctx, &in_err );
 		if ( in_err ) {
 			printf( "Error freeing Greeny context: %s", grn_err_to_string( in_err ) );
 		}
 	}
+	// the search gives up as soon as it finds another file, now that nothing will process it
+	join_search( cli_ctx );
 }
 
 static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **argv ) {
-	char shortopts[] = "t:hv";
+	char shortopts[] = "t:hvj:";
 	struct option longopts[] = {
 		{
 			.name = "help",
@@ -147,6 +165,36 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 			.flag = NULL,
 			.val = 'v',
 		},
+		{
+			.name = "jobs",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 'j',
+		},
+		{
+			.name = "sync",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 1338,
+		},
+		{
+			.name = "pipeline",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 1340,
+		},
+		{
+			.name = "io-depth",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 1339,
+		},
+		{
+			.name = "cache",
+			.has_arg = 1,
+			.flag = NULL,
+			.val = 1341,
+		},
 		{
 			.name = "orpheus",
 			.has_arg = 1,
@@ -176,6 +224,45 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 				}
 				strcpy( cli_ctx->orpheus_user_announce, optarg );
 				break;
+			case 1338:
+				;
+				if ( strcmp( optarg, "none" ) == 0 ) {
+					cli_ctx->sync = GRN_SYNC_NONE;
+				} else if ( strcmp( optarg, "batch" ) == 0 ) {
+					cli_ctx->sync = GRN_SYNC_BATCH;
+				} else if ( strcmp( optarg, "file" ) == 0 ) {
+					cli_ctx->sync = GRN_SYNC_FILE;
+				} else {
+					die_if( cli_ctx, GRN_ERR_CLI_OPT_SYNTAX );
+				}
+				break;
+			case 1339:
+				;
+				char *depth_end;
+				long io_depth = strtol( optarg, &depth_end, 10 );
+				if ( *optarg == '\0' || *depth_end != '\0' || io_depth < 1 || io_depth > 4096 ) {
+					die_if( cli_ctx, GRN_ERR_CLI_OPT_SYNTAX );
+				}
+				cli_ctx->io_depth = io_depth;
+				break;
+			case 1340:
+				;
+				char *pipeline_end;
+				long pipeline_n = strtol( optarg, &pipeline_end, 10 );
+				if ( *optarg == '\0' || *pipeline_end != '\0' || pipeline_n < 1 || pipeline_n > 1024 ) {
+					die_if( cli_ctx, GRN_ERR_CLI_OPT_SYNTAX );
+				}
+				cli_ctx->pipeline_n = pipeline_n;
+				break;
+			case 1341:
+				;
+				grn_free( cli_ctx->cache_path );
+				cli_ctx->cache_path = malloc( strlen( optarg ) + 1 );
+				if ( cli_ctx->cache_path == NULL ) {
+					die_if( cli_ctx, GRN_ERR_OOM );
+				}
+				strcpy( cli_ctx->cache_path, optarg );
+				break;
 			// unknown option
 			case '?':
 				;
@@ -185,6 +272,15 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 				;
 				puts( "Not implemented yet." );
 				break;
+			case 'j':
+				;
+				char *jobs_end;
+				long jobs_n = strtol( optarg, &jobs_end, 10 );
+				if ( *optarg == '\0' || *jobs_end != '\0' || jobs_n < 1 || jobs_n > 1024 ) {
+					die_if( cli_ctx, GRN_ERR_CLI_OPT_SYNTAX );
+				}
+				cli_ctx->jobs_n = jobs_n;
+				break;
 			case 'h':
 				;
 				puts( help_text );
@@ -205,37 +301,14 @@ static void handle_opts( struct cli_ctx *cli_ctx, int *argind, int argc, char **
 static void cat_transforms( struct cli_ctx *cli_ctx ) {
 	int in_err;
 
-	// add client-specific files
-#define X_CLIENT(x_machine, x_enum, x_human) if ( cli_ctx->x_machine ) { \
-	grn_cat_client( cli_ctx->files, x_enum, &in_err); \
-	die_if(cli_ctx, in_err); \
-}
-#include "x_clients.h"
-#undef X_CLIENT
-
 	if ( cli_ctx->orpheus_user_announce != NULL ) {
 		grn_cat_transforms_orpheus( cli_ctx->transforms, cli_ctx->orpheus_user_announce, &in_err );
 		die_if( cli_ctx, in_err );
 	}
 }
 
-static void cat_files( struct cli_ctx *cli_ctx, int argind, int argc, char **argv ) {
-	int in_err;
-
-	// add normal files
-	for ( ; argind < argc; argind++ ) {
-		printf( "Adding %s and subdirectories.\n", argv[argind] );
-		grn_cat_torrent_files( cli_ctx->files, argv[argind], NULL, &in_err );
-		if ( grn_err_is_single_file( in_err ) ) {
-			printf( "Error adding %s -- %s.\n", argv[argind], grn_err_to_string( in_err ) );
-			in_err = GRN_OK;
-		}
-		die_if( cli_ctx, in_err );
-	}
-}
-
 static void seal( struct cli_ctx *cli_ctx ) {
-	int files_n = vector_length( cli_ctx->files );
+	int in_err;
 	int transforms_n = vector_length( cli_ctx->transforms );
 
 	// TODO: should we have a defined error for this instead?
@@ -244,33 +317,98 @@ static void seal( struct cli_ctx *cli_ctx ) {
 		die_silent( cli_ctx );
 	}
 
-	printf( "About to process %d files with %d transformations.\n", files_n, transforms_n );
-	if ( files_n == 0 ) {
-		exit_kindly( cli_ctx );
-	}
+	printf( "About to process files with %d transformations as they're found.\n", transforms_n );
 
-	grn_ctx_set_files_v( cli_ctx->grn_ctx, cli_ctx->files );
+	cli_ctx->source = grn_source_alloc( 0, &in_err );
+	die_if( cli_ctx, in_err );
+	grn_ctx_set_source( cli_ctx->grn_ctx, cli_ctx->source );
 	grn_ctx_set_transforms_v( cli_ctx->grn_ctx, cli_ctx->transforms );
-	cli_ctx->files = NULL;
+	grn_ctx_set_threads( cli_ctx->grn_ctx, cli_ctx->jobs_n );
+	grn_ctx_set_pipeline( cli_ctx->grn_ctx, cli_ctx->pipeline_n );
+	grn_ctx_set_io_depth( cli_ctx->grn_ctx, cli_ctx->io_depth );
+	grn_ctx_set_sync( cli_ctx->grn_ctx, cli_ctx->sync );
 	cli_ctx->transforms = NULL;
 	cli_ctx_free_cats( cli_ctx );
+
+	if ( cli_ctx->cache_path != NULL ) {
+		grn_ctx_set_cache( cli_ctx->grn_ctx, cli_ctx->cache_path, &in_err );
+		die_if( cli_ctx, in_err );
+	}
+}
+
+static void start_search( struct cli_ctx *cli_ctx, int argind, int argc, char **argv ) {
+	cli_ctx->search_paths = argv + argind;
+	cli_ctx->search_paths_n = argc - argind;
+	if ( pthread_create( &cli_ctx->search_thread, NULL, search, cli_ctx ) ) {
+		// nothing else will ever close it
+		grn_source_close( cli_ctx->source );
+		die_if( cli_ctx, GRN_ERR_THREAD );
+	}
+	cli_ctx->searching = true;
+}
+
+// runs on search_thread, and closes the source when it's done
+static void *search( void *arg ) {
+	struct cli_ctx *cli_ctx = arg;
+	int in_err = GRN_OK;
+
+	// add client-specific files
+#define X_CLIENT(x_machine, x_enum, x_human) if ( cli_ctx->x_machine && in_err == GRN_OK ) { \
+	grn_source_cat_client( cli_ctx->source, x_enum, &in_err); \
+}
+#include "x_clients.h"
+#undef X_CLIENT
+
+	// add normal files
+	for ( int i = 0; in_err == GRN_OK && i < cli_ctx->search_paths_n; i++ ) {
+		printf( "Adding %s and subdirectories.\n", cli_ctx->search_paths[i] );
+		grn_source_cat_torrent_files( cli_ctx->source, cli_ctx->search_paths[i], NULL, &in_err );
+		if ( grn_err_is_single_file( in_err ) ) {
+			printf( "Error adding %s -- %s.\n", cli_ctx->search_paths[i], grn_err_to_string( in_err ) );
+			in_err = GRN_OK;
+		}
+	}
+
+	// reported by the main thread once it's joined this one
+	cli_ctx->search_err = in_err;
+	grn_source_close( cli_ctx->source );
+	return NULL;
+}
+
+static void join_search( struct cli_ctx *cli_ctx ) {
+	if ( cli_ctx->searching ) {
+		pthread_join( cli_ctx->search_thread, NULL );
+		cli_ctx->searching = false;
+	}
 }
 
 static void main_loop( struct cli_ctx *cli_ctx ) {
 	int in_err;
 
-	// on this blessed day, all files and transforms are in place. Let's do the thing!
+	// on this blessed day, all transforms are in place, and files are on their way. Let's do the thing!
 	while ( true ) {
-		char *next_file_path = grn_ctx_get_next_path( cli_ctx->grn_ctx );
 		if ( grn_one_file( cli_ctx->grn_ctx, &in_err ) ) {
 			break;
 		}
 		int single_file_err = grn_ctx_get_c_error( cli_ctx->grn_ctx );
 		if ( single_file_err ) {
-			printf( "%s for %s\n", grn_err_to_string( single_file_err ), next_file_path );
+			size_t path_n = grn_ctx_get_c_path( cli_ctx->grn_ctx, NULL, 0 );
+			char *path = malloc( path_n + 1 );
+			if ( path == NULL ) {
+				die_if( cli_ctx, GRN_ERR_OOM );
+			}
+			grn_ctx_get_c_path( cli_ctx->grn_ctx, path, path_n + 1 );
+			printf( "%s for %s\n", grn_err_to_string( single_file_err ), path );
+			free( path );
 		}
 		die_if( cli_ctx, in_err );
 	}
+	// the source is closed by now, so this doesn't wait for long
+	join_search( cli_ctx );
+	die_if( cli_ctx, cli_ctx->search_err );
 
-	printf( "Transformed %d files, %d of which had errors.\n", grn_ctx_get_files_n( cli_ctx->grn_ctx ), grn_ctx_get_errs_n( cli_ctx->grn_ctx ) );
+	if ( cli_ctx->cache_path != NULL ) {
+		printf( "Skipped %d files that haven't changed since they were last processed.\n", grn_ctx_get_cached_n( cli_ctx->grn_ctx ) );
+	}
+	printf( "Transformed %d files, %d of which had errors and %d of which were already up to date.\n", grn_ctx_get_files_n( cli_ctx->grn_ctx ), grn_ctx_get_errs_n( cli_ctx->grn_ctx ), grn_ctx_get_unchanged_n( cli_ctx->grn_ctx ) );
 }
@@ -0,0 +1,899 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "err.h"
+#include "util.h"
+#include "dfa.h"
+
+// past these, a regex is left to regcomp
+#define DFA_MAX_NFA 4096
+#define DFA_MAX_STATES 1024
+#define DFA_MAX_DEPTH 64
+#define DFA_MAX_REPEAT 255
+#define DFA_MAX_LITERALS 8
+#define DFA_MAX_ANY_OF 8
+// shorter required literals don't rule out enough to be worth searching for
+#define DFA_MIN_LITERAL 2
+
+struct grn_dfa {
+	bool anchor_start; // ^ at the start of the regex
+	bool anchor_end; // $ at the end
+	// the strings every match contains
+	char *literals[DFA_MAX_LITERALS];
+	size_t literals_n[DFA_MAX_LITERALS];
+	int literals_c;
+	// every match contains at least one of these, one from each side of an alternation. None if any_of_c is 0.
+	char *any_of[DFA_MAX_ANY_OF];
+	size_t any_of_n[DFA_MAX_ANY_OF];
+	int any_of_c;
+	// bytes that behave the same everywhere in the regex share a class
+	unsigned char byte_class[256];
+	int classes_n;
+	// next state for each state and class, -1 when there is no match down that way. State 0 is the start.
+	int *next;
+	bool *accepting;
+	int states_n;
+	// bytes the start state doesn't die on, for skipping over start positions that can't match
+	bool first[256];
+};
+
+// BEGIN parsing
+
+enum rx_type {
+	RX_SET, // a single byte out of set
+	RX_CAT, // a then b
+	RX_ALT, // a or b
+	RX_REPEAT, // a, min to max times
+};
+
+struct rx_node {
+	enum rx_type type;
+	unsigned char set[32];
+	struct rx_node *a, *b;
+	int min, max; // max is -1 when unbounded
+};
+
+struct rx_parser {
+	const char *p;
+	const char *end;
+	struct rx_node *nodes;
+	int nodes_n;
+	bool unsupported;
+};
+
+static void set_add( unsigned char *set, unsigned char c ) {
+	set[c / 8] |= 1 << ( c % 8 );
+}
+
+static bool set_has( const unsigned char *set, unsigned char c ) {
+	return set[c / 8] & ( 1 << ( c % 8 ) );
+}
+
+// the node array is sized for the worst case up front, so this can't run out
+static struct rx_node *rx_node( struct rx_parser *parser, enum rx_type type ) {
+	struct rx_node *node = &parser->nodes[parser->nodes_n++];
+	memset( node, 0, sizeof( struct rx_node ) );
+	node->type = type;
+	return node;
+}
+
+static struct rx_node *rx_alt( struct rx_parser *parser, int depth );
+
+// character classes, only for ASCII so the locale doesn't matter
+static bool rx_class( struct rx_parser *parser, unsigned char *set ) {
+	static const struct {
+		const char *name;
+		int ( *fn )( int );
+	} classes[] = {
+		{ "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum }, { "upper", isupper },
+		{ "lower", islower }, { "space", isspace }, { "xdigit", isxdigit }, { "punct", ispunct },
+		{ "blank", isblank }, { "cntrl", iscntrl }, { "print", isprint }, { "graph", isgraph },
+	};
+
+	// past the "[:"
+	const char *name = parser->p + 2;
+	const char *name_end = strstr( name, ":]" );
+	if ( name_end == NULL ) {
+		return false;
+	}
+	for ( size_t i = 0; i < sizeof( classes ) / sizeof( classes[0] ); i++ ) {
+		if ( strlen( classes[i].name ) == ( size_t ) ( name_end - name ) && !strncmp( classes[i].name, name, name_end - name ) ) {
+			for ( int c = 1; c < 128; c++ ) {
+				if ( classes[i].fn( c ) ) {
+					set_add( set, c );
+				}
+			}
+			parser->p = name_end + 2;
+			return true;
+		}
+	}
+	return false;
+}
+
+// a bracket expression, starting just past the [
+static struct rx_node *rx_bracket( struct rx_parser *parser ) {
+	struct rx_node *node = rx_node( parser, RX_SET );
+	bool negate = *parser->p == '^';
+	if ( negate ) {
+		parser->p++;
+	}
+
+	// a ] right at the start is a literal
+	bool first = true;
+	while ( first || *parser->p != ']' ) {
+		first = false;
+		const char *p = parser->p;
+		if ( p >= parser->end ) {
+			parser->unsupported = true;
+			return NULL;
+		}
+		if ( p[0] == '[' && ( p[1] == ':' || p[1] == '.' || p[1] == '=' ) ) {
+			if ( p[1] != ':' || !rx_class( parser, node->set ) ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			continue;
+		}
+
+		unsigned char lo = p[0], hi = p[0];
+		parser->p++;
+		if ( p[1] == '-' && p[2] != ']' && p[2] != '\0' ) {
+			hi = p[2];
+			parser->p += 2;
+			if ( hi == '[' || lo > hi ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+		}
+		// ranges past ASCII depend on the locale
+		if ( lo >= 128 || hi >= 128 ) {
+			parser->unsupported = true;
+			return NULL;
+		}
+		for ( int c = lo; c <= hi; c++ ) {
+			set_add( node->set, c );
+		}
+	}
+	parser->p++;
+
+	if ( negate ) {
+		// a negated set takes multibyte characters whole, which a byte at a time can't do
+		if ( MB_CUR_MAX > 1 ) {
+			parser->unsupported = true;
+			return NULL;
+		}
+		// in a single byte locale it's every other byte, high ones included, like regexec
+		for ( int i = 0; i < 32; i++ ) {
+			node->set[i] = ~node->set[i];
+		}
+		node->set[0] &= ~1;
+	}
+	return node;
+}
+
+static struct rx_node *rx_atom( struct rx_parser *parser, int depth ) {
+	const char *p = parser->p;
+	struct rx_node *node;
+	if ( p >= parser->end ) {
+		parser->unsupported = true;
+		return NULL;
+	}
+
+	switch ( *p ) {
+		case '(':
+			;
+			if ( depth >= DFA_MAX_DEPTH ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			parser->p++;
+			node = rx_alt( parser, depth + 1 );
+			if ( node == NULL || parser->p >= parser->end || *parser->p != ')' ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			parser->p++;
+			return node;
+		case '[':
+			;
+			parser->p++;
+			return rx_bracket( parser );
+		case '.':
+			;
+			// same problem as negated sets
+			if ( MB_CUR_MAX > 1 ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			node = rx_node( parser, RX_SET );
+			memset( node->set, 0xff, sizeof( node->set ) );
+			node->set[0] &= ~1;
+			parser->p++;
+			return node;
+		case '\\':
+			;
+			// backreferences, and the GNU extensions like \w and \b
+			if ( p + 1 >= parser->end || isalnum( ( unsigned char ) p[1] ) ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			node = rx_node( parser, RX_SET );
+			set_add( node->set, p[1] );
+			parser->p += 2;
+			return node;
+		case ')':
+		case '|':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case '^':
+		case '$':
+			;
+			parser->unsupported = true;
+			return NULL;
+		default:
+			;
+			if ( ( unsigned char ) *p >= 128 && MB_CUR_MAX > 1 ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			node = rx_node( parser, RX_SET );
+			set_add( node->set, *p );
+			parser->p++;
+			return node;
+	}
+}
+
+static bool rx_read_int( struct rx_parser *parser, int *n ) {
+	if ( !isdigit( ( unsigned char ) *parser->p ) ) {
+		return false;
+	}
+	*n = 0;
+	while ( isdigit( ( unsigned char ) *parser->p ) ) {
+		*n = *n * 10 + ( *parser->p++ - '0' );
+		if ( *n > DFA_MAX_REPEAT ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct rx_node *rx_repeat( struct rx_parser *parser, int depth ) {
+	struct rx_node *atom = rx_atom( parser, depth );
+	if ( atom == NULL ) {
+		return NULL;
+	}
+
+	int min, max;
+	switch ( *parser->p ) {
+		case '*':
+			;
+			min = 0;
+			max = -1;
+			parser->p++;
+			break;
+		case '+':
+			;
+			min = 1;
+			max = -1;
+			parser->p++;
+			break;
+		case '?':
+			;
+			min = 0;
+			max = 1;
+			parser->p++;
+			break;
+		case '{':
+			;
+			parser->p++;
+			if ( !rx_read_int( parser, &min ) ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			max = min;
+			if ( *parser->p == ',' ) {
+				parser->p++;
+				max = -1;
+				if ( *parser->p != '}' && ( !rx_read_int( parser, &max ) || max < min ) ) {
+					parser->unsupported = true;
+					return NULL;
+				}
+			}
+			if ( *parser->p != '}' ) {
+				parser->unsupported = true;
+				return NULL;
+			}
+			parser->p++;
+			break;
+		default:
+			;
+			return atom;
+	}
+	// stacked repetitions
+	if ( parser->p < parser->end && strchr( "*+?{", *parser->p ) ) {
+		parser->unsupported = true;
+		return NULL;
+	}
+
+	struct rx_node *node = rx_node( parser, RX_REPEAT );
+	node->a = atom;
+	node->min = min;
+	node->max = max;
+	return node;
+}
+
+static struct rx_node *rx_cat( struct rx_parser *parser, int depth ) {
+	struct rx_node *node = rx_repeat( parser, depth );
+	while ( node != NULL && parser->p < parser->end && *parser->p != '|' && *parser->p != ')' ) {
+		struct rx_node *next = rx_repeat( parser, depth );
+		if ( next == NULL ) {
+			return NULL;
+		}
+		struct rx_node *cat = rx_node( parser, RX_CAT );
+		cat->a = node;
+		cat->b = next;
+		node = cat;
+	}
+	return node;
+}
+
+static struct rx_node *rx_alt( struct rx_parser *parser, int depth ) {
+	struct rx_node *node = rx_cat( parser, depth );
+	while ( node != NULL && parser->p < parser->end && *parser->p == '|' ) {
+		parser->p++;
+		struct rx_node *next = rx_cat( parser, depth );
+		if ( next == NULL ) {
+			return NULL;
+		}
+		struct rx_node *alt = rx_node( parser, RX_ALT );
+		alt->a = node;
+		alt->b = next;
+		node = alt;
+	}
+	return node;
+}
+
+// END parsing
+
+// BEGIN required literals
+
+struct rx_literals {
+	struct grn_dfa *dfa; // where literals go, or NULL to only keep the longest one in best
+	char *run; // the literal being built
+	size_t run_n;
+	size_t cap; // the most a literal can take, which is the length of the regex
+	char *best;
+	size_t best_n;
+};
+
+static void rx_flush_literal( struct rx_literals *lits, int *out_err ) {
+	*out_err = GRN_OK;
+
+	size_t run_n = lits->run_n;
+	lits->run_n = 0;
+	struct grn_dfa *dfa = lits->dfa;
+	if ( run_n < DFA_MIN_LITERAL ) {
+		return;
+	}
+	if ( dfa == NULL ) {
+		if ( run_n > lits->best_n ) {
+			memcpy( lits->best, lits->run, run_n );
+			lits->best_n = run_n;
+		}
+		return;
+	}
+	// keep the longest ones
+	int slot = dfa->literals_c;
+	if ( slot == DFA_MAX_LITERALS ) {
+		slot = 0;
+		for ( int i = 1; i < DFA_MAX_LITERALS; i++ ) {
+			if ( dfa->literals_n[i] < dfa->literals_n[slot] ) {
+				slot = i;
+			}
+		}
+		if ( dfa->literals_n[slot] >= run_n ) {
+			return;
+		}
+		free( dfa->literals[slot] );
+	} else {
+		dfa->literals_c++;
+	}
+	dfa->literals[slot] = malloc( run_n );
+	dfa->literals_n[slot] = run_n;
+	ERR( dfa->literals[slot] == NULL, GRN_ERR_OOM );
+	memcpy( dfa->literals[slot], lits->run, run_n );
+}
+
+// the only byte a set matches, or -1
+static int rx_single_byte( const unsigned char *set ) {
+	int found = -1;
+	for ( int c = 0; c < 256; c++ ) {
+		if ( set_has( set, c ) ) {
+			if ( found != -1 ) {
+				return -1;
+			}
+			found = c;
+		}
+	}
+	return found;
+}
+
+static void rx_collect_literals( struct rx_literals *lits, const struct rx_node *node, int *out_err );
+
+// @return false if there are more than DFA_MAX_ANY_OF
+static bool rx_alt_branches( const struct rx_node *node, const struct rx_node **branches, int *branches_n ) {
+	if ( node->type == RX_ALT ) {
+		return rx_alt_branches( node->a, branches, branches_n ) && rx_alt_branches( node->b, branches, branches_n );
+	}
+	if ( *branches_n == DFA_MAX_ANY_OF ) {
+		return false;
+	}
+	branches[( *branches_n )++] = node;
+	return true;
+}
+
+static void rx_free_any_of( char **any_of, int any_of_c ) {
+	for ( int i = 0; i < any_of_c; i++ ) {
+		free( any_of[i] );
+	}
+}
+
+// keeps the longest literal of each side of an alternation every match goes through, if they all have one
+static void rx_collect_any_of( struct rx_literals *lits, const struct rx_node *node, int *out_err ) {
+	*out_err = GRN_OK;
+
+	const struct rx_node *branches[DFA_MAX_ANY_OF];
+	int branches_n = 0;
+	if ( !rx_alt_branches( node, branches, &branches_n ) ) {
+		return;
+	}
+	char *any_of[DFA_MAX_ANY_OF];
+	size_t any_of_n[DFA_MAX_ANY_OF];
+	int any_of_c = 0;
+	size_t shortest = SIZE_MAX;
+	for ( ; any_of_c < branches_n; any_of_c++ ) {
+		// the outer run was just flushed, so its buffer is free to use
+		struct rx_literals branch = {
+			.run = lits->run,
+			.cap = lits->cap,
+			.best = malloc( lits->cap ),
+		};
+		if ( branch.best == NULL ) {
+			rx_free_any_of( any_of, any_of_c );
+			ERR( GRN_ERR_OOM );
+		}
+		rx_collect_literals( &branch, branches[any_of_c], out_err );
+		rx_flush_literal( &branch, out_err );
+		any_of[any_of_c] = branch.best;
+		any_of_n[any_of_c] = branch.best_n;
+		if ( branch.best_n == 0 ) {
+			rx_free_any_of( any_of, any_of_c + 1 );
+			return;
+		}
+		if ( branch.best_n < shortest ) {
+			shortest = branch.best_n;
+		}
+	}
+
+	// keep the alternation whose shortest literal rules out the most
+	struct grn_dfa *dfa = lits->dfa;
+	size_t kept_shortest = SIZE_MAX;
+	for ( int i = 0; i < dfa->any_of_c; i++ ) {
+		kept_shortest = dfa->any_of_n[i] < kept_shortest ? dfa->any_of_n[i] : kept_shortest;
+	}
+	if ( dfa->any_of_c > 0 && kept_shortest >= shortest ) {
+		rx_free_any_of( any_of, any_of_c );
+		return;
+	}
+	rx_free_any_of( dfa->any_of, dfa->any_of_c );
+	memcpy( dfa->any_of, any_of, sizeof( any_of ) );
+	memcpy( dfa->any_of_n, any_of_n, sizeof( any_of_n ) );
+	dfa->any_of_c = any_of_c;
+}
+
+// collects the runs of single bytes that every match has to go through
+static void rx_collect_literals( struct rx_literals *lits, const struct rx_node *node, int *out_err ) {
+	*out_err = GRN_OK;
+
+	switch ( node->type ) {
+		case RX_SET:
+			;
+			int c = rx_single_byte( node->set );
+			if ( c == -1 ) {
+				rx_flush_literal( lits, out_err );
+				ERR_FW();
+			} else {
+				lits->run[lits->run_n++] = c;
+			}
+			break;
+		case RX_CAT:
+			;
+			rx_collect_literals( lits, node->a, out_err );
+			ERR_FW();
+			rx_collect_literals( lits, node->b, out_err );
+			ERR_FW();
+			break;
+		case RX_ALT:
+			;
+			rx_flush_literal( lits, out_err );
+			ERR_FW();
+			if ( lits->dfa != NULL ) {
+				rx_collect_any_of( lits, node, out_err );
+				ERR_FW();
+			}
+			break;
+		case RX_REPEAT:
+			;
+			rx_flush_literal( lits, out_err );
+			ERR_FW();
+			// whatever is inside has to be there at least once
+			if ( node->min > 0 ) {
+				rx_collect_literals( lits, node->a, out_err );
+				ERR_FW();
+				rx_flush_literal( lits, out_err );
+				ERR_FW();
+			}
+			break;
+	}
+}
+
+// END required literals
+
+// BEGIN automata
+
+// NFA states are either a byte set leading to out, or an epsilon split to out and out2
+struct nfa_state {
+	int set; // index into nfa.sets, -1 for a split, -2 for the accepting state
+	int out, out2;
+};
+
+struct nfa {
+	struct nfa_state *states;
+	int states_n;
+	unsigned char ( *sets )[32];
+	int sets_n;
+	bool too_big;
+};
+
+static int nfa_add( struct nfa *nfa, int set, int out, int out2 ) {
+	if ( nfa->states_n >= DFA_MAX_NFA ) {
+		nfa->too_big = true;
+		return 0;
+	}
+	nfa->states[nfa->states_n] = ( struct nfa_state ) {
+		.set = set,
+		.out = out,
+		.out2 = out2,
+	};
+	return nfa->states_n++;
+}
+
+// emits node so it continues to next, and returns where it starts. Built back to front.
+static int nfa_emit( struct nfa *nfa, const struct rx_node *node, int next ) {
+	if ( nfa->too_big ) {
+		return 0;
+	}
+	int start;
+	switch ( node->type ) {
+		case RX_SET:
+			;
+			if ( nfa->sets_n >= DFA_MAX_NFA ) {
+				nfa->too_big = true;
+				return 0;
+			}
+			memcpy( nfa->sets[nfa->sets_n], node->set, 32 );
+			return nfa_add( nfa, nfa->sets_n++, next, -1 );
+		case RX_CAT:
+			;
+			return nfa_emit( nfa, node->a, nfa_emit( nfa, node->b, next ) );
+		case RX_ALT:
+			;
+			start = nfa_emit( nfa, node->a, next );
+			return nfa_add( nfa, -1, start, nfa_emit( nfa, node->b, next ) );
+		case RX_REPEAT:
+			;
+			start = next;
+			if ( node->max == -1 ) {
+				// a loop back to itself
+				int loop = nfa_add( nfa, -1, -1, next );
+				if ( nfa->too_big ) {
+					return 0;
+				}
+				int body = nfa_emit( nfa, node->a, loop );
+				nfa->states[loop].out = body;
+				start = loop;
+			} else {
+				for ( int i = node->min; i < node->max; i++ ) {
+					start = nfa_add( nfa, -1, nfa_emit( nfa, node->a, start ), next );
+				}
+			}
+			for ( int i = 0; i < node->min; i++ ) {
+				start = nfa_emit( nfa, node->a, start );
+			}
+			return start;
+	}
+	return 0;
+}
+
+static void nfa_closure( const struct nfa *nfa, unsigned char *in, int state ) {
+	// states are bits in a bitset sized for the NFA
+	if ( state < 0 || ( in[state / 8] & ( 1 << ( state % 8 ) ) ) ) {
+		return;
+	}
+	in[state / 8] |= 1 << ( state % 8 );
+	if ( nfa->states[state].set == -1 ) {
+		nfa_closure( nfa, in, nfa->states[state].out );
+		nfa_closure( nfa, in, nfa->states[state].out2 );
+	}
+}
+
+// assigns byte classes: bytes are in the same class when every set agrees on them
+static void dfa_classes( struct grn_dfa *dfa, const struct nfa *nfa ) {
+	int representative[256];
+	dfa->classes_n = 0;
+	for ( int c = 0; c < 256; c++ ) {
+		int cls;
+		for ( cls = 0; cls < dfa->classes_n; cls++ ) {
+			int r = representative[cls];
+			int s;
+			for ( s = 0; s < nfa->sets_n; s++ ) {
+				if ( set_has( nfa->sets[s], c ) != set_has( nfa->sets[s], r ) ) {
+					break;
+				}
+			}
+			if ( s == nfa->sets_n ) {
+				break;
+			}
+		}
+		if ( cls == dfa->classes_n ) {
+			representative[dfa->classes_n++] = c;
+		}
+		dfa->byte_class[c] = cls;
+	}
+}
+
+static unsigned subset_hash( const unsigned char *subset, size_t bits_n ) {
+	unsigned hash = 2166136261u;
+	for ( size_t i = 0; i < bits_n; i++ ) {
+		hash = ( hash ^ subset[i] ) * 16777619u;
+	}
+	return hash;
+}
+
+// subset construction. Returns false if the DFA would have too many states.
+static bool dfa_build( struct grn_dfa *dfa, const struct nfa *nfa, int nfa_start, int nfa_accept, int *out_err ) {
+	*out_err = GRN_OK;
+
+	size_t bits_n = ( nfa->states_n + 7 ) / 8;
+	unsigned char *subsets = NULL, *subset = NULL;
+	unsigned *hashes = NULL;
+	int *members = NULL; // the byte-consuming NFA states in the DFA state being worked on
+	int representative[256];
+	bool fits = false;
+
+	dfa_classes( dfa, nfa );
+	for ( int c = 255; c >= 0; c-- ) {
+		representative[dfa->byte_class[c]] = c;
+	}
+	subsets = calloc( DFA_MAX_STATES, bits_n );
+	subset = malloc( bits_n );
+	hashes = malloc( DFA_MAX_STATES * sizeof( unsigned ) );
+	members = malloc( nfa->states_n * sizeof( int ) );
+	dfa->next = malloc( DFA_MAX_STATES * dfa->classes_n * sizeof( int ) );
+	dfa->accepting = calloc( DFA_MAX_STATES, sizeof( bool ) );
+	if ( subsets == NULL || subset == NULL || hashes == NULL || members == NULL || dfa->next == NULL || dfa->accepting == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+
+	nfa_closure( nfa, subsets, nfa_start );
+	hashes[0] = subset_hash( subsets, bits_n );
+	dfa->states_n = 1;
+	for ( int d = 0; d < dfa->states_n; d++ ) {
+		const unsigned char *from = subsets + d * bits_n;
+		dfa->accepting[d] = from[nfa_accept / 8] & ( 1 << ( nfa_accept % 8 ) );
+		int members_n = 0;
+		for ( int s = 0; s < nfa->states_n; s++ ) {
+			if ( ( from[s / 8] & ( 1 << ( s % 8 ) ) ) && nfa->states[s].set >= 0 ) {
+				members[members_n++] = s;
+			}
+		}
+
+		for ( int cls = 0; cls < dfa->classes_n; cls++ ) {
+			memset( subset, 0, bits_n );
+			bool any = false;
+			for ( int m = 0; m < members_n; m++ ) {
+				const struct nfa_state *state = &nfa->states[members[m]];
+				if ( set_has( nfa->sets[state->set], representative[cls] ) ) {
+					nfa_closure( nfa, subset, state->out );
+					any = true;
+				}
+			}
+			int to = -1;
+			if ( any ) {
+				unsigned hash = subset_hash( subset, bits_n );
+				for ( to = 0; to < dfa->states_n; to++ ) {
+					if ( hashes[to] == hash && memcmp( subsets + to * bits_n, subset, bits_n ) == 0 ) {
+						break;
+					}
+				}
+				if ( to == dfa->states_n ) {
+					if ( dfa->states_n == DFA_MAX_STATES ) {
+						goto cleanup;
+					}
+					memcpy( subsets + to * bits_n, subset, bits_n );
+					hashes[to] = hash;
+					dfa->states_n++;
+				}
+			}
+			dfa->next[d * dfa->classes_n + cls] = to;
+		}
+	}
+	fits = true;
+
+	for ( int c = 0; c < 256; c++ ) {
+		dfa->first[c] = dfa->next[dfa->byte_class[c]] != -1;
+	}
+	goto cleanup;
+cleanup:
+	grn_free( subsets );
+	grn_free( subset );
+	grn_free( hashes );
+	grn_free( members );
+	return fits;
+}
+
+// END automata
+
+void grn_dfa_free( struct grn_dfa *dfa ) {
+	if ( dfa == NULL ) {
+		return;
+	}
+	for ( int i = 0; i < dfa->literals_c; i++ ) {
+		free( dfa->literals[i] );
+	}
+	rx_free_any_of( dfa->any_of, dfa->any_of_c );
+	grn_free( dfa->next );
+	grn_free( dfa->accepting );
+	free( dfa );
+}
+
+struct grn_dfa *grn_dfa_compile( const char *regstr, int *out_err ) {
+	*out_err = GRN_OK;
+
+	size_t regstr_n = strlen( regstr );
+	struct grn_dfa *dfa = calloc( 1, sizeof( struct grn_dfa ) );
+	struct rx_parser parser = {
+		.p = regstr,
+		.end = regstr + regstr_n,
+		// every byte of the regex makes at most an atom and the node joining it to the rest
+		.nodes = malloc( ( 2 * regstr_n + 2 ) * sizeof( struct rx_node ) ),
+	};
+	struct rx_literals lits = {
+		.dfa = dfa,
+		.run = malloc( regstr_n + 1 ),
+		.cap = regstr_n + 1,
+	};
+	struct nfa nfa = {
+		.states = malloc( DFA_MAX_NFA * sizeof( struct nfa_state ) ),
+		.sets = malloc( DFA_MAX_NFA * sizeof( *nfa.sets ) ),
+	};
+	bool supported = false;
+	if ( dfa == NULL || parser.nodes == NULL || lits.run == NULL || nfa.states == NULL || nfa.sets == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+
+	// anchors are only understood at the very ends
+	if ( *parser.p == '^' ) {
+		dfa->anchor_start = true;
+		parser.p++;
+	}
+	if ( parser.end > parser.p && parser.end[-1] == '$' ) {
+		size_t backslashes_n = 0;
+		while ( parser.end - backslashes_n - 1 > parser.p && parser.end[-2 - ( long ) backslashes_n] == '\\' ) {
+			backslashes_n++;
+		}
+		if ( backslashes_n % 2 == 0 ) {
+			dfa->anchor_end = true;
+			parser.end--;
+		}
+	}
+
+	struct rx_node *root = rx_alt( &parser, 0 );
+	if ( root == NULL || parser.unsupported || parser.p != parser.end ) {
+		goto cleanup;
+	}
+	// the anchors would only apply to the first and last alternatives
+	if ( root->type == RX_ALT && ( dfa->anchor_start || dfa->anchor_end ) ) {
+		goto cleanup;
+	}
+
+	rx_collect_literals( &lits, root, out_err );
+	ERR_FW_CLEANUP();
+	rx_flush_literal( &lits, out_err );
+	ERR_FW_CLEANUP();
+
+	int nfa_accept = nfa_add( &nfa, -2, -1, -1 );
+	int nfa_start = nfa_emit( &nfa, root, nfa_accept );
+	if ( nfa.too_big ) {
+		goto cleanup;
+	}
+	supported = dfa_build( dfa, &nfa, nfa_start, nfa_accept, out_err );
+	ERR_FW_CLEANUP();
+	goto cleanup;
+cleanup:
+	grn_free( parser.nodes );
+	grn_free( lits.run );
+	grn_free( nfa.states );
+	grn_free( nfa.sets );
+	if ( !supported || *out_err ) {
+		grn_dfa_free( dfa );
+		return NULL;
+	}
+	return dfa;
+}
+
+bool grn_dfa_might_match( const struct grn_dfa *dfa, const char *str, size_t str_n ) {
+	for ( int i = 0; i < dfa->literals_c; i++ ) {
+		if ( !grn_contains( str, str_n, dfa->literals[i], dfa->literals_n[i] ) ) {
+			return false;
+		}
+	}
+	if ( dfa->any_of_c == 0 ) {
+		return true;
+	}
+	for ( int i = 0; i < dfa->any_of_c; i++ ) {
+		if ( grn_contains( str, str_n, dfa->any_of[i], dfa->any_of_n[i] ) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool grn_dfa_exec( const struct grn_dfa *dfa, const char *str, size_t str_n, size_t from, size_t *so, size_t *eo ) {
+	// the leftmost start that matches at all, and the longest match from there
+	size_t last_start = dfa->anchor_start ? 0 : str_n;
+	for ( size_t start = from; start <= last_start; start++ ) {
+		if ( !dfa->accepting[0] ) {
+			while ( start < str_n && !dfa->first[( unsigned char ) str[start]] ) {
+				start++;
+			}
+			if ( start >= str_n || ( dfa->anchor_start && start > 0 ) ) {
+				return false;
+			}
+		}
+
+		// locals, because writing through eo could alias the DFA as far as the compiler knows
+		const int *next = dfa->next;
+		const bool *accepting = dfa->accepting;
+		const unsigned char *byte_class = dfa->byte_class;
+		int classes_n = dfa->classes_n;
+		bool anchor_end = dfa->anchor_end;
+		int state = 0;
+		size_t i = start;
+		size_t match_end = SIZE_MAX;
+		while ( true ) {
+			if ( accepting[state] && ( !anchor_end || i == str_n ) ) {
+				match_end = i;
+			}
+			if ( i == str_n ) {
+				break;
+			}
+			state = next[state * classes_n + byte_class[( unsigned char ) str[i++]]];
+			if ( state == -1 ) {
+				break;
+			}
+		}
+		if ( match_end != SIZE_MAX ) {
+			*so = start;
+			*eo = match_end;
+			return true;
+		}
+	}
+	return false;
+}
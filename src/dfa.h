@@ -0,0 +1,40 @@
+#ifndef H_GRN_DFA
+#define H_GRN_DFA
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A POSIX extended regex compiled to a DFA, along with the literals any match has to contain,
+ * so most strings can be turned down with a substring search before the DFA even runs.
+ * Only covers the syntax greeny's own regexes need; everything else is left to regcomp.
+ */
+struct grn_dfa;
+
+/**
+ * Compile an extended regex, as regcomp( ..., REG_EXTENDED ) would.
+ * @return NULL if the regex uses syntax that isn't supported (backreferences, anchors in the middle,
+ * multibyte characters...) or would make too big a DFA. out_err is only set if memory runs out.
+ */
+struct grn_dfa *grn_dfa_compile( const char *regstr, int *out_err );
+// noop if null
+void grn_dfa_free( struct grn_dfa *dfa );
+
+/**
+ * Quickly rule out strings that don't contain the literals every match needs, or any of the alternatives of a
+ * required alternation, like the hosts in https://(foo\.org|bar\.net)/.
+ * @return false if the regex can't match anywhere in the string
+ */
+bool grn_dfa_might_match( const struct grn_dfa *dfa, const char *str, size_t str_n );
+
+/**
+ * Find the leftmost-longest match in a string, like regexec does. Matches never include NUL bytes.
+ * Doesn't check grn_dfa_might_match first, so searching the same string repeatedly doesn't redo it.
+ * @param from where to start looking. ^ only matches when this is 0, like REG_NOTBOL.
+ * @param so where to put the offset of the start of the match, from the start of str
+ * @param eo where to put the offset just past the end of the match
+ * @return whether there was a match
+ */
+bool grn_dfa_exec( const struct grn_dfa *dfa, const char *str, size_t str_n, size_t from, size_t *so, size_t *eo );
+
+#endif
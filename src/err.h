@@ -13,6 +13,7 @@ enum {
 	GRN_ERR_FS_WRITE,
 	GRN_ERR_FS_OPEN,
 	GRN_ERR_FS_CLOSE,
+	GRN_ERR_FS_RENAME,
 	GRN_ERR_FS_NFTW,
 	GRN_ERR_ENOENT,
 	GRN_ERR_BENCODE_SYNTAX, // represents BEN errors 1, 2, 4. Ben error 0 is GRN_OK, 3 is GRN_ERR_OOM
@@ -23,6 +24,8 @@ enum {
 	GRN_ERR_UNKNOWN_CLI_OPT,
 	GRN_ERR_USER_CANCELLED,
 	GRN_ERR_NO_FILES,
+	GRN_ERR_THREAD,
+	GRN_ERR_CLI_OPT_SYNTAX,
 };
 
 static char *grn_err_to_string( int err ) {
@@ -35,6 +38,7 @@ static char *grn_err_to_string( int err ) {
 			X_ERR( GRN_ERR_FS_WRITE, "Filesystem error: write" )
 			X_ERR( GRN_ERR_FS_OPEN, "Filesystem error: open" )
 			X_ERR( GRN_ERR_FS_CLOSE, "Filesystem error: close" )
+			X_ERR( GRN_ERR_FS_RENAME, "Filesystem error: rename" )
 			X_ERR( GRN_ERR_FS_NFTW, "Filesystem error: nftw/recursive search" )
 			X_ERR( GRN_ERR_ENOENT, "File/Directory not found" )
 			X_ERR( GRN_ERR_BENCODE_SYNTAX, "Invalid bencode syntax" )
@@ -45,6 +49,8 @@ static char *grn_err_to_string( int err ) {
 			X_ERR( GRN_ERR_UNKNOWN_CLI_OPT, "Unrecognized CLI option" )
 			X_ERR( GRN_ERR_USER_CANCELLED, "Operation cancelled" );
 			X_ERR( GRN_ERR_NO_FILES, "No files or clients selected" );
+			X_ERR( GRN_ERR_THREAD, "Unable to start worker threads" );
+			X_ERR( GRN_ERR_CLI_OPT_SYNTAX, "Invalid argument to CLI option" );
 #undef X_ERR
 	};
 	assert( false );
@@ -60,6 +66,7 @@ static bool grn_err_is_single_file( int err ) {
 	       err == GRN_ERR_FS_WRITE ||
 	       err == GRN_ERR_FS_OPEN ||
 	       err == GRN_ERR_FS_CLOSE ||
+	       err == GRN_ERR_FS_RENAME ||
 	       err == GRN_ERR_ENOENT ||
 	       err == GRN_ERR_BENCODE_SYNTAX;
 }
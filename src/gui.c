@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include <iup.h>
 
 #include "libannouncebulk.h"
@@ -18,6 +19,15 @@ Ihandle *main_dlg = NULL,
 struct vector *ui_files = NULL;
 struct grn_ctx *grn_run_ctx = NULL;
 
+// the files of a run are found on search_thread while the ones found so far are processed
+struct grn_source *search_source = NULL;
+char **search_paths = NULL; // ui_files as they were when the run started, since more can be dropped in meanwhile
+int search_paths_n = 0;
+pthread_t search_thread;
+bool searching = false; // whether search_thread still needs to be joined
+int search_err = GRN_OK;
+int search_file_err = GRN_OK; // the last file that couldn't be added, shown once the run is over
+
 static void ui_open();
 
 static void exit_with_code( int code );
@@ -34,7 +44,10 @@ static void setup_dlgs();
 static void summarize();
 static void progress_loop();
 static void add_file( const char *path );
-static void cat_files_to_runner();
+static void start_search( int *out_err );
+static void *search( void *arg );
+static void join_search();
+static void stop_run( int *out_err );
 static void cat_transforms_to_runner( int *out_err );
 static void seal();
 
@@ -73,7 +86,8 @@ static void exit_with_code( int code ) {
 	int in_err;
 
 	vector_free( ui_files );
-	grn_ctx_free( grn_run_ctx, &in_err );
+	stop_run( &in_err );
+	free( search_paths );
 	if ( main_dlg != NULL ) {
 		IupDestroy( main_dlg );
 	}
@@ -129,10 +143,16 @@ static int cb_run() {
 	if ( in_err ) {
 		// TODO: the IupLoopStep causes the main loop to exit if IUP_CLOSE is returned by anything (the cancel button), which isn't
 		// what the docs say and isn't desirable, either.
+		// also stops the search, which would otherwise wait forever for room for its next file
+		int stop_err;
+		stop_run( &stop_err );
 		popup_err( in_err );
 		return IUP_DEFAULT;
 	}
 	IupHide( progress_dlg );
+	if ( search_file_err ) {
+		popup_err( search_file_err );
+	}
 	summarize();
 	return IUP_DEFAULT;
 }
@@ -167,36 +187,75 @@ static void add_file( const char *path ) {
 	IupRefresh( label );
 }
 
-static void cat_files_to_runner( int *out_err ) {
-	*out_err = GRN_OK;
-
-	struct vector *tmp_all_files = vector_alloc( sizeof( char * ), out_err );
-	ERR_FW();
-	for ( int i = 0; i < vector_length( ui_files ); i++ ) {
-		char *this_ui_file = * ( char ** ) vector_get( ui_files, i );
-		GRN_LOG_DEBUG( "Sealing with UI file: '%s'", this_ui_file );
-		grn_cat_torrent_files( tmp_all_files, this_ui_file, NULL, out_err );
-		if ( *out_err ) {
-			if ( grn_err_is_single_file( *out_err ) ) {
-				popup_err( *out_err );
-				*out_err = GRN_OK;
-			} else {
-				return;
-			}
+// runs on search_thread, and closes the source when it's done. Mustn't touch IUP.
+static void *search( void *arg ) {
+	( void ) arg;
+	int in_err = GRN_OK;
+
+	for ( int i = 0; in_err == GRN_OK && i < search_paths_n; i++ ) {
+		GRN_LOG_DEBUG( "Searching UI file: '%s'", search_paths[i] );
+		grn_source_cat_torrent_files( search_source, search_paths[i], NULL, &in_err );
+		if ( grn_err_is_single_file( in_err ) ) {
+			search_file_err = in_err;
+			in_err = GRN_OK;
 		}
 	}
 
-#define X_CLIENT(var, enum, human) if (var##_val) { \
-	grn_cat_client( tmp_all_files, enum, out_err ); \
-	ERR_FW_CLEANUP(); \
+#define X_CLIENT(var, enum, human) if (var##_val && in_err == GRN_OK) { \
+	grn_source_cat_client( search_source, enum, &in_err ); \
 }
 #include "x_clients.h"
 #undef X_CLIENT
 
-	grn_ctx_set_files_v( grn_run_ctx, tmp_all_files );
+	// reported by the main thread once it's joined this one
+	search_err = in_err;
+	grn_source_close( search_source );
+	return NULL;
+}
+
+static void start_search( int *out_err ) {
+	*out_err = GRN_OK;
+
+	search_source = grn_source_alloc( 0, out_err );
+	ERR_FW();
+	grn_ctx_set_source( grn_run_ctx, search_source );
+
+	free( search_paths );
+	search_paths_n = vector_length( ui_files );
+	search_paths = malloc( sizeof( char * ) * ( search_paths_n + 1 ) );
+	if ( search_paths == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	for ( int i = 0; i < search_paths_n; i++ ) {
+		search_paths[i] = VECTOR_AT( ui_files, char *, i );
+	}
+	search_err = GRN_OK;
+	search_file_err = GRN_OK;
+
+	if ( pthread_create( &search_thread, NULL, search, NULL ) ) {
+		*out_err = GRN_ERR_THREAD;
+		goto cleanup;
+	}
+	searching = true;
 	return;
 cleanup:
-	vector_free_all( tmp_all_files );
+	// nothing else will ever close it
+	grn_source_close( search_source );
+}
+
+static void join_search() {
+	if ( searching ) {
+		pthread_join( search_thread, NULL );
+		searching = false;
+	}
+}
+
+// the search gives up as soon as it finds another file, once the context is freed
+static void stop_run( int *out_err ) {
+	grn_ctx_free( grn_run_ctx, out_err );
+	grn_run_ctx = NULL;
+	join_search();
 }
 
 static void cat_transforms_to_runner( int *out_err ) {
@@ -225,13 +284,13 @@ static void cat_transforms_to_runner( int *out_err ) {
 static void seal( int *out_err ) {
 	*out_err = GRN_OK;
 
-	grn_ctx_free( grn_run_ctx, out_err );
+	stop_run( out_err );
 	ERR_FW();
 	grn_run_ctx = grn_ctx_alloc( out_err );
 	ERR_FW();
 	cat_transforms_to_runner( out_err );
 	ERR_FW();
-	cat_files_to_runner( out_err );
+	start_search( out_err );
 	ERR_FW();
 }
 
@@ -240,23 +299,27 @@ static void progress_loop( int *out_err ) {
 	int in_err;
 	assert( grn_run_ctx != NULL );
 
-	IupSetInt( progress_dlg, "TOTALCOUNT", grn_ctx_get_files_n( grn_run_ctx ) );
 	while ( ! grn_ctx_get_is_done( grn_run_ctx ) ) {
 		grn_one_file( grn_run_ctx, &in_err );
 		exit_if_err( in_err );
+		// grows as the search finds more
+		IupSetInt( progress_dlg, "TOTALCOUNT", grn_ctx_get_files_n( grn_run_ctx ) );
 		IupSetInt( progress_dlg, "COUNT", grn_ctx_get_files_c( grn_run_ctx ) );
 		if ( IupLoopStep() == IUP_CLOSE ) {
 			*out_err = GRN_ERR_USER_CANCELLED;
 			return;
 		}
 	}
+	// the source is closed by now, so this doesn't wait for long
+	join_search();
+	*out_err = search_err;
 }
 
 static void summarize() {
 	assert( grn_run_ctx != NULL );
 
 	char summary_text[512];
-	sprintf( summary_text, "Done.\n%d files transformed, %d had errors.", grn_ctx_get_files_n( grn_run_ctx ), grn_ctx_get_errs_n( grn_run_ctx ) );
+	sprintf( summary_text, "Done.\n%d files transformed, %d had errors, %d were already up to date.", grn_ctx_get_files_n( grn_run_ctx ), grn_ctx_get_errs_n( grn_run_ctx ), grn_ctx_get_unchanged_n( grn_run_ctx ) );
 
 	show_text_dlg( "Transforms complete", summary_text );
 }
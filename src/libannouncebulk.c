@@ -1,30 +1,108 @@
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
+// for syscall and AT_FDCWD, which io_uring needs
+#define _DEFAULT_SOURCE
 
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <ftw.h>
 #include <ctype.h>
 #include <regex.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <bencode.h>
 
 #include "libannouncebulk.h"
 #include "vector.h"
 #include "util.h"
+#include "dfa.h"
+#include "cache.h"
 #include "err.h"
 
+// io_uring needs Linux 5.6, and headers new enough to know about it
+#if defined( __linux__ ) && !defined( GRN_NO_IO_URING )
+#define GRN_IO_URING
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+// reading directories with getdents64 instead of nftw
+#if defined( __linux__ ) && !defined( GRN_NO_GETDENTS )
+#define GRN_GETDENTS
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#else
+#include <ftw.h>
+#endif
+
+void pool_free( struct grn_ctx *ctx );
+bool pool_step( struct grn_ctx *ctx, int *out_err );
+void source_abandon( struct grn_source *source );
+void source_release( struct grn_source *source );
+const struct grn_path *file_path_ctx( const struct grn_ctx *ctx, int i );
+char *path_ctx( struct grn_ctx *ctx, int i );
+void flatten_output_ctx( struct grn_ctx *ctx, int *out_err );
+#ifndef _WIN32
+struct grn_cache_key cache_key( const struct stat *st );
+#endif
+#ifdef GRN_IO_URING
+void ring_free( struct grn_ctx *ctx );
+bool ring_step( struct grn_ctx *ctx, int *out_err );
+#endif
+
 // BEGIN context filesystem
 
+#ifndef _WIN32
+// map the file instead of reading it, if it's a regular file. Returns false if the file should be read normally.
+bool fmap_ctx( struct grn_ctx *ctx ) {
+	struct stat st;
+	int fd = fileno( ctx->fh );
+	// empty files can't be mapped, and pipes and such don't have a size
+	if ( fstat( fd, &st ) || !S_ISREG( st.st_mode ) || st.st_size <= 0 || ( unsigned long long ) st.st_size > SIZE_MAX ) {
+		return false;
+	}
+
+	void *mapped = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	if ( mapped == MAP_FAILED ) {
+		GRN_LOG_DEBUG( "Could not map file, reading instead%s", "" );
+		return false;
+	}
+	// the whole file is going to be scanned front to back right away
+	posix_madvise( mapped, st.st_size, POSIX_MADV_SEQUENTIAL );
+	posix_madvise( mapped, st.st_size, POSIX_MADV_WILLNEED );
+
+	ctx->buffer = mapped;
+	ctx->buffer_n = st.st_size;
+	ctx->buffer_mapped = true;
+	GRN_LOG_DEBUG( "Mapped file size: %d bytes", ( int )ctx->buffer_n );
+	return true;
+}
+#endif
+
 void fread_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 	assert( ctx->state == GRN_CTX_READ );
 	assert( ctx->fh != NULL );
 
+#ifndef _WIN32
+	if ( fmap_ctx( ctx ) ) {
+		return;
+	}
+#endif
+
 	// we can't just do fread(buffer, 1, some_massive_num, fh) because we can't be sure whether
 	// the whole file was read or not.
 	ERR( fseek( ctx->fh, 0, SEEK_END ), GRN_ERR_FS_SEEK );
@@ -41,12 +119,292 @@ void fread_ctx( struct grn_ctx *ctx, int *out_err ) {
 	}
 }
 
+#ifndef _WIN32
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// writev, but for any number of chunks and handling partial writes
+void write_iov_fd( int fd, const struct ben_iovec *iov, size_t iov_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct iovec batch[IOV_MAX < 1024 ? IOV_MAX : 1024];
+	const int batch_max = sizeof( batch ) / sizeof( batch[0] );
+	size_t i = 0;
+	size_t skip = 0; // bytes of iov[i] that were already written
+	while ( i < iov_n ) {
+		int batch_n = 0;
+		for ( size_t k = i; k < iov_n && batch_n < batch_max; k++ ) {
+			size_t k_skip = k == i ? skip : 0;
+			batch[batch_n].iov_base = ( char * ) iov[k].base + k_skip;
+			batch[batch_n].iov_len = iov[k].len - k_skip;
+			batch_n++;
+		}
+		ssize_t written = writev( fd, batch, batch_n );
+		if ( written < 0 && errno == EINTR ) {
+			continue;
+		}
+		ERR( written < 0, GRN_ERR_FS_WRITE );
+
+		size_t left = written;
+		while ( i < iov_n && left >= iov[i].len - skip ) {
+			left -= iov[i].len - skip;
+			skip = 0;
+			i++;
+		}
+		// nothing written without an error, the disk might be full
+		ERR( written == 0 && i < iov_n, GRN_ERR_FS_WRITE );
+		skip += left;
+	}
+}
+#endif
+
+#ifdef _WIN32
 void fwrite_ctx( struct grn_ctx *ctx, int *out_err ) {
 	*out_err = GRN_OK;
 	assert( ctx->state == GRN_CTX_WRITE );
 	assert( ctx->fh != NULL );
 
-	ERR( fwrite( ctx->buffer, ctx->buffer_n, 1, ctx->fh ) != 1, GRN_ERR_FS_WRITE );
+	for ( size_t i = 0; i < ctx->out_iov_n; i++ ) {
+		if ( ctx->out_iov[i].len > 0 ) {
+			ERR( fwrite( ctx->out_iov[i].base, ctx->out_iov[i].len, 1, ctx->fh ) != 1, GRN_ERR_FS_WRITE );
+		}
+	}
+}
+#else
+#define GRN_TMP_SUFFIX ".greeny-XXXXXX"
+
+/**
+ * Opens a temporary file next to the current one. fwrite_ctx renames it over the original once it's written,
+ * so the original is never left truncated or half-written.
+ * Files with more than one hard link are written in place instead, since a rename would split them from the others.
+ */
+void ftmp_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->tmp_path == NULL && !ctx->write_in_place );
+
+	// replace the file a symlink points to rather than the link itself
+	ctx->write_path = realpath( path_ctx( ctx, ctx->files_c ), NULL );
+	ERR( ctx->write_path == NULL, GRN_ERR_FS_OPEN );
+
+	struct stat st;
+	bool have_st = fstat( fileno( ctx->fh ), &st ) == 0;
+	if ( have_st && st.st_nlink > 1 ) {
+		GRN_LOG_WARNING( "%s has %ld hard links, writing it in place", ctx->write_path, ( long ) st.st_nlink );
+		// the output may point into a mapping of the file, which truncating it would pull out from under us
+		if ( ctx->buffer_mapped ) {
+			flatten_output_ctx( ctx, out_err );
+			ERR_FW();
+		}
+		ctx->tmp_fd = open( ctx->write_path, O_WRONLY | O_TRUNC );
+		ERR( ctx->tmp_fd == -1, GRN_ERR_FS_OPEN );
+		ctx->write_in_place = true;
+		return;
+	}
+
+	ctx->tmp_path = malloc( strlen( ctx->write_path ) + sizeof( GRN_TMP_SUFFIX ) );
+	ERR( ctx->tmp_path == NULL, GRN_ERR_OOM );
+	strcpy( ctx->tmp_path, ctx->write_path );
+	strcat( ctx->tmp_path, GRN_TMP_SUFFIX );
+
+	ctx->tmp_fd = mkstemp( ctx->tmp_path );
+	if ( ctx->tmp_fd == -1 ) {
+		free( ctx->tmp_path );
+		ctx->tmp_path = NULL;
+		ERR( GRN_ERR_FS_OPEN );
+	}
+	GRN_LOG_DEBUG( "Writing to temporary file %s", ctx->tmp_path );
+
+	// mkstemp makes files only the owner can read. Failing to copy ownership is fine when we aren't root.
+	if ( have_st ) {
+		fchmod( ctx->tmp_fd, st.st_mode & 07777 );
+		if ( fchown( ctx->tmp_fd, st.st_uid, st.st_gid ) ) {
+			GRN_LOG_DEBUG( "Could not copy file owner%s", "" );
+		}
+	}
+}
+
+// fsyncs the directory holding path, so a rename into it survives a crash
+void fsync_parent_dir( const char *path, int *out_err ) {
+	*out_err = GRN_OK;
+	char dir[GRN_PATH_MAX];
+	const char *slash = strrchr( path, '/' );
+	ERR( slash == NULL || ( size_t ) ( slash - path ) >= sizeof( dir ), GRN_ERR_FS_WRITE );
+	// the root directory keeps its slash
+	size_t dir_n = slash == path ? 1 : ( size_t ) ( slash - path );
+	memcpy( dir, path, dir_n );
+	dir[dir_n] = '\0';
+
+	int dir_fd = open( dir, O_RDONLY | O_DIRECTORY );
+	ERR( dir_fd == -1, GRN_ERR_FS_WRITE );
+	int sync_err = fsync( dir_fd );
+	close( dir_fd );
+	ERR( sync_err, GRN_ERR_FS_WRITE );
+}
+
+// closes the written temporary file and renames it over the original
+void commit_tmp_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->tmp_path != NULL || ctx->write_in_place );
+
+	int close_err = close( ctx->tmp_fd );
+	ctx->tmp_fd = -1;
+	if ( ctx->write_in_place ) {
+		ctx->write_in_place = false;
+		ERR( close_err, GRN_ERR_FS_CLOSE );
+		return;
+	}
+	ERR( close_err, GRN_ERR_FS_CLOSE );
+
+	ERR( rename( ctx->tmp_path, ctx->write_path ), GRN_ERR_FS_RENAME );
+	free( ctx->tmp_path );
+	ctx->tmp_path = NULL;
+	// the file's data is synced already, but the rename lives in the directory
+	if ( ctx->sync == GRN_SYNC_FILE ) {
+		fsync_parent_dir( ctx->write_path, out_err );
+		ERR_FW();
+	}
+}
+
+void fwrite_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_WRITE );
+	assert( ctx->tmp_path != NULL || ctx->write_in_place );
+
+	write_iov_fd( ctx->tmp_fd, ctx->out_iov, ctx->out_iov_n, out_err );
+	ERR_FW();
+	if ( ctx->sync == GRN_SYNC_FILE ) {
+		ERR( fsync( ctx->tmp_fd ), GRN_ERR_FS_WRITE );
+	}
+	commit_tmp_ctx( ctx, out_err );
+}
+#endif
+
+// whether the output is byte for byte the same as the input, so the file doesn't need to be written
+bool output_unchanged_ctx( struct grn_ctx *ctx ) {
+	if ( ctx->out_unchanged ) {
+		return true;
+	}
+	if ( ctx->out_n != ctx->buffer_n ) {
+		return false;
+	}
+	size_t off = 0;
+	for ( size_t i = 0; i < ctx->out_iov_n; i++ ) {
+		const struct ben_iovec *chunk = &ctx->out_iov[i];
+		// chunks copied straight from the input are usually in the same place
+		if ( chunk->base != ctx->buffer + off && memcmp( chunk->base, ctx->buffer + off, chunk->len ) ) {
+			return false;
+		}
+		off += chunk->len;
+	}
+	return true;
+}
+
+// removes the temporary file if it was never renamed, because of an error, or closes a file being written in place
+void discard_tmp_ctx( struct grn_ctx *ctx ) {
+#ifndef _WIN32
+	if ( ctx->tmp_path != NULL ) {
+		if ( ctx->tmp_fd != -1 ) {
+			close( ctx->tmp_fd );
+		}
+		unlink( ctx->tmp_path );
+	} else if ( ctx->write_in_place ) {
+		// the original is already truncated, so there's nothing to put back
+		close( ctx->tmp_fd );
+		ctx->tmp_fd = -1;
+		ctx->write_in_place = false;
+	}
+#endif
+	grn_free( ctx->tmp_path );
+	grn_free( ctx->write_path );
+	ctx->tmp_path = NULL;
+	ctx->write_path = NULL;
+}
+
+// flush everything written by this context to disk, if the context wants it done in one go at the end
+void sync_batch_ctx( struct grn_ctx *ctx ) {
+#ifndef _WIN32
+	if ( ctx->sync == GRN_SYNC_BATCH ) {
+		GRN_LOG_DEBUG( "Syncing all written files%s", "" );
+		sync();
+	}
+#endif
+}
+
+// frees or unmaps the input buffer
+void free_buffer_ctx( struct grn_ctx *ctx ) {
+	if ( ctx->buffer_mapped ) {
+#ifndef _WIN32
+		munmap( ctx->buffer, ctx->buffer_n );
+#endif
+	} else {
+		grn_free( ctx->buffer );
+	}
+	ctx->buffer = NULL;
+	ctx->buffer_mapped = false;
+}
+
+/**
+ * Make sure the input buffer is a heap copy, not a mapping of the file.
+ * Output chunks pointing into the buffer are NOT updated, so only call this before transforming.
+ */
+void buffer_to_heap_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	if ( !ctx->buffer_mapped ) {
+		return;
+	}
+
+	char *copy = malloc( ctx->buffer_n + 1 );
+	ERR( copy == NULL, GRN_ERR_OOM );
+	memcpy( copy, ctx->buffer, ctx->buffer_n );
+	size_t buffer_n = ctx->buffer_n;
+	free_buffer_ctx( ctx );
+	ctx->buffer = copy;
+	ctx->buffer_n = buffer_n;
+}
+
+void free_output_ctx( struct grn_ctx *ctx ) {
+	grn_free( ctx->out_iov );
+	grn_free( ctx->out_scratch );
+	ctx->out_iov = NULL;
+	ctx->out_iov_n = 0;
+	ctx->out_scratch = NULL;
+	ctx->out_n = 0;
+	ctx->out_unchanged = false;
+}
+
+// use a single dynamically allocated buffer as the output. Takes ownership of it, even on error.
+void set_output_buffer_ctx( struct grn_ctx *ctx, char *buffer, size_t buffer_n, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->out_iov == NULL );
+
+	ctx->out_iov = malloc( sizeof( struct ben_iovec ) );
+	if ( ctx->out_iov == NULL ) {
+		free( buffer );
+		ERR( GRN_ERR_OOM );
+	}
+	ctx->out_iov[0] = ( struct ben_iovec ) {
+		.base = buffer,
+		.len = buffer_n,
+	};
+	ctx->out_iov_n = 1;
+	ctx->out_scratch = buffer;
+	ctx->out_n = buffer_n;
+}
+
+// copy the output into a single buffer of its own, so it no longer points into the input
+void flatten_output_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	char *flat = malloc( ctx->out_n > 0 ? ctx->out_n : 1 );
+	ERR( flat == NULL, GRN_ERR_OOM );
+	size_t off = 0;
+	for ( size_t i = 0; i < ctx->out_iov_n; i++ ) {
+		memcpy( flat + off, ctx->out_iov[i].base, ctx->out_iov[i].len );
+		off += ctx->out_iov[i].len;
+	}
+	free_output_ctx( ctx );
+	set_output_buffer_ctx( ctx, flat, off, out_err );
 }
 
 // END context filesystem
@@ -70,15 +428,22 @@ void grn_ctx_free( struct grn_ctx *ctx, int *out_err ) {
 	if ( ctx == NULL ) {
 		return;
 	}
-	if ( ctx->files != NULL ) {
-		for ( int i = 0; i < ctx->files_n; i++ ) {
-			if ( ctx->files[i] == NULL ) {
-				break;
-			}
-			free( ctx->files[i] );
-		}
+	// wakes up workers waiting for files that will never be found, and whatever is still pushing them
+	if ( ctx->source != NULL ) {
+		source_abandon( ctx->source );
+	}
+	// workers still reference the files and transforms
+	pool_free( ctx );
+#ifdef GRN_IO_URING
+	// so is the kernel, until everything in flight completes
+	ring_free( ctx );
+#endif
+	if ( ctx->source != NULL ) {
+		source_release( ctx->source );
+	} else {
 		free( ctx->files );
 	}
+	grn_paths_free( ctx->paths );
 
 	if ( ctx->transforms != NULL ) {
 		for ( int i = 0; i < ctx->transforms_n; i++ ) {
@@ -86,7 +451,20 @@ void grn_ctx_free( struct grn_ctx *ctx, int *out_err ) {
 		}
 		free( ctx->transforms );
 	}
-	grn_free( ctx->buffer );
+	if ( ctx->plan_owned ) {
+		grn_plan_free( ctx->plan );
+	}
+	if ( ctx->arena_owned ) {
+		ben_arena_free( ctx->arena );
+	}
+	// whatever got done is worth remembering, even if the run was cut short
+	if ( ctx->cache != NULL ) {
+		grn_cache_save( ctx->cache, out_err );
+		grn_cache_free( ctx->cache );
+	}
+	free_buffer_ctx( ctx );
+	free_output_ctx( ctx );
+	discard_tmp_ctx( ctx );
 	if ( ctx->fh != NULL ) {
 		// we still want to continue when the fclose fails, to free the ctx
 		if ( fclose( ctx->fh ) ) {
@@ -97,13 +475,33 @@ void grn_ctx_free( struct grn_ctx *ctx, int *out_err ) {
 }
 
 // maybe I should stop pretending C is object oriented? But the ctx is supposed to be opaque, right?
-void grn_ctx_set_files( struct grn_ctx *ctx, char **files, int files_n ) {
-	ctx->files = files;
-	ctx->files_n = files_n;
+void grn_ctx_set_files( struct grn_ctx *ctx, char **files, int files_n, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->files == NULL && ctx->source == NULL );
+
+	ctx->paths = grn_paths_alloc( out_err );
+	ERR_FW_CLEANUP();
+	ctx->files = malloc( ( files_n > 0 ? files_n : 1 ) * sizeof( struct grn_path ) );
+	if ( ctx->files == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	for ( ; ctx->files_n < files_n; ctx->files_n++ ) {
+		ctx->files[ctx->files_n] = grn_paths_add_path( ctx->paths, files[ctx->files_n], out_err );
+		ERR_FW_CLEANUP();
+	}
+
+cleanup:
+	for ( int i = 0; i < files_n; i++ ) {
+		free( files[i] );
+	}
+	free( files );
 }
 
-void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files ) {
-	ctx->files = ( char ** ) vector_export( files, &ctx->files_n );
+void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files, int *out_err ) {
+	int files_n;
+	char **exported = vector_export( files, &files_n );
+	grn_ctx_set_files( ctx, exported, files_n, out_err );
 }
 
 void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n ) {
@@ -115,6 +513,25 @@ void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms )
 	ctx->transforms = ( struct grn_transform * ) vector_export( transforms, &ctx->transforms_n );
 }
 
+void grn_ctx_set_threads( struct grn_ctx *ctx, int threads_n ) {
+	assert( ctx->pool == NULL );
+	ctx->threads_n = threads_n;
+}
+
+void grn_ctx_set_pipeline( struct grn_ctx *ctx, int transformers_n ) {
+	assert( ctx->pool == NULL );
+	ctx->pipeline_n = transformers_n;
+}
+
+void grn_ctx_set_io_depth( struct grn_ctx *ctx, int io_depth ) {
+	assert( ctx->ring == NULL );
+	ctx->io_depth = io_depth;
+}
+
+void grn_ctx_set_sync( struct grn_ctx *ctx, enum grn_sync_mode sync ) {
+	ctx->sync = sync;
+}
+
 int bencode_error_to_anb( int bencode_error ) {
 	if ( bencode_error == BEN_OK ) return GRN_OK;
 	if ( bencode_error == BEN_NO_MEMORY ) return GRN_ERR_OOM;
@@ -240,15 +657,8 @@ void grn_cat_transforms_orpheus( struct vector *vec, char *user_announce, int *o
 	ut_del.dynamalloc = 0;
 	ut_del.key = base_dict_key;
 
-	vector_push( vec, &key_subst, out_err );
-	ERR_FW();
-	vector_push( vec, &list_subst, out_err );
-	ERR_FW();
-	vector_push( vec, &ut_subst, out_err );
-	ERR_FW();
-	vector_push( vec, &qb_subst, out_err );
-	ERR_FW();
-	vector_push( vec, &ut_del, out_err );
+	struct grn_transform all[] = { key_subst, list_subst, ut_subst, qb_subst, ut_del };
+	vector_append( vec, all, sizeof( all ) / sizeof( all[0] ), out_err );
 	ERR_FW();
 }
 
@@ -303,16 +713,28 @@ struct grn_transform grn_mktransform_substitute_regex( char *find_regstr, char *
 		.dynamalloc = GRN_DYNAMIC_TRANSFORM_FIRST,
 	};
 
-	int regcomp_res = regcomp( &to_return.payload.substitute_regex.find, find_regstr, REG_EXTENDED );
-	if ( regcomp_res == REG_ESPACE ) {
-		*out_err = GRN_ERR_OOM;
+	// the caller's pattern might not outlive the transform, but the cache hashes it later
+	char *find_str = grn_strcpy_malloc( find_regstr, out_err );
+	if ( *out_err ) {
 		return to_return;
 	}
+	int regcomp_res = regcomp( &to_return.payload.substitute_regex.find, find_regstr, REG_EXTENDED );
 	if ( regcomp_res ) {
-		*out_err = GRN_ERR_REGEX_SYNTAX;
+		free( find_str );
+		*out_err = regcomp_res == REG_ESPACE ? GRN_ERR_OOM : GRN_ERR_REGEX_SYNTAX;
 		return to_return;
 	}
 
+	// regexec is kept around for whatever the DFA can't do
+	to_return.payload.substitute_regex.dfa = grn_dfa_compile( find_regstr, out_err );
+	if ( *out_err ) {
+		free( find_str );
+		regfree( &to_return.payload.substitute_regex.find );
+		return to_return;
+	}
+	to_return.payload.substitute_regex.find_str = find_str;
+	GRN_LOG_DEBUG( "Regex %s compiled to a DFA: %d", find_regstr, to_return.payload.substitute_regex.dfa != NULL );
+
 	return to_return;
 }
 
@@ -330,6 +752,8 @@ void grn_free_transform( struct grn_transform *transform ) {
 	if ( bits & GRN_DYNAMIC_TRANSFORM_FIRST ) {
 		if ( transform->operation == GRN_TRANSFORM_SUBSTITUTE_REGEX ) {
 			regfree( &transform->payload.substitute_regex.find );
+			grn_dfa_free( transform->payload.substitute_regex.dfa );
+			free( transform->payload.substitute_regex.find_str );
 		} else {
 			free( transform->payload.delete_.key );
 		}
@@ -408,35 +832,124 @@ char *strsubst( const char *haystack, const char *find, const char *replace, int
 	return to_return;
 }
 
-// free the result. Will always return NULL on error.
-char *regsubst( const char *haystack_arg, regex_t *find, const char *replace, bool global, int *out_err ) {
+// a growable output string. Always null-terminated once anything has been appended.
+struct strbuf {
+	char *buf;
+	size_t n;
+	size_t allocated;
+};
+
+static void strbuf_append( struct strbuf *sb, const char *data, size_t data_n, int *out_err ) {
 	*out_err = GRN_OK;
-	regmatch_t match[1];
 
-	char *haystack = malloc( strlen( haystack_arg ) + 1 );
-	ERR_NULL( haystack == NULL, GRN_ERR_OOM );
-	strcpy( haystack, haystack_arg );
+	if ( sb->n + data_n + 1 > sb->allocated ) {
+		size_t allocated = sb->allocated > 0 ? sb->allocated : 16;
+		while ( sb->n + data_n + 1 > allocated ) {
+			allocated *= 2;
+		}
+		char *buf = realloc( sb->buf, allocated );
+		ERR( buf == NULL, GRN_ERR_OOM );
+		sb->buf = buf;
+		sb->allocated = allocated;
+	}
+	memcpy( sb->buf + sb->n, data, data_n );
+	sb->n += data_n;
+	sb->buf[sb->n] = '\0';
+}
 
-	// I'm stupidly proud of this little eo management shit
-	int last_eo = 0;
-	do {
-		int regexec_res = regexec( find, haystack + last_eo, 1, match, 0 );
+/**
+ * Find the next match at or after from, ignoring the NUL bytes in haystack the way the DFA does:
+ * no match spans one, ^ only matches at the very start and $ only at the very end.
+ * @param seg_end the end of the NUL-free segment from is in. Kept by the caller so each segment is only scanned once.
+ */
+static bool regsubst_find( const char *haystack, size_t haystack_n, regex_t *find, const struct grn_dfa *dfa, size_t from, size_t *seg_end, size_t *so, size_t *eo ) {
+	if ( dfa != NULL ) {
+		return grn_dfa_exec( dfa, haystack, haystack_n, from, so, eo );
+	}
+
+	while ( from <= haystack_n ) {
+		if ( from > *seg_end || *seg_end == SIZE_MAX ) {
+			const char *nul = memchr( haystack + from, '\0', haystack_n - from );
+			*seg_end = nul == NULL ? haystack_n : ( size_t ) ( nul - haystack );
+		}
+		int eflags = ( from > 0 ? REG_NOTBOL : 0 ) | ( *seg_end < haystack_n ? REG_NOTEOL : 0 );
+		regmatch_t match[1];
+#ifdef REG_STARTEND
+		// saves regexec from running strlen over the rest of the haystack every match
+		match->rm_so = from;
+		match->rm_eo = *seg_end;
 		// supposedly it can only fail in case of no match -- not OOM
-		if ( regexec_res ) {
-			break;
+		if ( !regexec( find, haystack, 1, match, eflags | REG_STARTEND ) ) {
+			*so = match->rm_so;
+			*eo = match->rm_eo;
+			return true;
 		}
-		int abs_so = match->rm_so + last_eo;
-		int abs_eo = match->rm_eo + last_eo;
-		last_eo += match->rm_eo;
-		char *next_haystack = strsubst_by_indices( haystack, replace, abs_so, abs_eo - abs_so, out_err );
-		// this is a bit of a break from our normal error handling but it should be fine
-		free( haystack );
-		ERR_FW_NULL();
+#else
+		if ( !regexec( find, haystack + from, 1, match, eflags ) ) {
+			*so = from + match->rm_so;
+			*eo = from + match->rm_eo;
+			return true;
+		}
+#endif
+		// try the segment after the next NUL
+		from = *seg_end + 1;
+	}
+	return false;
+}
+
+/**
+ * Substitute matches of a regex in a buffer that may contain NUL bytes, in one pass.
+ * @param haystack must have a NUL byte at haystack_n, for regexec
+ * @param dfa used instead of find if it isn't NULL
+ * @param out_n where to put the length of the result, which is also null-terminated
+ * @return the dynamically allocated result. NULL on error.
+ */
+char *regsubst_n( const char *haystack, size_t haystack_n, regex_t *find, const struct grn_dfa *dfa, const char *replace, bool global, size_t *out_n, int *out_err ) {
+	*out_err = GRN_OK;
+	const size_t replace_n = strlen( replace );
+	struct strbuf out = { 0 };
+
+	// most substitutions keep the length about the same
+	out.buf = malloc( haystack_n + 1 );
+	ERR_NULL( out.buf == NULL, GRN_ERR_OOM );
+	out.allocated = haystack_n + 1;
+	out.buf[0] = '\0';
+
+	bool search = dfa == NULL || grn_dfa_might_match( dfa, haystack, haystack_n );
+	size_t copied = 0, from = 0, seg_end = SIZE_MAX;
+	size_t last_eo = SIZE_MAX;
+	size_t so, eo;
+	while ( search && from <= haystack_n && regsubst_find( haystack, haystack_n, find, dfa, from, &seg_end, &so, &eo ) ) {
+		// like sed, an empty match right after the last match isn't another one
+		if ( so == eo && so == last_eo ) {
+			from = so + 1;
+			continue;
+		}
+		strbuf_append( &out, haystack + copied, so - copied, out_err );
+		ERR_FW_CLEANUP();
+		strbuf_append( &out, replace, replace_n, out_err );
+		ERR_FW_CLEANUP();
+		copied = eo;
+		last_eo = eo;
+		// an empty match has to move forward by itself
+		from = so == eo ? eo + 1 : eo;
+		search = global;
+	}
+	strbuf_append( &out, haystack + copied, haystack_n - copied, out_err );
+	ERR_FW_CLEANUP();
 
-		haystack = next_haystack;
-	} while ( global );
+	*out_n = out.n;
+	return out.buf;
+cleanup:
+	free( out.buf );
+	return NULL;
+}
 
-	return haystack;
+// free the result. Will always return NULL on error.
+// dfa is used instead of find if it isn't NULL.
+char *regsubst( const char *haystack, regex_t *find, const struct grn_dfa *dfa, const char *replace, bool global, int *out_err ) {
+	size_t out_n;
+	return regsubst_n( haystack, strlen( haystack ), find, dfa, replace, global, &out_n, out_err );
 }
 
 /**
@@ -461,12 +974,14 @@ void ben_free_grn( struct bencode *ben ) {
 	}
 }
 
-struct bencode *ben_decode_grn( const void *buffer, size_t buffer_n, int *out_err ) {
+// see ben_decode_arena. expand may be NULL to decode everything, and arena NULL to use the heap.
+// with borrow, strings point into buffer, which has to outlive the result.
+struct bencode *ben_decode_grn( const void *buffer, size_t buffer_n, ben_expand_fn expand, void *expand_arg, struct ben_arena *arena, bool borrow, int *out_err ) {
 	*out_err = GRN_OK;
 
 	int bencode_error;
 	size_t off = 0;
-	struct bencode *to_return = ben_decode2( buffer, buffer_n, &off, &bencode_error );
+	struct bencode *to_return = ben_decode_arena( buffer, buffer_n, &off, &bencode_error, expand, expand_arg, arena, borrow );
 	if ( bencode_error ) {
 		// TODO: rename anb
 		*out_err = bencode_error_to_anb( bencode_error );
@@ -477,24 +992,24 @@ struct bencode *ben_decode_grn( const void *buffer, size_t buffer_n, int *out_er
 	return to_return;
 }
 
-void *ben_encode_grn( struct bencode *ben, size_t *buffer_n, int *out_err ) {
-	void *to_return = ben_encode( buffer_n, ben );
+// see ben_encode_spliced
+struct ben_iovec *ben_encode_spliced_grn( struct bencode *ben, const char *src, size_t *iov_n, char **scratch, size_t *out_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct ben_iovec *to_return = ben_encode_spliced( iov_n, scratch, out_n, ben, src );
 	ERR_NULL( to_return == NULL, GRN_ERR_OOM );
 	return to_return;
 }
 
 /**
  * Replace a bencode string with a different one, in-place
- * The previous string will be freed.
+ * The previous string will be freed, unless it's in an arena.
  * @param ben the bencode string object to mutate
  * @param replace_with the string to use as the new one. *must* be dynamically allocated.
  */
 void ben_str_swap( struct bencode *ben, char *replace_with ) {
 	assert( ben->type == BENCODE_STR );
-	struct bencode_str *benstr = ( struct bencode_str * ) ben;
-	free( benstr->s );
-	benstr->s = replace_with;
-	benstr->len = strlen( replace_with );
+	ben_str_replace( ben, replace_with, strlen( replace_with ) );
 }
 
 void mutate_string_subst( struct bencode *ben, struct grn_op_substitute payload, int *out_err ) {
@@ -504,6 +1019,8 @@ void mutate_string_subst( struct bencode *ben, struct grn_op_substitute payload,
 	}
 	GRN_LOG_DEBUG( "Substituting %s for %s", payload.find, payload.replace );
 
+	// borrowed strings aren't null-terminated
+	ERR( ben_str_own( ben ), GRN_ERR_OOM );
 	char *substituted = strsubst( ben_str_val( ben ), payload.find, payload.replace, out_err );
 	ERR_FW();
 	ben_str_swap( ben, substituted );
@@ -515,37 +1032,12 @@ void mutate_string_subst_regex( struct bencode *ben, struct grn_op_substitute_re
 		return;
 	}
 
-	char *substituted = regsubst( ben_str_val( ben ), &payload.find, payload.replace, false, out_err );
+	ERR( ben_str_own( ben ), GRN_ERR_OOM );
+	char *substituted = regsubst( ben_str_val( ben ), &payload.find, payload.dfa, payload.replace, false, out_err );
 	ERR_FW();
 	ben_str_swap( ben, substituted );
 }
 
-void cat_descendants( struct vector *vec, struct bencode *ben, int *out_err ) {
-	*out_err = GRN_OK;
-
-	struct bencode *key, *val;
-	size_t pos;
-	switch ( ben->type ) {
-		case BENCODE_DICT:
-			;
-			ben_dict_for_each( key, val, pos, ben ) {
-				vector_push( vec, &val, out_err );
-				ERR_FW();
-			}
-			break;
-		case BENCODE_LIST:
-			;
-			ben_list_for_each( val, pos, ben ) {
-				vector_push( vec, &val, out_err );
-				ERR_FW();
-			}
-			break;
-		default:
-			;
-			break;
-	}
-}
-
 // transforms a buffer based on a single transform and does not filter
 void transform_buffer_single( struct bencode *ben, struct grn_transform transform, int *out_err ) {
 	*out_err = GRN_OK;
@@ -589,152 +1081,2461 @@ void transform_buffer_single( struct bencode *ben, struct grn_transform transfor
 	}
 }
 
-void transform_buffer( struct grn_ctx *ctx, int *out_err ) {
-	*out_err = GRN_OK;
-	assert( ctx->state == GRN_CTX_TRANSFORM );
+// BEGIN transform plans
+// The key paths of all the transforms are merged into a trie, so each file is walked once, applying every
+// transform where its key ends, instead of being filtered down from the top once per transform. Transforms
+// still happen in their original order wherever they overlap, so the result is the same as applying them
+// one after another.
+
+struct grn_plan_node {
+	char *key; // the dictionary key leading here from the parent. Empty for a wildcard.
+	size_t key_n;
+	long long key_hash;
+	struct grn_plan_node **children;
+	int children_n;
+	// indexes of the transforms whose key ends here, and of all those whose key passes through here. Ascending.
+	int *ops;
+	int ops_n;
+	int *reach;
+	int reach_n;
+};
 
-	struct bencode *main_dict = NULL;
+struct grn_plan {
+	int transforms_n;
+	struct grn_plan_node root;
+};
 
-	// BEGIN SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
-	if ( str_ends_with( grn_ctx_get_c_path( ctx ), "torrents.state" ) ) {
-		GRN_LOG_DEBUG( "Doing deluge .state transform%s", "" );
-		assert( ctx->transforms[0].operation = GRN_TRANSFORM_SUBSTITUTE_REGEX );
+void plan_push_op( int **ops, int *ops_n, int op, int *out_err ) {
+	*out_err = GRN_OK;
 
-		// we need to add the null byte so the file is a proper string
-		char *buffer_null = realloc( ctx->buffer, ctx->buffer_n + 1 );
-		// when realloc fails, the original pointer is still valid for free'ing
-		ERR( buffer_null == NULL, GRN_ERR_OOM );
-		ctx->buffer = NULL;
-		// it's unintuitive, but because it's zero indexed this is still actually one beyond the previous
-		// length
-		buffer_null[ctx->buffer_n] = '\0';
+	int *grown = realloc( *ops, ( *ops_n + 1 ) * sizeof( int ) );
+	ERR( grown == NULL, GRN_ERR_OOM );
+	*ops = grown;
+	( *ops )[( *ops_n )++] = op;
+}
 
-		ctx->buffer = regsubst( buffer_null, &ctx->transforms[0].payload.substitute_regex.find, ctx->transforms[0].payload.substitute_regex.replace, true, out_err );
-		free( buffer_null );
-		ERR_FW();
-		// intentionally not adding the null byte because there shouldn't be one.
-		ctx->buffer_n = strlen( ctx->buffer );
-		return;
-	}
-	// END SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+// finds or adds the child of node for key
+struct grn_plan_node *plan_child( struct grn_plan_node *node, const char *key, int *out_err ) {
+	*out_err = GRN_OK;
 
-	struct vector *f_to_traverse = NULL, *f_traversing = NULL, *f_out;
+	size_t key_n = strlen( key );
+	for ( int i = 0; i < node->children_n; i++ ) {
+		struct grn_plan_node *child = node->children[i];
+		if ( child->key_n == key_n && memcmp( child->key, key, key_n ) == 0 ) {
+			return child;
+		}
+	}
 
-	// TODO: this
-	f_to_traverse = vector_alloc( sizeof( struct bencode * ), out_err );
-	ERR_FW_CLEANUP();
-	f_traversing = vector_alloc( sizeof( struct bencode * ), out_err );
-	ERR_FW_CLEANUP();
+	struct grn_plan_node **children = realloc( node->children, ( node->children_n + 1 ) * sizeof( *children ) );
+	ERR_NULL( children == NULL, GRN_ERR_OOM );
+	node->children = children;
+	struct grn_plan_node *child = calloc( 1, sizeof( struct grn_plan_node ) );
+	ERR_NULL( child == NULL, GRN_ERR_OOM );
+	node->children[node->children_n++] = child;
+	child->key = malloc( key_n + 1 );
+	ERR_NULL( child->key == NULL, GRN_ERR_OOM );
+	memcpy( child->key, key, key_n + 1 );
+	child->key_n = key_n;
+	child->key_hash = ben_str_hash_buf( key, key_n );
+	return child;
+}
 
-	main_dict = ben_decode_grn( ctx->buffer, ctx->buffer_n, out_err );
-	ERR_FW_CLEANUP();
+void plan_free_node( struct grn_plan_node *node ) {
+	for ( int i = 0; i < node->children_n; i++ ) {
+		plan_free_node( node->children[i] );
+		free( node->children[i] );
+	}
+	grn_free( node->key );
+	grn_free( node->children );
+	grn_free( node->ops );
+	grn_free( node->reach );
+}
 
-	for ( int i = 0; i < ctx->transforms_n; i++ ) {
-		struct grn_transform transform = ctx->transforms[i];
-		assert( transform.key != NULL );
+void grn_plan_free( struct grn_plan *plan ) {
+	if ( plan == NULL ) {
+		return;
+	}
+	plan_free_node( &plan->root );
+	free( plan );
+}
 
-		// first, filter down by the keys in the transform
-		vector_clear( f_to_traverse );
-		vector_clear( f_traversing );
-		vector_push( f_to_traverse, &main_dict, out_err );
-		ERR_FW_CLEANUP();
+struct grn_plan *grn_plan_compile( const struct grn_transform *transforms, int transforms_n, int *out_err ) {
+	*out_err = GRN_OK;
 
-		char *filter_key;
-		int k = 0;
-		while ( ( filter_key = transform.key[k++] ) != NULL ) {
-			GRN_LOG_DEBUG( "Filtering by key: '%s' ", filter_key );
-			// essentially, we want to make f_to_traverse empty and start traversing the former to_traverse
-			struct vector *f_tmp = f_traversing;
-			f_traversing = f_to_traverse;
-			f_to_traverse = f_tmp;
-			vector_clear( f_to_traverse );
-
-			while ( vector_length( f_traversing ) > 0 ) {
-				struct bencode *traversing = * ( struct bencode ** ) vector_pop( f_traversing );
-
-				// wildcard
-				if ( strlen( filter_key ) == 0 ) {
-					GRN_LOG_DEBUG( "Performing wildcard filter%s", "" );
-					cat_descendants( f_to_traverse, traversing, out_err );
-					ERR_FW_CLEANUP();
-				} else {
-					GRN_LOG_DEBUG( "Non-wildcard filter%s", "" );
-					if ( traversing->type != BENCODE_DICT ) {
-						GRN_LOG_DEBUG( "Skipping because not a dictionary%s", "" );
-						continue;
-					}
-					struct bencode *maybe_val = ben_dict_get_by_str( traversing, filter_key );
-					if ( maybe_val != NULL ) {
-						vector_push( f_to_traverse, &maybe_val, out_err );
-						ERR_FW_CLEANUP();
-					}
-				}
+	struct grn_plan *plan = calloc( 1, sizeof( struct grn_plan ) );
+	ERR_NULL( plan == NULL, GRN_ERR_OOM );
+	plan->transforms_n = transforms_n;
+
+	for ( int i = 0; i < transforms_n && *out_err == GRN_OK; i++ ) {
+		assert( transforms[i].key != NULL );
+		struct grn_plan_node *node = &plan->root;
+		plan_push_op( &node->reach, &node->reach_n, i, out_err );
+		for ( int k = 0; transforms[i].key[k] != NULL && *out_err == GRN_OK; k++ ) {
+			node = plan_child( node, transforms[i].key[k], out_err );
+			if ( *out_err == GRN_OK ) {
+				plan_push_op( &node->reach, &node->reach_n, i, out_err );
 			}
 		}
-		f_out = f_to_traverse;
-
-		while ( vector_length( f_out ) > 0 ) {
-			struct bencode *filtered = * ( struct bencode ** ) vector_pop( f_out );
-			transform_buffer_single( filtered, transform, out_err );
-			if ( *out_err ) {
-				goto cleanup;
+		if ( *out_err == GRN_OK ) {
+			plan_push_op( &node->ops, &node->ops_n, i, out_err );
+		}
+	}
+	if ( *out_err ) {
+		grn_plan_free( plan );
+		return NULL;
+	}
+	return plan;
+}
+
+// the first of ops in [lo, hi), or -1
+int plan_first_op( const int *ops, int ops_n, int lo, int hi ) {
+	for ( int i = 0; i < ops_n && ops[i] < hi; i++ ) {
+		if ( ops[i] >= lo ) {
+			return ops[i];
+		}
+	}
+	return -1;
+}
+
+// the first transform in [lo, hi) ending at any of the matched plan nodes, or -1
+int plan_next_op( struct grn_plan_node **matched, int matched_n, int lo, int hi ) {
+	int next = -1;
+	for ( int i = 0; i < matched_n; i++ ) {
+		int op = plan_first_op( matched[i]->ops, matched[i]->ops_n, lo, next == -1 ? hi : next );
+		if ( op != -1 ) {
+			next = op;
+		}
+	}
+	return next;
+}
+
+/**
+ * Finds the plan nodes a child of the matched nodes goes to, leaving out those with nothing to do in [lo, hi).
+ * @param key the child's dictionary key, or NULL for list elements, which only wildcards match
+ * @param out room for a node per transform
+ * @return the number of nodes put in out
+ */
+int plan_children( struct grn_plan_node **matched, int matched_n, const char *key, size_t key_n, int lo, int hi, struct grn_plan_node **out ) {
+	int out_n = 0;
+	for ( int i = 0; i < matched_n; i++ ) {
+		for ( int j = 0; j < matched[i]->children_n; j++ ) {
+			struct grn_plan_node *child = matched[i]->children[j];
+			bool key_matches = child->key_n == 0 || ( key != NULL && child->key_n == key_n && memcmp( child->key, key, key_n ) == 0 );
+			if ( key_matches && plan_first_op( child->reach, child->reach_n, lo, hi ) != -1 ) {
+				out[out_n++] = child;
+			}
+		}
+	}
+	return out_n;
+}
+
+// whether any child of the matched nodes with something to do in [lo, hi) is a wildcard
+bool plan_wildcard_below( struct grn_plan_node **matched, int matched_n, int lo, int hi ) {
+	for ( int i = 0; i < matched_n; i++ ) {
+		for ( int j = 0; j < matched[i]->children_n; j++ ) {
+			struct grn_plan_node *child = matched[i]->children[j];
+			if ( child->key_n == 0 && plan_first_op( child->reach, child->reach_n, lo, hi ) != -1 ) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// whether a child of the matched nodes before matched[i]->children[j] has the same key and was already looked up
+bool plan_key_seen( struct grn_plan_node **matched, int i, int j, int lo, int hi ) {
+	struct grn_plan_node *child = matched[i]->children[j];
+	for ( int pi = 0; pi <= i; pi++ ) {
+		for ( int pj = 0; pj < ( pi == i ? j : matched[pi]->children_n ); pj++ ) {
+			struct grn_plan_node *prev = matched[pi]->children[pj];
+			if ( prev->key_n == child->key_n && memcmp( prev->key, child->key, child->key_n ) == 0
+			        && plan_first_op( prev->reach, prev->reach_n, lo, hi ) != -1 ) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// whether a path of dictionary keys (NULL for list elements) leads anywhere in the plan below node
+bool plan_reaches( const struct grn_plan_node *node, const struct bencode *const *path, int path_n ) {
+	if ( path_n == 0 ) {
+		return true;
+	}
+	for ( int i = 0; i < node->children_n; i++ ) {
+		const struct grn_plan_node *child = node->children[i];
+		if ( child->key_n > 0 ) {
+			// named keys only match dictionary string keys, like ben_dict_get_by_str
+			if ( path[0] == NULL || path[0]->type != BENCODE_STR || ben_str_len( path[0] ) != child->key_n ) {
+				continue;
+			}
+			if ( memcmp( ben_str_val( path[0] ), child->key, child->key_n ) ) {
+				continue;
+			}
+		}
+		if ( plan_reaches( child, path + 1, path_n - 1 ) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void plan_descend( const struct grn_transform *transforms, int transforms_n, struct bencode *ben, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err );
+
+/**
+ * Applies the transforms numbered lo to hi - 1 to ben and everything below it.
+ * @param matched the plan nodes ben was reached by
+ */
+void plan_apply( const struct grn_transform *transforms, int transforms_n, struct bencode *ben, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err ) {
+	*out_err = GRN_OK;
+
+	// everything a transform ending here could see has to be done before it, and everything after after it
+	while ( lo < hi ) {
+		int op = plan_next_op( matched, matched_n, lo, hi );
+		plan_descend( transforms, transforms_n, ben, matched, matched_n, lo, op == -1 ? hi : op, out_err );
+		ERR_FW();
+		if ( op == -1 ) {
+			break;
+		}
+		transform_buffer_single( ben, transforms[op], out_err );
+		ERR_FW();
+		lo = op + 1;
+	}
+}
+
+// applies the transforms numbered lo to hi - 1 to the children of ben
+void plan_descend( const struct grn_transform *transforms, int transforms_n, struct bencode *ben, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( lo >= hi || ( ben->type != BENCODE_DICT && ben->type != BENCODE_LIST ) ) {
+		return;
+	}
+	struct grn_plan_node *next[transforms_n];
+	int next_n;
+	struct bencode *key, *val;
+	size_t pos;
+
+	if ( ben->type == BENCODE_LIST ) {
+		next_n = plan_children( matched, matched_n, NULL, 0, lo, hi, next );
+		if ( next_n == 0 ) {
+			return;
+		}
+		ben_list_for_each( val, pos, ben ) {
+			plan_apply( transforms, transforms_n, val, next, next_n, lo, hi, out_err );
+			ERR_FW();
+		}
+	} else if ( plan_wildcard_below( matched, matched_n, lo, hi ) ) {
+		ben_dict_for_each( key, val, pos, ben ) {
+			bool str_key = key->type == BENCODE_STR;
+			next_n = plan_children( matched, matched_n, str_key ? ben_str_val( key ) : NULL, str_key ? ben_str_len( key ) : 0, lo, hi, next );
+			if ( next_n > 0 ) {
+				plan_apply( transforms, transforms_n, val, next, next_n, lo, hi, out_err );
+				ERR_FW();
+			}
+		}
+	} else {
+		// only named keys, so they can be looked up instead of going through the whole dictionary
+		for ( int i = 0; i < matched_n; i++ ) {
+			for ( int j = 0; j < matched[i]->children_n; j++ ) {
+				struct grn_plan_node *child = matched[i]->children[j];
+				if ( plan_first_op( child->reach, child->reach_n, lo, hi ) == -1 || plan_key_seen( matched, i, j, lo, hi ) ) {
+					continue;
+				}
+				val = ben_dict_get_by_hashed_str( ben, child->key, child->key_n, child->key_hash );
+				if ( val == NULL ) {
+					continue;
+				}
+				next_n = plan_children( matched, matched_n, child->key, child->key_n, lo, hi, next );
+				plan_apply( transforms, transforms_n, val, next, next_n, lo, hi, out_err );
+				ERR_FW();
 			}
 		}
 	}
+}
+
+void grn_ctx_set_plan( struct grn_ctx *ctx, struct grn_plan *plan ) {
+	assert( ctx->plan == NULL );
+	assert( plan->transforms_n == ctx->transforms_n );
+	ctx->plan = plan;
+}
+
+// compiles a plan for the context's transforms, unless it was given one
+void plan_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( ctx->plan != NULL ) {
+		return;
+	}
+	ctx->plan = grn_plan_compile( ctx->transforms, ctx->transforms_n, out_err );
+	ERR_FW();
+	ctx->plan_owned = true;
+}
+
+// END transform plans
+
+// BEGIN file sources
+
+// files a source can be found ahead of the one being processed, by default
+#define SOURCE_AHEAD_DEFAULT 4096
+
+/**
+ * Paths pushed on one thread and processed by a context on others. They're kept in a ring with one slot more than
+ * can be found ahead, because the file being processed keeps its path until the context moves on.
+ */
+struct grn_source {
+	pthread_mutex_t lock; // guards everything below
+	pthread_cond_t cond; // broadcast whenever a path is pushed or let go of, or either side is done
+	struct grn_path *paths;
+	int cap; // slots in paths
+	int n; // paths pushed so far. Path i is in slot i % cap.
+	int c; // the file the context is processing. The blocks only paths before it were in have been released.
+	struct grn_paths *pool; // where the paths in the ring are stored
+	bool closed; // nothing more will be pushed
+	bool abandoned; // the context was freed, so nothing more will be processed
+	int refs; // the pusher's and the context's. Freed when both are gone.
+	// files the cache says are done are dropped before they ever get a slot
+	struct grn_cache *cache;
+	uint64_t cache_hash;
+	int cached_n;
+};
+
+struct grn_source *grn_source_alloc( int ahead_n, int *out_err ) {
+	*out_err = GRN_OK;
 
-	free( ctx->buffer );
-	ctx->buffer = ben_encode_grn( main_dict, &ctx->buffer_n, out_err );
+	struct grn_source *source = calloc( 1, sizeof( struct grn_source ) );
+	ERR_NULL( source == NULL, GRN_ERR_OOM );
+	source->cap = ( ahead_n > 0 ? ahead_n : SOURCE_AHEAD_DEFAULT ) + 1;
+	source->c = -1;
+	source->refs = 1;
+	source->paths = calloc( source->cap, sizeof( struct grn_path ) );
+	if ( source->paths == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	source->pool = grn_paths_alloc( out_err );
 	ERR_FW_CLEANUP();
-	GRN_LOG_DEBUG( "Newly encoded file size: %d", ( int )ctx->buffer_n );
-	goto cleanup;
+	if ( pthread_mutex_init( &source->lock, NULL ) ) {
+		*out_err = GRN_ERR_THREAD;
+		goto cleanup;
+	}
+	if ( pthread_cond_init( &source->cond, NULL ) ) {
+		pthread_mutex_destroy( &source->lock );
+		*out_err = GRN_ERR_THREAD;
+		goto cleanup;
+	}
+	return source;
+
 cleanup:
-	if ( main_dict != NULL ) {
-		ben_free( main_dict );
+	grn_paths_free( source->pool );
+	grn_free( source->paths );
+	free( source );
+	return NULL;
+}
+
+// drop a reference, freeing the source and its paths if it was the last
+void source_release( struct grn_source *source ) {
+	pthread_mutex_lock( &source->lock );
+	bool last = --source->refs == 0;
+	pthread_mutex_unlock( &source->lock );
+	if ( !last ) {
+		return;
 	}
-	vector_free( f_traversing );
-	vector_free( f_to_traverse );
-	return;
+
+	pthread_mutex_destroy( &source->lock );
+	pthread_cond_destroy( &source->cond );
+	grn_paths_free( source->pool );
+	free( source->paths );
+	free( source );
+}
+
+void source_abandon( struct grn_source *source ) {
+	pthread_mutex_lock( &source->lock );
+	source->abandoned = true;
+	pthread_cond_broadcast( &source->cond );
+	pthread_mutex_unlock( &source->lock );
 }
 
 /**
- * Truncates the file and opens in writing mode.
+ * Push the file name in dir, copying it into the source's storage, so nothing has to be allocated for it on its own.
+ * @param dir not NUL terminated. Gets a slash after it unless it's empty or already ends with one.
  */
-void freopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+void source_push_in( struct grn_source *source, const char *dir, size_t dir_n, const char *name, size_t name_n, int *out_err ) {
 	*out_err = GRN_OK;
-	// it will get fclosed by the caller with grn_ctx_free
-	ctx->fh = freopen( ctx->files[ctx->files_c], "wb", ctx->fh );
-	ERR( ctx->fh == NULL, GRN_ERR_FS_OPEN );
+
+#ifndef _WIN32
+	// grn_ctx_set_cache sets the cache from the context's thread, so it's only read under the lock. The file is stat'ed
+	// without it, since that's the slow part, into a path of our own in case several threads push at once.
+	pthread_mutex_lock( &source->lock );
+	bool cached = source->cache != NULL;
+	pthread_mutex_unlock( &source->lock );
+	struct stat st;
+	bool stated = false;
+	if ( cached ) {
+		char path[GRN_PATH_MAX];
+		bool slash = dir_n > 0 && dir[dir_n - 1] != '/';
+		if ( dir_n + slash + name_n < sizeof( path ) ) {
+			memcpy( path, dir, dir_n );
+			path[dir_n] = '/';
+			memcpy( path + dir_n + slash, name, name_n + 1 );
+			stated = stat( path, &st ) == 0;
+		}
+	}
+#endif
+	pthread_mutex_lock( &source->lock );
+#ifndef _WIN32
+	if ( stated && grn_cache_fresh( source->cache, cache_key( &st ), source->cache_hash ) ) {
+		source->cached_n++;
+		pthread_mutex_unlock( &source->lock );
+		return;
+	}
+#endif
+	// the slot is free once the context has moved past the path that was in it
+	while ( source->n - source->cap >= source->c && !source->abandoned ) {
+		pthread_cond_wait( &source->cond, &source->lock );
+	}
+	if ( source->abandoned ) {
+		pthread_mutex_unlock( &source->lock );
+		ERR( GRN_ERR_USER_CANCELLED );
+	}
+	// the context releases blocks under the lock too
+	source->paths[source->n % source->cap] = grn_paths_add( source->pool, dir, dir_n, name, name_n, out_err );
+	if ( *out_err == GRN_OK ) {
+		source->n++;
+		pthread_cond_broadcast( &source->cond );
+	}
+	pthread_mutex_unlock( &source->lock );
 }
 
-// cleanup after a potentially failed single file then proceed to the next file
-void next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
+void grn_source_push( struct grn_source *source, char *path, int *out_err ) {
+	const char *name = strrchr( path, '/' );
+	name = name != NULL ? name + 1 : path;
+	source_push_in( source, path, name - path, name, strlen( name ), out_err );
+	free( path );
+}
+
+void grn_source_close( struct grn_source *source ) {
+	pthread_mutex_lock( &source->lock );
+	source->closed = true;
+	pthread_cond_broadcast( &source->cond );
+	pthread_mutex_unlock( &source->lock );
+	source_release( source );
+}
+
+void grn_ctx_set_source( struct grn_ctx *ctx, struct grn_source *source ) {
+	assert( ctx->files == NULL && ctx->source == NULL );
+	pthread_mutex_lock( &source->lock );
+	source->refs++;
+	pthread_mutex_unlock( &source->lock );
+	ctx->source = source;
+	ctx->files = source->paths;
+	ctx->files_cap = source->cap;
+}
+
+const struct grn_path *file_path_ctx( const struct grn_ctx *ctx, int i ) {
+	return &ctx->files[ctx->files_cap ? i % ctx->files_cap : i];
+}
+
+// the whole path of file i, in ctx->path. Empty if it's too long to open, so opening it fails.
+char *path_ctx( struct grn_ctx *ctx, int i ) {
+	if ( !grn_path_join( *file_path_ctx( ctx, i ), ctx->path, sizeof( ctx->path ) ) ) {
+		ctx->path[0] = '\0';
+	}
+	return ctx->path;
+}
+
+// whether there's a file i, waiting for it to be found if there's a source that's still open
+bool file_wait_ctx( struct grn_ctx *ctx, int i ) {
+	struct grn_source *source = ctx->source;
+	if ( source == NULL ) {
+		return i < ctx->files_n;
+	}
+	pthread_mutex_lock( &source->lock );
+	while ( i >= source->n && !source->closed && !source->abandoned ) {
+		pthread_cond_wait( &source->cond, &source->lock );
+	}
+	bool found = i < source->n;
+	pthread_mutex_unlock( &source->lock );
+	return found;
+}
+
+// the number of files found so far, without waiting for more
+int files_known_ctx( struct grn_ctx *ctx ) {
+	struct grn_source *source = ctx->source;
+	if ( source == NULL ) {
+		return ctx->files_n;
+	}
+	pthread_mutex_lock( &source->lock );
+	int known_n = source->n;
+	pthread_mutex_unlock( &source->lock );
+	return known_n;
+}
+
+// the context moved on to file i, so the slot before it can make room for another
+void file_advance_ctx( struct grn_ctx *ctx, int i ) {
+	struct grn_source *source = ctx->source;
+	if ( source == NULL ) {
+		return;
+	}
+	pthread_mutex_lock( &source->lock );
+	// later paths are never in earlier blocks
+	if ( i > 0 ) {
+		grn_paths_release( source->pool, file_path_ctx( ctx, i - 1 )->block );
+	}
+	source->c = i;
+	pthread_cond_broadcast( &source->cond );
+	pthread_mutex_unlock( &source->lock );
+}
+
+// END file sources
+
+// BEGIN scan cache
+
+// FNV-1a, continuing from hash. Includes the NUL, so consecutive strings can't run together.
+uint64_t hash_str( uint64_t hash, const char *str ) {
+	if ( str == NULL ) {
+		return hash * 0x100000001B3ULL;
+	}
+	do {
+		hash = ( hash ^ ( unsigned char ) *str ) * 0x100000001B3ULL;
+	} while ( *str++ != '\0' );
+	return hash;
+}
+
+// identifies what the transforms do, so a file done by different ones isn't skipped
+uint64_t transforms_hash( const struct grn_transform *transforms, int transforms_n ) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for ( int i = 0; i < transforms_n; i++ ) {
+		const struct grn_transform *transform = &transforms[i];
+		hash = ( hash ^ transform->operation ) * 0x100000001B3ULL;
+		for ( int j = 0; transform->key[j] != NULL; j++ ) {
+			hash = hash_str( hash, transform->key[j] );
+		}
+		hash = hash_str( hash, NULL );
+		const union grn_transform_payload *payload = &transform->payload;
+		switch ( transform->operation ) {
+			case GRN_TRANSFORM_DELETE:
+				hash = hash_str( hash, payload->delete_.key );
+				break;
+			case GRN_TRANSFORM_SET_STRING:
+				hash = hash_str( hash, payload->set_string.key );
+				hash = hash_str( hash, payload->set_string.val );
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE:
+				hash = hash_str( hash, payload->substitute.find );
+				hash = hash_str( hash, payload->substitute.replace );
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+				hash = hash_str( hash, payload->substitute_regex.find_str );
+				hash = hash_str( hash, payload->substitute_regex.replace );
+				break;
+		}
+	}
+	return hash;
+}
+
+#ifndef _WIN32
+struct grn_cache_key cache_key( const struct stat *st ) {
+	return ( struct grn_cache_key ) {
+		.dev = st->st_dev,
+		.ino = st->st_ino,
+		.size = st->st_size,
+		.mtime_ns = ( int64_t ) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+		.ctime_ns = ( int64_t ) st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec,
+	};
+}
+#endif
+
+void grn_ctx_set_cache( struct grn_ctx *ctx, const char *path, int *out_err ) {
+	*out_err = GRN_OK;
+
+#ifndef _WIN32
+	assert( ctx->cache == NULL );
+	assert( ctx->files_c == -1 );
+	ctx->cache = grn_cache_load( path, out_err );
+	ERR_FW();
+	ctx->cache_hash = transforms_hash( ctx->transforms, ctx->transforms_n );
+	if ( ctx->source != NULL ) {
+		pthread_mutex_lock( &ctx->source->lock );
+		ctx->source->cache = ctx->cache;
+		ctx->source->cache_hash = ctx->cache_hash;
+		pthread_mutex_unlock( &ctx->source->lock );
+		return;
+	}
+
+	int kept_n = 0;
+	for ( int i = 0; i < ctx->files_n; i++ ) {
+		struct stat st;
+		// files that can't be stat'ed are left to fail the normal way
+		if ( stat( path_ctx( ctx, i ), &st ) == 0 && grn_cache_fresh( ctx->cache, cache_key( &st ), ctx->cache_hash ) ) {
+			ctx->cached_n++;
+			continue;
+		}
+		ctx->files[kept_n++] = ctx->files[i];
+	}
+	GRN_LOG_DEBUG( "Skipping %d files the cache says are done", ctx->cached_n );
+	ctx->files_n = kept_n;
+#endif
+}
+
+// remember the file that was just reported done, if it didn't fail
+void cache_note_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+#ifndef _WIN32
+	struct stat st;
+	if ( ctx->cache == NULL || ctx->file_error || stat( path_ctx( ctx, ctx->files_c ), &st ) ) {
+		return;
+	}
+	// files being pushed are checked against the cache at the same time
+	if ( ctx->source != NULL ) {
+		pthread_mutex_lock( &ctx->source->lock );
+	}
+	grn_cache_record( ctx->cache, cache_key( &st ), ctx->cache_hash, out_err );
+	if ( ctx->source != NULL ) {
+		pthread_mutex_unlock( &ctx->source->lock );
+	}
+#endif
+}
+
+// END scan cache
+
+// BEGIN raw transforms
+// Substitutions and deletions only touch a few strings and dictionary entries, so they can be done
+// right on the bencoded bytes instead of decoding the whole file into a tree. Files with anything this
+// doesn't understand, malformed ones included, go through the decode path so errors stay the same.
+
+#define RAW_INVALID ( ( size_t ) -1 )
+
+// a pending edit to a range of the original buffer
+struct raw_patch {
+	size_t off;
+	size_t len;
+	char *val; // the new value of the string at off, or NULL to delete the range
+};
+
+// the same checks as read_long_long in bencode.c
+bool raw_read_ll( const char *buf, size_t buf_n, size_t *off, char term, long long *ll ) {
+	const char *term_p = memchr( buf + *off, term, buf_n - *off );
+	if ( term_p == NULL ) {
+		return false;
+	}
+	size_t slen = term_p - ( buf + *off );
+	char num[21]; // fits all 64 bit integers
+	if ( slen == 0 || slen >= sizeof( num ) ) {
+		return false;
+	}
+	memcpy( num, buf + *off, slen );
+	num[slen] = '\0';
+	if ( num[0] != '-' && !isdigit( ( unsigned char ) num[0] ) ) {
+		return false;
+	}
+
+	char *endptr;
+	errno = 0;
+	*ll = strtoll( num, &endptr, 10 );
+	if ( errno == ERANGE || *endptr != '\0' ) {
+		return false;
+	}
+	// only one encoding is allowed for each integer
+	if ( ( num[0] == '-' && num[1] == '0' ) || ( num[0] == '0' && slen != 1 ) ) {
+		return false;
+	}
+	*off += slen + 1;
+	return true;
+}
+
+// parses the length prefix of the string at off and returns the offset of its contents
+size_t raw_str( const char *buf, size_t buf_n, size_t off, size_t *str_n ) {
+	long long ll;
+	if ( !raw_read_ll( buf, buf_n, &off, ':', &ll ) || ll < 0 || ( unsigned long long ) ll > buf_n - off ) {
+		return RAW_INVALID;
+	}
+	*str_n = ll;
+	return off;
+}
+
+// one value of a file indexed by raw_index
+struct raw_token {
+	size_t off; // where the value starts
+	size_t end; // just past the value
+	size_t next; // index of the token after this value and everything inside of it
+};
+
+// the values of a file in the order they start in, so a container's children directly follow it
+struct raw_tape {
+	struct raw_token *tokens;
+	size_t n;
+	size_t allocated;
+};
+
+// a list or dictionary raw_index is inside of
+struct raw_frame {
+	size_t token;
+	bool dict;
+	bool want_key; // dictionaries alternate between keys and values
+	// the previous key, which the next one has to sort after. RAW_INVALID before the first one.
+	size_t key_off;
+	size_t key_n;
+};
+
+/**
+ * Validate the value at the start of buf like ben_decode would, and index every value in it in the same pass.
+ * Where a value starts only follows from the length prefix of the string before it, so the scan can't be split up,
+ * but nothing has to be parsed twice to find things in the file afterwards.
+ * @param tape NULL to only validate, which doesn't allocate anything
+ * @param end where to put the offset just past the value
+ * @return false if the file has anything raw transforms don't understand, or is malformed
+ */
+bool raw_index( const char *buf, size_t buf_n, struct raw_tape *tape, size_t *end, int *out_err ) {
 	*out_err = GRN_OK;
 
-	GRN_LOG_DEBUG( "Next: file %d to %d", ctx->files_c, ctx->files_c + 1 );
-	ctx->files_c++;
+	struct raw_frame frames[256];
+	int depth = 0;
+	size_t off = 0;
+	if ( tape != NULL ) {
+		tape->n = 0;
+	}
+
+	do {
+		if ( off >= buf_n ) {
+			return false;
+		}
+		struct raw_frame *frame = depth > 0 ? &frames[depth - 1] : NULL;
+		if ( frame != NULL && buf[off] == 'e' ) {
+			// a key without a value
+			if ( frame->dict && !frame->want_key ) {
+				return false;
+			}
+			if ( tape != NULL ) {
+				tape->tokens[frame->token].end = off + 1;
+				tape->tokens[frame->token].next = tape->n;
+			}
+			off++;
+			depth--;
+			if ( depth > 0 && frames[depth - 1].dict ) {
+				frames[depth - 1].want_key = !frames[depth - 1].want_key;
+			}
+			continue;
+		}
+		// the same limit as the decoder
+		if ( depth >= 256 ) {
+			return false;
+		}
+
+		size_t i = 0;
+		struct raw_token *token = NULL;
+		if ( tape != NULL ) {
+			if ( tape->n == tape->allocated ) {
+				size_t allocated = tape->allocated ? tape->allocated * 2 : buf_n / 16 + 16;
+				struct raw_token *tokens = realloc( tape->tokens, allocated * sizeof( struct raw_token ) );
+				if ( tokens == NULL ) {
+					*out_err = GRN_ERR_OOM;
+					return false;
+				}
+				tape->tokens = tokens;
+				tape->allocated = allocated;
+			}
+			i = tape->n++;
+			token = &tape->tokens[i];
+			token->off = off;
+		}
+		bool key = frame != NULL && frame->dict && frame->want_key;
+		char c = buf[off];
+		// integer keys are allowed by the decoder, but they're not worth handling here
+		if ( key && !isdigit( ( unsigned char ) c ) ) {
+			return false;
+		}
+
+		if ( c == 'l' || c == 'd' ) {
+			frames[depth++] = ( struct raw_frame ) {
+				.token = i,
+				.dict = c == 'd',
+				.want_key = true,
+				.key_off = RAW_INVALID,
+			};
+			off++;
+			continue;
+		}
+		if ( c == 'i' ) {
+			long long ll;
+			off++;
+			if ( !raw_read_ll( buf, buf_n, &off, 'e', &ll ) ) {
+				return false;
+			}
+		} else if ( isdigit( ( unsigned char ) c ) ) {
+			size_t str_n = 0;
+			size_t str_off = raw_str( buf, buf_n, off, &str_n );
+			if ( str_off == RAW_INVALID ) {
+				return false;
+			}
+			// keys must be strictly increasing
+			if ( key && frame->key_off != RAW_INVALID ) {
+				int cmp = memcmp( buf + frame->key_off, buf + str_off, frame->key_n < str_n ? frame->key_n : str_n );
+				if ( cmp > 0 || ( cmp == 0 && frame->key_n >= str_n ) ) {
+					return false;
+				}
+			}
+			if ( key ) {
+				frame->key_off = str_off;
+				frame->key_n = str_n;
+			}
+			off = str_off + str_n;
+		} else {
+			// booleans and user types
+			return false;
+		}
+		if ( token != NULL ) {
+			token->end = off;
+			token->next = i + 1;
+		}
+		if ( frame != NULL && frame->dict ) {
+			frame->want_key = !frame->want_key;
+		}
+	} while ( depth > 0 );
+	*end = off;
+	return true;
+}
+
+// the rest of the raw functions assume the buffer has already been indexed by raw_index
+
+/**
+ * Find the entry for key in the dictionary token d.
+ * @return the index of the entry's key token, whose value is the token after it, or RAW_INVALID
+ */
+size_t raw_dict_find( const char *buf, const struct raw_token *tokens, size_t d, const char *key, size_t key_n ) {
+	assert( buf[tokens[d].off] == 'd' );
+
+	for ( size_t k = d + 1; k < tokens[d].next; k = tokens[k + 1].next ) {
+		size_t str_n = 0;
+		size_t str_off = raw_str( buf, tokens[k].end, tokens[k].off, &str_n );
+		if ( str_n == key_n && memcmp( buf + str_off, key, key_n ) == 0 ) {
+			return k;
+		}
+	}
+	return RAW_INVALID;
+}
+
+bool raw_is_deleted( struct vector *patches, size_t off ) {
+	for ( int i = 0; i < ( int ) vector_length( patches ); i++ ) {
+		struct raw_patch *patch = vector_get( patches, i );
+		if ( patch->val == NULL && off >= patch->off && off < patch->off + patch->len ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// the patch replacing the string at off, if it was already substituted
+struct raw_patch *raw_find_patch( struct vector *patches, size_t off ) {
+	for ( int i = 0; i < ( int ) vector_length( patches ); i++ ) {
+		struct raw_patch *patch = vector_get( patches, i );
+		if ( patch->val != NULL && patch->off == off ) {
+			return patch;
+		}
+	}
+	return NULL;
+}
+
+// same as transform_buffer_single for the value token t, but records patches instead of modifying anything
+void raw_transform_single( const char *buf, size_t buf_n, const struct raw_token *tokens, size_t t, struct grn_transform transform, struct vector *patches, int *out_err ) {
+	*out_err = GRN_OK;
+
+	size_t off = tokens[t].off;
+	GRN_LOG_DEBUG( "Executing raw transform, %d", transform.operation );
+	switch ( transform.operation ) {
+		case GRN_TRANSFORM_DELETE:
+			;
+			if ( buf[off] != 'd' ) {
+				break;
+			}
+			const char *key = transform.payload.delete_.key;
+			size_t key_t = raw_dict_find( buf, tokens, t, key, strlen( key ) );
+			if ( key_t == RAW_INVALID || raw_is_deleted( patches, tokens[key_t + 1].off ) ) {
+				break;
+			}
+			struct raw_patch deletion = {
+				.off = tokens[key_t].off,
+				.len = tokens[key_t + 1].end - tokens[key_t].off,
+				.val = NULL,
+			};
+			vector_push( patches, &deletion, out_err );
+			ERR_FW();
+			break;
+		case GRN_TRANSFORM_SUBSTITUTE:
+		case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+			;
+			if ( !isdigit( ( unsigned char ) buf[off] ) ) {
+				break;
+			}
+			size_t str_n = 0;
+			size_t str_off = raw_str( buf, buf_n, off, &str_n );
+
+			// substitutions by earlier transforms have to be built on
+			struct raw_patch *patch = raw_find_patch( patches, off );
+			char *haystack;
+			if ( patch != NULL ) {
+				haystack = patch->val;
+			} else {
+				haystack = malloc( str_n + 1 );
+				ERR( haystack == NULL, GRN_ERR_OOM );
+				memcpy( haystack, buf + str_off, str_n );
+				haystack[str_n] = '\0';
+			}
+
+			char *substituted;
+			if ( transform.operation == GRN_TRANSFORM_SUBSTITUTE ) {
+				struct grn_op_substitute payload = transform.payload.substitute;
+				GRN_LOG_DEBUG( "Substituting %s for %s", payload.find, payload.replace );
+				substituted = strsubst( haystack, payload.find, payload.replace, out_err );
+			} else {
+				struct grn_op_substitute_regex payload = transform.payload.substitute_regex;
+				substituted = regsubst( haystack, &payload.find, payload.dfa, payload.replace, false, out_err );
+			}
+			if ( patch == NULL ) {
+				free( haystack );
+			}
+			ERR_FW();
+
+			if ( patch != NULL ) {
+				free( patch->val );
+				patch->val = substituted;
+				break;
+			}
+			if ( strlen( substituted ) == str_n && memcmp( substituted, buf + str_off, str_n ) == 0 ) {
+				free( substituted );
+				break;
+			}
+			struct raw_patch substitution = {
+				.off = off,
+				.len = str_off + str_n - off,
+				.val = substituted,
+			};
+			vector_push( patches, &substitution, out_err );
+			if ( *out_err ) {
+				free( substituted );
+				return;
+			}
+			break;
+		default:
+			;
+			assert( false );
+			break;
+	}
+}
+
+// what the raw versions of the plan functions work on
+struct raw_walk {
+	const struct grn_transform *transforms;
+	int transforms_n;
+	const char *buf;
+	size_t buf_n;
+	const struct raw_token *tokens;
+	struct vector *patches;
+};
+
+void raw_plan_descend( struct raw_walk *walk, size_t t, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err );
+
+// same as plan_apply, for the value token t
+void raw_plan_apply( struct raw_walk *walk, size_t t, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err ) {
+	*out_err = GRN_OK;
+
+	while ( lo < hi ) {
+		int op = plan_next_op( matched, matched_n, lo, hi );
+		raw_plan_descend( walk, t, matched, matched_n, lo, op == -1 ? hi : op, out_err );
+		ERR_FW();
+		if ( op == -1 ) {
+			break;
+		}
+		raw_transform_single( walk->buf, walk->buf_n, walk->tokens, t, walk->transforms[op], walk->patches, out_err );
+		ERR_FW();
+		lo = op + 1;
+	}
+}
+
+// same as plan_descend, skipping entries deleted so far
+void raw_plan_descend( struct raw_walk *walk, size_t t, struct grn_plan_node **matched, int matched_n, int lo, int hi, int *out_err ) {
+	*out_err = GRN_OK;
+
+	const char *buf = walk->buf;
+	const struct raw_token *tokens = walk->tokens;
+	char type = buf[tokens[t].off];
+	if ( lo >= hi || ( type != 'd' && type != 'l' ) ) {
+		return;
+	}
+	struct grn_plan_node *next[walk->transforms_n];
+	int next_n;
+
+	if ( type == 'l' ) {
+		next_n = plan_children( matched, matched_n, NULL, 0, lo, hi, next );
+		if ( next_n == 0 ) {
+			return;
+		}
+		for ( size_t c = t + 1; c < tokens[t].next; c = tokens[c].next ) {
+			raw_plan_apply( walk, c, next, next_n, lo, hi, out_err );
+			ERR_FW();
+		}
+	} else if ( plan_wildcard_below( matched, matched_n, lo, hi ) ) {
+		for ( size_t k = t + 1; k < tokens[t].next; k = tokens[k + 1].next ) {
+			if ( raw_is_deleted( walk->patches, tokens[k + 1].off ) ) {
+				continue;
+			}
+			size_t key_n = 0;
+			size_t key_off = raw_str( buf, tokens[k].end, tokens[k].off, &key_n );
+			next_n = plan_children( matched, matched_n, buf + key_off, key_n, lo, hi, next );
+			if ( next_n > 0 ) {
+				raw_plan_apply( walk, k + 1, next, next_n, lo, hi, out_err );
+				ERR_FW();
+			}
+		}
+	} else {
+		for ( int i = 0; i < matched_n; i++ ) {
+			for ( int j = 0; j < matched[i]->children_n; j++ ) {
+				struct grn_plan_node *child = matched[i]->children[j];
+				if ( plan_first_op( child->reach, child->reach_n, lo, hi ) == -1 || plan_key_seen( matched, i, j, lo, hi ) ) {
+					continue;
+				}
+				size_t key_t = raw_dict_find( buf, tokens, t, child->key, child->key_n );
+				if ( key_t == RAW_INVALID || raw_is_deleted( walk->patches, tokens[key_t + 1].off ) ) {
+					continue;
+				}
+				next_n = plan_children( matched, matched_n, child->key, child->key_n, lo, hi, next );
+				raw_plan_apply( walk, key_t + 1, next, next_n, lo, hi, out_err );
+				ERR_FW();
+			}
+		}
+	}
+}
+
+int raw_patch_cmp( const void *a, const void *b ) {
+	const struct raw_patch *patch_a = a, *patch_b = b;
+	return ( patch_a->off > patch_b->off ) - ( patch_a->off < patch_b->off );
+}
+
+// splice the patches into the original buffer to make the output
+void raw_output_ctx( struct grn_ctx *ctx, size_t top_end, struct vector *patches, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->out_iov == NULL );
+
+	int patches_n = vector_length( patches );
+	qsort( patches->buffer, patches_n, sizeof( struct raw_patch ), raw_patch_cmp );
+
+	size_t scratch_n = 1;
+	for ( int i = 0; i < patches_n; i++ ) {
+		struct raw_patch *patch = vector_get( patches, i );
+		if ( patch->val != NULL ) {
+			scratch_n += 21 + 1 + strlen( patch->val );
+		}
+	}
+	ctx->out_scratch = malloc( scratch_n );
+	ERR( ctx->out_scratch == NULL, GRN_ERR_OOM );
+	ctx->out_iov = malloc( ( 2 * patches_n + 1 ) * sizeof( struct ben_iovec ) );
+	ERR( ctx->out_iov == NULL, GRN_ERR_OOM );
+
+	char *scratch = ctx->out_scratch;
+	size_t cursor = 0;
+	for ( int i = 0; i < patches_n; i++ ) {
+		struct raw_patch *patch = vector_get( patches, i );
+		// inside of something that was deleted
+		if ( patch->off < cursor ) {
+			continue;
+		}
+		if ( patch->off > cursor ) {
+			ctx->out_iov[ctx->out_iov_n++] = ( struct ben_iovec ) {
+				.base = ctx->buffer + cursor,
+				.len = patch->off - cursor,
+			};
+		}
+		if ( patch->val != NULL ) {
+			size_t val_n = strlen( patch->val );
+			int prefix_n = sprintf( scratch, "%lu:", ( unsigned long ) val_n );
+			memcpy( scratch + prefix_n, patch->val, val_n );
+			ctx->out_iov[ctx->out_iov_n++] = ( struct ben_iovec ) {
+				.base = scratch,
+				.len = prefix_n + val_n,
+			};
+			scratch += prefix_n + val_n;
+		}
+		cursor = patch->off + patch->len;
+	}
+	if ( top_end > cursor ) {
+		ctx->out_iov[ctx->out_iov_n++] = ( struct ben_iovec ) {
+			.base = ctx->buffer + cursor,
+			.len = top_end - cursor,
+		};
+	}
+	for ( size_t i = 0; i < ctx->out_iov_n; i++ ) {
+		ctx->out_n += ctx->out_iov[i].len;
+	}
+}
+
+// a quick check on the whole file for whether any transform could change it. Strings are contiguous in the file,
+// so anything a transform looks for inside one of them has to be somewhere in it.
+bool raw_might_change( const struct grn_ctx *ctx ) {
+	const char *buf = ctx->buffer;
+	size_t buf_n = ctx->buffer_n;
+	for ( int i = 0; i < ctx->transforms_n; i++ ) {
+		const union grn_transform_payload *payload = &ctx->transforms[i].payload;
+		const char *needle;
+		switch ( ctx->transforms[i].operation ) {
+			case GRN_TRANSFORM_DELETE:
+				needle = payload->delete_.key;
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE:
+				needle = payload->substitute.find;
+				break;
+			case GRN_TRANSFORM_SUBSTITUTE_REGEX:
+				;
+				const struct grn_dfa *dfa = payload->substitute_regex.dfa;
+				if ( dfa == NULL || grn_dfa_might_match( dfa, buf, buf_n ) ) {
+					return true;
+				}
+				continue;
+			default:
+				// setting a string changes files that don't have it at all
+				return true;
+		}
+		size_t needle_n = strlen( needle );
+		if ( needle_n == 0 || grn_contains( buf, buf_n, needle, needle_n ) ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Apply the transforms directly to the bencoded buffer, without decoding it.
+ * @return false if the file has to go through the decode path instead. In that case, nothing was done.
+ */
+bool transform_buffer_raw( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	for ( int i = 0; i < ctx->transforms_n; i++ ) {
+		// inserting keys in the right place is left to the decode path
+		if ( ctx->transforms[i].operation == GRN_TRANSFORM_SET_STRING ) {
+			return false;
+		}
+	}
+	const char *buf = ctx->buffer;
+	size_t buf_n = ctx->buffer_n;
+	struct vector *patches = NULL;
+	struct raw_tape tape = { 0 };
+	size_t top_end;
+	bool indexed = raw_index( buf, buf_n, &tape, &top_end, out_err );
+	if ( *out_err ) {
+		free( tape.tokens );
+		return true;
+	}
+	if ( !indexed ) {
+		GRN_LOG_DEBUG( "Falling back to decoding the file%s", "" );
+		free( tape.tokens );
+		return false;
+	}
+
+	patches = vector_alloc( sizeof( struct raw_patch ), out_err );
+	ERR_FW_CLEANUP();
+
+	struct raw_walk walk = {
+		.transforms = ctx->transforms,
+		.transforms_n = ctx->transforms_n,
+		.buf = buf,
+		.buf_n = buf_n,
+		.tokens = tape.tokens,
+		.patches = patches,
+	};
+	struct grn_plan_node *root = &ctx->plan->root;
+	raw_plan_apply( &walk, 0, &root, 1, 0, ctx->transforms_n, out_err );
+	ERR_FW_CLEANUP();
+
+	raw_output_ctx( ctx, top_end, patches, out_err );
+	ERR_FW_CLEANUP();
+	GRN_LOG_DEBUG( "Raw patched file size: %d, in %d chunks", ( int )ctx->out_n, ( int )ctx->out_iov_n );
+	goto cleanup;
+cleanup:
+	if ( patches != NULL ) {
+		for ( int i = 0; i < ( int ) vector_length( patches ); i++ ) {
+			free( ( ( struct raw_patch * ) vector_get( patches, i ) )->val );
+		}
+	}
+	vector_free( patches );
+	free( tape.tokens );
+	return true;
+}
+
+// END raw transforms
+
+/**
+ * Whether a value might be reached by one of the transforms, following their keys. Everything else is left
+ * undecoded (for example the info dictionary, with all its piece hashes) and copied to the output as-is.
+ * @param arg the grn_ctx
+ */
+int transforms_reach( void *arg, const struct bencode *const *path, int path_n ) {
+	struct grn_ctx *ctx = arg;
+	return plan_reaches( &ctx->plan->root, path, path_n );
+}
+
+void transform_buffer( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_TRANSFORM );
+
+	struct bencode *main_dict = NULL;
+
+	// BEGIN SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+	if ( str_ends_with( file_path_ctx( ctx, ctx->files_c )->name, "torrents.state" ) ) {
+		GRN_LOG_DEBUG( "Doing deluge .state transform%s", "" );
+		assert( ctx->transforms[0].operation = GRN_TRANSFORM_SUBSTITUTE_REGEX );
+
+		buffer_to_heap_ctx( ctx, out_err );
+		ERR_FW();
+		// we need to add the null byte so the file is a proper string
+		char *buffer_null = realloc( ctx->buffer, ctx->buffer_n + 1 );
+		// when realloc fails, the original pointer is still valid for free'ing
+		ERR( buffer_null == NULL, GRN_ERR_OOM );
+		ctx->buffer = buffer_null;
+		// it's unintuitive, but because it's zero indexed this is still actually one beyond the previous
+		// length
+		buffer_null[ctx->buffer_n] = '\0';
+
+		struct grn_op_substitute_regex payload = ctx->transforms[0].payload.substitute_regex;
+		size_t substituted_n;
+		char *substituted = regsubst_n( buffer_null, ctx->buffer_n, &payload.find, payload.dfa, payload.replace, true, &substituted_n, out_err );
+		ERR_FW();
+		// intentionally not adding the null byte because there shouldn't be one.
+		set_output_buffer_ctx( ctx, substituted, substituted_n, out_err );
+		ERR_FW();
+		return;
+	}
+	// END SHITTY DELUGE FUCKING SHIT THAT NEEDS TO BE LESIONED
+
+	// most files in a client's directory have nothing the transforms are looking for. Malformed ones still go the long
+	// way, to be reported, and so do ones with trailing garbage, which the normal path cuts off.
+	size_t top_end;
+	if ( !raw_might_change( ctx ) && raw_index( ctx->buffer, ctx->buffer_n, NULL, &top_end, out_err ) && top_end == ctx->buffer_n ) {
+		GRN_LOG_DEBUG( "No transform can change the file%s", "" );
+		ctx->out_unchanged = true;
+		return;
+	}
+	ERR_FW();
+
+	plan_ctx( ctx, out_err );
+	ERR_FW();
+	assert( ctx->plan->transforms_n == ctx->transforms_n );
+	if ( transform_buffer_raw( ctx, out_err ) ) {
+		return;
+	}
+
+	if ( ctx->arena == NULL ) {
+		ctx->arena = ben_arena_new();
+		ERR( ctx->arena == NULL, GRN_ERR_OOM );
+		ctx->arena_owned = true;
+	}
+	// the buffer outlives the tree, so strings don't need copying out of it
+	main_dict = ben_decode_grn( ctx->buffer, ctx->buffer_n, transforms_reach, ctx, ctx->arena, true, out_err );
+	ERR_FW_CLEANUP();
+
+	struct grn_plan_node *root = &ctx->plan->root;
+	plan_apply( ctx->transforms, ctx->transforms_n, main_dict, &root, 1, 0, ctx->transforms_n, out_err );
+	ERR_FW_CLEANUP();
+
+	// untouched parts of the file are copied from the original buffer, which stays around until the next file
+	ctx->out_iov = ben_encode_spliced_grn( main_dict, ctx->buffer, &ctx->out_iov_n, &ctx->out_scratch, &ctx->out_n, out_err );
+	ERR_FW_CLEANUP();
+	GRN_LOG_DEBUG( "Newly encoded file size: %d, in %d chunks", ( int )ctx->out_n, ( int )ctx->out_iov_n );
+	goto cleanup;
+cleanup:
+	if ( main_dict != NULL ) {
+		ben_free( main_dict );
+	}
+	// the encoded output only points into buffer and out_scratch, so the tree's memory can be reused
+	if ( ctx->arena != NULL ) {
+		ben_arena_reset( ctx->arena );
+	}
+	return;
+}
+
+#ifdef _WIN32
+/**
+ * Truncates the file and opens in writing mode.
+ * Windows can't rename over an open file, so it doesn't get the temporary file treatment.
+ */
+void freopen_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	// it will get fclosed by the caller with grn_ctx_free
+	ctx->fh = freopen( path_ctx( ctx, ctx->files_c ), "wb", ctx->fh );
+	ERR( ctx->fh == NULL, GRN_ERR_FS_OPEN );
+}
+#endif
+
+// for timing files. 0 if there's no monotonic clock.
+uint64_t monotonic_ns( void ) {
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	if ( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 ) {
+		return ( uint64_t ) ts.tv_sec * 1000000000 + ( uint64_t ) ts.tv_nsec;
+	}
+#endif
+	return 0;
+}
+
+// cleanup after a potentially failed single file then proceed to the next file
+void next_file_ctx( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+
+	GRN_LOG_DEBUG( "Next: file %d to %d", ctx->files_c, ctx->files_c + 1 );
+	if ( ctx->files_c >= 0 ) {
+		cache_note_ctx( ctx, out_err );
+		ERR_FW();
+	}
+	ctx->files_c++;
+	ctx->file_error = GRN_OK;
+
+	free_buffer_ctx( ctx );
+	free_output_ctx( ctx );
+	discard_tmp_ctx( ctx );
+	// close the previously processing file
+	if ( ctx->fh != NULL ) {
+		// TODO: have a separate GRN_CTX_CLOSE state
+		if ( fclose( ctx->fh ) ) {
+			*out_err = GRN_ERR_FS_CLOSE;
+		}
+		ctx->fh = NULL;
+	}
+	file_advance_ctx( ctx, ctx->files_c );
+
+	// are we done?
+	if ( !file_wait_ctx( ctx, ctx->files_c ) ) {
+		ctx->state = GRN_CTX_DONE;
+		sync_batch_ctx( ctx );
+		return;
+	}
+
+	// prepare the next file for reading
+	ctx->c_started_ns = monotonic_ns();
+	ERR( ( ctx->fh = fopen( path_ctx( ctx, ctx->files_c ), "rb" ) ) == NULL, GRN_ERR_FS_OPEN );
+	ctx->state = GRN_CTX_READ;
+}
+
+// BEGIN worker pool
+
+// files waiting between two stages of a pipeline
+struct pipe_queue {
+	struct grn_ctx **files;
+	int cap;
+	int head;
+	int n;
+	bool closed; // nothing more will be pushed
+	pthread_cond_t cond; // broadcast whenever a file is pushed or popped, the queue is closed, or the pool stops
+};
+
+/**
+ * Workers claim files in order and run each through the normal state machine on a private context,
+ * so the only things they share with the main context are the (read-only) files and transforms.
+ * The main context then "completes" files strictly in order as their results come in.
+ *
+ * In a pipeline, the state machine of each file is split between threads instead: a reader opens and reads
+ * files in order, transformers transform them, and a writer writes them, with bounded queues in between so
+ * only a few files are in memory at once. Results come in the same way.
+ */
+struct grn_pool {
+	pthread_t *threads;
+	int threads_n; // the number of threads actually started
+	pthread_mutex_t lock; // guards everything below, queues included
+	pthread_cond_t done_cond;
+	int next_i; // the next file to be claimed by a worker
+	struct pipe_queue read_q; // read, waiting to be transformed
+	struct pipe_queue write_q; // transformed, waiting to be written
+	int transformers_left; // the write queue is closed once they've all stopped
+	int results_n; // the length of the per-file arrays. File i goes at i % results_n, which only wraps with a source.
+	bool *done; // per file
+	int *errs; // per file, single-file errors only
+	bool *unchanged; // per file, whether it was left alone because no transform changed it
+	uint64_t *started_ns; // per file, when it was opened
+	int fatal_err; // the first fatal error encountered by any worker. Stops all workers.
+	bool stopping;
+	bool sync_initialized; // whether lock and done_cond need to be destroyed
+};
+
+// a private context for processing only file i, sharing the files and transforms of ctx. Set arena to reuse one.
+struct grn_ctx isolated_ctx( struct grn_ctx *ctx, int i ) {
+	return ( struct grn_ctx ) {
+		.transforms = ctx->transforms,
+		.transforms_n = ctx->transforms_n,
+		.plan = ctx->plan,
+		.files = ctx->files,
+		.files_cap = ctx->files_cap,
+		// so next_file_ctx opens file i, and afterwards goes straight to done
+		.files_c = i - 1,
+		.files_n = i + 1,
+		.state = GRN_CTX_NEXT,
+		// batches are synced once by the main context
+		.sync = ctx->sync == GRN_SYNC_FILE ? GRN_SYNC_FILE : GRN_SYNC_NONE,
+	};
+}
+
+// frees whatever a fatal error left behind on an isolated context
+void free_isolated_ctx( struct grn_ctx *file_ctx ) {
+	free_buffer_ctx( file_ctx );
+	free_output_ctx( file_ctx );
+	discard_tmp_ctx( file_ctx );
+	if ( file_ctx->fh != NULL ) {
+		fclose( file_ctx->fh );
+		file_ctx->fh = NULL;
+	}
+	if ( file_ctx->arena_owned ) {
+		ben_arena_free( file_ctx->arena );
+		file_ctx->arena = NULL;
+		file_ctx->arena_owned = false;
+	}
+}
+
+/**
+ * Close the file of an isolated context that has been run back to GRN_CTX_NEXT.
+ * @param unchanged set to whether the file didn't need to be rewritten
+ * @return the single-file error for this file, if any. Fatal errors go to out_err.
+ */
+int finish_isolated_ctx( struct grn_ctx *file_ctx, bool *unchanged, int *out_err ) {
+	*out_err = GRN_OK;
+
+	int file_err = file_ctx->file_error;
+	// closes the file. Might report a close error.
+	grn_one_step( file_ctx, out_err );
+	if ( file_err == GRN_OK ) {
+		file_err = file_ctx->file_error;
+	}
+	assert( *out_err || file_ctx->state == GRN_CTX_DONE );
+	*unchanged = file_ctx->unchanged_n > 0;
+	free_isolated_ctx( file_ctx );
+	return file_err;
+}
+
+/**
+ * Process a single file on a private context sharing the files and transforms of ctx.
+ * @param arena where to decode the file, so a thread can reuse one. May be NULL.
+ * @param unchanged set to whether the file didn't need to be rewritten
+ * @param started_ns set to when the file was opened
+ * @return the single-file error for this file, if any. Fatal errors go to out_err.
+ */
+int one_file_isolated( struct grn_ctx *ctx, int i, struct ben_arena *arena, bool *unchanged, uint64_t *started_ns, int *out_err ) {
+	*out_err = GRN_OK;
+	*unchanged = false;
+
+	struct grn_ctx file_ctx = isolated_ctx( ctx, i );
+	file_ctx.arena = arena;
+	grn_one_file( &file_ctx, out_err );
+	*started_ns = file_ctx.c_started_ns;
+	if ( *out_err ) {
+		free_isolated_ctx( &file_ctx );
+		return GRN_OK;
+	}
+	return finish_isolated_ctx( &file_ctx, unchanged, out_err );
+}
+
+// record that file i is done, or stop everything on a fatal error. Call with the lock held.
+void pool_done( struct grn_pool *pool, int i, int file_err, bool unchanged, uint64_t started_ns, int fatal_err ) {
+	if ( fatal_err && pool->fatal_err == GRN_OK ) {
+		pool->fatal_err = fatal_err;
+		// wake up any stage waiting on a queue, so it notices
+		pthread_cond_broadcast( &pool->read_q.cond );
+		pthread_cond_broadcast( &pool->write_q.cond );
+	}
+	pool->errs[i % pool->results_n] = file_err;
+	pool->unchanged[i % pool->results_n] = unchanged;
+	pool->started_ns[i % pool->results_n] = started_ns;
+	pool->done[i % pool->results_n] = true;
+	pthread_cond_broadcast( &pool->done_cond );
+}
+
+void *pool_worker( void *arg ) {
+	struct grn_ctx *ctx = arg;
+	struct grn_pool *pool = ctx->pool;
+	int in_err;
+	// if this fails, each file gets an arena of its own
+	struct ben_arena *arena = ben_arena_new();
+
+	while ( true ) {
+		pthread_mutex_lock( &pool->lock );
+		if ( pool->stopping || pool->fatal_err ) {
+			pthread_mutex_unlock( &pool->lock );
+			break;
+		}
+		int i = pool->next_i++;
+		pthread_mutex_unlock( &pool->lock );
+		// the rest of the workers will find there are no more files either
+		if ( !file_wait_ctx( ctx, i ) ) {
+			break;
+		}
+
+		GRN_LOG_DEBUG( "Worker claimed file %d", i );
+		bool unchanged;
+		uint64_t started_ns;
+		int file_err = one_file_isolated( ctx, i, arena, &unchanged, &started_ns, &in_err );
+
+		pthread_mutex_lock( &pool->lock );
+		pool_done( pool, i, file_err, unchanged, started_ns, in_err );
+		pthread_mutex_unlock( &pool->lock );
+	}
+	ben_arena_free( arena );
+	return NULL;
+}
+
+// the pipeline, below
+void *pipe_reader( void *arg );
+void *pipe_transformer( void *arg );
+void *pipe_writer( void *arg );
+bool pipe_queue_init( struct pipe_queue *queue, int cap );
+void pipe_queue_free( struct pipe_queue *queue );
+
+void pool_start( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->pool == NULL );
+
+	struct grn_pool *pool = calloc( 1, sizeof( struct grn_pool ) );
+	ERR( pool == NULL, GRN_ERR_OOM );
+	ctx->pool = pool;
+	// worker threads take precedence over a pipeline, which needs a reader and a writer besides the transformers
+	bool pipeline = ctx->threads_n <= 1;
+	int threads_n = pipeline ? ctx->pipeline_n + 2 : ctx->threads_n;
+	pool->threads = calloc( threads_n, sizeof( pthread_t ) );
+	// files can't be found further ahead than a source has slots for
+	pool->results_n = ctx->source != NULL ? ctx->files_cap : ctx->files_n + 1;
+	pool->done = calloc( pool->results_n, sizeof( bool ) );
+	pool->errs = calloc( pool->results_n, sizeof( int ) );
+	pool->unchanged = calloc( pool->results_n, sizeof( bool ) );
+	pool->started_ns = calloc( pool->results_n, sizeof( uint64_t ) );
+	ERR( pool->threads == NULL || pool->done == NULL || pool->errs == NULL || pool->unchanged == NULL || pool->started_ns == NULL, GRN_ERR_OOM );
+	if ( pipeline ) {
+		// enough for every transformer to have a file ready to go, without reading far ahead
+		bool queued = pipe_queue_init( &pool->read_q, ctx->pipeline_n + 1 ) &&
+		              pipe_queue_init( &pool->write_q, ctx->pipeline_n + 1 );
+		ERR( !queued, GRN_ERR_OOM );
+		pool->transformers_left = ctx->pipeline_n;
+	}
+	ERR( pthread_mutex_init( &pool->lock, NULL ), GRN_ERR_THREAD );
+	if ( pthread_cond_init( &pool->done_cond, NULL ) ) {
+		pthread_mutex_destroy( &pool->lock );
+		ERR( GRN_ERR_THREAD );
+	}
+	if ( pthread_cond_init( &pool->read_q.cond, NULL ) ) {
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->done_cond );
+		ERR( GRN_ERR_THREAD );
+	}
+	if ( pthread_cond_init( &pool->write_q.cond, NULL ) ) {
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->done_cond );
+		pthread_cond_destroy( &pool->read_q.cond );
+		ERR( GRN_ERR_THREAD );
+	}
+	pool->sync_initialized = true;
+
+	for ( int i = 0; i < threads_n; i++ ) {
+		void *( *start )( void * ) = pool_worker;
+		if ( pipeline ) {
+			start = i == 0 ? pipe_reader : i == threads_n - 1 ? pipe_writer : pipe_transformer;
+		}
+		if ( pthread_create( &pool->threads[i], NULL, start, ctx ) ) {
+			// the threads that did start are joined by pool_free
+			ERR( GRN_ERR_THREAD );
+		}
+		pool->threads_n++;
+	}
+	GRN_LOG_DEBUG( pipeline ? "Started a pipeline of %d threads" : "Started %d workers", pool->threads_n );
+}
+
+void pool_free( struct grn_ctx *ctx ) {
+	struct grn_pool *pool = ctx->pool;
+	if ( pool == NULL ) {
+		return;
+	}
+
+	if ( pool->threads_n > 0 ) {
+		pthread_mutex_lock( &pool->lock );
+		pool->stopping = true;
+		// pipeline stages could be waiting on each other
+		pthread_cond_broadcast( &pool->read_q.cond );
+		pthread_cond_broadcast( &pool->write_q.cond );
+		pthread_mutex_unlock( &pool->lock );
+		for ( int i = 0; i < pool->threads_n; i++ ) {
+			pthread_join( pool->threads[i], NULL );
+		}
+	}
+	pipe_queue_free( &pool->read_q );
+	pipe_queue_free( &pool->write_q );
+	if ( pool->sync_initialized ) {
+		pthread_mutex_destroy( &pool->lock );
+		pthread_cond_destroy( &pool->done_cond );
+		pthread_cond_destroy( &pool->read_q.cond );
+		pthread_cond_destroy( &pool->write_q.cond );
+	}
+	grn_free( pool->threads );
+	grn_free( pool->done );
+	grn_free( pool->errs );
+	grn_free( pool->unchanged );
+	grn_free( pool->started_ns );
+	free( pool );
+	ctx->pool = NULL;
+}
+
+// threaded equivalent of the whole NEXT -> READ -> ... -> WRITE cycle: waits for the next file in order
+bool pool_step( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_NEXT || ctx->state == GRN_CTX_DONE );
+
+	if ( ctx->state == GRN_CTX_DONE ) {
+		return true;
+	}
+	if ( ctx->pool == NULL ) {
+		pool_start( ctx, out_err );
+		ERR_FW_NULL();
+	}
+	struct grn_pool *pool = ctx->pool;
+
+	int i = ctx->files_c + 1;
+	ctx->file_error = GRN_OK;
+	if ( !file_wait_ctx( ctx, i ) ) {
+		ctx->files_c = i;
+		file_advance_ctx( ctx, i );
+		ctx->state = GRN_CTX_DONE;
+		sync_batch_ctx( ctx );
+		return true;
+	}
+
+	int slot = i % pool->results_n;
+	pthread_mutex_lock( &pool->lock );
+	while ( !pool->done[slot] && pool->fatal_err == GRN_OK ) {
+		pthread_cond_wait( &pool->done_cond, &pool->lock );
+	}
+	int fatal_err = pool->fatal_err;
+	int file_err = pool->errs[slot];
+	bool unchanged = pool->unchanged[slot];
+	uint64_t started_ns = pool->started_ns[slot];
+	// ready for the file that wraps around to it
+	pool->done[slot] = false;
+	pthread_mutex_unlock( &pool->lock );
+	ERR_NULL( fatal_err, fatal_err );
+
+	ctx->files_c = i;
+	ctx->c_started_ns = started_ns;
+	file_advance_ctx( ctx, i );
+	if ( file_err ) {
+		GRN_LOG_DEBUG( "File error: %s.", grn_err_to_string( file_err ) );
+		ctx->file_error = file_err;
+		ctx->errs_n++;
+	}
+	if ( unchanged ) {
+		ctx->unchanged_n++;
+	}
+	cache_note_ctx( ctx, out_err );
+	return false;
+}
+
+// END worker pool
+
+// BEGIN pipeline
+
+/**
+ * Wait for room in a queue and push a file onto it. Call with the lock held.
+ * @return false if the pool is stopping, in which case the file is still the caller's
+ */
+bool pipe_push( struct grn_pool *pool, struct pipe_queue *queue, struct grn_ctx *file ) {
+	while ( queue->n == queue->cap && !pool->stopping && !pool->fatal_err ) {
+		pthread_cond_wait( &queue->cond, &pool->lock );
+	}
+	if ( pool->stopping || pool->fatal_err ) {
+		return false;
+	}
+	queue->files[( queue->head + queue->n ) % queue->cap] = file;
+	queue->n++;
+	pthread_cond_broadcast( &queue->cond );
+	return true;
+}
+
+/**
+ * Wait for a file and pop it off a queue. Call with the lock held.
+ * @return NULL once the queue is closed and empty, or the pool is stopping
+ */
+struct grn_ctx *pipe_pop( struct grn_pool *pool, struct pipe_queue *queue ) {
+	while ( queue->n == 0 && !queue->closed && !pool->stopping && !pool->fatal_err ) {
+		pthread_cond_wait( &queue->cond, &pool->lock );
+	}
+	if ( queue->n == 0 || pool->stopping || pool->fatal_err ) {
+		return NULL;
+	}
+	struct grn_ctx *file = queue->files[queue->head];
+	queue->head = ( queue->head + 1 ) % queue->cap;
+	queue->n--;
+	pthread_cond_broadcast( &queue->cond );
+	return file;
+}
+
+void pipe_close( struct pipe_queue *queue ) {
+	queue->closed = true;
+	pthread_cond_broadcast( &queue->cond );
+}
+
+// run a file's state machine until it gets to stop_state, or it's done early because of an error or nothing to write
+void pipe_run( struct grn_ctx *file, int stop_state, int *out_err ) {
+	*out_err = GRN_OK;
+	do {
+		grn_one_step( file, out_err );
+		ERR_FW();
+	} while ( file->state != stop_state && file->state != GRN_CTX_NEXT );
+}
+
+/**
+ * Run a file through one stage of the pipeline, then pass it on to the next queue, or report it if it's done.
+ * @param next_q NULL for the last stage
+ * @return false if the pool is stopping
+ */
+bool pipe_stage( struct grn_pool *pool, struct grn_ctx *file, int i, int stop_state, struct pipe_queue *next_q ) {
+	int in_err;
+	bool unchanged = false;
+	int file_err = GRN_OK;
+
+	pipe_run( file, stop_state, &in_err );
+	uint64_t started_ns = file->c_started_ns;
+	if ( in_err == GRN_OK && file->state == stop_state && next_q != NULL ) {
+		pthread_mutex_lock( &pool->lock );
+		bool pushed = pipe_push( pool, next_q, file );
+		pthread_mutex_unlock( &pool->lock );
+		if ( pushed ) {
+			return true;
+		}
+		free_isolated_ctx( file );
+		free( file );
+		return false;
+	}
+
+	if ( in_err == GRN_OK ) {
+		file_err = finish_isolated_ctx( file, &unchanged, &in_err );
+	} else {
+		free_isolated_ctx( file );
+	}
+	free( file );
+	pthread_mutex_lock( &pool->lock );
+	pool_done( pool, i, file_err, unchanged, started_ns, in_err );
+	bool stopping = pool->stopping || pool->fatal_err;
+	pthread_mutex_unlock( &pool->lock );
+	return !stopping;
+}
+
+// opens and reads files in order
+void *pipe_reader( void *arg ) {
+	struct grn_ctx *ctx = arg;
+	struct grn_pool *pool = ctx->pool;
+
+	for ( int i = 0; file_wait_ctx( ctx, i ); i++ ) {
+		struct grn_ctx *file = malloc( sizeof( struct grn_ctx ) );
+		if ( file == NULL ) {
+			pthread_mutex_lock( &pool->lock );
+			pool_done( pool, i, GRN_OK, false, 0, GRN_ERR_OOM );
+			pthread_mutex_unlock( &pool->lock );
+			break;
+		}
+		*file = isolated_ctx( ctx, i );
+		GRN_LOG_DEBUG( "Reader claimed file %d", i );
+		if ( !pipe_stage( pool, file, i, GRN_CTX_TRANSFORM, &pool->read_q ) ) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock( &pool->lock );
+	pipe_close( &pool->read_q );
+	pthread_mutex_unlock( &pool->lock );
+	return NULL;
+}
+
+void *pipe_transformer( void *arg ) {
+	struct grn_ctx *ctx = arg;
+	struct grn_pool *pool = ctx->pool;
+	// if this fails, each file gets an arena of its own
+	struct ben_arena *arena = ben_arena_new();
+
+	while ( true ) {
+		pthread_mutex_lock( &pool->lock );
+		struct grn_ctx *file = pipe_pop( pool, &pool->read_q );
+		pthread_mutex_unlock( &pool->lock );
+		if ( file == NULL ) {
+			break;
+		}
+		// the tree is gone by the time the file reaches the writer
+		file->arena = arena;
+		if ( !pipe_stage( pool, file, file->files_c, GRN_CTX_REOPEN, &pool->write_q ) ) {
+			break;
+		}
+	}
+	ben_arena_free( arena );
+
+	pthread_mutex_lock( &pool->lock );
+	if ( --pool->transformers_left == 0 ) {
+		pipe_close( &pool->write_q );
+	}
+	pthread_mutex_unlock( &pool->lock );
+	return NULL;
+}
+
+// writes files out and reports them. Runs each file back to GRN_CTX_NEXT, so stop_state never comes up.
+void *pipe_writer( void *arg ) {
+	struct grn_ctx *ctx = arg;
+	struct grn_pool *pool = ctx->pool;
+
+	while ( true ) {
+		pthread_mutex_lock( &pool->lock );
+		struct grn_ctx *file = pipe_pop( pool, &pool->write_q );
+		pthread_mutex_unlock( &pool->lock );
+		if ( file == NULL || !pipe_stage( pool, file, file->files_c, GRN_CTX_DONE, NULL ) ) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+bool pipe_queue_init( struct pipe_queue *queue, int cap ) {
+	queue->cap = cap;
+	queue->files = calloc( cap, sizeof( struct grn_ctx * ) );
+	return queue->files != NULL;
+}
+
+// frees the files still waiting in a queue after the pool is stopped
+void pipe_queue_free( struct pipe_queue *queue ) {
+	for ( int k = 0; k < queue->n; k++ ) {
+		struct grn_ctx *file = queue->files[( queue->head + k ) % queue->cap];
+		free_isolated_ctx( file );
+		free( file );
+	}
+	grn_free( queue->files );
+}
+
+// END pipeline
+
+// BEGIN io_uring
+
+#ifdef GRN_IO_URING
+// chunks of output submitted per writev
+#define RING_IOV_BATCH 64
+// read buffer size to start with when the size of a file isn't known up front
+#define RING_READ_CHUNK 4096
+
+enum ring_stage {
+	RING_FREE,
+	RING_OPEN,
+	RING_READ,
+	RING_WRITE,
+	RING_FSYNC,
+};
+
+/**
+ * One file in flight. At most one operation per slot is submitted at a time, and the file runs through the same
+ * helpers as the normal state machine on a private context, only with the blocking parts done by the kernel.
+ */
+struct ring_slot {
+	struct grn_ctx file;
+	enum ring_stage stage;
+	size_t size; // the size the file had when it was opened. 0 if unknown.
+	size_t allocated; // of file.buffer, while reading
+	// write progress through file.out_iov
+	size_t iov_i;
+	size_t iov_skip;
+	size_t written_n;
+	struct iovec batch[RING_IOV_BATCH]; // has to stay put until the kernel is done with the writev
+};
+
+/**
+ * The submission and completion queues shared with the kernel, and the files in flight.
+ * Like the worker pool, files are claimed in order but complete in any order, so results are kept per file.
+ */
+struct grn_ring {
+	int fd;
+	void *sq_map;
+	size_t sq_map_n;
+	void *cq_map; // same as sq_map if the kernel maps both at once
+	size_t cq_map_n;
+	struct io_uring_sqe *sqes;
+	size_t sqes_n;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit; // queued since the last io_uring_enter
+	int first_op; // opcode of the first of those, or of the last batch when nothing is queued. Blamed if entering fails.
+	int in_flight; // submitted or queued and not completed yet
+
+	struct ring_slot *slots;
+	int slots_n;
+	int next_i; // the next file to claim
+	int results_n; // like in the worker pool, file i goes at i % results_n
+	bool *done; // per file
+	int *errs; // per file, single-file errors only
+	bool *unchanged; // per file
+	uint64_t *started_ns; // per file
+};
+
+int ring_setup_syscall( unsigned entries, struct io_uring_params *params ) {
+	return syscall( SYS_io_uring_setup, entries, params );
+}
+
+int ring_enter_syscall( int fd, unsigned to_submit, unsigned min_complete, unsigned flags ) {
+	return syscall( SYS_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+// whether the kernel can do every operation the ring needs. Probing itself is new in 5.6, like opening files.
+bool ring_probe( int fd, int *out_err ) {
+	*out_err = GRN_OK;
+	const int ops_n = 256;
+	struct io_uring_probe *probe = calloc( 1, sizeof( struct io_uring_probe ) + ops_n * sizeof( struct io_uring_probe_op ) );
+	ERR_NULL( probe == NULL, GRN_ERR_OOM );
+
+	bool supported = syscall( SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, ops_n ) == 0;
+	const int needed[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_FSYNC };
+	for ( size_t i = 0; supported && i < sizeof( needed ) / sizeof( needed[0] ); i++ ) {
+		supported = needed[i] <= probe->last_op && ( probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED );
+	}
+	free( probe );
+	return supported;
+}
+
+// NULL on failure, rather than MAP_FAILED
+void *ring_mmap( int fd, size_t n, off_t offset ) {
+	void *mapped = mmap( NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset );
+	return mapped == MAP_FAILED ? NULL : mapped;
+}
+
+/**
+ * Set up the queues.
+ * @return false if io_uring isn't available, say because the kernel is too old or it's disabled
+ */
+bool ring_map( struct grn_ring *ring, unsigned entries, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct io_uring_params params = { 0 };
+	ring->fd = ring_setup_syscall( entries, &params );
+	if ( ring->fd < 0 ) {
+		GRN_LOG_DEBUG( "Could not set up io_uring: %s", strerror( errno ) );
+		return false;
+	}
+	bool supported = ring_probe( ring->fd, out_err );
+	ERR_FW_NULL();
+	if ( !supported ) {
+		GRN_LOG_DEBUG( "io_uring can't open and read files on this kernel%s", "" );
+		return false;
+	}
+
+	ring->sq_map_n = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+	ring->cq_map_n = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+	bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+	if ( single_map && ring->cq_map_n > ring->sq_map_n ) {
+		ring->sq_map_n = ring->cq_map_n;
+	}
+	ring->sq_map = ring_mmap( ring->fd, ring->sq_map_n, IORING_OFF_SQ_RING );
+	ring->cq_map = single_map ? ring->sq_map : ring_mmap( ring->fd, ring->cq_map_n, IORING_OFF_CQ_RING );
+	ring->sqes_n = params.sq_entries * sizeof( struct io_uring_sqe );
+	ring->sqes = ring_mmap( ring->fd, ring->sqes_n, IORING_OFF_SQES );
+	if ( ring->sq_map == NULL || ring->cq_map == NULL || ring->sqes == NULL ) {
+		GRN_LOG_DEBUG( "Could not map io_uring queues%s", "" );
+		return false;
+	}
+
+	char *sq = ring->sq_map, *cq = ring->cq_map;
+	ring->sq_tail = ( unsigned * ) ( sq + params.sq_off.tail );
+	ring->sq_mask = *( unsigned * ) ( sq + params.sq_off.ring_mask );
+	ring->sq_array = ( unsigned * ) ( sq + params.sq_off.array );
+	ring->cq_head = ( unsigned * ) ( cq + params.cq_off.head );
+	ring->cq_tail = ( unsigned * ) ( cq + params.cq_off.tail );
+	ring->cq_mask = *( unsigned * ) ( cq + params.cq_off.ring_mask );
+	ring->cqes = ( struct io_uring_cqe * ) ( cq + params.cq_off.cqes );
+	return true;
+}
+
+// the next submission queue entry, cleared and tagged with the slot it's for
+struct io_uring_sqe *ring_sqe( struct grn_ring *ring, struct ring_slot *slot, int opcode ) {
+	// only we write the tail, so it doesn't need to be read atomically
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset( sqe, 0, sizeof( *sqe ) );
+	sqe->opcode = opcode;
+	sqe->user_data = slot - ring->slots;
+	ring->sq_array[index] = index;
+	// the kernel has to see the entry before the new tail
+	__atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+	if ( ring->to_submit == 0 ) {
+		ring->first_op = opcode;
+	}
+	ring->to_submit++;
+	ring->in_flight++;
+	return sqe;
+}
+
+// the error an operation reports, the same one the normal I/O path would
+int ring_op_err( int opcode ) {
+	switch ( opcode ) {
+		case IORING_OP_OPENAT:
+			return GRN_ERR_FS_OPEN;
+		case IORING_OP_WRITEV:
+		case IORING_OP_FSYNC:
+			return GRN_ERR_FS_WRITE;
+		default:
+			return GRN_ERR_FS_READ;
+	}
+}
+
+// submit what's queued, and wait for at least one completion if anything is in flight. This blocks.
+void ring_enter( struct grn_ring *ring, int *out_err ) {
+	*out_err = GRN_OK;
+
+	unsigned min_complete = ring->in_flight > 0 ? 1 : 0;
+	int submitted;
+	do {
+		submitted = ring_enter_syscall( ring->fd, ring->to_submit, min_complete, IORING_ENTER_GETEVENTS );
+	} while ( submitted < 0 && errno == EINTR );
+	// the queues can't fill up because each slot has at most one operation in flight, so any error is fatal
+	ERR( submitted < 0, ring_op_err( ring->first_op ) );
+	ring->to_submit -= submitted;
+}
+
+void ring_submit_read( struct grn_ring *ring, struct ring_slot *slot ) {
+	struct grn_ctx *file = &slot->file;
+	struct io_uring_sqe *sqe = ring_sqe( ring, slot, IORING_OP_READ );
+	sqe->fd = fileno( file->fh );
+	sqe->addr = ( uintptr_t ) ( file->buffer + file->buffer_n );
+	sqe->len = slot->allocated - file->buffer_n;
+	sqe->off = file->buffer_n;
+}
+
+// writes as many of the remaining output chunks as fit in one writev
+void ring_submit_write( struct grn_ring *ring, struct ring_slot *slot ) {
+	struct grn_ctx *file = &slot->file;
+	int batch_n = 0;
+	for ( size_t k = slot->iov_i; k < file->out_iov_n && batch_n < RING_IOV_BATCH; k++ ) {
+		size_t k_skip = k == slot->iov_i ? slot->iov_skip : 0;
+		slot->batch[batch_n].iov_base = ( char * ) file->out_iov[k].base + k_skip;
+		slot->batch[batch_n].iov_len = file->out_iov[k].len - k_skip;
+		batch_n++;
+	}
+	struct io_uring_sqe *sqe = ring_sqe( ring, slot, IORING_OP_WRITEV );
+	sqe->fd = file->tmp_fd;
+	sqe->addr = ( uintptr_t ) slot->batch;
+	sqe->len = batch_n;
+	sqe->off = slot->written_n;
+}
+
+// record the result of a file and free its slot for the next one
+void ring_finish( struct grn_ring *ring, struct ring_slot *slot, int file_err, bool unchanged ) {
+	struct grn_ctx *file = &slot->file;
+	free_buffer_ctx( file );
+	free_output_ctx( file );
+	discard_tmp_ctx( file );
+	if ( file->fh != NULL && fclose( file->fh ) && file_err == GRN_OK ) {
+		file_err = GRN_ERR_FS_CLOSE;
+	}
+	file->fh = NULL;
+
+	ring->errs[file->files_c % ring->results_n] = file_err;
+	ring->unchanged[file->files_c % ring->results_n] = unchanged;
+	ring->started_ns[file->files_c % ring->results_n] = file->c_started_ns;
+	ring->done[file->files_c % ring->results_n] = true;
+	slot->stage = RING_FREE;
+}
+
+// start on the next file
+void ring_claim( struct grn_ctx *ctx, struct ring_slot *slot ) {
+	struct grn_ring *ring = ctx->ring;
+	int i = ring->next_i++;
+	GRN_LOG_DEBUG( "Opening file %d", i );
+
+	slot->file = ( struct grn_ctx ) {
+		.transforms = ctx->transforms,
+		.transforms_n = ctx->transforms_n,
+		.plan = ctx->plan,
+		// files are transformed one at a time on this thread, so they can all decode into the same arena
+		.arena = ctx->arena,
+		.files = ctx->files,
+		.files_cap = ctx->files_cap,
+		.files_c = i,
+		.files_n = i + 1,
+		.state = GRN_CTX_READ,
+		// batches are synced once by the main context
+		.sync = ctx->sync == GRN_SYNC_FILE ? GRN_SYNC_FILE : GRN_SYNC_NONE,
+		.tmp_fd = -1,
+	};
+	slot->stage = RING_OPEN;
+	slot->size = 0;
+	slot->allocated = 0;
+	slot->iov_i = 0;
+	slot->iov_skip = 0;
+	slot->written_n = 0;
+	slot->file.c_started_ns = monotonic_ns();
+
+	struct io_uring_sqe *sqe = ring_sqe( ring, slot, IORING_OP_OPENAT );
+	sqe->fd = AT_FDCWD;
+	sqe->addr = ( uintptr_t ) path_ctx( &slot->file, i );
+	sqe->open_flags = O_RDONLY;
+}
+
+// ends the file on single-file errors. Anything else is fatal.
+void ring_file_err( struct grn_ring *ring, struct ring_slot *slot, int err, int *out_err ) {
+	*out_err = GRN_OK;
+	if ( grn_err_is_single_file( err ) ) {
+		GRN_LOG_DEBUG( "File error: %s.", grn_err_to_string( err ) );
+		ring_finish( ring, slot, err, false );
+		return;
+	}
+	ERR( err );
+}
+
+// the rest of the output, then the sync, then the rename
+void ring_continue_write( struct grn_ring *ring, struct ring_slot *slot, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *file = &slot->file;
+
+	if ( slot->iov_i < file->out_iov_n ) {
+		ring_submit_write( ring, slot );
+		return;
+	}
+	if ( file->sync == GRN_SYNC_FILE && slot->stage != RING_FSYNC ) {
+		slot->stage = RING_FSYNC;
+		struct io_uring_sqe *sqe = ring_sqe( ring, slot, IORING_OP_FSYNC );
+		sqe->fd = file->tmp_fd;
+		return;
+	}
+
+	int in_err;
+	commit_tmp_ctx( file, &in_err );
+	if ( in_err ) {
+		ring_file_err( ring, slot, in_err, out_err );
+		return;
+	}
+	ring_finish( ring, slot, GRN_OK, false );
+}
+
+// the file is all read, so transform it and start writing it out if anything changed
+void ring_transform( struct grn_ring *ring, struct ring_slot *slot, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *file = &slot->file;
+	int in_err;
+
+	file->state = GRN_CTX_TRANSFORM;
+	transform_buffer( file, &in_err );
+	if ( in_err ) {
+		ring_file_err( ring, slot, in_err, out_err );
+		return;
+	}
+	if ( output_unchanged_ctx( file ) ) {
+		GRN_LOG_DEBUG( "Nothing changed, not rewriting the file%s", "" );
+		ring_finish( ring, slot, GRN_OK, true );
+		return;
+	}
+
+	ftmp_ctx( file, &in_err );
+	if ( in_err ) {
+		ring_file_err( ring, slot, in_err, out_err );
+		return;
+	}
+	file->state = GRN_CTX_WRITE;
+	slot->stage = RING_WRITE;
+	ring_continue_write( ring, slot, out_err );
+}
+
+void ring_opened( struct grn_ring *ring, struct ring_slot *slot, int res, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *file = &slot->file;
+
+	if ( res < 0 ) {
+		ring_finish( ring, slot, GRN_ERR_FS_OPEN, false );
+		return;
+	}
+	// the temporary file and closing work through the FILE like they do normally
+	file->fh = fdopen( res, "rb" );
+	if ( file->fh == NULL ) {
+		close( res );
+		ring_finish( ring, slot, GRN_ERR_FS_OPEN, false );
+		return;
+	}
+
+	// read regular files in one go. Anything else is read until it runs out.
+	struct stat st;
+	if ( fstat( res, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 && ( unsigned long long ) st.st_size < SIZE_MAX ) {
+		slot->size = st.st_size;
+		slot->allocated = slot->size + 1;
+	} else {
+		slot->allocated = RING_READ_CHUNK;
+	}
+	GRN_LOG_DEBUG( "File size: %d bytes", ( int )slot->size );
+	file->buffer = malloc( slot->allocated );
+	ERR( file->buffer == NULL, GRN_ERR_OOM );
+	file->buffer_n = 0;
+	slot->stage = RING_READ;
+	ring_submit_read( ring, slot );
+}
+
+void ring_read( struct grn_ring *ring, struct ring_slot *slot, int res, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *file = &slot->file;
+
+	if ( res == -EINTR || res == -EAGAIN ) {
+		ring_submit_read( ring, slot );
+		return;
+	}
+	if ( res < 0 ) {
+		ring_finish( ring, slot, GRN_ERR_FS_READ, false );
+		return;
+	}
+	file->buffer_n += res;
+	if ( res == 0 || ( slot->size > 0 && file->buffer_n >= slot->size ) ) {
+		ring_transform( ring, slot, out_err );
+		return;
+	}
+
+	// always leave room for a null byte, like fread_ctx does
+	if ( file->buffer_n + 1 >= slot->allocated ) {
+		char *buffer = realloc( file->buffer, slot->allocated * 2 );
+		ERR( buffer == NULL, GRN_ERR_OOM );
+		file->buffer = buffer;
+		slot->allocated *= 2;
+	}
+	ring_submit_read( ring, slot );
+}
+
+void ring_written( struct grn_ring *ring, struct ring_slot *slot, int res, int *out_err ) {
+	*out_err = GRN_OK;
+	struct grn_ctx *file = &slot->file;
+
+	if ( res == -EINTR || res == -EAGAIN ) {
+		ring_submit_write( ring, slot );
+		return;
+	}
+	// nothing written without an error, the disk might be full
+	if ( res <= 0 ) {
+		ring_finish( ring, slot, GRN_ERR_FS_WRITE, false );
+		return;
+	}
+
+	slot->written_n += res;
+	size_t left = res;
+	while ( slot->iov_i < file->out_iov_n && left >= file->out_iov[slot->iov_i].len - slot->iov_skip ) {
+		left -= file->out_iov[slot->iov_i].len - slot->iov_skip;
+		slot->iov_skip = 0;
+		slot->iov_i++;
+	}
+	slot->iov_skip += left;
+	ring_continue_write( ring, slot, out_err );
+}
+
+// moves a file along after one of its operations completes
+void ring_complete( struct grn_ring *ring, struct ring_slot *slot, int res, int *out_err ) {
+	*out_err = GRN_OK;
+
+	switch ( slot->stage ) {
+		case RING_OPEN:
+			;
+			ring_opened( ring, slot, res, out_err );
+			break;
+		case RING_READ:
+			;
+			ring_read( ring, slot, res, out_err );
+			break;
+		case RING_WRITE:
+			;
+			ring_written( ring, slot, res, out_err );
+			break;
+		case RING_FSYNC:
+			;
+			if ( res < 0 ) {
+				ring_finish( ring, slot, GRN_ERR_FS_WRITE, false );
+				break;
+			}
+			ring_continue_write( ring, slot, out_err );
+			break;
+		default:
+			;
+			assert( false );
+			break;
+	}
+}
+
+/**
+ * Handle every completion that has come in.
+ * @param process false to just throw them away, when shutting down
+ */
+void ring_reap( struct grn_ring *ring, bool process, int *out_err ) {
+	*out_err = GRN_OK;
+
+	unsigned head = *ring->cq_head;
+	// the completions have to be read after the tail that says they're there
+	unsigned tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+	while ( head != tail ) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		struct ring_slot *slot = &ring->slots[cqe->user_data];
+		int res = cqe->res;
+		__atomic_store_n( ring->cq_head, ++head, __ATOMIC_RELEASE );
+		ring->in_flight--;
+
+		if ( process ) {
+			ring_complete( ring, slot, res, out_err );
+			ERR_FW();
+		} else if ( slot->stage == RING_OPEN && res >= 0 ) {
+			close( res );
+		}
+	}
+}
+
+/**
+ * Set up io_uring and the slots for files in flight.
+ * @return false if io_uring isn't available, in which case ctx->ring is left NULL
+ */
+bool ring_start( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->ring == NULL );
+
+	struct grn_ring *ring = calloc( 1, sizeof( struct grn_ring ) );
+	ERR_NULL( ring == NULL, GRN_ERR_OOM );
+	ctx->ring = ring;
+	ring->fd = -1;
+	ring->slots_n = ctx->io_depth;
+	if ( ctx->source == NULL && ctx->files_n < ring->slots_n ) {
+		ring->slots_n = ctx->files_n;
+	}
+	if ( ring->slots_n < 1 ) {
+		ring->slots_n = 1;
+	}
+
+	bool available = ring_map( ring, ring->slots_n, out_err );
+	ERR_FW_NULL();
+	if ( !available ) {
+		ring_free( ctx );
+		return false;
+	}
+
+	if ( ctx->arena == NULL ) {
+		ctx->arena = ben_arena_new();
+		ERR_NULL( ctx->arena == NULL, GRN_ERR_OOM );
+		ctx->arena_owned = true;
+	}
+	ring->slots = calloc( ring->slots_n, sizeof( struct ring_slot ) );
+	ring->results_n = ctx->source != NULL ? ctx->files_cap : ctx->files_n + 1;
+	ring->done = calloc( ring->results_n, sizeof( bool ) );
+	ring->errs = calloc( ring->results_n, sizeof( int ) );
+	ring->unchanged = calloc( ring->results_n, sizeof( bool ) );
+	ring->started_ns = calloc( ring->results_n, sizeof( uint64_t ) );
+	ERR_NULL( ring->slots == NULL || ring->done == NULL || ring->errs == NULL || ring->unchanged == NULL || ring->started_ns == NULL, GRN_ERR_OOM );
+	GRN_LOG_DEBUG( "Keeping up to %d files in flight with io_uring", ring->slots_n );
+	return true;
+}
+
+void ring_free( struct grn_ctx *ctx ) {
+	struct grn_ring *ring = ctx->ring;
+	if ( ring == NULL ) {
+		return;
+	}
+
+	// the kernel could still be reading into buffers that are about to be freed
+	int in_err;
+	while ( ring->in_flight > 0 ) {
+		ring_enter( ring, &in_err );
+		if ( in_err ) {
+			break;
+		}
+		ring_reap( ring, false, &in_err );
+	}
+	for ( int i = 0; ring->slots != NULL && i < ring->slots_n; i++ ) {
+		struct grn_ctx *file = &ring->slots[i].file;
+		if ( ring->slots[i].stage == RING_FREE ) {
+			continue;
+		}
+		free_buffer_ctx( file );
+		free_output_ctx( file );
+		discard_tmp_ctx( file );
+		if ( file->fh != NULL ) {
+			fclose( file->fh );
+		}
+	}
+
+	if ( ring->sqes != NULL ) {
+		munmap( ring->sqes, ring->sqes_n );
+	}
+	if ( ring->cq_map != NULL && ring->cq_map != ring->sq_map ) {
+		munmap( ring->cq_map, ring->cq_map_n );
+	}
+	if ( ring->sq_map != NULL ) {
+		munmap( ring->sq_map, ring->sq_map_n );
+	}
+	if ( ring->fd != -1 ) {
+		close( ring->fd );
+	}
+	grn_free( ring->slots );
+	grn_free( ring->done );
+	grn_free( ring->errs );
+	grn_free( ring->unchanged );
+	grn_free( ring->started_ns );
+	free( ring );
+	ctx->ring = NULL;
+}
+
+// the io_uring equivalent of the whole NEXT -> READ -> ... -> WRITE cycle, like pool_step
+bool ring_step( struct grn_ctx *ctx, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( ctx->state == GRN_CTX_NEXT || ctx->state == GRN_CTX_DONE );
+
+	if ( ctx->state == GRN_CTX_DONE ) {
+		return true;
+	}
+	if ( ctx->ring == NULL ) {
+		bool available = ring_start( ctx, out_err );
+		ERR_FW_NULL();
+		if ( !available ) {
+			ctx->io_depth = 0;
+			return grn_one_step( ctx, out_err );
+		}
+	}
+	struct grn_ring *ring = ctx->ring;
+
+	int i = ctx->files_c + 1;
 	ctx->file_error = GRN_OK;
+	// nothing can be in flight while waiting for a file to be found, since it's the next one
+	if ( !file_wait_ctx( ctx, i ) ) {
+		ctx->files_c = i;
+		file_advance_ctx( ctx, i );
+		ctx->state = GRN_CTX_DONE;
+		sync_batch_ctx( ctx );
+		return true;
+	}
 
-	grn_free( ctx->buffer );
-	ctx->buffer = NULL;
-	// close the previously processing file
-	if ( ctx->fh != NULL ) {
-		// TODO: have a separate GRN_CTX_CLOSE state
-		if ( fclose( ctx->fh ) ) {
-			*out_err = GRN_ERR_FS_CLOSE;
+	// keep every slot busy, only waiting when there's nothing else to do
+	int slot = i % ring->results_n;
+	while ( !ring->done[slot] ) {
+		int known_n = files_known_ctx( ctx );
+		for ( int k = 0; k < ring->slots_n && ring->next_i < known_n; k++ ) {
+			if ( ring->slots[k].stage == RING_FREE ) {
+				ring_claim( ctx, &ring->slots[k] );
+			}
 		}
-		ctx->fh = NULL;
+		assert( ring->in_flight > 0 );
+		ring_enter( ring, out_err );
+		ERR_FW_NULL();
+		ring_reap( ring, true, out_err );
+		ERR_FW_NULL();
 	}
 
-	// are we done?
-	if ( ctx->files_c >= ctx->files_n ) {
-		ctx->state = GRN_CTX_DONE;
-		return;
+	ctx->files_c = i;
+	ctx->c_started_ns = ring->started_ns[slot];
+	file_advance_ctx( ctx, i );
+	ring->done[slot] = false;
+	if ( ring->errs[slot] ) {
+		GRN_LOG_DEBUG( "File error: %s.", grn_err_to_string( ring->errs[slot] ) );
+		ctx->file_error = ring->errs[slot];
+		ctx->errs_n++;
 	}
-
-	// prepare the next file for reading
-	ERR( ( ctx->fh = fopen( ctx->files[ctx->files_c], "rb" ) ) == NULL, GRN_ERR_FS_OPEN );
-	ctx->state = GRN_CTX_READ;
+	if ( ring->unchanged[slot] ) {
+		ctx->unchanged_n++;
+	}
+	cache_note_ctx( ctx, out_err );
+	return false;
 }
+#endif
+
+// END io_uring
 
 // BEGIN mainish functions
 
@@ -754,6 +3555,18 @@ bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 	} \
 } while (0)
 
+	// compiled up front so the workers can share it
+	plan_ctx( ctx, out_err );
+	ERR_FW_NULL();
+	if ( ctx->threads_n > 1 || ctx->pipeline_n > 0 ) {
+		return pool_step( ctx, out_err );
+	}
+#ifdef GRN_IO_URING
+	if ( ctx->io_depth > 1 ) {
+		return ring_step( ctx, out_err );
+	}
+#endif
+
 	GRN_LOG_DEBUG( "Stepping -- current state: %d", ctx->state );
 	switch ( ctx->state ) {
 		case GRN_CTX_DONE:
@@ -761,7 +3574,11 @@ bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 			break;
 		case GRN_CTX_REOPEN:
 			;
+#ifdef _WIN32
 			freopen_ctx( ctx, out_err );
+#else
+			ftmp_ctx( ctx, out_err );
+#endif
 			GRN_STEP_ERR();
 			ctx->state = GRN_CTX_WRITE;
 			break;
@@ -785,6 +3602,12 @@ bool grn_one_step( struct grn_ctx *ctx, int *out_err ) {
 			;
 			transform_buffer( ctx, out_err );
 			GRN_STEP_ERR();
+			if ( output_unchanged_ctx( ctx ) ) {
+				GRN_LOG_DEBUG( "Nothing changed, not rewriting the file%s", "" );
+				ctx->unchanged_n++;
+				ctx->state = GRN_CTX_NEXT;
+				break;
+			}
 			ctx->state = GRN_CTX_REOPEN;
 			// TODO: run grn_one_step again
 			break;
@@ -835,8 +3658,563 @@ void grn_one_ctx( struct grn_ctx *ctx, int *out_err ) {
 // END mainish functions
 
 
+// BEGIN recursive search
+
+// where found files go: into a vector, or pushed to a source that's already being processed
+struct cat_dest {
+	struct vector *vec;
+	struct grn_source *source;
+};
+
+// @param path not NUL terminated. Gets a / after it unless it already ends with one.
+char *scan_join( const char *path, size_t path_n, const char *name, size_t name_n, size_t *joined_n ) {
+	bool slash = path_n > 0 && path[path_n - 1] != '/';
+#ifdef _WIN32
+	slash = slash && path[path_n - 1] != '\\';
+#endif
+	*joined_n = path_n + slash + name_n;
+	char *joined = malloc( *joined_n + 1 );
+	if ( joined == NULL ) {
+		return NULL;
+	}
+	memcpy( joined, path, path_n );
+	joined[path_n] = '/';
+	memcpy( joined + path_n + slash, name, name_n + 1 );
+	return joined;
+}
+
+/**
+ * Add the file name in dir. A source stores it without allocating anything for it on its own.
+ * @param dir not NUL terminated. Gets a slash after it unless it's empty or already ends with one.
+ */
+void cat_push( struct cat_dest dest, const char *dir, size_t dir_n, const char *name, size_t name_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( dest.source != NULL ) {
+		source_push_in( dest.source, dir, dir_n, name, name_n, out_err );
+		return;
+	}
+	size_t path_n;
+	char *path = scan_join( dir, dir_n, name, name_n, &path_n );
+	ERR( path == NULL, GRN_ERR_OOM );
+	vector_push( dest.vec, &path, out_err );
+	if ( *out_err ) {
+		free( path );
+	}
+}
+
+// add a whole path, split after its last slash
+void cat_push_path( struct cat_dest dest, const char *path, int *out_err ) {
+	const char *name = strrchr( path, '/' );
+	name = name != NULL ? name + 1 : path;
+	cat_push( dest, path, name - path, name, strlen( name ), out_err );
+}
+
+#ifdef GRN_GETDENTS
+// Directories are read with getdents64 by several threads at once. File types come from the directory entries,
+// so only symlinks and entries on filesystems that don't fill in d_type have to be stat'ed.
+
+#define SCAN_THREADS_MAX 8
+// entries listed but not handed over yet, after which helper threads stop reading ahead
+#define SCAN_AHEAD_MAX 8192
+
+// what a directory contained, in the order the kernel listed it so results don't depend on which thread read what
+struct scan_entry {
+	size_t name_off; // where the name of a file with the right extension is in the directory's names
+	size_t name_n;
+	struct scan_dir *dir; // or the subdirectory, if it isn't a file
+};
+
+struct scan_dir {
+	char *path;
+	size_t path_n;
+	struct scan_entry *entries;
+	size_t entries_n;
+	size_t entries_allocated;
+	// the files' names one after another, NUL terminated, so they don't need an allocation each
+	char *names;
+	size_t names_n;
+	size_t names_allocated;
+	struct scan_dir *next_queued;
+	struct scan_dir *parent;
+	// set once it's opened, so symlinks can't lead back to it. ino stays 0 if it couldn't be.
+	dev_t dev;
+	ino_t ino;
+	bool taken; // a thread has started reading it, so it's not queued anymore
+	bool listed; // read, or given up on
+};
+
+// a directory that has been handed over, so other symlinks to it are skipped
+struct scan_seen {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct scan {
+	const char *ext;
+	size_t ext_n;
+	// only used by scan_collect, so it's the first path to a directory in the order files are handed over that wins.
+	// open addressing, with ino 0 marking empty slots
+	struct scan_seen *seen;
+	size_t seen_n;
+	size_t seen_allocated;
+	pthread_mutex_t lock; // guards everything below
+	pthread_cond_t cond;
+	struct scan_dir *queue; // waiting to be read. A stack, so the tree is mostly read depth first.
+	size_t ahead_n; // entries listed but not handed over yet
+	bool finished; // everything has been handed over, so the helpers can stop
+	int err; // the first error, which stops everything
+	struct scan_dir *root; // the one directory that has to be readable
+};
+
+// the layout getdents64 fills the buffer with. glibc only declares it for _GNU_SOURCE.
+struct scan_dirent {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// @return false if the directory has been read already
+bool scan_mark_seen( struct scan *scan, dev_t dev, ino_t ino, int *out_err ) {
+	*out_err = GRN_OK;
+
+	if ( ( scan->seen_n + 1 ) * 2 > scan->seen_allocated ) {
+		size_t allocated = scan->seen_allocated ? scan->seen_allocated * 2 : 64;
+		struct scan_seen *seen = calloc( allocated, sizeof( struct scan_seen ) );
+		if ( seen == NULL ) {
+			*out_err = GRN_ERR_OOM;
+			return false;
+		}
+		for ( size_t i = 0; i < scan->seen_allocated; i++ ) {
+			struct scan_seen old = scan->seen[i];
+			if ( old.ino == 0 ) {
+				continue;
+			}
+			size_t j = ( ( uint64_t ) old.ino * 0x9E3779B97F4A7C15ULL ^ old.dev ) & ( allocated - 1 );
+			while ( seen[j].ino != 0 ) {
+				j = ( j + 1 ) & ( allocated - 1 );
+			}
+			seen[j] = old;
+		}
+		free( scan->seen );
+		scan->seen = seen;
+		scan->seen_allocated = allocated;
+	}
+
+	// inode 0 never belongs to a directory anyone can open
+	size_t i = ( ( uint64_t ) ino * 0x9E3779B97F4A7C15ULL ^ dev ) & ( scan->seen_allocated - 1 );
+	for ( ; scan->seen[i].ino != 0; i = ( i + 1 ) & ( scan->seen_allocated - 1 ) ) {
+		if ( scan->seen[i].ino == ino && scan->seen[i].dev == dev ) {
+			return false;
+		}
+	}
+	scan->seen[i] = ( struct scan_seen ) {
+		.dev = dev,
+		.ino = ino,
+	};
+	scan->seen_n++;
+	return true;
+}
+
+void scan_dir_free( struct scan_dir *dir ) {
+	if ( dir == NULL ) {
+		return;
+	}
+	for ( size_t i = 0; i < dir->entries_n; i++ ) {
+		scan_dir_free( dir->entries[i].dir );
+	}
+	free( dir->entries );
+	free( dir->names );
+	free( dir->path );
+	free( dir );
+}
+
+bool scan_add_entry( struct scan_dir *dir, struct scan_entry entry ) {
+	if ( dir->entries_n == dir->entries_allocated ) {
+		size_t allocated = dir->entries_allocated ? dir->entries_allocated * 2 : 8;
+		struct scan_entry *entries = realloc( dir->entries, allocated * sizeof( struct scan_entry ) );
+		if ( entries == NULL ) {
+			return false;
+		}
+		dir->entries = entries;
+		dir->entries_allocated = allocated;
+	}
+	dir->entries[dir->entries_n++] = entry;
+	return true;
+}
+
+// @return where name was copied to in dir's names, or SIZE_MAX if it couldn't be
+size_t scan_add_name( struct scan_dir *dir, const char *name, size_t name_n ) {
+	if ( dir->names_allocated - dir->names_n < name_n + 1 ) {
+		size_t allocated = dir->names_allocated ? dir->names_allocated * 2 : 1024;
+		while ( allocated - dir->names_n < name_n + 1 ) {
+			allocated *= 2;
+		}
+		char *names = realloc( dir->names, allocated );
+		if ( names == NULL ) {
+			return SIZE_MAX;
+		}
+		dir->names = names;
+		dir->names_allocated = allocated;
+	}
+	size_t name_off = dir->names_n;
+	memcpy( dir->names + name_off, name, name_n + 1 );
+	dir->names_n += name_n + 1;
+	return name_off;
+}
+
+/**
+ * List the matching files and subdirectories of dir, queueing the subdirectories once it's done.
+ * Directories that can't be read are left empty, like nftw does.
+ */
+void scan_read_dir( struct scan *scan, struct scan_dir *dir, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct scan_dir *queued = NULL;
+	struct scan_dir **queued_tail = &queued;
+	int fd = open( dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	// unreadable subdirectories are skipped, like nftw does, but there's nothing to search without the root
+	if ( fd == -1 ) {
+		if ( dir == scan->root ) {
+			*out_err = errno == EACCES || errno == ENOENT || errno == ENOTDIR ? GRN_ERR_ENOENT : GRN_ERR_FS_NFTW;
+		}
+		return;
+	}
+	struct stat st;
+	if ( fstat( fd, &st ) ) {
+		if ( dir == scan->root ) {
+			*out_err = GRN_ERR_FS_NFTW;
+		}
+		goto cleanup;
+	}
+	dir->dev = st.st_dev;
+	dir->ino = st.st_ino;
+	// a symlink back up the tree would go on forever. Other ways of getting to the same directory are read, and left
+	// for scan_collect to skip, since which of them gets read first depends on the threads.
+	for ( struct scan_dir *up = dir->parent; up != NULL; up = up->parent ) {
+		if ( up->dev == dir->dev && up->ino == dir->ino ) {
+			goto cleanup;
+		}
+	}
+
+	// long enough for hundreds of entries per call
+	char buf[32768] __attribute__( ( aligned( 8 ) ) );
+	long buf_n;
+	while ( ( buf_n = syscall( SYS_getdents64, fd, buf, sizeof( buf ) ) ) > 0 ) {
+		for ( long off = 0; off < buf_n; ) {
+			struct scan_dirent *ent = ( struct scan_dirent * ) ( buf + off );
+			off += ent->d_reclen;
+			const char *name = ent->d_name;
+			if ( name[0] == '.' && ( name[1] == '\0' || ( name[1] == '.' && name[2] == '\0' ) ) ) {
+				continue;
+			}
+
+			bool is_dir = ent->d_type == DT_DIR;
+			if ( ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN ) {
+				// symlinks are followed, and dangling ones skipped
+				if ( fstatat( fd, name, &st, 0 ) ) {
+					continue;
+				}
+				is_dir = S_ISDIR( st.st_mode );
+			}
+			size_t name_n = strlen( name );
+			if ( !is_dir && ( name_n < scan->ext_n || memcmp( name + name_n - scan->ext_n, scan->ext, scan->ext_n ) ) ) {
+				continue;
+			}
+
+			struct scan_entry entry = {
+				.name_n = name_n,
+			};
+			bool added;
+			if ( is_dir ) {
+				size_t path_n;
+				char *path = scan_join( dir->path, dir->path_n, name, name_n, &path_n );
+				entry.dir = path != NULL ? calloc( 1, sizeof( struct scan_dir ) ) : NULL;
+				if ( entry.dir != NULL ) {
+					entry.dir->path = path;
+					entry.dir->path_n = path_n;
+					entry.dir->parent = dir;
+				} else {
+					free( path );
+				}
+				added = entry.dir != NULL && scan_add_entry( dir, entry );
+			} else {
+				entry.name_off = scan_add_name( dir, name, name_n );
+				added = entry.name_off != SIZE_MAX && scan_add_entry( dir, entry );
+			}
+			if ( !added ) {
+				scan_dir_free( entry.dir );
+				*out_err = GRN_ERR_OOM;
+				goto cleanup;
+			}
+			if ( is_dir ) {
+				*queued_tail = entry.dir;
+				queued_tail = &entry.dir->next_queued;
+			}
+		}
+	}
+	// like an unreadable subdirectory, one that fails partway through keeps what was listed
+	if ( buf_n < 0 && dir == scan->root ) {
+		*out_err = GRN_ERR_FS_NFTW;
+	}
+
+cleanup:
+	close( fd );
+	// the directories are owned by dir, so they're freed with it even if they never get read
+	if ( queued != NULL && !*out_err ) {
+		pthread_mutex_lock( &scan->lock );
+		*queued_tail = scan->queue;
+		scan->queue = queued;
+		pthread_cond_broadcast( &scan->cond );
+		pthread_mutex_unlock( &scan->lock );
+	}
+}
+
+// read a taken directory and mark it listed. Call with the lock held; it's released while reading.
+void scan_list( struct scan *scan, struct scan_dir *dir ) {
+	int in_err;
+
+	pthread_mutex_unlock( &scan->lock );
+	scan_read_dir( scan, dir, &in_err );
+	pthread_mutex_lock( &scan->lock );
+	dir->listed = true;
+	scan->ahead_n += dir->entries_n;
+	if ( in_err && !scan->err ) {
+		scan->err = in_err;
+	}
+	pthread_cond_broadcast( &scan->cond );
+}
+
+// helpers read queued directories ahead of scan_collect, until it's finished
+void *scan_worker( void *arg ) {
+	struct scan *scan = arg;
+
+	pthread_mutex_lock( &scan->lock );
+	while ( true ) {
+		while ( ( scan->queue == NULL || scan->ahead_n >= SCAN_AHEAD_MAX ) && !scan->finished && !scan->err ) {
+			pthread_cond_wait( &scan->cond, &scan->lock );
+		}
+		if ( scan->finished || scan->err ) {
+			break;
+		}
+		struct scan_dir *dir = scan->queue;
+		scan->queue = dir->next_queued;
+		dir->taken = true;
+		scan_list( scan, dir );
+	}
+	pthread_mutex_unlock( &scan->lock );
+	return NULL;
+}
+
+// wait for dir to be listed, reading it on this thread if no helper has gotten to it yet
+void scan_wait_listed( struct scan *scan, struct scan_dir *dir, int *out_err ) {
+	*out_err = GRN_OK;
+
+	pthread_mutex_lock( &scan->lock );
+	if ( !dir->taken ) {
+		// usually at the top, since the queue is mostly in the order directories are handed over in
+		struct scan_dir **queued = &scan->queue;
+		while ( *queued != dir ) {
+			queued = &( *queued )->next_queued;
+		}
+		*queued = dir->next_queued;
+		dir->taken = true;
+		scan_list( scan, dir );
+	}
+	while ( !dir->listed && !scan->err ) {
+		pthread_cond_wait( &scan->cond, &scan->lock );
+	}
+	*out_err = scan->err;
+	pthread_mutex_unlock( &scan->lock );
+}
+
+/**
+ * Give up on the contents of a listed directory: its subdirectories are taken off the queue, or waited for if they're
+ * being read. Call with the lock held.
+ */
+void scan_discard( struct scan *scan, struct scan_dir *dir, int *out_err ) {
+	*out_err = GRN_OK;
+
+	for ( size_t i = 0; i < dir->entries_n; i++ ) {
+		if ( scan->ahead_n-- == SCAN_AHEAD_MAX ) {
+			pthread_cond_broadcast( &scan->cond );
+		}
+		struct scan_dir *sub = dir->entries[i].dir;
+		if ( sub == NULL ) {
+			continue;
+		}
+		if ( !sub->taken ) {
+			struct scan_dir **queued = &scan->queue;
+			while ( *queued != sub ) {
+				queued = &( *queued )->next_queued;
+			}
+			*queued = sub->next_queued;
+			sub->taken = true;
+			sub->listed = true;
+			continue;
+		}
+		while ( !sub->listed && !scan->err ) {
+			pthread_cond_wait( &scan->cond, &scan->lock );
+		}
+		ERR( scan->err, scan->err );
+		scan_discard( scan, sub, out_err );
+		ERR_FW();
+	}
+}
+
+/**
+ * Hand the files over in the order they were listed in, as soon as the directory they're in has been listed,
+ * freeing the tree as it goes. On errors, the rest of the tree is left for the caller to free once the helpers stop.
+ */
+void scan_collect( struct scan *scan, struct cat_dest dest, struct scan_dir *dir, int *out_err ) {
+	*out_err = GRN_OK;
+
+	scan_wait_listed( scan, dir, out_err );
+	ERR_FW();
+	// of several symlinks to the same directory, the first one in this order gets its files, like with nftw
+	if ( dir->ino != 0 ) {
+		bool unseen = scan_mark_seen( scan, dir->dev, dir->ino, out_err );
+		ERR_FW();
+		if ( !unseen ) {
+			pthread_mutex_lock( &scan->lock );
+			scan_discard( scan, dir, out_err );
+			pthread_mutex_unlock( &scan->lock );
+			ERR_FW();
+			scan_dir_free( dir );
+			return;
+		}
+	}
+	// room for at least this directory's files in one go
+	if ( dest.vec != NULL ) {
+		vector_reserve( dest.vec, vector_length( dest.vec ) + dir->entries_n, out_err );
+		ERR_FW();
+	}
+	for ( size_t i = 0; i < dir->entries_n; i++ ) {
+		pthread_mutex_lock( &scan->lock );
+		// helpers wait for there to be room before reading ahead again
+		if ( scan->ahead_n-- == SCAN_AHEAD_MAX ) {
+			pthread_cond_broadcast( &scan->cond );
+		}
+		pthread_mutex_unlock( &scan->lock );
+		if ( dir->entries[i].dir != NULL ) {
+			scan_collect( scan, dest, dir->entries[i].dir, out_err );
+			ERR_FW();
+			dir->entries[i].dir = NULL;
+		} else {
+			cat_push( dest, dir->path, dir->path_n, dir->names + dir->entries[i].name_off, dir->entries[i].name_n, out_err );
+			ERR_FW();
+		}
+	}
+	scan_dir_free( dir );
+}
+
+void scan_tree( struct cat_dest dest, const char *path, const char *extension, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct scan scan = {
+		.ext = extension,
+		.ext_n = strlen( extension ),
+	};
+	pthread_t threads[SCAN_THREADS_MAX - 1];
+	int threads_n = 0;
+	bool sync_initialized = false;
+	struct scan_dir *root = calloc( 1, sizeof( struct scan_dir ) );
+	if ( root == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	// like nftw, the files in "dir//" are "dir/file"
+	root->path_n = strlen( path );
+	while ( root->path_n > 1 && path[root->path_n - 1] == '/' && path[root->path_n - 2] == '/' ) {
+		root->path_n--;
+	}
+	root->path = malloc( root->path_n + 1 );
+	if ( root->path == NULL ) {
+		*out_err = GRN_ERR_OOM;
+		goto cleanup;
+	}
+	memcpy( root->path, path, root->path_n );
+	root->path[root->path_n] = '\0';
+	scan.root = root;
+
+	if ( pthread_mutex_init( &scan.lock, NULL ) ) {
+		*out_err = GRN_ERR_THREAD;
+		goto cleanup;
+	}
+	if ( pthread_cond_init( &scan.cond, NULL ) ) {
+		pthread_mutex_destroy( &scan.lock );
+		*out_err = GRN_ERR_THREAD;
+		goto cleanup;
+	}
+	sync_initialized = true;
+
+	// small trees aren't worth starting threads for
+	pthread_mutex_lock( &scan.lock );
+	root->taken = true;
+	scan_list( &scan, root );
+	bool subdirs = scan.queue != NULL;
+	pthread_mutex_unlock( &scan.lock );
+	if ( subdirs ) {
+		long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+		for ( ; threads_n < cpus - 1 && threads_n < SCAN_THREADS_MAX - 1; threads_n++ ) {
+			// fewer threads only makes it slower
+			if ( pthread_create( &threads[threads_n], NULL, scan_worker, &scan ) ) {
+				break;
+			}
+		}
+	}
+	// reads whatever the helpers haven't gotten to by the time it's needed, so it works without any
+	scan_collect( &scan, dest, root, out_err );
+	if ( *out_err == GRN_OK ) {
+		root = NULL;
+	}
+
+	pthread_mutex_lock( &scan.lock );
+	scan.finished = true;
+	if ( *out_err && !scan.err ) {
+		scan.err = *out_err;
+	}
+	pthread_cond_broadcast( &scan.cond );
+	pthread_mutex_unlock( &scan.lock );
+
+cleanup:
+	for ( int i = 0; i < threads_n; i++ ) {
+		pthread_join( threads[i], NULL );
+	}
+	if ( sync_initialized ) {
+		pthread_mutex_destroy( &scan.lock );
+		pthread_cond_destroy( &scan.cond );
+	}
+	free( scan.seen );
+	// the directories still queued belong to the tree too
+	scan_dir_free( root );
+}
+
+void cat_torrent_files( struct cat_dest dest, const char *path, const char *extension, int *out_err ) {
+	*out_err = GRN_OK;
+
+	extension = extension != NULL ? extension : ".torrent";
+	struct stat st;
+	if ( stat( path, &st ) ) {
+		ERR( errno == EACCES || errno == ENOENT || errno == ENOTDIR ? GRN_ERR_ENOENT : GRN_ERR_FS_NFTW );
+	}
+	if ( S_ISDIR( st.st_mode ) ) {
+		scan_tree( dest, path, extension, out_err );
+		return;
+	}
+
+	if ( !str_ends_with( path, extension ) ) {
+		return;
+	}
+	cat_push_path( dest, path, out_err );
+}
+
+#else
+
 // global because nftw doesn't support a custom callback argument
-struct vector *cat_vec;
+struct cat_dest cat_dest;
 const char *cat_ext;
 
 // used as nftw callback below
@@ -853,20 +4231,15 @@ int cat_nftw_cb( const char *path, const struct stat *st, int file_type, struct
 		return 0;
 	}
 
-	// the path might not be dynamic (it might actually change between callback runs, if nftw uses readdir internally?)
-	char *path_cp = malloc( strlen( path ) + 1 );
-	if ( path_cp == NULL ) {
-		return GRN_ERR_OOM;
-	}
-	strcpy( path_cp, path );
-	vector_push( cat_vec, &path_cp, &in_err );
+	// copied, since the path might change between callback runs. The name starts at base, after the separator.
+	cat_push( cat_dest, path, ftw_info->base, path + ftw_info->base, strlen( path + ftw_info->base ), &in_err );
 	return in_err;
 }
 
-void grn_cat_torrent_files( struct vector *vec, const char *path, const char *extension, int *out_err ) {
+void cat_torrent_files( struct cat_dest dest, const char *path, const char *extension, int *out_err ) {
 	*out_err = GRN_OK;
 
-	cat_vec = vec;
+	cat_dest = dest;
 	cat_ext = extension != NULL ? extension : ".torrent";
 
 	int nftw_err = nftw( path, cat_nftw_cb, 16, 0 );
@@ -887,10 +4260,27 @@ void grn_cat_torrent_files( struct vector *vec, const char *path, const char *ex
 	}
 }
 
+#endif
+
+void grn_cat_torrent_files( struct vector *vec, const char *path, const char *extension, int *out_err ) {
+	struct cat_dest dest = {
+		.vec = vec,
+	};
+	cat_torrent_files( dest, path, extension, out_err );
+}
+
+void grn_source_cat_torrent_files( struct grn_source *source, const char *path, const char *extension, int *out_err ) {
+	struct cat_dest dest = {
+		.source = source,
+	};
+	cat_torrent_files( dest, path, extension, out_err );
+}
+
+// END recursive search
+
 // helper function for use in grn_cat_client
-void cat_client_single_path( struct vector *vec, const char *home, const char *sub, const char *extension, int *out_err ) {
+void cat_client_single_path( struct cat_dest dest, const char *home, const char *sub, const char *extension, int *out_err ) {
 	*out_err = GRN_OK;
-	assert( vec != NULL );
 	assert( home != NULL );
 	assert( sub != NULL );
 
@@ -904,7 +4294,7 @@ void cat_client_single_path( struct vector *vec, const char *home, const char *s
 		*out_err = GRN_ERR_READ_CLIENT_PATH;
 		goto cleanup;
 	}
-	grn_cat_torrent_files( vec, full_path, extension, out_err );
+	cat_torrent_files( dest, full_path, extension, out_err );
 	ERR_FW_CLEANUP();
 	goto cleanup;
 cleanup:
@@ -918,7 +4308,7 @@ cleanup:
  *   - qBittorrent: Has separate fastresume files in the same folder as the main torrent. The "trackers" key must be modified.
  *   - uTorrent is also bencode. Each key in the root dict is the name of a .torrent file. Inside is a "trackers" list.
  */
-void grn_cat_client( struct vector *vec, int client, int *out_err ) {
+void cat_client( struct cat_dest dest, int client, int *out_err ) {
 	*out_err = GRN_OK;
 
 #ifdef _WIN32
@@ -935,60 +4325,60 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 		case GRN_CLIENT_QBITTORRENT:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.local/share/data/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/.local/share/data/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/.local/share/data/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( dest, home_path, "/.local/share/data/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( dest, home_path, "/Library/Application Support/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/qBittorrent/BT_backup", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/AppData/Local/qBittorrent/BT_backup", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/AppData/Local/qBittorrent/BT_backup", ".fastresume", out_err );
+			cat_client_single_path( dest, home_path, "/AppData/Local/qBittorrent/BT_backup", ".fastresume", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_DELUGE:
 			;
 #if defined __unix__ || defined __APPLE__
-			cat_client_single_path( vec, home_path, "/.config/deluge/state", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/.config/deluge/state", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, home_path, "/.config/deluge/state/torrents.state", ".state", out_err );
+			cat_client_single_path( dest, home_path, "/.config/deluge/state/torrents.state", ".state", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, appdata_path, "/deluge/state", ".torrent", out_err );
+			cat_client_single_path( dest, appdata_path, "/deluge/state", ".torrent", out_err );
 			ERR_FW();
-			cat_client_single_path( vec, appdata_path, "/deluge/state/torrents.state", ".state", out_err );
+			cat_client_single_path( dest, appdata_path, "/deluge/state/torrents.state", ".state", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_TRANSMISSION:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.config/transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/.config/transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/AppData/Local/transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 #endif
 			break;
 		case GRN_CLIENT_TRANSMISSION_DAEMON:
 			;
 #if defined __unix__
-			cat_client_single_path( vec, home_path, "/.config/transmission-daemon/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/.config/transmission-daemon/torrents", ".torrent", out_err );
 			ERR_FW();
 #elif defined __APPLE__
-			cat_client_single_path( vec, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/Library/Application Support/Transmission/torrents", ".torrent", out_err );
 			ERR_FW();
 			// TODO: check what the status is of transmission daemon on mac. Does it exist at all?
 #elif defined _WIN32
-			cat_client_single_path( vec, home_path, "/AppData/Local/transmission-daemon/torrents", ".torrent", out_err );
+			cat_client_single_path( dest, home_path, "/AppData/Local/transmission-daemon/torrents", ".torrent", out_err );
 			ERR_FW();
 #endif
 			break;
@@ -996,10 +4386,10 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 		case GRN_CLIENT_UTORRENT:
 			;
 			/*
-			cat_client_single_path( vec, appdata_path, "/uTorrent", ".torrent", out_err );
+			cat_client_single_path( dest, appdata_path, "/uTorrent", ".torrent", out_err );
 			ERR_FW();
 			*/
-			cat_client_single_path( vec, appdata_path, "/uTorrent/resume.dat", ".dat", out_err );
+			cat_client_single_path( dest, appdata_path, "/uTorrent/resume.dat", ".dat", out_err );
 			ERR_FW();
 			break;
 #endif
@@ -1010,23 +4400,44 @@ void grn_cat_client( struct vector *vec, int client, int *out_err ) {
 	}
 }
 
+void grn_cat_client( struct vector *vec, int client, int *out_err ) {
+	struct cat_dest dest = {
+		.vec = vec,
+	};
+	cat_client( dest, client, out_err );
+}
+
+void grn_source_cat_client( struct grn_source *source, int client, int *out_err ) {
+	struct cat_dest dest = {
+		.source = source,
+	};
+	cat_client( dest, client, out_err );
+}
+
 // BEGIN get info
 
 bool grn_ctx_get_is_done( struct grn_ctx *ctx ) {
 	return ctx->state == GRN_CTX_DONE;
 }
 
-char *grn_ctx_get_c_path( struct grn_ctx *ctx ) {
+// copied out, since ctx->path is overwritten by every step
+size_t get_path_ctx( struct grn_ctx *ctx, int i, char *buf, size_t buf_n ) {
+	const struct grn_path *path = file_path_ctx( ctx, i );
+	grn_path_join( *path, buf, buf_n );
+	return ( size_t ) path->dir_n + path->name_n;
+}
+
+size_t grn_ctx_get_c_path( struct grn_ctx *ctx, char *buf, size_t buf_n ) {
 	assert( ctx->files_c >= 0 );
-	assert( ctx->files_c < ctx->files_n );
-	return ctx->files[ctx->files_c];
+	assert( ctx->source != NULL || ctx->files_c < ctx->files_n );
+	return get_path_ctx( ctx, ctx->files_c, buf, buf_n );
 }
 
-char *grn_ctx_get_next_path( struct grn_ctx *ctx ) {
-	if ( ctx->files_c + 1 < ctx->files_n ) {
-		return ctx->files[ctx->files_c + 1];
+size_t grn_ctx_get_next_path( struct grn_ctx *ctx, char *buf, size_t buf_n ) {
+	if ( ctx->files_c + 1 < files_known_ctx( ctx ) ) {
+		return get_path_ctx( ctx, ctx->files_c + 1, buf, buf_n );
 	} else {
-		return NULL;
+		return 0;
 	}
 }
 
@@ -1039,14 +4450,32 @@ int grn_ctx_get_files_c( struct grn_ctx *ctx ) {
 	return ctx->files_c + 1;
 }
 
+uint64_t grn_ctx_get_c_started_ns( struct grn_ctx *ctx ) {
+	return ctx->c_started_ns;
+}
+
 int grn_ctx_get_files_n( struct grn_ctx *ctx ) {
-	return ctx->files_n;
+	return files_known_ctx( ctx );
 }
 
 int grn_ctx_get_errs_n( struct grn_ctx *ctx ) {
 	return ctx->errs_n;
 }
 
+int grn_ctx_get_unchanged_n( struct grn_ctx *ctx ) {
+	return ctx->unchanged_n;
+}
+
+int grn_ctx_get_cached_n( struct grn_ctx *ctx ) {
+	if ( ctx->source == NULL ) {
+		return ctx->cached_n;
+	}
+	pthread_mutex_lock( &ctx->source->lock );
+	int cached_n = ctx->source->cached_n;
+	pthread_mutex_unlock( &ctx->source->lock );
+	return cached_n;
+}
+
 // END get info
 
 
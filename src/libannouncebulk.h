@@ -3,9 +3,23 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <regex.h>
 
 #include "vector.h"
+#include "paths.h"
+
+// the longest path a file can be opened by, including the NUL. Linux's PATH_MAX, which isn't defined everywhere this
+// header is included, and the size of grn_ctx can't depend on that.
+#define GRN_PATH_MAX 4096
+
+struct ben_iovec;
+struct ben_arena;
+struct grn_plan;
+struct grn_ring;
+struct grn_dfa;
+struct grn_cache;
+struct grn_source;
 
 int ben_error_to_anb( int bencode_error );
 
@@ -45,6 +59,10 @@ struct grn_transform {
 		struct grn_op_substitute_regex {
 			// this is inline so we don't have to allocate memory for it and shit
 			regex_t find;
+			// a copy of the regex it was compiled from. Owned like find.
+			char *find_str;
+			// the same regex as a DFA, or NULL if it uses syntax the DFA doesn't support. Owned like find.
+			struct grn_dfa *dfa;
 			char *replace;
 		} substitute_regex;
 	} payload;
@@ -67,6 +85,14 @@ void grn_free_transform( struct grn_transform *transform );
 // frees the vector too
 void grn_free_transforms_v( struct vector *vec );
 
+/**
+ * Compile a list of transforms into a plan that applies all of them in a single pass over each file.
+ * Only the keys are kept, so a plan can be shared by any number of contexts whose transforms have the same
+ * keys in the same order, for example ones made from the same preset.
+ */
+struct grn_plan *grn_plan_compile( const struct grn_transform *transforms, int transforms_n, int *out_err );
+void grn_plan_free( struct grn_plan *plan );
+
 struct grn_callback_arg {
 	// progress bar info
 	int numerator;
@@ -80,6 +106,13 @@ struct grn_transform_result {
 	char error[64];
 };
 
+// how hard to try to get written files onto the disk before saying they're done
+enum grn_sync_mode {
+	GRN_SYNC_NONE, // leave it to the OS
+	GRN_SYNC_BATCH, // sync everything once, after the last file
+	GRN_SYNC_FILE, // fsync each file before it replaces the original
+};
+
 enum grn_ctx_state {
 	GRN_CTX_NEXT,
 	GRN_CTX_READ,
@@ -92,36 +125,121 @@ enum grn_ctx_state {
 struct grn_ctx {
 	struct grn_transform *transforms;
 	int transforms_n;
-	char **files;
+	struct grn_plan *plan; // the transforms compiled for applying them all at once. Compiled by the first step if not set.
+	bool plan_owned;
+	struct ben_arena *arena; // decoded files live here until they're encoded. Created by the first transform if not set.
+	bool arena_owned;
+	struct grn_path *files;
+	int files_cap; // with a source, files is a ring of this many paths, indexed modulo it. 0 otherwise.
+	struct grn_paths *paths; // where the files set up front are stored. A source stores its own.
+	char path[GRN_PATH_MAX]; // the whole path of the file last asked for, since files only has the parts
 	int files_c; // index to the currently processing file
-	int files_n;
+	uint64_t c_started_ns; // monotonic time the current file was opened. 0 where there's no monotonic clock.
+	int files_n; // unused with a source, which keeps count itself
+	struct grn_source *source; // where files come from while they're still being found. NULL if they were set up front.
 	int file_error; // error during processing current file. Only recoverable errors.
 	int errs_n;
+	int unchanged_n; // files that were left alone because no transform changed them
 	int state; // represents what to do next (sometimes this coincides with what is in progress)
 	FILE *fh;
-	char *buffer;
+	char *buffer; // contents of the current file. Kept until the next file, because the output may point into it.
 	size_t buffer_n;
+	bool buffer_mapped; // whether buffer is a read-only mapping of the file rather than on the heap
+	// the transformed file, as chunks pointing into buffer or out_scratch
+	struct ben_iovec *out_iov;
+	size_t out_iov_n;
+	char *out_scratch;
+	size_t out_n;
+	bool out_unchanged; // set instead of any output when the transforms can't have changed the file
+	// the temporary file being written, and the path it replaces
+	char *tmp_path;
+	char *write_path;
+	int tmp_fd;
+	bool write_in_place; // tmp_fd is the original file itself, because it has other hard links
+	enum grn_sync_mode sync;
+	int threads_n; // number of worker threads. 0 or 1 means everything happens on the calling thread.
+	int pipeline_n; // transformer threads in a pipeline. 0 means no pipeline.
+	struct grn_pool *pool; // started lazily by the first step if threads_n > 1 or pipeline_n > 0
+	int io_depth; // files to keep I/O in flight for with io_uring. 0 or 1 waits on each operation in turn.
+	struct grn_ring *ring; // set up lazily by the first step if io_depth > 1
+	struct grn_cache *cache; // files done in earlier runs. NULL if there isn't one.
+	uint64_t cache_hash; // identifies the transforms in the cache
+	int cached_n; // files dropped from the list because the cache says they're done
 };
 
 struct grn_ctx *grn_ctx_alloc( int *out_err );
-// assumes that individual files are dynamically allocated, as well as the whole
-void grn_ctx_set_files( struct grn_ctx *ctx, char **files, int files_n );
+// assumes that individual files are dynamically allocated, as well as the whole. They're moved into a grn_paths and
+// freed right away, even on failure.
+void grn_ctx_set_files( struct grn_ctx *ctx, char **files, int files_n, int *out_err );
 // takes ownership of the vector, do not free it
 // also assumes that all individual files are dynamically allocated
-void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files );
+void grn_ctx_set_files_v( struct grn_ctx *ctx, struct vector *files, int *out_err );
+/**
+ * Process files as they're pushed to a source, instead of setting them all up front. Must be called before the first
+ * step, and before anything is pushed. The context keeps a reference to the source until it's freed.
+ */
+void grn_ctx_set_source( struct grn_ctx *ctx, struct grn_source *source );
 void grn_ctx_set_transforms( struct grn_ctx *ctx, struct grn_transform *transforms, int transforms_n );
 // takes ownership of the vector, do not free it
 void grn_ctx_set_transforms_v( struct grn_ctx *ctx, struct vector *transforms );
+/**
+ * Process files concurrently on a pool of worker threads. Must be called before the first step.
+ * Files are still reported as done in order, so the getters below behave the same as in serial mode.
+ * @param threads_n the number of worker threads. 0 or 1 processes files on the calling thread.
+ */
+void grn_ctx_set_threads( struct grn_ctx *ctx, int threads_n );
+/**
+ * Overlap reading, transforming and writing files: a reader thread reads ahead of transformer threads, which hand
+ * files on to a writer thread. Only a few files are waiting between stages at once, so memory use stays bounded.
+ * Files are still reported as done in order. Must be called before the first step. Ignored when threads_n > 1.
+ * @param transformers_n the number of transformer threads. 0 processes files on the calling thread.
+ */
+void grn_ctx_set_pipeline( struct grn_ctx *ctx, int transformers_n );
+/**
+ * Keep the opens, reads and writes of several files in flight at once on the calling thread using io_uring,
+ * instead of waiting on each in turn. Files are still reported as done in order. Must be called before the first step.
+ * This is not a non-blocking mode: a step still blocks until the file it reports is done, waiting on the kernel in
+ * between. Ignored when processing on threads or in a pipeline, and where io_uring isn't available.
+ * @param io_depth the number of files to work on at once. 0 or 1 does I/O the normal way.
+ */
+void grn_ctx_set_io_depth( struct grn_ctx *ctx, int io_depth );
+// GRN_SYNC_NONE by default
+void grn_ctx_set_sync( struct grn_ctx *ctx, enum grn_sync_mode sync );
+/**
+ * Skip files that were processed by the same transforms in an earlier run and haven't changed since, and remember the
+ * ones processed by this one. The cache is kept in a file at path, which is rewritten when the context is freed.
+ * Files are told apart by device and inode, so this is ignored on Windows.
+ * Must be called after the files and transforms are set and before the first step. The skipped files are removed from
+ * the list of files right away, so the getters below never see them. With a source, they're dropped as they're pushed
+ * instead, so call it before anything is pushed.
+ */
+void grn_ctx_set_cache( struct grn_ctx *ctx, const char *path, int *out_err );
+// use a plan compiled by grn_plan_compile instead of compiling one. The plan is not freed with the context.
+// Must be called after the transforms are set and before the first step.
+void grn_ctx_set_plan( struct grn_ctx *ctx, struct grn_plan *plan );
 
 bool grn_ctx_get_is_done( struct grn_ctx *ctx );
-// the path of the currently / just processed file
-char *grn_ctx_get_c_path( struct grn_ctx *ctx );
-char *grn_ctx_get_next_path( struct grn_ctx *ctx );
+/**
+ * Copy the path of the currently / just processed file into buf, NUL terminated.
+ * @return the path's length. If it's buf_n or more, buf was too small and is left alone, so call it again with
+ * length + 1 bytes. buf may be NULL when buf_n is 0.
+ */
+size_t grn_ctx_get_c_path( struct grn_ctx *ctx, char *buf, size_t buf_n );
+// like grn_ctx_get_c_path, for the file after it. 0 if there isn't one, or it hasn't been found yet.
+size_t grn_ctx_get_next_path( struct grn_ctx *ctx, char *buf, size_t buf_n );
 int grn_ctx_get_c_error( struct grn_ctx *ctx );
+// with a source, the number found so far
 int grn_ctx_get_files_n( struct grn_ctx *ctx );
 // the number that have been completed
 int grn_ctx_get_files_c( struct grn_ctx *ctx );
+// monotonic nanoseconds when the current file was opened, to time it. Files are reported in order, so with threads
+// or io_uring this includes any wait behind earlier files.
+uint64_t grn_ctx_get_c_started_ns( struct grn_ctx *ctx );
 int grn_ctx_get_errs_n (struct grn_ctx *ctx);
+// the number of files that didn't need to be rewritten
+int grn_ctx_get_unchanged_n( struct grn_ctx *ctx );
+// the number of files the cache said were already done
+int grn_ctx_get_cached_n( struct grn_ctx *ctx );
 
 /**
  * Free a context
@@ -167,6 +285,26 @@ typedef struct {
 	int buffer_n;
 } grn_file;
 
+// BEGIN file sources
+
+/**
+ * A queue of files for a context to process while they're still being found, so searching and processing overlap.
+ * Only a bounded number of found files wait in it, and their paths are freed in blocks as they're processed, so memory
+ * use stays the same however many files there are. One thread pushes files while the context processes them on another.
+ * @param ahead_n how many files can be found ahead of the one being processed. 0 for the default.
+ */
+struct grn_source *grn_source_alloc( int ahead_n, int *out_err );
+/**
+ * Add a file to the end of the queue, waiting for room if it's full.
+ * @param path dynamically allocated. Copied into the source's storage and freed, even on failure.
+ * Fails with GRN_ERR_USER_CANCELLED once the context it was set on has been freed, so the search should stop.
+ */
+void grn_source_push( struct grn_source *source, char *path, int *out_err );
+// no more files will be pushed. Do not use the source afterwards; it's freed once the context is freed too.
+void grn_source_close( struct grn_source *source );
+
+// END file sources
+
 // BEGIN client-specific
 
 enum grn_torrent_client {
@@ -184,6 +322,8 @@ enum grn_torrent_client {
 * @param client The enum value of the client (see x_clients.h)
 */
 void grn_cat_client( struct vector *vec, int client, int *out_err );
+// like grn_cat_client, but pushes each file as soon as it's found
+void grn_source_cat_client( struct grn_source *source, int client, int *out_err );
 
 // END client-specific
 
@@ -194,13 +334,14 @@ void grn_cat_client( struct vector *vec, int client, int *out_err );
  * @param extension the file extension of torrents. If NULL, uses ".torrent". Does not apply to single files; only when searching directories
  * If a filesystem error is encountered (unreadable and nonexistant files, for example) this function will set out_err to GRN_ERR_FS
  * but attempt to continue and return an accurate value anyway.
+ * Symlinks are followed, but each directory is only searched once. On Linux, subdirectories are searched on several
+ * threads, and it's safe to call from more than one thread at a time.
  */
 void grn_cat_torrent_files( struct vector *vec, const char *path, const char *extension, int *out_err );
+// like grn_cat_torrent_files, but pushes each file as soon as the directory it's in has been read
+void grn_source_cat_torrent_files( struct grn_source *source, const char *path, const char *extension, int *out_err );
 
 // BEGIN transform catting
-// ONE DAY, we will have a proper vector implementation that can just append a whole buffer to itself
-// but then, how do you handle freeing the elements, if you have no idea how they were allocated?
-// (after all, the buffer those items were added from is unknown!)
 
 /**
  * Adds the orpheus default transforms to the list.
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "paths.h"
+
+// names are packed into blocks this big. Longer names get a block of their own.
+#define PATHS_BLOCK_N 65536
+
+struct paths_block {
+	struct paths_block *next;
+	uint32_t seq; // counts up from 0 in the order blocks are started
+	size_t used_n;
+	size_t allocated_n;
+	char data[];
+};
+
+struct paths_dir {
+	const char *dir;
+	uint32_t dir_n;
+	uint64_t hash;
+};
+
+struct grn_paths {
+	// names, oldest first. Paths are only ever added to the last block.
+	struct paths_block *names;
+	struct paths_block *names_last;
+	// directories, which are never released
+	struct paths_block *dirs;
+	struct paths_block *dirs_last;
+	// open addressing on the directories' hashes. dir NULL marks an empty slot.
+	struct paths_dir *dirs_index;
+	size_t dirs_n;
+	size_t dirs_allocated;
+	// consecutive paths are usually in the same directory
+	struct paths_dir dir_last;
+};
+
+struct grn_paths *grn_paths_alloc( int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_paths *paths = calloc( 1, sizeof( struct grn_paths ) );
+	ERR_NULL( paths == NULL, GRN_ERR_OOM );
+	return paths;
+}
+
+void paths_blocks_free( struct paths_block *block ) {
+	while ( block != NULL ) {
+		struct paths_block *next = block->next;
+		free( block );
+		block = next;
+	}
+}
+
+void grn_paths_free( struct grn_paths *paths ) {
+	if ( paths == NULL ) {
+		return;
+	}
+	paths_blocks_free( paths->names );
+	paths_blocks_free( paths->dirs );
+	free( paths->dirs_index );
+	free( paths );
+}
+
+// room for n bytes in the last block of a list, starting a new one after it if it's full
+char *paths_block_take( struct paths_block **last, uint32_t seq, size_t n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct paths_block *block = *last;
+	if ( block == NULL || block->allocated_n - block->used_n < n ) {
+		size_t allocated_n = n > PATHS_BLOCK_N ? n : PATHS_BLOCK_N;
+		block = malloc( sizeof( struct paths_block ) + allocated_n );
+		ERR_NULL( block == NULL, GRN_ERR_OOM );
+		block->next = NULL;
+		block->seq = seq;
+		block->used_n = 0;
+		block->allocated_n = allocated_n;
+		if ( *last != NULL ) {
+			( *last )->next = block;
+		}
+		*last = block;
+	}
+	char *taken = block->data + block->used_n;
+	block->used_n += n;
+	return taken;
+}
+
+// FNV-1a
+uint64_t paths_hash( const char *dir, size_t dir_n, bool slash ) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for ( size_t i = 0; i < dir_n; i++ ) {
+		hash = ( hash ^ ( unsigned char ) dir[i] ) * 0x100000001B3ULL;
+	}
+	if ( slash ) {
+		hash = ( hash ^ '/' ) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+bool paths_dir_eq( struct paths_dir stored, const char *dir, size_t dir_n, bool slash, uint64_t hash ) {
+	return stored.hash == hash &&
+	       stored.dir_n == dir_n + slash &&
+	       memcmp( stored.dir, dir, dir_n ) == 0;
+}
+
+// the stored copy of dir, stored now if it hasn't been before
+struct paths_dir paths_intern( struct grn_paths *paths, const char *dir, size_t dir_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	bool slash = dir_n > 0 && dir[dir_n - 1] != '/';
+#ifdef _WIN32
+	slash = slash && dir[dir_n - 1] != '\\';
+#endif
+	uint64_t hash = paths_hash( dir, dir_n, slash );
+	if ( paths->dir_last.dir != NULL && paths_dir_eq( paths->dir_last, dir, dir_n, slash, hash ) ) {
+		return paths->dir_last;
+	}
+
+	// kept at most half full
+	if ( ( paths->dirs_n + 1 ) * 2 > paths->dirs_allocated ) {
+		size_t allocated = paths->dirs_allocated ? paths->dirs_allocated * 2 : 64;
+		struct paths_dir *index = calloc( allocated, sizeof( struct paths_dir ) );
+		if ( index == NULL ) {
+			*out_err = GRN_ERR_OOM;
+			return ( struct paths_dir ) { 0 };
+		}
+		for ( size_t i = 0; i < paths->dirs_allocated; i++ ) {
+			if ( paths->dirs_index[i].dir == NULL ) {
+				continue;
+			}
+			size_t j = paths->dirs_index[i].hash & ( allocated - 1 );
+			while ( index[j].dir != NULL ) {
+				j = ( j + 1 ) & ( allocated - 1 );
+			}
+			index[j] = paths->dirs_index[i];
+		}
+		free( paths->dirs_index );
+		paths->dirs_index = index;
+		paths->dirs_allocated = allocated;
+	}
+
+	size_t i = hash & ( paths->dirs_allocated - 1 );
+	for ( ; paths->dirs_index[i].dir != NULL; i = ( i + 1 ) & ( paths->dirs_allocated - 1 ) ) {
+		if ( paths_dir_eq( paths->dirs_index[i], dir, dir_n, slash, hash ) ) {
+			paths->dir_last = paths->dirs_index[i];
+			return paths->dir_last;
+		}
+	}
+
+	char *stored = paths_block_take( &paths->dirs_last, 0, dir_n + slash, out_err );
+	if ( *out_err ) {
+		return ( struct paths_dir ) { 0 };
+	}
+	if ( paths->dirs == NULL ) {
+		paths->dirs = paths->dirs_last;
+	}
+	memcpy( stored, dir, dir_n );
+	if ( slash ) {
+		stored[dir_n] = '/';
+	}
+	paths->dirs_index[i] = ( struct paths_dir ) {
+		.dir = stored,
+		.dir_n = dir_n + slash,
+		.hash = hash,
+	};
+	paths->dirs_n++;
+	paths->dir_last = paths->dirs_index[i];
+	return paths->dir_last;
+}
+
+struct grn_path grn_paths_add( struct grn_paths *paths, const char *dir, size_t dir_n, const char *name, size_t name_n, int *out_err ) {
+	*out_err = GRN_OK;
+
+	struct grn_path path = { 0 };
+	struct paths_dir stored_dir = paths_intern( paths, dir, dir_n, out_err );
+	if ( *out_err ) {
+		return path;
+	}
+	uint32_t seq = paths->names_last != NULL ? paths->names_last->seq + 1 : 0;
+	char *stored_name = paths_block_take( &paths->names_last, seq, name_n + 1, out_err );
+	if ( *out_err ) {
+		return path;
+	}
+	if ( paths->names == NULL ) {
+		paths->names = paths->names_last;
+	}
+	memcpy( stored_name, name, name_n + 1 );
+
+	path.dir = stored_dir.dir;
+	path.dir_n = stored_dir.dir_n;
+	path.name = stored_name;
+	path.name_n = name_n;
+	path.block = paths->names_last->seq;
+	return path;
+}
+
+struct grn_path grn_paths_add_path( struct grn_paths *paths, const char *path, int *out_err ) {
+	const char *slash = strrchr( path, '/' );
+#ifdef _WIN32
+	const char *backslash = strrchr( path, '\\' );
+	if ( backslash != NULL && ( slash == NULL || backslash > slash ) ) {
+		slash = backslash;
+	}
+#endif
+	size_t dir_n = slash != NULL ? ( size_t ) ( slash - path + 1 ) : 0;
+	return grn_paths_add( paths, path, dir_n, path + dir_n, strlen( path + dir_n ), out_err );
+}
+
+void grn_paths_release( struct grn_paths *paths, uint32_t block ) {
+	while ( paths->names != paths->names_last && paths->names->seq < block ) {
+		struct paths_block *next = paths->names->next;
+		free( paths->names );
+		paths->names = next;
+	}
+}
+
+bool grn_path_join( struct grn_path path, char *buf, size_t buf_n ) {
+	if ( ( size_t ) path.dir_n + path.name_n + 1 > buf_n ) {
+		return false;
+	}
+	memcpy( buf, path.dir, path.dir_n );
+	memcpy( buf + path.dir_n, path.name, path.name_n + 1 );
+	return true;
+}
@@ -0,0 +1,46 @@
+#ifndef H_GRN_PATHS
+#define H_GRN_PATHS
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Storage for lots of paths at once. Names are packed into big blocks instead of each getting an allocation of its own,
+ * and each directory is only stored once for all the paths in it.
+ */
+struct grn_paths;
+
+// a path in a grn_paths, split where its directory ends. Valid until the block its name is in is released.
+struct grn_path {
+	const char *dir; // ends with a slash unless it's empty. Not NUL terminated.
+	const char *name; // NUL terminated
+	uint32_t dir_n;
+	uint32_t name_n;
+	uint32_t block; // the block name is in, for grn_paths_release
+};
+
+struct grn_paths *grn_paths_alloc( int *out_err );
+// noop if null
+void grn_paths_free( struct grn_paths *paths );
+/**
+ * Store a path by its parts. Storing a directory that's been stored before takes no more room.
+ * @param dir not NUL terminated. Gets a slash after it unless it's empty or already ends with one.
+ * @param name NUL terminated
+ */
+struct grn_path grn_paths_add( struct grn_paths *paths, const char *dir, size_t dir_n, const char *name, size_t name_n, int *out_err );
+// store a whole path, split after its last slash
+struct grn_path grn_paths_add_path( struct grn_paths *paths, const char *path, int *out_err );
+/**
+ * Free the names in the blocks before block, for when paths are let go of in the order they were added.
+ * The block paths are being added to is kept either way, and directories are kept until the end.
+ */
+void grn_paths_release( struct grn_paths *paths, uint32_t block );
+
+/**
+ * Write the whole path into buf, NUL terminated.
+ * @return false if it doesn't fit in buf_n bytes
+ */
+bool grn_path_join( struct grn_path path, char *buf, size_t buf_n );
+
+#endif
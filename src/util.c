@@ -18,6 +18,22 @@ void *grn_malloc( size_t sz, int *out_err ) {
 	return to_return;
 }
 
+// memmem, which isn't everywhere
+bool grn_contains( const char *str, size_t str_n, const char *lit, size_t lit_n ) {
+	const char *end = str + str_n;
+	while ( ( size_t ) ( end - str ) >= lit_n ) {
+		const char *found = memchr( str, lit[0], end - str - lit_n + 1 );
+		if ( found == NULL ) {
+			return false;
+		}
+		if ( memcmp( found, lit, lit_n ) == 0 ) {
+			return true;
+		}
+		str = found + 1;
+	}
+	return false;
+}
+
 char *grn_strcpy_malloc( const char *in, int *out_err ) {
 	*out_err = GRN_OK;
 
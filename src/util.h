@@ -1,9 +1,14 @@
 #ifndef H_GRN_UTIL
 #define H_GRN_UTIL
 
+#include <stdbool.h>
+#include <stddef.h>
+
 void grn_free( void *arg );
 void *grn_malloc( size_t size, int *out_err );
 char *grn_strcpy_malloc( const char *in, int *out_err );
 void grn_decode_url( char *dst, const char *src );
+// whether lit is somewhere in str. Neither needs to be NUL terminated, but lit can't be empty.
+bool grn_contains( const char *str, size_t str_n, const char *lit, size_t lit_n );
 
 #endif
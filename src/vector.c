@@ -9,7 +9,7 @@
 struct vector *vector_alloc( int sz, int *out_err ) {
 	*out_err = GRN_OK;
 
-	struct vector *to_return = malloc( sizeof( struct vector ) );
+	struct vector *to_return = calloc( 1, sizeof( struct vector ) );
 	if ( to_return == NULL ) {
 		*out_err = GRN_ERR_OOM;
 		return NULL;
@@ -41,21 +41,45 @@ void vector_free_all( struct vector *free_me ) {
 	for ( int i = 0; i < vector_length( free_me ); i++ ) {
 		grn_free( *( void ** )vector_get( free_me, i ) );
 	}
-	free( free_me );
+	vector_free( free_me );
+}
+
+void vector_reserve( struct vector *vector, int n, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( vector != NULL );
+
+	if ( n <= vector->allocated_n ) {
+		return;
+	}
+	// doubles, so that pushing one at a time still only reallocates log(n) times
+	int allocated_n = vector->allocated_n;
+	while ( allocated_n < n ) {
+		allocated_n *= 2;
+	}
+	void *buffer_new = realloc( vector->buffer, ( size_t ) allocated_n * vector->sz );
+	ERR( buffer_new == NULL, GRN_ERR_OOM );
+	vector->buffer = buffer_new;
+	vector->allocated_n = allocated_n;
 }
 
 void vector_push( struct vector *vector, void *push_me, int *out_err ) {
 	assert( vector != NULL );
 	assert( push_me != NULL );
-	vector->used_n++;
-	if ( vector->used_n > vector->allocated_n ) {
-		vector->allocated_n *= 2;
-		void **buffer_new = realloc( vector->buffer, vector->allocated_n * vector->sz );
-		ERR( vector->buffer == NULL, GRN_ERR_OOM );
-		vector->buffer = buffer_new;
+	vector_append( vector, push_me, 1, out_err );
+}
+
+void vector_append( struct vector *vector, const void *items, int n, int *out_err ) {
+	*out_err = GRN_OK;
+	assert( vector != NULL );
+	assert( n >= 0 );
+
+	vector_reserve( vector, vector->used_n + n, out_err );
+	ERR_FW();
+	if ( n == 0 ) {
+		return;
 	}
-	memcpy( vector->buffer + ( vector->used_n - 1 ) * vector->sz , push_me, vector->sz );
-	RETURN_OK();
+	memcpy( ( char * ) vector->buffer + ( size_t ) vector->used_n * vector->sz, items, ( size_t ) n * vector->sz );
+	vector->used_n += n;
 }
 
 size_t vector_length( const struct vector *vector ) {
@@ -65,7 +89,12 @@ size_t vector_length( const struct vector *vector ) {
 void *vector_get( struct vector *vector, int i ) {
 	assert( i >= 0 );
 	assert( i < vector->used_n );
-	return vector->buffer + i * vector->sz;
+	return ( char * ) vector->buffer + ( size_t ) i * vector->sz;
+}
+
+void *vector_get_sz( struct vector *vector, int i, int sz ) {
+	assert( vector->sz == sz );
+	return vector_get( vector, i );
 }
 
 void *vector_get_last( struct vector *vector ) {
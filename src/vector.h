@@ -8,6 +8,9 @@ struct vector {
 	int sz;
 };
 
+// the element at i, as type. Asserts that type is the size the vector was allocated with.
+#define VECTOR_AT( vector, type, i ) ( * ( type * ) vector_get_sz( ( vector ), ( i ), sizeof( type ) ) )
+
 struct vector *vector_alloc( int sz, int *out_err );
 // noop if null
 void vector_free( struct vector *free_me );
@@ -15,15 +18,25 @@ void vector_free( struct vector *free_me );
 void vector_free_all( struct vector *free_me );
 // will copy push_me by value
 void vector_push( struct vector *vector, void *push_me, int *out_err );
+/**
+ * Copy n elements from items onto the end, growing at most once.
+ * Like vector_push, the elements are copied by value: the vector doesn't know how to free what they point to,
+ * so whoever frees the vector (or its export) has to know where every element came from.
+ */
+void vector_append( struct vector *vector, const void *items, int n, int *out_err );
+// make room for n elements in total, so pushes up to there never reallocate
+void vector_reserve( struct vector *vector, int n, int *out_err );
 size_t vector_length( const struct vector *vector );
 void *vector_get( struct vector *vector, int i );
+// vector_get, asserting that the elements are sz bytes
+void *vector_get_sz( struct vector *vector, int i, int sz );
 void *vector_get_last( struct vector *vector );
 // the element returned is only valid until the vector is modified.
 void *vector_pop( struct vector *vector );
 // do not access previously popped or exported after this
 void vector_clear( struct vector *vector );
 /**
- * Convert a vector into a simple buffer. You still must free the vector later.
+ * Convert a vector into a simple buffer. The vector itself is freed.
  * @param vector the vector to export
  * @param n where to put the size of the exported vector.
  * @return pointer to the dynamically allocated array of vector contents.
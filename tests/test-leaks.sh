@@ -36,5 +36,49 @@ cp -r tests/fixtures/basic-in .tmp/greeny-basic-in
 grind --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
 assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
 
+rm -rf .tmp/greeny-basic-in
+cp -r tests/fixtures/basic-in .tmp/greeny-basic-in
+grind --jobs 4 --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
+assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
+
+# nested directories, with a symlink back up that must not be followed in circles
+rm -rf .tmp/greeny-nested-in
+mkdir -p .tmp/greeny-nested-in/a/b .tmp/greeny-nested-in/c
+cp tests/fixtures/basic-in/me.torrent .tmp/greeny-nested-in/a/b/
+cp tests/fixtures/basic-in/me.torrent .tmp/greeny-nested-in/c/
+ln -s ../.. .tmp/greeny-nested-in/a/b/up
+grind --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-nested-in
+assert_dir_eq .tmp/greeny-nested-in/a/b/me.torrent tests/fixtures/basic-out/me.torrent
+assert_dir_eq .tmp/greeny-nested-in/c/me.torrent tests/fixtures/basic-out/me.torrent
+
+rm -rf .tmp/greeny-basic-in
+cp -r tests/fixtures/basic-in .tmp/greeny-basic-in
+grind --pipeline 2 --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
+assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
+
+rm -rf .tmp/greeny-basic-in
+cp -r tests/fixtures/basic-in .tmp/greeny-basic-in
+grind --io-depth 8 --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
+assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
+
+# the second run should know from the cache that there's nothing to do
+rm -rf .tmp/greeny-basic-in .tmp/greeny-cache
+cp -r tests/fixtures/basic-in .tmp/greeny-basic-in
+grind --cache .tmp/greeny-cache --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
+grind --cache .tmp/greeny-cache --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in | grep -q 'Skipped 1 files' || {
+	echo 'The cache did not skip a file it had already processed.';
+	exit 1;
+}
+assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
+
+# already converted, so nothing should be rewritten
+touch -d '2001-01-01' .tmp/greeny-basic-in/me.torrent
+grind --orpheus abcdef0123456789abcdef0123456789 .tmp/greeny-basic-in
+assert_dir_eq .tmp/greeny-basic-in tests/fixtures/basic-out
+[[ -n "$(find .tmp/greeny-basic-in/me.torrent ! -newermt '2001-01-02')" ]] || {
+	echo 'An unchanged file was rewritten.';
+	exit 1;
+}
+
 echo
 echo 'All tests passed.'
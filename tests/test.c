@@ -1,7 +1,12 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <regex.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -11,6 +16,11 @@
 #include "../src/err.h"
 #include "../src/vector.h"
 #include "../src/libannouncebulk.h"
+#include "../src/dfa.h"
+#include "../src/cache.h"
+#include "../src/paths.h"
+#include "../src/util.h"
+#include "bencode.h"
 
 #define ASSERT_OK() assert_int_equal( in_err, GRN_OK );
 
@@ -56,6 +66,29 @@ static void test_vector( void **state ) {
 	void *export_buffer = vector_export( vec, &export_length );
 	assert_int_equal( export_length, 2 );
 	assert_ptr_equal( export_buffer, pre_export_buffer );
+	free( export_buffer );
+
+	// reserve and bulk append
+	int ints[100];
+	for ( int i = 0; i < 100; i++ ) {
+		ints[i] = i;
+	}
+	vec = vector_alloc( sizeof( int ), &in_err );
+	ASSERT_OK();
+	vector_reserve( vec, 70, &in_err );
+	ASSERT_OK();
+	assert_true( vec->allocated_n >= 70 );
+	void *reserved_buffer = vec->buffer;
+	vector_append( vec, ints, 70, &in_err );
+	ASSERT_OK();
+	assert_ptr_equal( vec->buffer, reserved_buffer );
+	vector_append( vec, ints + 70, 30, &in_err );
+	ASSERT_OK();
+	assert_int_equal( vector_length( vec ), 100 );
+	for ( int i = 0; i < 100; i++ ) {
+		assert_int_equal( VECTOR_AT( vec, int, i ), i );
+	}
+	vector_free( vec );
 }
 
 char *strsubst( const char *haystack, const char *find, const char *replace, int *out_err );
@@ -103,18 +136,71 @@ static void test_strsubst( void **state ) {
 }
 
 void transform_buffer( struct grn_ctx *ctx, int *out_err );
+void free_output_ctx( struct grn_ctx *ctx );
 
 // line numbers aren't reported right when it's a real function. kekek
-void _assert_transform_buffer_single( const char *buffer, struct grn_transform transform, char *expected_buffer ) {
+// plan may be NULL, to have the context compile its own
+void _assert_transform_buffer_many( const char *buffer, struct grn_transform *transforms, int transforms_n, struct grn_plan *plan, char *expected_buffer ) {
 	int in_err;
 
-	char *boop[] = {
-		"yap",
+	struct grn_path boop[] = {
+		{ .dir = "", .name = "yap", .name_n = 3 },
 	};
 	struct grn_ctx my_ctx = {
 		.state = GRN_CTX_TRANSFORM,
 		.buffer = malloc( 256 ),
 		.buffer_n = strlen( buffer ), // they don't need to know about that silly null byte
+		.transforms = transforms,
+		.transforms_n = transforms_n,
+		.files_c = 0,
+		.files_n = 1,
+		.files = boop,
+	};
+	if ( plan != NULL ) {
+		grn_ctx_set_plan( &my_ctx, plan );
+	}
+	strcpy( my_ctx.buffer, buffer );
+	transform_buffer( &my_ctx, &in_err );
+	ASSERT_OK();
+	// files no transform could change don't get any output
+	if ( my_ctx.out_unchanged ) {
+		assert_string_equal( buffer, expected_buffer );
+	} else {
+		// the output is in chunks, pointing into the original buffer where it wasn't modified
+		assert_int_equal( my_ctx.out_n, strlen( expected_buffer ) );
+		char *joined = malloc( my_ctx.out_n + 1 );
+		size_t joined_n = 0;
+		for ( size_t i = 0; i < my_ctx.out_iov_n; i++ ) {
+			memcpy( joined + joined_n, my_ctx.out_iov[i].base, my_ctx.out_iov[i].len );
+			joined_n += my_ctx.out_iov[i].len;
+		}
+		assert_int_equal( joined_n, my_ctx.out_n );
+		assert_memory_equal( joined, expected_buffer, joined_n );
+		free( joined );
+	}
+	free_output_ctx( &my_ctx );
+	free( my_ctx.buffer );
+	if ( my_ctx.plan_owned ) {
+		grn_plan_free( my_ctx.plan );
+	}
+	ben_arena_free( my_ctx.arena );
+}
+
+void _assert_transform_buffer_single( const char *buffer, struct grn_transform transform, char *expected_buffer ) {
+	_assert_transform_buffer_many( buffer, &transform, 1, NULL, expected_buffer );
+}
+
+// malformed files have to be reported the same way, whichever way the transform is done
+void _assert_transform_buffer_error( const char *buffer, struct grn_transform transform, int expected_err ) {
+	int in_err;
+
+	struct grn_path boop[] = {
+		{ .dir = "", .name = "yap", .name_n = 3 },
+	};
+	struct grn_ctx my_ctx = {
+		.state = GRN_CTX_TRANSFORM,
+		.buffer = malloc( 256 ),
+		.buffer_n = strlen( buffer ),
 		.transforms = &transform,
 		.transforms_n = 1,
 		.files_c = 0,
@@ -123,11 +209,15 @@ void _assert_transform_buffer_single( const char *buffer, struct grn_transform t
 	};
 	strcpy( my_ctx.buffer, buffer );
 	transform_buffer( &my_ctx, &in_err );
-	ASSERT_OK();
-	assert_memory_equal( my_ctx.buffer, expected_buffer, my_ctx.buffer_n );
+	assert_int_equal( in_err, expected_err );
+	free_output_ctx( &my_ctx );
 	free( my_ctx.buffer );
+	grn_plan_free( my_ctx.plan );
+	ben_arena_free( my_ctx.arena );
 }
 
+uint64_t transforms_hash( const struct grn_transform *, int );
+
 // test buffer transforms when they will do the transform as expected.
 static void test_transform_buffer( void **state ) {
 	( void ) state;
@@ -170,6 +260,20 @@ static void test_transform_buffer( void **state ) {
 	_assert_transform_buffer_single( "d6:presto5:largoe", transform_set_presto, "d6:presto5:largoe" );
 	_assert_transform_buffer_single( "d6:presto4:lapde", transform_sub_presto, "d6:presto4:lapde" );
 
+	// only the deleted entry goes away
+	_assert_transform_buffer_single( "d1:a1:b6:presto5:largo1:zi3ee", transform_del_presto, "d1:a1:b1:zi3ee" );
+	// nothing a transform looks for, or trailing garbage the rewrite drops
+	_assert_transform_buffer_single( "d1:ad1:bi1eee", transform_sub_presto, "d1:ad1:bi1eee" );
+	_assert_transform_buffer_single( "d1:a1:bejunk", transform_del_presto, "d1:a1:be" );
+	// entries are found past nested and empty containers
+	_assert_transform_buffer_single( "d1:ald1:xlleeee1:bde6:presto5:largo1:zlee", transform_del_presto, "d1:ald1:xlleeee1:bde1:zlee" );
+
+	// test malformed files
+	_assert_transform_buffer_error( "d6:presto5:largo", transform_sub_presto, GRN_ERR_BENCODE_SYNTAX );
+	_assert_transform_buffer_error( "d6:presto5:largo1:a1:be", transform_del_presto, GRN_ERR_BENCODE_SYNTAX );
+	_assert_transform_buffer_error( "i03e", transform_sub_presto, GRN_ERR_BENCODE_SYNTAX );
+	_assert_transform_buffer_error( "d1:ald1:xe6:presto5:largoe", transform_del_presto, GRN_ERR_BENCODE_SYNTAX );
+
 	// test incorrect types
 	_assert_transform_buffer_single( "6:presto", transform_set_presto, "6:presto" );
 	_assert_transform_buffer_single( "6:presto", transform_del_presto, "6:presto" );
@@ -200,6 +304,67 @@ static void test_transform_buffer( void **state ) {
 	    transform_sub_deep,
 	    "d5:hellod5:listol4:fapd6:retapde4:what2:cde10:helloworld4:flip5:worldd5:listol4:fapd6:retapde4:what2:cdee"
 	);
+
+	// the pattern is copied, so the caller's buffer can go away before the cache hashes it
+	char pattern[] = "m.{3}";
+	struct grn_transform from_buffer = grn_mktransform_substitute_regex( pattern, "mm", &in_err );
+	ASSERT_OK();
+	struct grn_transform from_literal = grn_mktransform_substitute_regex( "m.{3}", "mm", &in_err );
+	ASSERT_OK();
+	from_buffer.key = from_literal.key = key_dummy;
+	memset( pattern, 'x', sizeof( pattern ) - 1 );
+	assert_string_equal( from_buffer.payload.substitute_regex.find_str, "m.{3}" );
+	assert_true( transforms_hash( &from_buffer, 1 ) == transforms_hash( &from_literal, 1 ) );
+	grn_free_transform( &from_buffer );
+	grn_free_transform( &from_literal );
+}
+
+// several transforms on overlapping keys have to act like they were applied one after another
+static void test_transform_plan( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char *key_root[] = { NULL };
+	char *key_a[] = { "a", NULL };
+	char *key_any[] = { "", NULL };
+	char *key_any_b[] = { "", "b", NULL };
+
+	struct grn_transform transforms[] = {
+		grn_mktransform_substitute( "x", "y" ),
+		grn_mktransform_substitute( "y", "z" ),
+		grn_mktransform_delete( "c" ),
+		grn_mktransform_substitute( "x", "y" ),
+		grn_mktransform_substitute( "y", "w" ),
+	};
+	transforms[0].key = key_a;
+	transforms[1].key = key_any;
+	transforms[2].key = key_root;
+	transforms[3].key = key_any_b;
+	transforms[4].key = key_any_b;
+
+	// a is reached both by name and by wildcard, and goes x -> y -> z
+	_assert_transform_buffer_many(
+	    "d1:a1:x1:bd1:b1:xe1:cd1:b1:xee",
+	    transforms, 5, NULL,
+	    "d1:a1:z1:bd1:b1:wee"
+	);
+
+	// a plan can be compiled once and shared between contexts
+	struct grn_plan *plan = grn_plan_compile( transforms, 5, &in_err );
+	ASSERT_OK();
+	_assert_transform_buffer_many( "d1:a1:xe", transforms, 5, plan, "d1:a1:ze" );
+	_assert_transform_buffer_many( "d1:bd1:b1:xee", transforms, 5, plan, "d1:bd1:b1:wee" );
+	grn_plan_free( plan );
+
+	// keys set by one transform can be reached by the next
+	char *key_n[] = { "n", NULL };
+	struct grn_transform set_then_sub[] = {
+		grn_mktransform_set_string( "n", "xx" ),
+		grn_mktransform_substitute( "x", "y" ),
+	};
+	set_then_sub[0].key = key_root;
+	set_then_sub[1].key = key_n;
+	_assert_transform_buffer_many( "de", set_then_sub, 2, NULL, "d1:n2:yxe" );
 }
 
 bool is_string_passphrase( const char * );
@@ -285,7 +450,8 @@ static void test_cat_orpheus_transforms( void **state ) {
 	grn_free_transforms_v( my_vec );
 }
 
-char *regsubst( char *, regex_t *, char *, bool, int * );
+char *regsubst( char *, regex_t *, struct grn_dfa *, char *, bool, int * );
+char *regsubst_n( char *, size_t, regex_t *, struct grn_dfa *, char *, bool, size_t *, int * );
 
 static void test_regsubst_all( void **state ) {
 	( void ) state;
@@ -294,27 +460,27 @@ static void test_regsubst_all( void **state ) {
 	regex_t yarr;
 	regcomp( &yarr, "yar*", 0 );
 
-	char *singular = regsubst( "i am the yarr of yarrs", &yarr, "afar", false, &in_err );
+	char *singular = regsubst( "i am the yarr of yarrs", &yarr, NULL, "afar", false, &in_err );
 	ASSERT_OK();
 	assert_string_equal( singular, "i am the afar of yarrs" );
 	free( singular );
 
-	char *not_a_pirate = regsubst( "Barr m8ies", &yarr, "rahrchrhr", true, &in_err );
+	char *not_a_pirate = regsubst( "Barr m8ies", &yarr, NULL, "rahrchrhr", true, &in_err );
 	ASSERT_OK();
 	assert_string_equal( not_a_pirate, "Barr m8ies" );
 	free( not_a_pirate );
 
-	char *a_pirate = regsubst( "yarr m8ies", &yarr, "afar", true, &in_err );
+	char *a_pirate = regsubst( "yarr m8ies", &yarr, NULL, "afar", true, &in_err );
 	ASSERT_OK();
 	assert_string_equal( a_pirate, "afar m8ies" );
 	free( a_pirate );
 
-	char *many_pirates = regsubst( "yarr m99ies yaryar m8", &yarr, "afar", true, &in_err );
+	char *many_pirates = regsubst( "yarr m99ies yaryar m8", &yarr, NULL, "afar", true, &in_err );
 	ASSERT_OK();
 	assert_string_equal( many_pirates, "afar m99ies afarafar m8" );
 	free( many_pirates );
 
-	char *weird_pirates = regsubst( "yayaryarrr", &yarr, "yarrr", true, &in_err );
+	char *weird_pirates = regsubst( "yayaryarrr", &yarr, NULL, "yarrr", true, &in_err );
 	ASSERT_OK();
 	assert_string_equal( weird_pirates, "yarrryarrryarrr" );
 	free( weird_pirates );
@@ -322,16 +488,1033 @@ static void test_regsubst_all( void **state ) {
 	regfree( &yarr );
 }
 
+// global substitution over whole files, like deluge's torrents.state, which can have NUL bytes
+static void test_regsubst_global( void **state ) {
+	( void ) state;
+	int in_err;
+
+	const char *patterns[] = { "yar*", "^a", "x*", "https://mars\\.apollo\\.rip/" };
+	regex_t regexes[4];
+	struct grn_dfa *dfas[4];
+	for ( int i = 0; i < 4; i++ ) {
+		assert_int_equal( regcomp( &regexes[i], patterns[i], REG_EXTENDED ), 0 );
+		dfas[i] = grn_dfa_compile( patterns[i], &in_err );
+		ASSERT_OK();
+		assert_non_null( dfas[i] );
+	}
+
+	const size_t many_n = 20000;
+	char *many = malloc( many_n + 1 );
+	for ( size_t i = 0; i < many_n; i += 2 ) {
+		memcpy( many + i, "ya", 2 );
+	}
+	many[many_n] = '\0';
+
+	// with and without the DFA
+	for ( int dfa_i = 0; dfa_i < 2; dfa_i++ ) {
+		size_t out_n;
+		char *out;
+
+		// NUL bytes are kept and nothing matches across them
+		char nuls[] = "yarr\0yar\0\0m8 yarrr";
+		out = regsubst_n( nuls, sizeof( nuls ) - 1, &regexes[0], dfa_i ? dfas[0] : NULL, "X", true, &out_n, &in_err );
+		ASSERT_OK();
+		assert_int_equal( out_n, 9 );
+		assert_memory_equal( out, "X\0X\0\0m8 X", 10 );
+		free( out );
+
+		// ^ only matches at the very start, not after each substitution
+		out = regsubst_n( "aaa", 3, &regexes[1], dfa_i ? dfas[1] : NULL, "X", true, &out_n, &in_err );
+		ASSERT_OK();
+		assert_string_equal( out, "Xaa" );
+		free( out );
+
+		// empty matches, like sed: not right after another match
+		out = regsubst_n( "xab", 3, &regexes[2], dfa_i ? dfas[2] : NULL, "-", true, &out_n, &in_err );
+		ASSERT_OK();
+		assert_string_equal( out, "-a-b-" );
+		free( out );
+
+		// back to back matches with a shorter replacement, which used to skip every other one
+		char adjacent[] = "https://mars.apollo.rip/https://mars.apollo.rip/announce";
+		out = regsubst_n( adjacent, sizeof( adjacent ) - 1, &regexes[3], dfa_i ? dfas[3] : NULL, "https://x.ch/", true, &out_n, &in_err );
+		ASSERT_OK();
+		assert_string_equal( out, "https://x.ch/https://x.ch/announce" );
+		free( out );
+
+		out = regsubst_n( many, many_n, &regexes[0], dfa_i ? dfas[0] : NULL, "yarr", true, &out_n, &in_err );
+		ASSERT_OK();
+		assert_int_equal( out_n, many_n * 2 );
+		assert_int_equal( strlen( out ), out_n );
+		assert_memory_equal( out + out_n - 8, "yarryarr", 8 );
+		free( out );
+	}
+
+	free( many );
+	for ( int i = 0; i < 4; i++ ) {
+		grn_dfa_free( dfas[i] );
+		regfree( &regexes[i] );
+	}
+}
+
+// the DFA has to find the same leftmost-longest matches as regexec
+static void test_dfa( void **state ) {
+	( void ) state;
+	int in_err;
+
+	const char *patterns[] = {
+		"https?:\\/\\/?((mars|home)\\.)?(apollo\\.rip|xanax\\.rip|opsfet\\.ch)(:2095)?\\/[a-f0-9]{32}\\/announce/?",
+		"yar*",
+		"a|ab|abc",
+		"(a|ab)(c|bcd)",
+		"x*",
+		"^ab+",
+		"b+c$",
+		"[]a-c]{2,3}",
+		"[^a-c]+",
+		"[[:digit:]]+\\.",
+		"(ab){2,}",
+		"m.{3}",
+	};
+	const char *subjects[] = {
+		"",
+		"https://mars.apollo.rip/abcdef0123456789abcdef0123456789/announce",
+		"http:/opsfet.ch:2095/abcdef0123456789abcdef0123456789/announce/",
+		"https://flacsfor.me/abcdef0123456789abcdef0123456789/announce",
+		"i am the yarr of yarrs",
+		"abcd",
+		"xxabcbcd",
+		"abbbc",
+		"]]cab",
+		"version 12.5",
+		"abababa",
+		"imeltunity",
+	};
+
+	for ( size_t i = 0; i < sizeof( patterns ) / sizeof( patterns[0] ); i++ ) {
+		regex_t regex;
+		assert_int_equal( regcomp( &regex, patterns[i], REG_EXTENDED ), 0 );
+		struct grn_dfa *dfa = grn_dfa_compile( patterns[i], &in_err );
+		ASSERT_OK();
+		assert_non_null( dfa );
+
+		for ( size_t j = 0; j < sizeof( subjects ) / sizeof( subjects[0] ); j++ ) {
+			regmatch_t match[1];
+			bool regex_matched = regexec( &regex, subjects[j], 1, match, 0 ) == 0;
+			size_t so, eo;
+			size_t subject_n = strlen( subjects[j] );
+			bool dfa_matched = grn_dfa_might_match( dfa, subjects[j], subject_n ) &&
+			                   grn_dfa_exec( dfa, subjects[j], subject_n, 0, &so, &eo );
+			assert_int_equal( dfa_matched, regex_matched );
+			if ( regex_matched ) {
+				assert_int_equal( so, match->rm_so );
+				assert_int_equal( eo, match->rm_eo );
+			}
+		}
+		grn_dfa_free( dfa );
+		regfree( &regex );
+	}
+
+	// one of the hosts has to be there, which rules out other trackers without running the DFA
+	struct grn_dfa *hosts = grn_dfa_compile( patterns[0], &in_err );
+	ASSERT_OK();
+	assert_false( grn_dfa_might_match( hosts, subjects[3], strlen( subjects[3] ) ) );
+	assert_true( grn_dfa_might_match( hosts, "http://xanax.rip/x/announce", 27 ) );
+	assert_false( grn_dfa_might_match( hosts, "http://xanax.ri/x/announce", 26 ) );
+	grn_dfa_free( hosts );
+
+	// high bytes are characters of their own in the C locale, so a negated set takes them like regexec does
+	{
+		regex_t regex;
+		regmatch_t match[1];
+		const char high[] = "a\xe9" "a";
+		size_t so, eo;
+		assert_int_equal( regcomp( &regex, "[^a]", REG_EXTENDED ), 0 );
+		struct grn_dfa *dfa = grn_dfa_compile( "[^a]", &in_err );
+		ASSERT_OK();
+		assert_non_null( dfa );
+		assert_int_equal( regexec( &regex, high, 1, match, 0 ), 0 );
+		assert_true( grn_dfa_exec( dfa, high, 3, 0, &so, &eo ) );
+		assert_int_equal( so, match->rm_so );
+		assert_int_equal( eo, match->rm_eo );
+		grn_dfa_free( dfa );
+		regfree( &regex );
+	}
+
+	// left to regcomp
+	assert_null( grn_dfa_compile( "(a)\\1", &in_err ) );
+	assert_null( grn_dfa_compile( "a^b", &in_err ) );
+	assert_null( grn_dfa_compile( "[[.a.]]", &in_err ) );
+	ASSERT_OK();
+}
+
+// untouched subtrees should be copied straight out of the source buffer
+static void test_encode_spliced( void **state ) {
+	( void ) state;
+
+	const char *src = "d8:announce3:foo4:infod6:lengthi5eee";
+	const char *expected = "d8:announce3:bar4:infod6:lengthi5eee";
+	struct bencode *ben = ben_decode( src, strlen( src ) );
+	assert_non_null( ben );
+	assert_int_equal( ben_dict_set_str_by_str( ben, "announce", "bar" ), 0 );
+
+	size_t iov_n, out_n;
+	char *scratch;
+	struct ben_iovec *iov = ben_encode_spliced( &iov_n, &scratch, &out_n, ben, src );
+	assert_non_null( iov );
+	assert_int_equal( out_n, strlen( expected ) );
+
+	size_t joined_n = 0;
+	bool info_from_src = false;
+	for ( size_t i = 0; i < iov_n; i++ ) {
+		assert_memory_equal( iov[i].base, expected + joined_n, iov[i].len );
+		const char *info = src + strlen( "d8:announce3:foo4:info" );
+		const char *base = iov[i].base;
+		if ( base <= info && base + iov[i].len >= info + strlen( "d6:lengthi5ee" ) ) {
+			info_from_src = true;
+		}
+		joined_n += iov[i].len;
+	}
+	assert_int_equal( joined_n, out_n );
+	assert_true( info_from_src );
+
+	free( iov );
+	free( scratch );
+	ben_free( ben );
+}
+
+static int expand_only_announce( void *arg, const struct bencode *const *path, int path_n ) {
+	( void ) arg;
+	return path_n == 1 && strcmp( ben_str_val( path[0] ), "announce" ) == 0;
+}
+
+// subtrees that aren't expanded are still validated, and encode back to the same bytes
+static void test_decode_lazy( void **state ) {
+	( void ) state;
+
+	const char *src = "d8:announce3:foo4:infod5:filesld6:lengthi5eee6:pieces3:abcee";
+	size_t off = 0;
+	int error;
+	struct bencode *ben = ben_decode_arena( src, strlen( src ), &off, &error, expand_only_announce, NULL, NULL, 0 );
+	assert_int_equal( error, BEN_OK );
+	assert_non_null( ben );
+	assert_int_equal( off, strlen( src ) );
+	assert_true( ben_is_str( ben_dict_get_by_str( ben, "announce" ) ) );
+	assert_true( ben_is_user( ben_dict_get_by_str( ben, "info" ) ) );
+
+	size_t encoded_n;
+	char *encoded = ben_encode( &encoded_n, ben );
+	assert_int_equal( encoded_n, strlen( src ) );
+	assert_memory_equal( encoded, src, encoded_n );
+	free( encoded );
+	ben_free( ben );
+
+	// unsorted keys inside of the skipped info dictionary
+	const char *bad = "d8:announce3:foo4:infod6:pieces3:abc5:filesleee";
+	off = 0;
+	assert_null( ben_decode_arena( bad, strlen( bad ), &off, &error, expand_only_announce, NULL, NULL, 0 ) );
+	assert_int_equal( error, BEN_INVALID );
+}
+
+// trees decoded into an arena can be modified like any other, and the arena reused afterwards
+static void test_decode_arena( void **state ) {
+	( void ) state;
+
+	struct ben_arena *arena = ben_arena_new();
+	assert_non_null( arena );
+	const char *src = "d8:announce3:foo4:infod6:pieces3:abce4:listli1ei2eee";
+	const char *expected = "d8:announce3:bar5:extrai7e4:listli1ei2ei0ei1ei2ei3ei4ei5ei6ei7ei8ei9eee";
+
+	for ( int round = 0; round < 2; round++ ) {
+		size_t off = 0;
+		int error;
+		struct bencode *ben = ben_decode_arena( src, strlen( src ), &off, &error, NULL, NULL, arena, round );
+		assert_int_equal( error, BEN_OK );
+		assert_non_null( ben );
+
+		char *bar = malloc( 4 );
+		strcpy( bar, "bar" );
+		ben_str_replace( ben_dict_get_by_str( ben, "announce" ), bar, 3 );
+		ben_free( ben_dict_pop_by_str( ben, "info" ) );
+		// grows the list's arena array onto the heap
+		struct bencode *list = ben_dict_get_by_str( ben, "list" );
+		for ( int i = 0; i < 10; i++ ) {
+			assert_int_equal( ben_list_append( list, ben_int( i ) ), 0 );
+		}
+		assert_int_equal( ben_dict_set_str_by_str( ben, "extra", "" ), 0 );
+		assert_int_equal( ben_dict_set( ben, ben_str( "extra" ), ben_int( 7 ) ), 0 );
+
+		size_t encoded_n;
+		char *encoded = ben_encode( &encoded_n, ben );
+		assert_int_equal( encoded_n, strlen( expected ) );
+		assert_memory_equal( encoded, expected, encoded_n );
+		free( encoded );
+		ben_free( ben );
+		ben_arena_reset( arena );
+	}
+	ben_arena_free( arena );
+}
+
+// borrowed strings point into the source until they're owned or replaced
+static void test_decode_borrowed( void **state ) {
+	( void ) state;
+
+	const char *src = "d8:announce3:foo7:comment5:hello4:infod6:pieces6:abcdefee";
+	size_t off = 0;
+	int error;
+	struct bencode *ben = ben_decode_arena( src, strlen( src ), &off, &error, NULL, NULL, NULL, true );
+	assert_int_equal( error, BEN_OK );
+	assert_non_null( ben );
+
+	struct bencode *pieces = ben_dict_get_by_str( ben_dict_get_by_str( ben, "info" ), "pieces" );
+	assert_ptr_equal( ben_str_val( pieces ), strstr( src, "abcdef" ) );
+	assert_int_equal( ben_str_len( pieces ), 6 );
+
+	struct bencode *comment = ben_dict_get_by_str( ben, "comment" );
+	assert_int_equal( ben_str_own( comment ), 0 );
+	assert_string_equal( ben_str_val( comment ), "hello" );
+	// already owned
+	assert_int_equal( ben_str_own( comment ), 0 );
+
+	size_t encoded_n;
+	char *encoded = ben_encode( &encoded_n, ben );
+	assert_int_equal( encoded_n, strlen( src ) );
+	assert_memory_equal( encoded, src, encoded_n );
+	free( encoded );
+	ben_free( ben );
+}
+
+// dicts are sized up front from a count of their entries, which mustn't matter for what's decoded
+static void test_decode_dict_sizes( void **state ) {
+	( void ) state;
+
+	// more entries than the count looks at, and nested containers in between
+	for ( int entries_n = 0; entries_n <= 3000; entries_n += entries_n < 10 ? 1 : 997 ) {
+		char *src = malloc( 2 + entries_n * 32 );
+		assert_non_null( src );
+		size_t src_n = 0;
+		char entry[32];
+		src[src_n++] = 'd';
+		for ( int i = 0; i < entries_n; i++ ) {
+			src_n += sprintf( src + src_n, "5:k%04dl%sd1:ai%dee1:xe", i, i % 2 ? "i1e" : "", i );
+		}
+		src[src_n++] = 'e';
+
+		size_t off = 0;
+		int error;
+		struct bencode *ben = ben_decode2( src, src_n, &off, &error );
+		assert_int_equal( error, BEN_OK );
+		assert_int_equal( ben_dict_len( ben ), entries_n );
+		for ( int i = 0; i < entries_n; i++ ) {
+			snprintf( entry, sizeof entry, "k%04d", i );
+			struct bencode *list = ben_dict_get_by_str( ben, entry );
+			assert_non_null( list );
+			assert_int_equal( ben_int_val( ben_dict_get_by_str( ben_list_get( list, i % 2 ), "a" ) ), i );
+		}
+		ben_free( ben );
+		free( src );
+	}
+
+	const char *bad[] = {
+		"d1:ai1e1:ai2ee", // duplicate
+		"d1:bi1e1:ai2ee", // out of order
+		"di1e1:a1:bi2ee", // ints first, in order
+		"d1:ai1ei1ei2ee", // ints before strings
+		"d1:ai1e1:bi2e", // no end
+	};
+	const int bad_errs[] = { BEN_INVALID, BEN_INVALID, BEN_OK, BEN_INVALID, BEN_INSUFFICIENT };
+	for ( size_t i = 0; i < sizeof( bad ) / sizeof( bad[0] ); i++ ) {
+		size_t off = 0;
+		int error;
+		struct bencode *ben = ben_decode2( bad[i], strlen( bad[i] ), &off, &error );
+		assert_int_equal( error, bad_errs[i] );
+		ben_free( ben );
+	}
+}
+
+// dicts are encoded in key order whichever order keys were added and removed in
+static void test_dict_order( void **state ) {
+	( void ) state;
+
+	for ( int shuffled = 0; shuffled < 2; shuffled++ ) {
+		struct bencode *dict = ben_dict();
+		assert_non_null( dict );
+		char key[16];
+		for ( int i = 0; i < 50; i++ ) {
+			// 7 and 50 are coprime, so this goes through all of them
+			snprintf( key, sizeof key, "k%02d", shuffled ? i * 7 % 50 : i );
+			assert_int_equal( ben_dict_set_str_by_str( dict, key, key ), 0 );
+		}
+		assert_int_equal( ben_dict_cast( dict )->unsorted, shuffled );
+		// from the front, the middle and the end
+		for ( int i = 0; i < 50; i += 3 ) {
+			snprintf( key, sizeof key, "k%02d", i );
+			ben_free( ben_dict_pop_by_str( dict, key ) );
+		}
+		assert_int_equal( ben_dict_cast( dict )->unsorted, shuffled );
+		for ( int i = 0; i < 50; i++ ) {
+			snprintf( key, sizeof key, "k%02d", i );
+			struct bencode *value = ben_dict_get_by_str( dict, key );
+			if ( i % 3 == 0 ) {
+				assert_null( value );
+			} else {
+				assert_non_null( value );
+				assert_string_equal( ben_str_val( value ), key );
+			}
+		}
+
+		// the decoder rejects keys that aren't in order
+		size_t encoded_n;
+		char *encoded = ben_encode( &encoded_n, dict );
+		assert_non_null( encoded );
+		size_t off = 0;
+		int error;
+		struct bencode *decoded = ben_decode2( encoded, encoded_n, &off, &error );
+		assert_int_equal( error, BEN_OK );
+		assert_int_equal( ben_cmp( decoded, dict ), 0 );
+		ben_free( decoded );
+		free( encoded );
+		ben_free( dict );
+	}
+}
+
+// encoding in one walk, growing the output as it goes, gives the same size the sizing pass predicts
+static void test_encode( void **state ) {
+	( void ) state;
+
+	const char *src = "d1:ai-9223372036854775808e1:bi9223372036854775807e1:ci0e1:dli-1ei10e"
+		"40:0123456789012345678901234567890123456789ee";
+	struct bencode *ben = ben_decode( src, strlen( src ) );
+	assert_non_null( ben );
+	size_t encoded_n;
+	char *encoded = ben_encode( &encoded_n, ben );
+	assert_non_null( encoded );
+	assert_int_equal( encoded_n, strlen( src ) );
+	assert_memory_equal( encoded, src, encoded_n );
+	assert_int_equal( ben_encoded_size( ben ), encoded_n );
+	free( encoded );
+	ben_free( ben );
+}
+
+static void test_paths( void **state ) {
+	( void ) state;
+	int in_err;
+	char joined[64];
+
+	struct grn_paths *paths = grn_paths_alloc( &in_err );
+	ASSERT_OK();
+	struct grn_path a = grn_paths_add( paths, "/tor/rents", 10, "a.torrent", 9, &in_err );
+	ASSERT_OK();
+	struct grn_path b = grn_paths_add_path( paths, "/tor/rents/b.torrent", &in_err );
+	ASSERT_OK();
+	struct grn_path c = grn_paths_add_path( paths, "/other/c.torrent", &in_err );
+	ASSERT_OK();
+	struct grn_path d = grn_paths_add_path( paths, "d.torrent", &in_err );
+	ASSERT_OK();
+	// the same directory is only stored once, however it's given
+	struct grn_path e = grn_paths_add( paths, "/tor/rents/", 11, "e.torrent", 9, &in_err );
+	ASSERT_OK();
+	assert_ptr_equal( a.dir, b.dir );
+	assert_ptr_equal( a.dir, e.dir );
+	assert_true( a.dir != c.dir );
+
+	assert_true( grn_path_join( a, joined, sizeof( joined ) ) );
+	assert_string_equal( joined, "/tor/rents/a.torrent" );
+	assert_true( grn_path_join( b, joined, sizeof( joined ) ) );
+	assert_string_equal( joined, "/tor/rents/b.torrent" );
+	assert_true( grn_path_join( c, joined, sizeof( joined ) ) );
+	assert_string_equal( joined, "/other/c.torrent" );
+	assert_true( grn_path_join( d, joined, sizeof( joined ) ) );
+	assert_string_equal( joined, "d.torrent" );
+	assert_string_equal( e.name, "e.torrent" );
+	assert_false( grn_path_join( a, joined, strlen( "/tor/rents/a.torrent" ) ) );
+
+	// enough names to fill a few blocks, released as they're let go of in order
+	struct grn_path last;
+	for ( int i = 0; i < 20000; i++ ) {
+		char name[32];
+		sprintf( name, "%05d.torrent", i );
+		last = grn_paths_add( paths, "/many", 5, name, strlen( name ), &in_err );
+		ASSERT_OK();
+	}
+	assert_true( last.block > a.block );
+	grn_paths_release( paths, last.block );
+	assert_true( grn_path_join( last, joined, sizeof( joined ) ) );
+	assert_string_equal( joined, "/many/19999.torrent" );
+	grn_paths_free( paths );
+
+	// paths set up front are moved into a pool
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	char **files = malloc( 2 * sizeof( char * ) );
+	files[0] = grn_strcpy_malloc( "/tor/rents/a.torrent", &in_err );
+	files[1] = grn_strcpy_malloc( "/tor/rents/b.torrent", &in_err );
+	grn_ctx_set_files( ctx, files, 2, &in_err );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_files_n( ctx ), 2 );
+	assert_ptr_equal( ctx->files[0].dir, ctx->files[1].dir );
+	char path[32], next_path[32] = "untouched";
+	assert_int_equal( grn_ctx_get_next_path( ctx, next_path, 20 ), 20 );
+	assert_string_equal( next_path, "untouched" );
+	assert_int_equal( grn_ctx_get_next_path( ctx, next_path, sizeof( next_path ) ), 20 );
+	assert_string_equal( next_path, "/tor/rents/a.torrent" );
+	// neither exists, but the current and next paths can both be held while the steps run
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	grn_ctx_set_transforms_v( ctx, transforms );
+	assert_false( grn_one_file( ctx, &in_err ) );
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_c_path( ctx, path, sizeof( path ) ), 20 );
+	assert_int_equal( grn_ctx_get_next_path( ctx, next_path, sizeof( next_path ) ), 20 );
+	assert_string_equal( path, "/tor/rents/a.torrent" );
+	assert_string_equal( next_path, "/tor/rents/b.torrent" );
+	assert_false( grn_one_file( ctx, &in_err ) );
+	ASSERT_OK();
+	assert_string_equal( path, "/tor/rents/a.torrent" );
+	assert_int_equal( grn_ctx_get_next_path( ctx, next_path, sizeof( next_path ) ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+}
+
+static void test_cache( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char path[] = "/tmp/greeny-cache-XXXXXX";
+	int fd = mkstemp( path );
+	assert_true( fd >= 0 );
+	close( fd );
+	remove( path );
+
+	// starts out empty when there's no file yet
+	struct grn_cache *cache = grn_cache_load( path, &in_err );
+	ASSERT_OK();
+	struct grn_cache_key key = { .dev = 1, .ino = 2, .size = 3, .mtime_ns = 4, .ctime_ns = 5 };
+	assert_false( grn_cache_fresh( cache, key, 42 ) );
+	grn_cache_record( cache, key, 42, &in_err );
+	ASSERT_OK();
+	assert_true( grn_cache_fresh( cache, key, 42 ) );
+	// different transforms, or a change to the file
+	assert_false( grn_cache_fresh( cache, key, 43 ) );
+	struct grn_cache_key changed = key;
+	changed.mtime_ns++;
+	assert_false( grn_cache_fresh( cache, changed, 42 ) );
+	// lots of files, so it has to grow
+	for ( uint64_t ino = 100; ino < 5000; ino++ ) {
+		struct grn_cache_key other = key;
+		other.ino = ino;
+		grn_cache_record( cache, other, 7, &in_err );
+		ASSERT_OK();
+	}
+	grn_cache_save( cache, &in_err );
+	ASSERT_OK();
+	grn_cache_free( cache );
+
+	cache = grn_cache_load( path, &in_err );
+	ASSERT_OK();
+	assert_true( grn_cache_fresh( cache, key, 42 ) );
+	key.ino = 4999;
+	assert_true( grn_cache_fresh( cache, key, 7 ) );
+	key.ino = 5000;
+	assert_false( grn_cache_fresh( cache, key, 7 ) );
+	grn_cache_free( cache );
+
+	// anything that isn't a cache is ignored
+	FILE *fh = fopen( path, "wb" );
+	fputs( "d8:announce3:fooe", fh );
+	fclose( fh );
+	cache = grn_cache_load( path, &in_err );
+	ASSERT_OK();
+	key.ino = 2;
+	assert_false( grn_cache_fresh( cache, key, 42 ) );
+	grn_cache_free( cache );
+	remove( path );
+}
+
+static void test_cat_torrent_files( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char dir[] = "/tmp/greeny-cat-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	char path[64];
+	sprintf( path, "%s/a.torrent", dir );
+	fclose( fopen( path, "wb" ) );
+	sprintf( path, "%s/sub", dir );
+	assert_int_equal( mkdir( path, 0755 ), 0 );
+	sprintf( path, "%s/sub/b.torrent", dir );
+	fclose( fopen( path, "wb" ) );
+
+	struct vector *vec = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	grn_cat_torrent_files( vec, dir, NULL, &in_err );
+	ASSERT_OK();
+	assert_int_equal( vector_length( vec ), 2 );
+	vector_free_all( vec );
+
+	vec = vector_alloc( sizeof( char * ), &in_err );
+	ASSERT_OK();
+	sprintf( path, "%s/typo", dir );
+	grn_cat_torrent_files( vec, path, NULL, &in_err );
+	assert_int_equal( in_err, GRN_ERR_ENOENT );
+	assert_int_equal( vector_length( vec ), 0 );
+
+	// permissions don't stop root
+	if ( geteuid() != 0 ) {
+		// an unreadable subdirectory is skipped, but an unreadable root is an error
+		sprintf( path, "%s/sub", dir );
+		chmod( path, 0 );
+		grn_cat_torrent_files( vec, dir, NULL, &in_err );
+		ASSERT_OK();
+		assert_int_equal( vector_length( vec ), 1 );
+		chmod( path, 0755 );
+		chmod( dir, 0 );
+		grn_cat_torrent_files( vec, dir, NULL, &in_err );
+		assert_int_equal( in_err, GRN_ERR_ENOENT );
+		chmod( dir, 0755 );
+	}
+	vector_free_all( vec );
+
+	sprintf( path, "%s/sub/b.torrent", dir );
+	remove( path );
+	sprintf( path, "%s/sub", dir );
+	remove( path );
+	sprintf( path, "%s/a.torrent", dir );
+	remove( path );
+	remove( dir );
+}
+
+// directories reachable through several symlinks are searched once, through the same one every time
+static void test_cat_symlinks( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char dir[] = "/tmp/greeny-cat-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	char path[64], target[16];
+	for ( int i = 0; i < 5; i++ ) {
+		sprintf( path, "%s/sub%d", dir, i );
+		assert_int_equal( mkdir( path, 0755 ), 0 );
+		sprintf( path, "%s/sub%d/%d.torrent", dir, i, i );
+		fclose( fopen( path, "wb" ) );
+		sprintf( target, "sub%d", i );
+		sprintf( path, "%s/link%d", dir, i );
+		assert_int_equal( symlink( target, path ), 0 );
+	}
+	// and one back up the tree
+	sprintf( path, "%s/sub0/up", dir );
+	assert_int_equal( symlink( "..", path ), 0 );
+
+	char first[5][64];
+	for ( int round = 0; round < 20; round++ ) {
+		struct vector *vec = vector_alloc( sizeof( char * ), &in_err );
+		ASSERT_OK();
+		grn_cat_torrent_files( vec, dir, NULL, &in_err );
+		ASSERT_OK();
+		assert_int_equal( vector_length( vec ), 5 );
+		for ( int i = 0; i < 5; i++ ) {
+			const char *found = VECTOR_AT( vec, char *, i );
+			if ( round == 0 ) {
+				assert_true( strlen( found ) < sizeof( first[0] ) );
+				strcpy( first[i], found );
+			} else {
+				assert_string_equal( found, first[i] );
+			}
+		}
+		vector_free_all( vec );
+	}
+
+	sprintf( path, "%s/sub0/up", dir );
+	remove( path );
+	for ( int i = 0; i < 5; i++ ) {
+		sprintf( path, "%s/link%d", dir, i );
+		remove( path );
+		sprintf( path, "%s/sub%d/%d.torrent", dir, i, i );
+		remove( path );
+		sprintf( path, "%s/sub%d", dir, i );
+		remove( path );
+	}
+	remove( dir );
+}
+
+struct source_search {
+	struct grn_source *source;
+	const char *dir;
+	int err;
+};
+
+static void *source_search( void *arg ) {
+	struct source_search *search = arg;
+	grn_source_cat_torrent_files( search->source, search->dir, NULL, &search->err );
+	grn_source_close( search->source );
+	return NULL;
+}
+
+static void write_source_files( const char *dir, const char *contents ) {
+	char path[64];
+	for ( int i = 0; i < 40; i++ ) {
+		sprintf( path, "%s/%d.torrent", dir, i );
+		FILE *fh = fopen( path, "wb" );
+		assert_non_null( fh );
+		fputs( contents, fh );
+		fclose( fh );
+	}
+}
+
+static void test_source( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char dir[] = "/tmp/greeny-source-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	const char *before = "d8:announce65:https://mars.apollo.rip/abcdef0123456789abcdef0123456789/announcee";
+	const char *after = "d8:announce64:https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announcee";
+	char path[64];
+	char contents[128];
+	pthread_t thread;
+
+	// serially, on workers, in a pipeline, and with io_uring
+	for ( int mode = 0; mode < 4; mode++ ) {
+		write_source_files( dir, before );
+		struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+		ASSERT_OK();
+		struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+		ASSERT_OK();
+		grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+		ASSERT_OK();
+		grn_ctx_set_transforms_v( ctx, transforms );
+		// room for only a few files, so the ring wraps around many times
+		struct source_search search = {
+			.source = grn_source_alloc( 3, &in_err ),
+			.dir = dir,
+		};
+		ASSERT_OK();
+		grn_ctx_set_source( ctx, search.source );
+		grn_ctx_set_threads( ctx, mode == 1 ? 3 : 0 );
+		grn_ctx_set_pipeline( ctx, mode == 2 ? 2 : 0 );
+		grn_ctx_set_io_depth( ctx, mode == 3 ? 4 : 0 );
+		assert_int_equal( pthread_create( &thread, NULL, source_search, &search ), 0 );
+
+		while ( !grn_one_file( ctx, &in_err ) ) {
+			ASSERT_OK();
+			assert_int_equal( grn_ctx_get_c_error( ctx ), GRN_OK );
+			char c_path[64];
+			assert_true( grn_ctx_get_c_path( ctx, c_path, sizeof( c_path ) ) < sizeof( c_path ) );
+			assert_non_null( strstr( c_path, dir ) );
+		}
+		ASSERT_OK();
+		pthread_join( thread, NULL );
+		assert_int_equal( search.err, GRN_OK );
+		assert_int_equal( grn_ctx_get_files_n( ctx ), 40 );
+		assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+		grn_ctx_free( ctx, &in_err );
+		ASSERT_OK();
+
+		for ( int i = 0; i < 40; i++ ) {
+			sprintf( path, "%s/%d.torrent", dir, i );
+			FILE *fh = fopen( path, "rb" );
+			assert_non_null( fh );
+			assert_non_null( fgets( contents, sizeof( contents ), fh ) );
+			fclose( fh );
+			assert_string_equal( contents, after );
+		}
+	}
+
+	// the search is told to stop once nothing is going to process what it finds
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	struct source_search search = {
+		.source = grn_source_alloc( 3, &in_err ),
+		.dir = dir,
+	};
+	ASSERT_OK();
+	grn_ctx_set_source( ctx, search.source );
+	assert_int_equal( pthread_create( &thread, NULL, source_search, &search ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+	pthread_join( thread, NULL );
+	assert_int_equal( search.err, GRN_ERR_USER_CANCELLED );
+
+	for ( int i = 0; i < 40; i++ ) {
+		sprintf( path, "%s/%d.torrent", dir, i );
+		remove( path );
+	}
+	rmdir( dir );
+}
+
+#define LINKS_BEFORE "d8:announce65:https://mars.apollo.rip/abcdef0123456789abcdef0123456789/announcee"
+#define LINKS_AFTER "d8:announce64:https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announcee"
+
+static void read_links_file( const char *dir, const char *name, char *out, size_t out_n ) {
+	char path[64];
+	sprintf( path, "%s/%s", dir, name );
+	FILE *fh = fopen( path, "rb" );
+	assert_non_null( fh );
+	size_t read_n = fread( out, 1, out_n - 1, fh );
+	out[read_n] = '\0';
+	fclose( fh );
+}
+
+// rewriting a file keeps its mode, writes through symlinks, and doesn't split hard links apart
+static void test_write_links( void **state ) {
+	( void ) state;
+	int in_err;
+
+	char dir[] = "/tmp/greeny-links-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	const char *names[] = { "plain.torrent", "hard.torrent", "target.torrent" };
+	char path[64], other[64];
+	for ( int i = 0; i < 3; i++ ) {
+		sprintf( path, "%s/%s", dir, names[i] );
+		FILE *fh = fopen( path, "wb" );
+		assert_non_null( fh );
+		fputs( LINKS_BEFORE, fh );
+		fclose( fh );
+	}
+	sprintf( path, "%s/plain.torrent", dir );
+	assert_int_equal( chmod( path, 0640 ), 0 );
+	sprintf( path, "%s/hard.torrent", dir );
+	sprintf( other, "%s/hard-other.torrent", dir );
+	assert_int_equal( link( path, other ), 0 );
+	sprintf( path, "%s/sym.torrent", dir );
+	assert_int_equal( symlink( "target.torrent", path ), 0 );
+
+	const char *process[] = { "plain.torrent", "hard.torrent", "sym.torrent" };
+	char **files = malloc( 3 * sizeof( char * ) );
+	assert_non_null( files );
+	for ( int i = 0; i < 3; i++ ) {
+		files[i] = malloc( 64 );
+		assert_non_null( files[i] );
+		sprintf( files[i], "%s/%s", dir, process[i] );
+	}
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, 3, &in_err );
+	ASSERT_OK();
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	grn_ctx_set_transforms_v( ctx, transforms );
+	grn_ctx_set_sync( ctx, GRN_SYNC_FILE );
+	while ( !grn_one_file( ctx, &in_err ) ) {
+		ASSERT_OK();
+		assert_int_equal( grn_ctx_get_c_error( ctx ), GRN_OK );
+	}
+	ASSERT_OK();
+	assert_int_equal( grn_ctx_get_errs_n( ctx ), 0 );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	char contents[128];
+	struct stat st, other_st;
+	read_links_file( dir, "plain.torrent", contents, sizeof( contents ) );
+	assert_string_equal( contents, LINKS_AFTER );
+	sprintf( path, "%s/plain.torrent", dir );
+	assert_int_equal( stat( path, &st ), 0 );
+	assert_int_equal( st.st_mode & 07777, 0640 );
+
+	read_links_file( dir, "hard-other.torrent", contents, sizeof( contents ) );
+	assert_string_equal( contents, LINKS_AFTER );
+	sprintf( path, "%s/hard.torrent", dir );
+	assert_int_equal( stat( path, &st ), 0 );
+	assert_int_equal( stat( other, &other_st ), 0 );
+	assert_true( st.st_ino == other_st.st_ino );
+	assert_int_equal( st.st_nlink, 2 );
+
+	sprintf( path, "%s/sym.torrent", dir );
+	assert_int_equal( lstat( path, &st ), 0 );
+	assert_true( S_ISLNK( st.st_mode ) );
+	read_links_file( dir, "target.torrent", contents, sizeof( contents ) );
+	assert_string_equal( contents, LINKS_AFTER );
+
+	// nothing left behind by the temporary files
+	const char *all[] = { "plain.torrent", "hard.torrent", "hard-other.torrent", "target.torrent", "sym.torrent" };
+	for ( int i = 0; i < 5; i++ ) {
+		sprintf( path, "%s/%s", dir, all[i] );
+		assert_int_equal( remove( path ), 0 );
+	}
+	assert_int_equal( rmdir( dir ), 0 );
+}
+
+#define MODES_FILES_N 25
+
+// what a context did with each file, in the order it reported them
+struct modes_result {
+	char paths[MODES_FILES_N][64];
+	int errors[MODES_FILES_N];
+	char contents[MODES_FILES_N][128];
+	int steps_n;
+	int errs_n;
+	int unchanged_n;
+};
+
+// a mix of files that change, files that don't, malformed files, and one that's missing
+static void write_modes_files( const char *dir ) {
+	char path[64];
+	for ( int i = 0; i < MODES_FILES_N - 1; i++ ) {
+		sprintf( path, "%s/%02d.torrent", dir, i );
+		FILE *fh = fopen( path, "wb" );
+		assert_non_null( fh );
+		switch ( i % 3 ) {
+			case 0:
+				fputs( "d8:announce65:https://mars.apollo.rip/abcdef0123456789abcdef0123456789/announcee", fh );
+				break;
+			case 1:
+				fputs( "d8:announce36:https://tracker.example.org/announcee", fh );
+				break;
+			case 2:
+				fputs( "d8:announce", fh );
+				break;
+		}
+		fclose( fh );
+	}
+}
+
+static void run_modes( const char *dir, int threads_n, int pipeline_n, struct modes_result *result ) {
+	int in_err;
+
+	write_modes_files( dir );
+	char **files = malloc( MODES_FILES_N * sizeof( char * ) );
+	assert_non_null( files );
+	for ( int i = 0; i < MODES_FILES_N; i++ ) {
+		files[i] = malloc( 64 );
+		assert_non_null( files[i] );
+		sprintf( files[i], "%s/%02d.torrent", dir, i );
+	}
+	struct grn_ctx *ctx = grn_ctx_alloc( &in_err );
+	ASSERT_OK();
+	grn_ctx_set_files( ctx, files, MODES_FILES_N, &in_err );
+	ASSERT_OK();
+	struct vector *transforms = vector_alloc( sizeof( struct grn_transform ), &in_err );
+	ASSERT_OK();
+	grn_cat_transforms_orpheus( transforms, "abcdef0123456789abcdef0123456789", &in_err );
+	ASSERT_OK();
+	grn_ctx_set_transforms_v( ctx, transforms );
+	grn_ctx_set_threads( ctx, threads_n );
+	grn_ctx_set_pipeline( ctx, pipeline_n );
+
+	memset( result, 0, sizeof( struct modes_result ) );
+	while ( !grn_one_file( ctx, &in_err ) ) {
+		ASSERT_OK();
+		assert_true( result->steps_n < MODES_FILES_N );
+		grn_ctx_get_c_path( ctx, result->paths[result->steps_n], sizeof( result->paths[0] ) );
+		result->errors[result->steps_n] = grn_ctx_get_c_error( ctx );
+		result->steps_n++;
+	}
+	ASSERT_OK();
+	result->errs_n = grn_ctx_get_errs_n( ctx );
+	result->unchanged_n = grn_ctx_get_unchanged_n( ctx );
+	grn_ctx_free( ctx, &in_err );
+	ASSERT_OK();
+
+	for ( int i = 0; i < MODES_FILES_N - 1; i++ ) {
+		char path[64];
+		sprintf( path, "%s/%02d.torrent", dir, i );
+		FILE *fh = fopen( path, "rb" );
+		assert_non_null( fh );
+		size_t read_n = fread( result->contents[i], 1, sizeof( result->contents[0] ) - 1, fh );
+		result->contents[i][read_n] = '\0';
+		fclose( fh );
+		remove( path );
+	}
+}
+
+static void assert_modes_equal( const struct modes_result *serial, const struct modes_result *other ) {
+	assert_int_equal( other->steps_n, serial->steps_n );
+	for ( int i = 0; i < serial->steps_n; i++ ) {
+		assert_string_equal( other->paths[i], serial->paths[i] );
+		assert_int_equal( other->errors[i], serial->errors[i] );
+	}
+	for ( int i = 0; i < MODES_FILES_N - 1; i++ ) {
+		assert_string_equal( other->contents[i], serial->contents[i] );
+	}
+	assert_int_equal( other->errs_n, serial->errs_n );
+	assert_int_equal( other->unchanged_n, serial->unchanged_n );
+}
+
+// the worker pool reports the same files, in the same order, with the same results as going one at a time
+static void test_threads( void **state ) {
+	( void ) state;
+
+	char dir[] = "/tmp/greeny-modes-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	struct modes_result *serial = malloc( sizeof( struct modes_result ) );
+	struct modes_result *threaded = malloc( sizeof( struct modes_result ) );
+	assert_non_null( serial );
+	assert_non_null( threaded );
+
+	run_modes( dir, 0, 0, serial );
+	assert_int_equal( serial->steps_n, MODES_FILES_N );
+	// the malformed files and the missing one
+	assert_int_equal( serial->errs_n, 9 );
+	assert_int_equal( serial->errors[2], GRN_ERR_BENCODE_SYNTAX );
+	assert_int_equal( serial->errors[MODES_FILES_N - 1], GRN_ERR_FS_OPEN );
+	assert_int_equal( serial->unchanged_n, 8 );
+	assert_string_equal( serial->contents[0], "d8:announce64:https://home.opsfet.ch/abcdef0123456789abcdef0123456789/announcee" );
+
+	for ( int threads_n = 1; threads_n <= 4; threads_n++ ) {
+		run_modes( dir, threads_n, 0, threaded );
+		assert_modes_equal( serial, threaded );
+	}
+
+	free( serial );
+	free( threaded );
+	rmdir( dir );
+}
+
+// same for a pipeline, whichever number of transformers sits between the reader and the writer
+static void test_pipeline( void **state ) {
+	( void ) state;
+
+	char dir[] = "/tmp/greeny-modes-XXXXXX";
+	assert_non_null( mkdtemp( dir ) );
+	struct modes_result *serial = malloc( sizeof( struct modes_result ) );
+	struct modes_result *piped = malloc( sizeof( struct modes_result ) );
+	assert_non_null( serial );
+	assert_non_null( piped );
+
+	run_modes( dir, 0, 0, serial );
+	for ( int pipeline_n = 1; pipeline_n <= 3; pipeline_n++ ) {
+		run_modes( dir, 0, pipeline_n, piped );
+		assert_modes_equal( serial, piped );
+	}
+
+	free( serial );
+	free( piped );
+	rmdir( dir );
+}
+
 int main( void ) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test( test_sanity ),
 		cmocka_unit_test( test_vector ),
 		cmocka_unit_test( test_strsubst ),
 		cmocka_unit_test( test_transform_buffer ),
+		cmocka_unit_test( test_transform_plan ),
 		cmocka_unit_test( test_is_string_passphrase ),
 		cmocka_unit_test( test_normalize_orpheus_announce ),
 		cmocka_unit_test( test_cat_orpheus_transforms ),
 		cmocka_unit_test( test_regsubst_all ),
+		cmocka_unit_test( test_regsubst_global ),
+		cmocka_unit_test( test_dfa ),
+		cmocka_unit_test( test_encode_spliced ),
+		cmocka_unit_test( test_decode_lazy ),
+		cmocka_unit_test( test_decode_arena ),
+		cmocka_unit_test( test_decode_borrowed ),
+		cmocka_unit_test( test_decode_dict_sizes ),
+		cmocka_unit_test( test_dict_order ),
+		cmocka_unit_test( test_encode ),
+		cmocka_unit_test( test_cache ),
+		cmocka_unit_test( test_cat_torrent_files ),
+		cmocka_unit_test( test_cat_symlinks ),
+		cmocka_unit_test( test_write_links ),
+		cmocka_unit_test( test_threads ),
+		cmocka_unit_test( test_pipeline ),
+		cmocka_unit_test( test_source ),
+		cmocka_unit_test( test_paths ),
 	};
 
 	return cmocka_run_group_tests( tests, NULL, NULL );